@@ -0,0 +1,634 @@
+#include "asset_bundle.h"
+#include "compress_cache.h"
+#include "http_conn.h"
+#include "locker.h"
+#include "log.h"
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//加载到内存中的资源包, 由当前指针和所有正在发送它的文件的响应共同引用
+struct bundle_image
+{
+    std::string path;                       //资源包的路径
+    struct stat st;                         //加载时的文件状态, 重新加载时用来判断文件是否变了
+    int fd;                                 //文件内容从这个描述符sendfile
+    char* data;                             //mmap的整个资源包, 读取索引和元数据
+    size_t size;
+    const bundle_header* header;
+    const uint32_t* seeds;                  //每个桶的种子
+    const bundle_asset* assets;             //按槽位排列的文件表
+    file_entry* entries;                    //每个文件的每个版本包装成的file_entry, 下标为槽位 * BUNDLE_VARIANTS + 版本
+    std::atomic<int> refcount;
+};
+
+namespace
+{
+
+std::atomic<bundle_image*> current(nullptr);    //当前的资源包, 没有时为nullptr
+locker current_locker;                          //保护取当前资源包并增加引用计数的过程, 替换时不会在两步之间释放
+
+void put(bundle_image* b)
+{
+    if(b->refcount.fetch_sub(1, std::memory_order_acq_rel) > 1)
+    {
+        return;
+    }
+    delete [] b->entries;
+    munmap(b->data, b->size);
+    close(b->fd);
+    delete b;
+}
+
+//检查资源包的格式, 所有偏移都在文件范围内, 通过后设置索引的指针
+bool validate(bundle_image* b, std::string* error)
+{
+    const bundle_header* h = reinterpret_cast<const bundle_header*>(b->data);
+    if(b->size < sizeof(bundle_header) || memcmp(h->magic, BUNDLE_MAGIC, 8) != 0)
+    {
+        *error = "not an asset bundle";
+        return false;
+    }
+    if(h->version != BUNDLE_VERSION)
+    {
+        *error = "unsupported version";
+        return false;
+    }
+    if(h->file_size != b->size)
+    {
+        *error = "truncated";
+        return false;
+    }
+    if((h->asset_count > 0 && h->bucket_count == 0)
+        || h->seeds_offset % sizeof(uint32_t) != 0 || h->seeds_offset > b->size
+        || (b->size - h->seeds_offset) / sizeof(uint32_t) < h->bucket_count
+        || h->assets_offset % sizeof(uint64_t) != 0 || h->assets_offset > b->size
+        || (b->size - h->assets_offset) / sizeof(bundle_asset) < h->asset_count)
+    {
+        *error = "bad index";
+        return false;
+    }
+    b->header = h;
+    b->seeds = reinterpret_cast<const uint32_t*>(b->data + h->seeds_offset);
+    b->assets = reinterpret_cast<const bundle_asset*>(b->data + h->assets_offset);
+    for(uint32_t i = 0; i < h->asset_count; ++i)
+    {
+        const bundle_asset* a = b->assets + i;
+        if(a->path_offset > b->size || b->size - a->path_offset < a->path_len
+            || a->type_offset >= b->size || memchr(b->data + a->type_offset, '\0', b->size - a->type_offset) == nullptr
+            || a->variants[BUNDLE_IDENTITY].offset == 0)
+        {
+            *error = "bad asset";
+            return false;
+        }
+        for(int v = 0; v < BUNDLE_VARIANTS; ++v)
+        {
+            const bundle_variant& var = a->variants[v];
+            if(var.offset > b->size || b->size - var.offset < var.length
+                || memchr(var.etag, '\0', sizeof(var.etag)) == nullptr)
+            {
+                *error = "bad asset";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//把文件的各个版本包装成file_entry, 头部、条件请求和Range直接使用
+void build_entries(bundle_image* b)
+{
+    uint32_t count = b->header->asset_count;
+    b->entries = new file_entry[count * BUNDLE_VARIANTS];
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        const bundle_asset* a = b->assets + i;
+        for(int v = 0; v < BUNDLE_VARIANTS; ++v)
+        {
+            const bundle_variant& var = a->variants[v];
+            file_entry* e = b->entries + i * BUNDLE_VARIANTS + v;
+            e->fd = b->fd;
+            e->base = var.offset;
+            e->bundle = b;
+            memset(&e->st, 0, sizeof(e->st));
+            e->st.st_mode = S_IFREG | 0444;
+            e->st.st_size = var.length;
+            e->st.st_mtime = a->mtime;
+            snprintf(e->etag, sizeof(e->etag), "%s", var.etag);
+            memcpy(e->last_modified, a->last_modified, sizeof(e->last_modified));
+            e->last_modified[sizeof(e->last_modified) - 1] = '\0';
+            e->refcount = 1;
+            e->cached = false;
+            e->prev = nullptr;
+            e->next = nullptr;
+        }
+    }
+}
+
+
+//以下是打包用到的函数
+
+//打包时的一个文件
+struct pack_item
+{
+    std::string path;                       //URL路径
+    std::string file;                       //文件的完整路径
+    struct stat st;
+    const char* type;
+    std::string compressed[BUNDLE_VARIANTS];    //压缩版本的内容, 空表示没有
+    uint64_t hash;
+    uint32_t slot;
+};
+
+bool read_file(const std::string& path, size_t size, std::string* content)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return false;
+    }
+    content->resize(size);
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t n = read(fd, &(*content)[done], size - done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    return done == size;
+}
+
+bool write_all(int fd, const char* data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//递归收集dir下的普通文件, rel是相对资源目录的路径(以/开头)
+//符号链接指向的文件和服务器一样跟随, 指向的目录不进入, 避免循环
+bool collect(const std::string& root, const std::string& rel, std::vector<pack_item>* items)
+{
+    std::string dir = root + rel;
+    DIR* d = opendir(dir.c_str());
+    if(d == nullptr)
+    {
+        fprintf(stderr, "pack: %s: %s\n", dir.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = true;
+    while(struct dirent* ent = readdir(d))
+    {
+        if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+        std::string path = rel + "/" + ent->d_name;
+        std::string file = root + path;
+        struct stat lst;
+        struct stat st;
+        if(lstat(file.c_str(), &lst) < 0 || stat(file.c_str(), &st) < 0)
+        {
+            continue;
+        }
+        if(S_ISDIR(lst.st_mode))
+        {
+            ok = collect(root, path, items) && ok;
+        }
+        else if(S_ISREG(st.st_mode) && (st.st_mode & S_IROTH))
+        {
+            //和服务器一样只提供所有人可读的文件
+            pack_item item;
+            item.path = path;
+            item.file = file;
+            item.st = st;
+            items->push_back(item);
+        }
+    }
+    closedir(d);
+    return ok;
+}
+
+//ETag按内容生成, 重新打包内容不变时ETag不变, 客户端缓存继续有效
+void make_etag(const std::string& content, const char* suffix, char* etag, size_t size)
+{
+    snprintf(etag, size, "\"%016llx-%llx%s\"", (unsigned long long)bundle_hash(content.data(), content.size()),
+        (unsigned long long)content.size(), suffix);
+}
+
+//同目录下的预压缩文件, 和压缩缓存的规则相同: 不比原始文件旧, 并且比原始文件小
+bool read_sidecar(const pack_item& item, const char* ext, std::string* content)
+{
+    std::string path = item.file + ext;
+    struct stat st;
+    if(stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)
+        || st.st_mtime < item.st.st_mtime || st.st_size >= item.st.st_size)
+    {
+        return false;
+    }
+    return read_file(path, st.st_size, content);
+}
+
+//为每个桶找一个种子, 使所有路径落在不同的槽位; 大的桶先放, 空槽位多时容易找到
+bool build_index(std::vector<pack_item>& items, std::vector<uint32_t>* seeds)
+{
+    uint32_t count = items.size();
+    uint32_t bucket_count = count / BUNDLE_KEYS_PER_BUCKET + 1;
+    std::vector<std::vector<uint32_t> > buckets(bucket_count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        items[i].hash = bundle_hash(items[i].path.data(), items[i].path.size());
+        buckets[(items[i].hash >> 32) % bucket_count].push_back(i);
+    }
+    std::vector<uint32_t> order(bucket_count);
+    for(uint32_t i = 0; i < bucket_count; ++i)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b){return buckets[a].size() > buckets[b].size();});
+
+    seeds->assign(bucket_count, 0);
+    std::vector<bool> taken(count, false);
+    std::vector<uint32_t> slots;
+    for(uint32_t i = 0; i < bucket_count; ++i)
+    {
+        const std::vector<uint32_t>& bucket = buckets[order[i]];
+        if(bucket.empty())
+        {
+            break;
+        }
+        uint32_t seed = 0;
+        for(; seed < BUNDLE_MAX_SEED; ++seed)
+        {
+            slots.clear();
+            for(size_t k = 0; k < bucket.size(); ++k)
+            {
+                uint32_t slot = bundle_slot(items[bucket[k]].hash, seed, count);
+                if(taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+                {
+                    break;
+                }
+                slots.push_back(slot);
+            }
+            if(slots.size() == bucket.size())
+            {
+                break;
+            }
+        }
+        if(seed == BUNDLE_MAX_SEED)
+        {
+            //两个路径的哈希值完全相同时不可能分开
+            fprintf(stderr, "pack: no perfect hash seed for %s\n", items[bucket[0]].path.c_str());
+            return false;
+        }
+        (*seeds)[order[i]] = seed;
+        for(size_t k = 0; k < bucket.size(); ++k)
+        {
+            taken[slots[k]] = true;
+            items[bucket[k]].slot = slots[k];
+        }
+    }
+    return true;
+}
+
+}
+
+
+bool asset_bundle::load(const char* path)
+{
+    if(path[0] == '\0')
+    {
+        current_locker.lock();
+        bundle_image* old = current.exchange(nullptr);
+        current_locker.unlock();
+        if(old)
+        {
+            LOG_INFO("asset bundle %s unloaded", old->path.c_str());
+            put(old);
+        }
+        return true;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0)
+    {
+        LOG_ERROR("asset bundle %s: %s", path, strerror(errno));
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    //只有加载的线程修改当前指针, 这里读取不需要加锁
+    //打包工具用rename替换资源包, 文件变了inode一定变
+    bundle_image* cur = current.load();
+    if(cur && cur->path == path && cur->st.st_dev == st.st_dev && cur->st.st_ino == st.st_ino
+        && cur->st.st_size == st.st_size && cur->st.st_mtim.tv_sec == st.st_mtim.tv_sec && cur->st.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+    {
+        close(fd);
+        return true;
+    }
+
+    void* data = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(data == MAP_FAILED)
+    {
+        LOG_ERROR("asset bundle %s: mmap failed", path);
+        close(fd);
+        return false;
+    }
+    //启动后的第一批请求不再等磁盘: 提前把整个资源包读进页缓存, sendfile和mmap共用这些页
+    madvise(data, st.st_size, MADV_WILLNEED);
+
+    bundle_image* b = new bundle_image;
+    b->path = path;
+    b->st = st;
+    b->fd = fd;
+    b->data = static_cast<char*>(data);
+    b->size = st.st_size;
+    b->header = nullptr;
+    b->seeds = nullptr;
+    b->assets = nullptr;
+    b->entries = nullptr;
+    b->refcount = 1;
+    std::string error;
+    if(!validate(b, &error))
+    {
+        LOG_ERROR("asset bundle %s: %s", path, error.c_str());
+        put(b);
+        return false;
+    }
+    build_entries(b);
+
+    //替换当前指针, 旧的资源包等正在发送它的响应都发完后释放
+    current_locker.lock();
+    bundle_image* old = current.exchange(b);
+    current_locker.unlock();
+    if(old)
+    {
+        put(old);
+    }
+    LOG_INFO("asset bundle %s: %u files, %ld bytes", path, b->header->asset_count, (long)b->size);
+    return true;
+}
+
+file_entry* asset_bundle::acquire(const char* path, int len, int accept, int* encoding, const char** content_type, bool* vary)
+{
+    //没有资源包时不加锁
+    if(current.load(std::memory_order_acquire) == nullptr)
+    {
+        return nullptr;
+    }
+    current_locker.lock();
+    bundle_image* b = current.load(std::memory_order_relaxed);
+    if(b)
+    {
+        b->refcount.fetch_add(1, std::memory_order_relaxed);
+    }
+    current_locker.unlock();
+    if(b == nullptr)
+    {
+        return nullptr;
+    }
+
+    //一次哈希找到唯一可能的槽位, 再比较一次路径
+    const bundle_header* h = b->header;
+    const bundle_asset* a = nullptr;
+    if(h->asset_count > 0)
+    {
+        uint64_t hash = bundle_hash(path, len);
+        uint32_t slot = bundle_slot(hash, b->seeds[(hash >> 32) % h->bucket_count], h->asset_count);
+        a = b->assets + slot;
+        if(a->path_len != (uint32_t)len || memcmp(b->data + a->path_offset, path, len) != 0)
+        {
+            a = nullptr;
+        }
+    }
+    if(a == nullptr)
+    {
+        put(b);
+        return nullptr;
+    }
+
+    //优先br
+    int variant = BUNDLE_IDENTITY;
+    if((accept & ENCODING_BR) && a->variants[BUNDLE_BR].offset)
+    {
+        variant = BUNDLE_BR;
+    }
+    else if((accept & ENCODING_GZIP) && a->variants[BUNDLE_GZIP].offset)
+    {
+        variant = BUNDLE_GZIP;
+    }
+    *encoding = variant == BUNDLE_BR ? ENCODING_BR : (variant == BUNDLE_GZIP ? ENCODING_GZIP : 0);
+    *content_type = b->data + a->type_offset;
+    *vary = a->variants[BUNDLE_GZIP].offset || a->variants[BUNDLE_BR].offset;
+    return b->entries + (a - b->assets) * BUNDLE_VARIANTS + variant;
+}
+
+void asset_bundle::retain(file_entry* entry)
+{
+    entry->bundle->refcount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void asset_bundle::release(file_entry* entry)
+{
+    put(entry->bundle);
+}
+
+bool asset_bundle::pack(const char* dir, const char* output)
+{
+    std::string root(dir);
+    while(root.size() > 1 && root[root.size() - 1] == '/')
+    {
+        root.erase(root.size() - 1);
+    }
+    std::vector<pack_item> items;
+    if(!collect(root, "", &items))
+    {
+        return false;
+    }
+    //按路径排序, 同样的目录打出同样的资源包
+    std::sort(items.begin(), items.end(), [](const pack_item& a, const pack_item& b){return a.path < b.path;});
+
+    //准备压缩版本: 优先使用预压缩文件, 可以压缩的文本类型在内存中压缩
+    for(size_t i = 0; i < items.size(); ++i)
+    {
+        pack_item& item = items[i];
+        bool compressible = false;
+        item.type = http_conn::mime_type(item.path.data(), item.path.size(), &compressible);
+        read_sidecar(item, ".gz", &item.compressed[BUNDLE_GZIP]);
+        read_sidecar(item, ".br", &item.compressed[BUNDLE_BR]);
+        if(!compressible || item.st.st_size < COMPRESS_MIN_FILE
+            || (!item.compressed[BUNDLE_GZIP].empty() && !item.compressed[BUNDLE_BR].empty()))
+        {
+            continue;
+        }
+        std::string content;
+        if(!read_file(item.file, item.st.st_size, &content))
+        {
+            fprintf(stderr, "pack: %s: read failed\n", item.file.c_str());
+            return false;
+        }
+        for(int v = BUNDLE_GZIP; v <= BUNDLE_BR; ++v)
+        {
+            if(item.compressed[v].empty())
+            {
+                compress_cache::compress_data(content.data(), content.size(), v == BUNDLE_BR ? ENCODING_BR : ENCODING_GZIP, &item.compressed[v]);
+            }
+        }
+    }
+
+    std::vector<uint32_t> seeds;
+    if(!build_index(items, &seeds))
+    {
+        return false;
+    }
+
+    //布局: 头部、种子、文件表、字符串、文件内容
+    uint32_t count = items.size();
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, 8);
+    header.version = BUNDLE_VERSION;
+    header.asset_count = count;
+    header.bucket_count = seeds.size();
+    header.seeds_offset = sizeof(bundle_header);
+    header.assets_offset = (header.seeds_offset + seeds.size() * sizeof(uint32_t) + 7) / 8 * 8;
+
+    std::string strings;
+    uint64_t strings_offset = header.assets_offset + (uint64_t)count * sizeof(bundle_asset);
+    std::map<std::string, uint64_t> types;
+    std::vector<bundle_asset> assets(count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        const pack_item& item = items[i];
+        bundle_asset& a = assets[item.slot];
+        memset(&a, 0, sizeof(a));
+        a.path_offset = strings_offset + strings.size();
+        a.path_len = item.path.size();
+        strings += item.path;
+        std::map<std::string, uint64_t>::iterator it = types.find(item.type);
+        if(it == types.end())
+        {
+            it = types.insert(std::make_pair(std::string(item.type), strings_offset + strings.size())).first;
+            strings.append(item.type, strlen(item.type) + 1);
+        }
+        a.type_offset = it->second;
+        a.mtime = item.st.st_mtime;
+        struct tm tm;
+        gmtime_r(&item.st.st_mtime, &tm);
+        strftime(a.last_modified, sizeof(a.last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+
+    //文件内容按槽位顺序排列, 每个文件的原始内容后面紧跟它的压缩版本
+    uint64_t offset = (strings_offset + strings.size() + 7) / 8 * 8;
+    std::vector<uint32_t> by_slot(count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        by_slot[items[i].slot] = i;
+    }
+    for(uint32_t s = 0; s < count; ++s)
+    {
+        const pack_item& item = items[by_slot[s]];
+        bundle_asset& a = assets[s];
+        a.variants[BUNDLE_IDENTITY].offset = offset;
+        a.variants[BUNDLE_IDENTITY].length = item.st.st_size;
+        offset += item.st.st_size;
+        for(int v = BUNDLE_GZIP; v <= BUNDLE_BR; ++v)
+        {
+            if(!item.compressed[v].empty())
+            {
+                a.variants[v].offset = offset;
+                a.variants[v].length = item.compressed[v].size();
+                offset += item.compressed[v].size();
+            }
+        }
+    }
+    header.file_size = offset;
+
+    //先写临时文件, 写完后rename, 替换对正在读旧资源包的服务器是原子的
+    std::string tmp = std::string(output) + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        fprintf(stderr, "pack: %s: %s\n", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    static const char zeros[8] = {0};
+    bool ok = write_all(fd, reinterpret_cast<const char*>(&header), sizeof(header))
+        && write_all(fd, reinterpret_cast<const char*>(seeds.data()), seeds.size() * sizeof(uint32_t))
+        && write_all(fd, zeros, header.assets_offset - header.seeds_offset - seeds.size() * sizeof(uint32_t))
+        && write_all(fd, reinterpret_cast<const char*>(assets.data()), assets.size() * sizeof(bundle_asset))
+        && write_all(fd, strings.data(), strings.size())
+        && write_all(fd, zeros, assets.empty() ? 0 : assets[0].variants[0].offset - strings_offset - strings.size());
+    size_t raw_bytes = 0;
+    size_t compressed_bytes = 0;
+    for(uint32_t s = 0; s < count && ok; ++s)
+    {
+        const pack_item& item = items[by_slot[s]];
+        std::string content;
+        //打包期间文件被修改时长度可能不符, 放弃这次打包
+        ok = read_file(item.file, item.st.st_size, &content) && write_all(fd, content.data(), content.size());
+        if(!ok)
+        {
+            fprintf(stderr, "pack: %s: changed while packing\n", item.file.c_str());
+            break;
+        }
+        make_etag(content, "", assets[s].variants[BUNDLE_IDENTITY].etag, sizeof(assets[s].variants[BUNDLE_IDENTITY].etag));
+        raw_bytes += content.size();
+        for(int v = BUNDLE_GZIP; v <= BUNDLE_BR && ok; ++v)
+        {
+            if(!item.compressed[v].empty())
+            {
+                ok = write_all(fd, item.compressed[v].data(), item.compressed[v].size());
+                make_etag(content, v == BUNDLE_BR ? "-br" : "-gz", assets[s].variants[v].etag, sizeof(assets[s].variants[v].etag));
+                compressed_bytes += item.compressed[v].size();
+            }
+        }
+    }
+    //ETag要读过内容才知道, 最后写回文件表
+    ok = ok && pwrite(fd, assets.data(), assets.size() * sizeof(bundle_asset), header.assets_offset) == (ssize_t)(assets.size() * sizeof(bundle_asset));
+    ok = ok && fsync(fd) == 0;
+    if(close(fd) != 0 || !ok || rename(tmp.c_str(), output) != 0)
+    {
+        fprintf(stderr, "pack: writing %s failed: %s\n", output, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    printf("packed %u files (%zu bytes, %zu bytes compressed variants) into %s, %llu bytes\n",
+        count, raw_bytes, compressed_bytes, output, (unsigned long long)header.file_size);
+    return true;
+}
@@ -0,0 +1,114 @@
+#ifndef ASSET_BUNDLE_H
+#define ASSET_BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "file_cache.h"
+
+#define BUNDLE_MAGIC "WSBUNDL1"             //资源包文件开头的8个字节
+#define BUNDLE_VERSION 1
+#define BUNDLE_KEYS_PER_BUCKET 2            //完美哈希每个桶平均的路径数, 越大索引越小, 打包越慢
+#define BUNDLE_MAX_SEED (1 << 24)           //打包时为一个桶尝试的种子数上限
+
+//资源包中每个文件的版本, 和ENCODING_*对应
+#define BUNDLE_IDENTITY 0
+#define BUNDLE_GZIP 1
+#define BUNDLE_BR 2
+#define BUNDLE_VARIANTS 3
+
+
+/*
+    资源包的格式, 所有整数按本机字节序, 打包和加载在同一种机器上进行
+    [bundle_header][种子: bucket_count个uint32_t][bundle_asset: asset_count个][路径和Content-Type][文件内容]
+    路径先哈希到桶, 再用桶的种子算出槽位, 不同的路径落在不同的槽位(最小完美哈希), 查找只比较一次路径
+*/
+struct bundle_header
+{
+    char magic[8];                          //BUNDLE_MAGIC
+    uint32_t version;                       //BUNDLE_VERSION
+    uint32_t asset_count;                   //文件数量, 也是槽位数量
+    uint32_t bucket_count;                  //桶数量
+    uint32_t reserved;
+    uint64_t file_size;                     //整个资源包的大小, 加载时检查是否被截断
+    uint64_t seeds_offset;                  //种子数组的偏移
+    uint64_t assets_offset;                 //按槽位排列的文件表的偏移
+};
+
+//文件的一个版本(原始内容或者压缩内容)
+struct bundle_variant
+{
+    uint64_t offset;                        //内容在资源包中的偏移, 为0时没有这个版本
+    uint64_t length;                        //内容的字节数
+    char etag[48];                          //按内容生成的ETag, 包括引号
+};
+
+struct bundle_asset
+{
+    uint64_t path_offset;                   //URL路径(以/开头, 不以'\0'结尾)的偏移
+    uint32_t path_len;
+    uint32_t reserved;
+    uint64_t type_offset;                   //Content-Type(以'\0'结尾)的偏移
+    int64_t mtime;                          //原始文件的修改时间(秒)
+    char last_modified[32];                 //HTTP日期格式的修改时间
+    bundle_variant variants[BUNDLE_VARIANTS];
+};
+
+
+//路径的哈希值, 打包和查找共用: FNV-1a再做一次混合
+inline uint64_t bundle_hash(const char* data, int len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(int i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+//路径的哈希值在桶的种子下对应的槽位
+inline uint32_t bundle_slot(uint64_t hash, uint32_t seed, uint32_t slots)
+{
+    uint64_t h = hash ^ (seed * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h % slots;
+}
+
+
+//一个加载到内存中的资源包, 内部使用
+struct bundle_image;
+
+/*
+    静态资源包
+    打包工具(sever pack)把一个目录打成一个文件: 完美哈希索引、每个文件的Content-Type、长度、ETag、Last-Modified,
+    以及可以压缩的文件的gzip/br版本; 服务器启动时mmap一次, 请求命中时只做一次哈希查找, 不stat也不open,
+    文件内容和普通文件一样从资源包的描述符sendfile, 只是偏移不同
+    资源包中的文件包装成file_entry, 头部、条件请求和Range沿用普通文件的处理; 引用计数记在资源包上,
+    用file_cache的release释放
+    收到SIGHUP时资源包文件变了(打包工具写临时文件再rename)就加载新的并原子地替换,
+    旧的资源包等最后一个引用它的响应发完后才munmap
+*/
+class asset_bundle
+{
+public:
+    //加载path并替换当前的资源包, path为空时不使用资源包; 文件和当前的相同时什么都不做
+    //出错时保留当前的资源包并返回false
+    static bool load(const char* path);
+
+    //查找URL路径path(不含查询字符串), 找到时返回文件并增加引用计数, 没有时返回nullptr
+    //accept是客户端接受的编码, 有对应的压缩版本时返回它, *encoding为它的编码(0为原始内容)
+    //*content_type为打包时确定的Content-Type, 和返回的文件一起有效; *vary表示这个文件有压缩版本
+    static file_entry* acquire(const char* path, int len, int accept, int* encoding, const char** content_type, bool* vary);
+    static void retain(file_entry* entry);
+    static void release(file_entry* entry);
+
+    //把目录dir下的文件打包写到output, 先写临时文件再rename, 正在运行的服务器不会读到写了一半的资源包
+    static bool pack(const char* dir, const char* output);
+};
+
+#endif
@@ -0,0 +1,699 @@
+/*
+    HTTP压力测试工具
+    每个线程一个epoll, 管理若干条连接, 支持长连接、流水线深度、闭环和开环两种发压方式以及按权重混合的URL
+    结束时输出吞吐量和延迟分位数, 可以同时写出JSON格式的结果
+
+    编译: g++ -std=c++17 -O2 -pthread bench/loadgen.cpp -o loadgen
+    例子: ./loadgen -p 10000 -c 100 -d 10 -k -P 4 -u /index.html:3 -u /images/image1.jpg:1 -o result.json
+*/
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#define MAX_PIPELINE 64                 //流水线深度上限
+#define MAX_EVENTS 1024
+#define READ_SIZE 65536
+#define HIST_SUB_BITS 5                 //每个2的幂区间分成32个桶
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+
+
+//对数-线性分桶的延迟直方图(纳秒)
+struct histogram
+{
+    std::vector<uint64_t> buckets;
+    uint64_t count;
+    uint64_t max;
+
+    histogram():buckets(HIST_BUCKETS, 0), count(0), max(0){}
+
+    static int index(uint64_t v)
+    {
+        if(v < (1ULL << HIST_SUB_BITS))
+        {
+            return v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        if(msb > HIST_MAX_BITS)
+        {
+            return HIST_BUCKETS - 1;
+        }
+        int shift = msb - HIST_SUB_BITS;
+        return ((shift + 1) << HIST_SUB_BITS) + ((v >> shift) & ((1 << HIST_SUB_BITS) - 1));
+    }
+
+    static uint64_t upper(int i)
+    {
+        if(i < (1 << HIST_SUB_BITS))
+        {
+            return i;
+        }
+        int shift = (i >> HIST_SUB_BITS) - 1;
+        uint64_t sub = i & ((1 << HIST_SUB_BITS) - 1);
+        return (((1ULL << HIST_SUB_BITS) + sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t v)
+    {
+        ++buckets[index(v)];
+        ++count;
+        if(v > max)
+        {
+            max = v;
+        }
+    }
+
+    void merge(const histogram& other)
+    {
+        for(int i = 0; i < HIST_BUCKETS; ++i)
+        {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+        if(other.max > max)
+        {
+            max = other.max;
+        }
+    }
+
+    uint64_t quantile(double q) const
+    {
+        if(count == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q * count + 0.5);
+        if(rank == 0)
+        {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for(int i = 0; i < HIST_BUCKETS; ++i)
+        {
+            seen += buckets[i];
+            if(seen >= rank)
+            {
+                uint64_t v = upper(i);
+                return v < max ? v : max;
+            }
+        }
+        return max;
+    }
+};
+
+
+struct url_weight
+{
+    std::string request;                //预先拼好的完整请求
+    int weight;
+};
+
+struct options
+{
+    const char* host = "127.0.0.1";
+    int port = 10000;
+    int connections = 100;
+    int threads = 1;
+    double duration = 10;
+    bool keepalive = false;
+    int pipeline = 1;
+    double rate = 0;                    //开环模式的总请求速率(每秒), 0为闭环模式
+    std::vector<url_weight> urls;
+    const char* name = "loadgen";
+    const char* output = nullptr;
+};
+
+options opt;
+int total_weight = 0;
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+//一条连接
+struct connection
+{
+    int fd;
+    bool connecting;
+    uint64_t sent_at[MAX_PIPELINE];     //已经发出还没有收到响应的请求的开始时间, 环形队列
+    int head;
+    int inflight;
+    std::string out;                    //还没有写出的请求数据
+    size_t out_offset;
+
+    //响应解析状态
+    std::string header;                 //还没有收完的响应头部
+    long body_remaining;                //当前响应还没有收到的正文字节数, -1表示正在收头部
+    bool close_after;                   //当前响应之后服务器会关闭连接
+};
+
+struct worker
+{
+    int index;
+    int epollfd;
+    int connections;
+    std::vector<connection> conns;
+    uint32_t seed;
+
+    //开环模式
+    double rate;                        //本线程的请求速率
+    uint64_t start;
+    uint64_t issued;                    //已经按计划应该发出的请求数
+    std::deque<uint64_t> backlog;       //到了计划时间但没有空闲连接的请求, 记录计划发出的时间, 最早的在队头
+
+    //统计
+    histogram latency;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t status_errors;             //非2xx响应
+    uint64_t bytes;
+    uint64_t reconnects;
+};
+
+uint32_t next_random(uint32_t& seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+const std::string& pick_request(worker& w)
+{
+    int r = next_random(w.seed) % total_weight;
+    for(size_t i = 0; i < opt.urls.size(); ++i)
+    {
+        r -= opt.urls[i].weight;
+        if(r < 0)
+        {
+            return opt.urls[i].request;
+        }
+    }
+    return opt.urls.back().request;
+}
+
+bool open_connection(worker& w, connection& c)
+{
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c.fd < 0)
+    {
+        return false;
+    }
+    int one = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opt.port);
+    inet_pton(AF_INET, opt.host, &addr.sin_addr);
+    int ret = connect(c.fd, (struct sockaddr*)&addr, sizeof(addr));
+    if(ret < 0 && errno != EINPROGRESS)
+    {
+        close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    c.connecting = true;
+    c.head = 0;
+    c.inflight = 0;
+    c.out.clear();
+    c.out_offset = 0;
+    c.header.clear();
+    c.body_remaining = -1;
+    c.close_after = false;
+
+    struct epoll_event event;
+    event.data.ptr = &c;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    epoll_ctl(w.epollfd, EPOLL_CTL_ADD, c.fd, &event);
+    return true;
+}
+
+void close_connection(worker& w, connection& c)
+{
+    if(c.fd >= 0)
+    {
+        epoll_ctl(w.epollfd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+    }
+}
+
+//连接上还能再发几个请求
+int capacity(const connection& c)
+{
+    if(c.fd < 0 || c.close_after)
+    {
+        return 0;
+    }
+    int depth = opt.keepalive ? opt.pipeline : 1;
+    return depth - c.inflight;
+}
+
+void queue_request(worker& w, connection& c, uint64_t start)
+{
+    c.out += pick_request(w);
+    c.sent_at[(c.head + c.inflight) % MAX_PIPELINE] = start;
+    ++c.inflight;
+}
+
+bool flush(worker& w, connection& c)
+{
+    while(c.out_offset < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_offset, c.out.size() - c.out_offset, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EAGAIN)
+            {
+                break;
+            }
+            return false;
+        }
+        c.out_offset += n;
+    }
+    if(c.out_offset == c.out.size())
+    {
+        c.out.clear();
+        c.out_offset = 0;
+    }
+    struct epoll_event event;
+    event.data.ptr = &c;
+    event.events = EPOLLIN | EPOLLRDHUP | (c.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+    epoll_ctl(w.epollfd, EPOLL_CTL_MOD, c.fd, &event);
+    return true;
+}
+
+//闭环模式下把连接上的请求补满
+void fill(worker& w, connection& c)
+{
+    if(opt.rate > 0)
+    {
+        //开环模式先发积压的请求
+        while(!w.backlog.empty() && capacity(c) > 0)
+        {
+            queue_request(w, c, w.backlog.front());
+            w.backlog.pop_front();
+        }
+        return;
+    }
+    uint64_t now = now_ns();
+    while(capacity(c) > 0)
+    {
+        queue_request(w, c, now);
+    }
+}
+
+void response_done(worker& w, connection& c, int status)
+{
+    uint64_t start = c.sent_at[c.head];
+    c.head = (c.head + 1) % MAX_PIPELINE;
+    --c.inflight;
+    w.latency.record(now_ns() - start);
+    ++w.completed;
+    if(status < 200 || status >= 300)
+    {
+        ++w.status_errors;
+    }
+}
+
+//解析收到的数据, 返回false表示连接出错
+bool consume(worker& w, connection& c, const char* data, size_t len)
+{
+    static thread_local int status = 0;
+    while(len > 0)
+    {
+        if(c.body_remaining < 0)
+        {
+            //收头部, 直到空行
+            size_t old = c.header.size();
+            c.header.append(data, len);
+            size_t end = c.header.find("\r\n\r\n", old > 3 ? old - 3 : 0);
+            if(end == std::string::npos)
+            {
+                return c.header.size() < 65536;
+            }
+            size_t used = end + 4 - old;
+            data += used;
+            len -= used;
+
+            if(c.header.compare(0, 9, "HTTP/1.1 ") != 0 && c.header.compare(0, 9, "HTTP/1.0 ") != 0)
+            {
+                return false;
+            }
+            status = atoi(c.header.c_str() + 9);
+            c.body_remaining = 0;
+            c.close_after = !opt.keepalive;
+            //逐行检查Content-Length和Connection
+            size_t pos = c.header.find("\r\n");
+            while(pos < end)
+            {
+                size_t line_end = c.header.find("\r\n", pos + 2);
+                std::string line = c.header.substr(pos + 2, line_end - pos - 2);
+                if(strncasecmp(line.c_str(), "Content-Length:", 15) == 0)
+                {
+                    c.body_remaining = atol(line.c_str() + 15);
+                }
+                else if(strncasecmp(line.c_str(), "Connection:", 11) == 0 && strcasestr(line.c_str() + 11, "close"))
+                {
+                    c.close_after = true;
+                }
+                pos = line_end;
+            }
+            c.header.clear();
+        }
+
+        size_t take = (size_t)c.body_remaining < len ? c.body_remaining : len;
+        c.body_remaining -= take;
+        data += take;
+        len -= take;
+        if(c.body_remaining == 0)
+        {
+            c.body_remaining = -1;
+            if(c.inflight == 0)
+            {
+                return false;
+            }
+            response_done(w, c, status);
+        }
+    }
+    return true;
+}
+
+void reconnect(worker& w, connection& c)
+{
+    //没有收到响应的请求算作错误, 开环模式下放回积压队列
+    for(int i = 0; i < c.inflight; ++i)
+    {
+        if(opt.rate > 0)
+        {
+            w.backlog.push_front(c.sent_at[(c.head + c.inflight - 1 - i) % MAX_PIPELINE]);
+        }
+    }
+    close_connection(w, c);
+    ++w.reconnects;
+    if(!open_connection(w, c))
+    {
+        ++w.errors;
+    }
+}
+
+void handle(worker& w, connection& c, uint32_t events)
+{
+    if(c.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0 || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            ++w.errors;
+            reconnect(w, c);
+            return;
+        }
+        c.connecting = false;
+        fill(w, c);
+        if(!flush(w, c))
+        {
+            ++w.errors;
+            reconnect(w, c);
+        }
+        return;
+    }
+
+    if(events & EPOLLIN)
+    {
+        char buf[READ_SIZE];
+        while(true)
+        {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if(n > 0)
+            {
+                w.bytes += n;
+                if(!consume(w, c, buf, n))
+                {
+                    ++w.errors;
+                    reconnect(w, c);
+                    return;
+                }
+                continue;
+            }
+            if(n < 0 && errno == EAGAIN)
+            {
+                break;
+            }
+            //对端关闭, 短连接模式下这是正常的
+            if(c.inflight > 0)
+            {
+                ++w.errors;
+            }
+            reconnect(w, c);
+            return;
+        }
+    }
+    else if(events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+    {
+        ++w.errors;
+        reconnect(w, c);
+        return;
+    }
+
+    if(c.close_after && c.inflight == 0)
+    {
+        reconnect(w, c);
+        return;
+    }
+    fill(w, c);
+    if(!flush(w, c))
+    {
+        ++w.errors;
+        reconnect(w, c);
+    }
+}
+
+//开环模式: 按计划时间生成请求, 交给有空闲的连接
+void schedule(worker& w)
+{
+    uint64_t now = now_ns();
+    uint64_t due = (uint64_t)((now - w.start) / 1e9 * w.rate);
+    for(; w.issued < due; ++w.issued)
+    {
+        w.backlog.push_back(w.start + (uint64_t)(w.issued / w.rate * 1e9));
+    }
+    for(size_t i = 0; i < w.conns.size() && !w.backlog.empty(); ++i)
+    {
+        connection& c = w.conns[i];
+        if(c.fd < 0 || c.connecting || capacity(c) <= 0)
+        {
+            continue;
+        }
+        fill(w, c);
+        if(!flush(w, c))
+        {
+            ++w.errors;
+            reconnect(w, c);
+        }
+    }
+}
+
+void* run(void* arg)
+{
+    worker& w = *static_cast<worker*>(arg);
+    w.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    w.conns.resize(w.connections);
+    for(size_t i = 0; i < w.conns.size(); ++i)
+    {
+        w.conns[i].fd = -1;
+        if(!open_connection(w, w.conns[i]))
+        {
+            ++w.errors;
+        }
+    }
+
+    w.start = now_ns();
+    uint64_t end = w.start + (uint64_t)(opt.duration * 1e9);
+    struct epoll_event events[MAX_EVENTS];
+    while(true)
+    {
+        uint64_t now = now_ns();
+        if(now >= end)
+        {
+            break;
+        }
+        int timeout = (int)((end - now) / 1000000) + 1;
+        if(opt.rate > 0)
+        {
+            //开环模式每毫秒检查一次计划
+            timeout = 1;
+        }
+        int number = epoll_wait(w.epollfd, events, MAX_EVENTS, timeout);
+        for(int i = 0; i < number; ++i)
+        {
+            handle(w, *static_cast<connection*>(events[i].data.ptr), events[i].events);
+        }
+        if(opt.rate > 0)
+        {
+            schedule(w);
+        }
+    }
+
+    for(size_t i = 0; i < w.conns.size(); ++i)
+    {
+        close_connection(w, w.conns[i]);
+    }
+    close(w.epollfd);
+    return nullptr;
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -h host          服务器地址(默认127.0.0.1)\n"
+        "  -p port          端口(默认10000)\n"
+        "  -c connections   连接数(默认100)\n"
+        "  -t threads       线程数(默认1)\n"
+        "  -d seconds       持续时间(默认10)\n"
+        "  -k               使用长连接\n"
+        "  -P depth         长连接上的流水线深度(默认1)\n"
+        "  -r rate          开环模式, 每秒发出的总请求数; 不指定时为闭环模式\n"
+        "  -u url[:weight]  请求的URL和权重, 可以指定多次(默认/index.html)\n"
+        "  -n name          结果中的场景名\n"
+        "  -o file          把结果以JSON格式写入文件\n", name);
+}
+
+void add_url(const char* arg)
+{
+    std::string url = arg;
+    int weight = 1;
+    size_t colon = url.rfind(':');
+    if(colon != std::string::npos && colon + 1 < url.size() && url.find_first_not_of("0123456789", colon + 1) == std::string::npos)
+    {
+        weight = atoi(url.c_str() + colon + 1);
+        url.resize(colon);
+    }
+    url_weight u;
+    u.weight = weight > 0 ? weight : 1;
+    u.request = "GET " + url + " HTTP/1.1\r\nHost: " + opt.host + "\r\n"
+        + (opt.keepalive ? "Connection: keep-alive\r\n" : "Connection: close\r\n") + "\r\n";
+    opt.urls.push_back(u);
+    total_weight += u.weight;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<const char*> urls;
+    int c;
+    while((c = getopt(argc, argv, "h:p:c:t:d:kP:r:u:n:o:")) != -1)
+    {
+        switch(c)
+        {
+            case 'h': opt.host = optarg; break;
+            case 'p': opt.port = atoi(optarg); break;
+            case 'c': opt.connections = atoi(optarg); break;
+            case 't': opt.threads = atoi(optarg); break;
+            case 'd': opt.duration = atof(optarg); break;
+            case 'k': opt.keepalive = true; break;
+            case 'P': opt.pipeline = atoi(optarg); break;
+            case 'r': opt.rate = atof(optarg); break;
+            case 'u': urls.push_back(optarg); break;
+            case 'n': opt.name = optarg; break;
+            case 'o': opt.output = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(opt.connections <= 0 || opt.threads <= 0 || opt.pipeline <= 0 || opt.pipeline > MAX_PIPELINE)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if(opt.threads > opt.connections)
+    {
+        opt.threads = opt.connections;
+    }
+    //URL中的请求头依赖-k, 所以在参数全部解析完之后再生成
+    if(urls.empty())
+    {
+        urls.push_back("/index.html");
+    }
+    for(size_t i = 0; i < urls.size(); ++i)
+    {
+        add_url(urls[i]);
+    }
+
+    std::vector<worker> workers(opt.threads);
+    std::vector<pthread_t> threads(opt.threads);
+    for(int i = 0; i < opt.threads; ++i)
+    {
+        worker& w = workers[i];
+        w.index = i;
+        w.connections = opt.connections / opt.threads + (i < opt.connections % opt.threads ? 1 : 0);
+        w.seed = 2463534242u + i;
+        w.rate = opt.rate / opt.threads;
+        w.issued = 0;
+        w.completed = w.errors = w.status_errors = w.bytes = w.reconnects = 0;
+        pthread_create(&threads[i], nullptr, run, &w);
+    }
+
+    histogram latency;
+    uint64_t completed = 0, errors = 0, status_errors = 0, bytes = 0, reconnects = 0, backlog = 0;
+    for(int i = 0; i < opt.threads; ++i)
+    {
+        pthread_join(threads[i], nullptr);
+        latency.merge(workers[i].latency);
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        status_errors += workers[i].status_errors;
+        bytes += workers[i].bytes;
+        reconnects += workers[i].reconnects;
+        backlog += workers[i].backlog.size();
+    }
+
+    double throughput = completed / opt.duration;
+    printf("%s: %d connections, %d threads, %.1fs, keep-alive %s, pipeline %d, %s\n", opt.name, opt.connections,
+        opt.threads, opt.duration, opt.keepalive ? "on" : "off", opt.pipeline, opt.rate > 0 ? "open loop" : "closed loop");
+    printf("  requests %llu (%.1f/s), %.2f MB/s, errors %llu, non-2xx %llu, reconnects %llu, unsent %llu\n",
+        (unsigned long long)completed, throughput, bytes / opt.duration / 1e6, (unsigned long long)errors,
+        (unsigned long long)status_errors, (unsigned long long)reconnects, (unsigned long long)backlog);
+    printf("  latency p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n", latency.quantile(0.5) / 1e3,
+        latency.quantile(0.99) / 1e3, latency.quantile(0.999) / 1e3, latency.max / 1e3);
+
+    if(opt.output)
+    {
+        FILE* fp = fopen(opt.output, "w");
+        if(fp == nullptr)
+        {
+            perror("open output");
+            return 1;
+        }
+        fprintf(fp, "{\"scenario\": \"%s\", \"connections\": %d, \"threads\": %d, \"duration\": %.3f, "
+            "\"keepalive\": %s, \"pipeline\": %d, \"rate\": %.1f, "
+            "\"requests\": %llu, \"throughput\": %.1f, \"bytes\": %llu, \"errors\": %llu, \"non_2xx\": %llu, "
+            "\"reconnects\": %llu, \"unsent\": %llu, "
+            "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+            opt.name, opt.connections, opt.threads, opt.duration, opt.keepalive ? "true" : "false", opt.pipeline, opt.rate,
+            (unsigned long long)completed, throughput, (unsigned long long)bytes, (unsigned long long)errors,
+            (unsigned long long)status_errors, (unsigned long long)reconnects, (unsigned long long)backlog,
+            latency.quantile(0.5) / 1e3, latency.quantile(0.99) / 1e3, latency.quantile(0.999) / 1e3, latency.max / 1e3);
+        fclose(fp);
+    }
+    return errors > 0 ? 2 : 0;
+}
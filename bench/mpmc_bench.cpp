@@ -0,0 +1,366 @@
+/*
+    线程池任务队列的微基准测试
+    比较线程池原来的任务队列(std::list + 互斥锁 + 信号量)和现在的无锁环形队列(mpmc_queue, 先自旋再休眠),
+    N个生产者对N个消费者, N依次取-t指定的线程数
+    吞吐量: 生产者不停入队, 队列满时重试, 统计每秒出队的任务数
+    延迟: 每个生产者每隔-i纳秒入队一个带入队时刻的任务, 消费者出队时记录入队到出队的时间,
+          包括队列空时消费者休眠后被唤醒的时间
+    可以同时写出JSON格式的结果
+
+    编译: g++ -std=c++17 -O2 -pthread bench/mpmc_bench.cpp -o mpmc_bench
+    例子: ./mpmc_bench -t 1,2,4,8,16,32,64 -n 200000 -o mpmc.json
+*/
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <list>
+#include <string>
+#include <vector>
+#include "../locker.h"
+#include "../mpmc_queue.h"
+#include "../pool_base.h"
+
+#define QUEUE_SIZE 10000                //和MAX_REQUESTS相同
+#define SPIN 2000                       //和THREADPOOL_SPIN相同
+#define STOP 0                          //入队时刻不会是0, 用来通知消费者退出
+
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+//原来的任务队列: 每个任务一个链表节点, 入队出队各加锁一次, 用信号量计数
+class locked_queue
+{
+public:
+    bool push(uint64_t value)
+    {
+        m_locker.lock();
+        if(m_list.size() > QUEUE_SIZE)
+        {
+            m_locker.unlock();
+            return false;
+        }
+        m_list.push_back(value);
+        m_locker.unlock();
+        m_count.post();
+        return true;
+    }
+
+    uint64_t pop()
+    {
+        m_count.wait();
+        m_locker.lock();
+        uint64_t value = m_list.front();
+        m_list.pop_front();
+        m_locker.unlock();
+        return value;
+    }
+
+private:
+    std::list<uint64_t> m_list;
+    locker m_locker;
+    sem m_count;
+};
+
+
+//现在的任务队列: 和threadpool一样, 消费者先自旋, 登记休眠后再检查一次队列, 生产者只在有线程休眠时post
+class ring_queue
+{
+public:
+    ring_queue():m_queue(QUEUE_SIZE), m_idle(0){}
+
+    bool push(uint64_t value)
+    {
+        if(!m_queue.push(value))
+        {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int idle = m_idle.load(std::memory_order_relaxed);
+        while(idle > 0)
+        {
+            if(m_idle.compare_exchange_weak(idle, idle - 1))
+            {
+                m_wakeup.post();
+                break;
+            }
+        }
+        return true;
+    }
+
+    uint64_t pop()
+    {
+        uint64_t value;
+        while(true)
+        {
+            for(int i = 0; i < SPIN; ++i)
+            {
+                if(m_queue.pop(value))
+                {
+                    return value;
+                }
+                cpu_relax();
+            }
+            m_idle.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(m_queue.pop(value))
+            {
+                int idle = m_idle.load(std::memory_order_relaxed);
+                while(idle > 0 && !m_idle.compare_exchange_weak(idle, idle - 1))
+                {
+                }
+                return value;
+            }
+            m_wakeup.wait();
+        }
+    }
+
+private:
+    mpmc_queue<uint64_t> m_queue;
+    sem m_wakeup;
+    std::atomic<int> m_idle;
+};
+
+
+struct options
+{
+    std::vector<int> threads;
+    long items = 100000;                //每个生产者入队的任务数
+    long interval = 20000;              //测延迟时每个生产者入队的间隔(纳秒)
+    const char* output = nullptr;
+};
+
+options opt;
+
+//一次测试的共享状态
+template<typename Q>
+struct run_state
+{
+    Q queue;
+    long items;
+    long interval;                      //0为不限速
+    std::atomic<int> ready;
+    std::atomic<bool> go;
+};
+
+template<typename Q>
+struct thread_arg
+{
+    run_state<Q>* state;
+    std::vector<uint32_t> latency;      //消费者记录的延迟(纳秒)
+};
+
+template<typename Q>
+void* producer(void* arg)
+{
+    run_state<Q>* s = static_cast<thread_arg<Q>*>(arg)->state;
+    s->ready.fetch_add(1);
+    while(!s->go.load(std::memory_order_acquire))
+    {
+        cpu_relax();
+    }
+    uint64_t next = now_ns();
+    for(long i = 0; i < s->items; ++i)
+    {
+        if(s->interval > 0)
+        {
+            //按计划的时刻入队, 线程被抢占后不补发积压的任务
+            next += s->interval;
+            uint64_t now;
+            while((now = now_ns()) < next)
+            {
+                if(next - now > 100000)
+                {
+                    usleep((next - now) / 1000 - 50);
+                }
+            }
+        }
+        while(!s->queue.push(now_ns()))
+        {
+            cpu_relax();
+        }
+    }
+    return nullptr;
+}
+
+template<typename Q>
+void* consumer(void* arg)
+{
+    thread_arg<Q>* a = static_cast<thread_arg<Q>*>(arg);
+    run_state<Q>* s = a->state;
+    s->ready.fetch_add(1);
+    while(true)
+    {
+        uint64_t start = s->queue.pop();
+        if(start == STOP)
+        {
+            break;
+        }
+        if(s->interval > 0)
+        {
+            uint64_t d = now_ns() - start;
+            a->latency.push_back(d > UINT32_MAX ? UINT32_MAX : d);
+        }
+    }
+    return nullptr;
+}
+
+struct result
+{
+    double seconds;
+    uint64_t p50, p99, p999, max;
+};
+
+//n个生产者对n个消费者跑一次, 返回所用时间和消费者记录的延迟分位数
+template<typename Q>
+result run(int n, long items, long interval)
+{
+    run_state<Q>* s = new run_state<Q>;
+    s->items = items;
+    s->interval = interval;
+    s->ready = 0;
+    s->go = false;
+    std::vector<thread_arg<Q> > args(2 * n);
+    std::vector<pthread_t> threads(2 * n);
+    for(int i = 0; i < 2 * n; ++i)
+    {
+        args[i].state = s;
+        if(interval > 0 && i >= n)
+        {
+            args[i].latency.reserve(items + 1024);
+        }
+        pthread_create(&threads[i], nullptr, i < n ? producer<Q> : consumer<Q>, &args[i]);
+    }
+    while(s->ready.load() < 2 * n)
+    {
+        usleep(100);
+    }
+
+    uint64_t start = now_ns();
+    s->go.store(true, std::memory_order_release);
+    for(int i = 0; i < n; ++i)
+    {
+        pthread_join(threads[i], nullptr);
+    }
+    for(int i = 0; i < n; ++i)
+    {
+        while(!s->queue.push(STOP))
+        {
+            cpu_relax();
+        }
+    }
+    std::vector<uint32_t> latency;
+    for(int i = n; i < 2 * n; ++i)
+    {
+        pthread_join(threads[i], nullptr);
+        latency.insert(latency.end(), args[i].latency.begin(), args[i].latency.end());
+    }
+
+    result r;
+    r.seconds = (now_ns() - start) / 1e9;
+    r.p50 = r.p99 = r.p999 = r.max = 0;
+    if(!latency.empty())
+    {
+        std::sort(latency.begin(), latency.end());
+        r.p50 = latency[latency.size() * 50 / 100];
+        r.p99 = latency[latency.size() * 99 / 100];
+        r.p999 = latency[latency.size() * 999 / 1000];
+        r.max = latency.back();
+    }
+    delete s;
+    return r;
+}
+
+template<typename Q>
+void bench(const char* name, std::string& json)
+{
+    for(size_t i = 0; i < opt.threads.size(); ++i)
+    {
+        int n = opt.threads[i];
+        result t = run<Q>(n, opt.items, 0);
+        //测延迟时每个生产者的任务数按间隔折算, 让一次测试大约0.5秒
+        long paced = 500000000L / opt.interval;
+        result l = run<Q>(n, paced < opt.items ? paced : opt.items, opt.interval);
+        double throughput = opt.items * n / t.seconds;
+        printf("%-8s %3d x %-3d %10.0f ops/s   latency p50 %6.1fus p99 %7.1fus p999 %7.1fus max %8.1fus\n",
+            name, n, n, throughput, l.p50 / 1e3, l.p99 / 1e3, l.p999 / 1e3, l.max / 1e3);
+        fflush(stdout);
+
+        char line[512];
+        snprintf(line, sizeof(line), "%s{\"queue\": \"%s\", \"producers\": %d, \"consumers\": %d, \"throughput\": %.1f, "
+            "\"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}}",
+            json.empty() ? "" : ", ", name, n, n, throughput, l.p50 / 1e3, l.p99 / 1e3, l.p999 / 1e3, l.max / 1e3);
+        json += line;
+    }
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -t n,n,...       生产者和消费者各自的线程数(默认1,2,4,8,16,32,64)\n"
+        "  -n items         测吞吐量时每个生产者入队的任务数(默认100000)\n"
+        "  -i ns            测延迟时每个生产者入队的间隔(纳秒, 默认20000)\n"
+        "  -o file          把结果以JSON格式写入文件\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    int c;
+    while((c = getopt(argc, argv, "t:n:i:o:")) != -1)
+    {
+        switch(c)
+        {
+            case 't':
+            {
+                for(char* p = strtok(optarg, ","); p; p = strtok(nullptr, ","))
+                {
+                    opt.threads.push_back(atoi(p));
+                }
+                break;
+            }
+            case 'n': opt.items = atol(optarg); break;
+            case 'i': opt.interval = atol(optarg); break;
+            case 'o': opt.output = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(opt.threads.empty())
+    {
+        opt.threads = {1, 2, 4, 8, 16, 32, 64};
+    }
+    if(opt.items <= 0 || opt.interval <= 0
+        || std::find_if(opt.threads.begin(), opt.threads.end(), [](int n){return n <= 0;}) != opt.threads.end())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string json;
+    bench<locked_queue>("locked", json);
+    bench<ring_queue>("mpmc", json);
+
+    if(opt.output)
+    {
+        FILE* fp = fopen(opt.output, "w");
+        if(fp == nullptr)
+        {
+            perror("open output");
+            return 1;
+        }
+        fprintf(fp, "{\"scenario\": \"mpmc_queue\", \"results\": [%s]}\n", json.c_str());
+        fclose(fp);
+    }
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+    线程池调度方式的微基准测试
+    比较所有线程共享一个任务队列的threadpool和每个线程有自己队列、空闲时偷取任务的steal_threadpool(轮询和按地址分配)
+    一个生产者线程像reactor一样把任务交给线程池, 同时在处理中的任务不超过-w个; 任务在工作线程中忙等指定的时间
+    uniform: 所有任务耗时相同; mixed: 每-m个任务中有一个耗时很长的任务, 看便宜的任务会不会排在它后面等待
+    统计吞吐量和每个任务从append到处理完的延迟, 可以同时写出JSON格式的结果
+
+    编译: g++ -std=c++17 -O2 -pthread bench/pool_bench.cpp log.cpp -o pool_bench
+    例子: ./pool_bench -t 1,2,4,8 -n 20000 -o pool.json
+*/
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "../threadpool.h"
+#include "../steal_threadpool.h"
+
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct options
+{
+    std::vector<int> threads;
+    long tasks = 20000;                 //每次测试的任务数
+    int window = 64;                    //同时在处理中的任务数上限
+    long cheap = 2000;                  //普通任务的耗时(纳秒)
+    long expensive = 200000;            //mixed中耗时长的任务的耗时(纳秒)
+    int mix = 20;                       //mixed中每mix个任务有一个耗时长的任务
+    const char* output = nullptr;
+};
+
+options opt;
+std::atomic<long> completed(0);
+
+
+//线程池的任务, 和http_conn一样提供process()
+struct task
+{
+    uint64_t cost;                      //忙等的时间
+    uint64_t queued;                    //append的时刻
+    uint64_t latency;                   //append到处理完的时间
+
+    void process()
+    {
+        uint64_t start = now_ns();
+        while(now_ns() - start < cost)
+        {
+            cpu_relax();
+        }
+        latency = now_ns() - queued;
+        completed.fetch_add(1, std::memory_order_release);
+    }
+};
+
+struct result
+{
+    double throughput;
+    uint64_t p50, p99, max;
+    uint64_t cheap_p99;                 //普通任务的p99, 看是否被耗时长的任务拖慢
+};
+
+uint64_t percentile(std::vector<uint64_t>& v, int per_mille)
+{
+    if(v.empty())
+    {
+        return 0;
+    }
+    return v[std::min(v.size() - 1, v.size() * per_mille / 1000)];
+}
+
+result run(pool_base<task>* pool, bool mixed)
+{
+    std::vector<task> tasks(opt.tasks);
+    for(long i = 0; i < opt.tasks; ++i)
+    {
+        tasks[i].cost = mixed && i % opt.mix == 0 ? opt.expensive : opt.cheap;
+    }
+    completed.store(0);
+
+    uint64_t start = now_ns();
+    for(long i = 0; i < opt.tasks; ++i)
+    {
+        while(i - completed.load(std::memory_order_acquire) >= opt.window)
+        {
+            sched_yield();
+        }
+        tasks[i].queued = now_ns();
+        while(!pool->append(&tasks[i]))
+        {
+            sched_yield();
+        }
+    }
+    while(completed.load(std::memory_order_acquire) < opt.tasks)
+    {
+        sched_yield();
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    std::vector<uint64_t> all;
+    std::vector<uint64_t> cheap;
+    for(long i = 0; i < opt.tasks; ++i)
+    {
+        all.push_back(tasks[i].latency);
+        if(tasks[i].cost == (uint64_t)opt.cheap)
+        {
+            cheap.push_back(tasks[i].latency);
+        }
+    }
+    std::sort(all.begin(), all.end());
+    std::sort(cheap.begin(), cheap.end());
+
+    result r;
+    r.throughput = opt.tasks / seconds;
+    r.p50 = percentile(all, 500);
+    r.p99 = percentile(all, 990);
+    r.max = all.back();
+    r.cheap_p99 = percentile(cheap, 990);
+    return r;
+}
+
+pool_base<task>* make_pool(const char* name, int threads)
+{
+    if(strcmp(name, "shared") == 0)
+    {
+        return new threadpool<task>(threads);
+    }
+    if(strcmp(name, "steal") == 0)
+    {
+        return new steal_threadpool<task>(threads);
+    }
+    return new steal_threadpool<task>(threads, MAX_REQUESTS, steal_threadpool<task>::STEAL_AFFINITY);
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -t n,n,...       工作线程数(默认1,2,4,8)\n"
+        "  -n tasks         每次测试的任务数(默认20000)\n"
+        "  -w window        同时在处理中的任务数上限(默认64)\n"
+        "  -c ns            普通任务的耗时(纳秒, 默认2000)\n"
+        "  -e ns            mixed中耗时长的任务的耗时(纳秒, 默认200000)\n"
+        "  -m n             mixed中每n个任务有一个耗时长的任务(默认20)\n"
+        "  -o file          把结果以JSON格式写入文件\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    int c;
+    while((c = getopt(argc, argv, "t:n:w:c:e:m:o:")) != -1)
+    {
+        switch(c)
+        {
+            case 't':
+            {
+                for(char* p = strtok(optarg, ","); p; p = strtok(nullptr, ","))
+                {
+                    opt.threads.push_back(atoi(p));
+                }
+                break;
+            }
+            case 'n': opt.tasks = atol(optarg); break;
+            case 'w': opt.window = atoi(optarg); break;
+            case 'c': opt.cheap = atol(optarg); break;
+            case 'e': opt.expensive = atol(optarg); break;
+            case 'm': opt.mix = atoi(optarg); break;
+            case 'o': opt.output = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(opt.threads.empty())
+    {
+        opt.threads = {1, 2, 4, 8};
+    }
+    if(opt.tasks <= 0 || opt.window <= 0 || opt.cheap < 0 || opt.expensive < 0 || opt.mix <= 0
+        || std::find_if(opt.threads.begin(), opt.threads.end(), [](int n){return n <= 0;}) != opt.threads.end())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    //线程池创建和调整线程时的日志不需要
+    logger::set_level(LOG_LEVEL_ERROR);
+
+    const char* pools[] = {"shared", "steal", "affinity"};
+    const char* loads[] = {"uniform", "mixed"};
+    std::string json;
+    for(int l = 0; l < 2; ++l)
+    {
+        for(size_t i = 0; i < opt.threads.size(); ++i)
+        {
+            for(int p = 0; p < 3; ++p)
+            {
+                int n = opt.threads[i];
+                pool_base<task>* pool = make_pool(pools[p], n);
+                result r = run(pool, l == 1);
+                delete pool;
+                printf("%-8s %3d threads %-9s %10.0f tasks/s   latency p50 %8.1fus p99 %8.1fus max %8.1fus  cheap p99 %8.1fus\n",
+                    loads[l], n, pools[p], r.throughput, r.p50 / 1e3, r.p99 / 1e3, r.max / 1e3, r.cheap_p99 / 1e3);
+                fflush(stdout);
+
+                char line[512];
+                snprintf(line, sizeof(line), "%s{\"load\": \"%s\", \"threads\": %d, \"pool\": \"%s\", \"throughput\": %.1f, "
+                    "\"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f, \"cheap_p99\": %.2f}}",
+                    json.empty() ? "" : ", ", loads[l], n, pools[p], r.throughput,
+                    r.p50 / 1e3, r.p99 / 1e3, r.max / 1e3, r.cheap_p99 / 1e3);
+                json += line;
+            }
+        }
+    }
+
+    if(opt.output)
+    {
+        FILE* fp = fopen(opt.output, "w");
+        if(fp == nullptr)
+        {
+            perror("open output");
+            return 1;
+        }
+        fprintf(fp, "{\"scenario\": \"threadpool\", \"results\": [%s]}\n", json.c_str());
+        fclose(fp);
+    }
+    return 0;
+}
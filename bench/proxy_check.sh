@@ -0,0 +1,108 @@
+#!/bin/bash
+# 反向代理的场景检查
+# 启动stub_backend.py作为后端, 服务器把/api/*转发给它, 把/dead/*转发给没有监听的端口, 依次检查:
+#   keepalive_reuse     连续两个请求复用同一条后端连接
+#   backend_close       后端回复Connection: close后, 下一个请求使用新的后端连接
+#   pooled_close_retry  复用的空闲连接被后端直接关闭时, 换一条新连接重试, 客户端仍然收到200
+#   post_not_retried    同样的情况下已经发给后端的POST不重试, 回复502, 避免后端执行两次
+#   connect_failure     后端连接失败时回复502
+# 任何一项失败时退出码非0
+#
+# 用法: bench/proxy_check.sh
+# 环境变量: PORT(服务器端口, 默认18080, 后端使用PORT+1, PORT+2保持没有监听) BIN(已经编译好的服务器所在目录)
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${PORT:-18080}
+BACKEND_PORT=$((PORT + 1))
+DEAD_PORT=$((PORT + 2))
+BIN=${BIN:-}
+LOG=$(mktemp)
+
+if [ -z "$BIN" ]; then
+    BIN=$(mktemp -d)
+    g++ -std=c++17 -O2 -pthread "$ROOT"/*.cpp -o "$BIN/sever" -lz
+fi
+
+SERVER_PID=
+BACKEND_PID=
+cleanup()
+{
+    for pid in $SERVER_PID $BACKEND_PID; do
+        kill "$pid" 2>/dev/null || true
+        wait "$pid" 2>/dev/null || true
+    done
+    rm -f "$LOG"
+}
+trap cleanup EXIT
+
+# wait_port <端口>
+wait_port()
+{
+    for i in $(seq 50); do
+        if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "port $1 did not open" >&2
+    exit 1
+}
+
+python3 "$ROOT/bench/stub_backend.py" "$BACKEND_PORT" &
+BACKEND_PID=$!
+wait_port "$BACKEND_PORT"
+
+# 一个reactor, 所有请求使用同一个后端连接池
+WEBSERVER_ROOT="$ROOT/resources" "$BIN/sever" "--upstream=/api/*=127.0.0.1:$BACKEND_PORT;/dead/*=127.0.0.1:$DEAD_PORT" \
+    "$PORT" 1 > "$LOG" 2>&1 &
+SERVER_PID=$!
+wait_port "$PORT"
+
+# request <路径> [curl参数...]: 输出"状态码 后端连接编号", 每次是一条新的客户端连接
+request()
+{
+    local path=$1
+    shift
+    curl -s -m 5 -D - -o /dev/null "$@" "http://127.0.0.1:$PORT$path" | tr -d '\r' \
+        | awk 'NR == 1 {status = $2} tolower($1) == "x-conn:" {conn = $2} END {print status, conn}'
+}
+
+FAILED=0
+# check <名字> <条件>
+check()
+{
+    if eval "$2"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1: $3"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+read -r s1 c1 <<< "$(request /api/first)"
+read -r s2 c2 <<< "$(request /api/second)"
+check keepalive_reuse '[ "$s1" = 200 ] && [ "$s2" = 200 ] && [ "$c1" = "$c2" ]' "status $s1/$s2, backend connections $c1/$c2"
+
+read -r s1 c1 <<< "$(request /api/close)"
+read -r s2 c2 <<< "$(request /api/after-close)"
+check backend_close '[ "$s1" = 200 ] && [ "$s2" = 200 ] && [ "$c1" != "$c2" ]' "status $s1/$s2, backend connections $c1/$c2"
+
+read -r s1 c1 <<< "$(request /api/drop-next)"
+read -r s2 c2 <<< "$(request /api/retried)"
+check pooled_close_retry '[ "$s1" = 200 ] && [ "$s2" = 200 ] && [ "$c1" != "$c2" ]' "status $s1/$s2, backend connections $c1/$c2"
+
+read -r s1 c1 <<< "$(request /api/drop-next)"
+read -r s2 c2 <<< "$(request /api/post-once -d x)"
+read -r s3 c3 <<< "$(request /api/after-post)"
+check post_not_retried '[ "$s1" = 200 ] && [ "$s2" = 502 ] && [ "$s3" = 200 ]' "status $s1/$s2/$s3"
+
+read -r s1 c1 <<< "$(request /dead/x)"
+check connect_failure '[ "$s1" = 502 ]' "status $s1"
+
+if [ $FAILED -gt 0 ]; then
+    echo "server log:"
+    cat "$LOG"
+fi
+exit $FAILED
@@ -0,0 +1,149 @@
+#!/bin/bash
+# 压力测试场景
+# 编译服务器和loadgen, 在回环地址上用仓库中的resources目录启动服务器, 依次运行各个场景,
+# 每个场景的结果写入 $OUT/<场景名>.json, 所有结果合并到 $OUT/summary.json
+#
+# 用法: bench/run.sh [场景名...]        不指定时运行全部场景
+# 环境变量: PORT(默认18080) DURATION(每个场景的秒数, 默认10) OUT(结果目录, 默认bench/results)
+# 每个场景结束时从/metrics读取系统调用数, 结果中的syscalls_per_request是平均每个请求的系统调用次数
+# 微基准测试(micro开头的场景)不启动服务器, 直接比较服务器内部组件新旧实现的性能
+# proxy_check用stub_backend.py作为后端检查反向代理的连接复用、后端关闭连接后的重试和连接失败时的502
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${PORT:-18080}
+DURATION=${DURATION:-10}
+OUT=${OUT:-$ROOT/bench/results}
+BIN=$OUT/bin
+
+mkdir -p "$OUT" "$BIN"
+g++ -std=c++17 -O2 -pthread "$ROOT"/*.cpp -o "$BIN/sever" -lz
+g++ -std=c++17 -O2 -pthread "$ROOT/bench/loadgen.cpp" -o "$BIN/loadgen"
+g++ -std=c++17 -O2 -pthread "$ROOT/bench/mpmc_bench.cpp" -o "$BIN/mpmc_bench"
+g++ -std=c++17 -O2 "$ROOT/bench/scan_bench.cpp" -o "$BIN/scan_bench"
+g++ -std=c++17 -O2 -pthread "$ROOT/bench/pool_bench.cpp" "$ROOT/log.cpp" -o "$BIN/pool_bench"
+
+SERVER_PID=
+stop_server()
+{
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+        SERVER_PID=
+    fi
+}
+trap stop_server EXIT
+
+# start_server <服务器参数...>
+start_server()
+{
+    WEBSERVER_BACKEND=${SERVER_BACKEND:-epoll} WEBSERVER_ROOT="$ROOT/resources" "$BIN/sever" "$PORT" "$@" > "$OUT/server.log" 2>&1 &
+    SERVER_PID=$!
+    for i in $(seq 50); do
+        if (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "server did not start" >&2
+    exit 1
+}
+
+# metric <指标名>: 从服务器的/metrics中读取一个计数器(所有线程的合计)
+metric()
+{
+    exec 3<>/dev/tcp/127.0.0.1/$PORT
+    printf 'GET /metrics HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n' >&3
+    awk -v name="$1" '$1 == name {print $2}' <&3
+    exec 3<&-
+}
+
+# scenario <名字> "<服务器参数>" <loadgen参数...>
+# 环境变量SERVER_BACKEND选择服务器的事件循环后端(epoll或uring)
+scenario()
+{
+    local name=$1 server_args=$2
+    shift 2
+    if [ ${#SELECTED[@]} -gt 0 ] && [[ ! " ${SELECTED[*]} " =~ " $name " ]]; then
+        return 0
+    fi
+    start_server $server_args
+    local syscalls_before requests_before
+    syscalls_before=$(metric webserver_syscalls_total)
+    requests_before=$(metric webserver_requests_total)
+    "$BIN/loadgen" -p "$PORT" -d "$DURATION" -n "$name" -o "$OUT/$name.json" "$@" || true
+    local per_request
+    per_request=$(awk -v s0="$syscalls_before" -v s1="$(metric webserver_syscalls_total)" \
+        -v r0="$requests_before" -v r1="$(metric webserver_requests_total)" \
+        'BEGIN {printf "%.2f", (r1 > r0) ? (s1 - s0) / (r1 - r0) : 0}')
+    if [ -f "$OUT/$name.json" ]; then
+        sed -i "s/}\$/, \"syscalls_per_request\": $per_request}/" "$OUT/$name.json"
+    fi
+    stop_server
+}
+
+# micro <名字> <程序> <参数...>: 运行一个微基准测试, 结果写入$OUT/<名字>.json
+micro()
+{
+    local name=$1 program=$2
+    shift 2
+    if [ ${#SELECTED[@]} -gt 0 ] && [[ ! " ${SELECTED[*]} " =~ " $name " ]]; then
+        return 0
+    fi
+    echo "$name:"
+    "$BIN/$program" -o "$OUT/$name.json" "$@" || true
+}
+
+# check <名字> <脚本>: 运行一个场景检查脚本, 失败的项数写入$OUT/<名字>.json
+check()
+{
+    local name=$1 script=$2
+    if [ ${#SELECTED[@]} -gt 0 ] && [[ ! " ${SELECTED[*]} " =~ " $name " ]]; then
+        return 0
+    fi
+    echo "$name:"
+    local failed=0
+    BIN="$BIN" PORT="$PORT" "$ROOT/bench/$script" || failed=$?
+    echo "{\"scenario\": \"$name\", \"failed\": $failed}" > "$OUT/$name.json"
+}
+
+SELECTED=("$@")
+rm -f "$OUT"/*.json
+
+scenario keepalive_c100         "0"         -c 100 -k
+scenario short_c100             "0"         -c 100
+scenario pipeline_c50_p8        "0"         -c 50 -k -P 8
+scenario mix_c100               "0"         -c 100 -k -u /index.html:4 -u /images/image1.jpg:2 -u /missing.html:1
+scenario open_loop_5k           "0"         -c 100 -k -r 5000
+scenario steal_c100             "0 steal"   -c 100 -k
+scenario reuseport_c100         "$(nproc)"  -c 100 -k
+scenario accept_storm_c1000     "$(nproc)"  -c 1000
+SERVER_BACKEND=uring \
+scenario uring_keepalive_c100   "$(nproc)"  -c 100 -k
+SERVER_BACKEND=uring \
+scenario uring_short_c100       "$(nproc)"  -c 100
+SERVER_BACKEND=uring \
+scenario uring_pipeline_c50_p8  "$(nproc)"  -c 50 -k -P 8
+
+check proxy_check               proxy_check.sh
+
+micro micro_http_scan           scan_bench
+micro micro_mpmc_queue          mpmc_bench  -t 1,2,4,8,16,32,64
+micro micro_threadpool          pool_bench  -t 1,2,4,8
+
+# 合并为一个JSON数组, 方便和之前的结果比较
+{
+    echo "["
+    first=1
+    for f in "$OUT"/*.json; do
+        [ "$(basename "$f")" = summary.json ] && continue
+        [ $first -eq 1 ] || echo ","
+        first=0
+        tr -d '\n' < "$f"
+    done
+    echo
+    echo "]"
+} > "$OUT/summary.json.tmp"
+mv "$OUT/summary.json.tmp" "$OUT/summary.json"
+echo "results: $OUT/summary.json"
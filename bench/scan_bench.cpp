@@ -0,0 +1,417 @@
+/*
+    请求解析的微基准测试
+    比较原来逐字节查找行尾、往缓冲区里写'\0'再用strncasecmp逐个比较字段名的状态机,
+    和现在用http_scan按向量查找分隔符、得到偏移和长度、按字段名长度分派的解析方式,
+    后者分别使用http_scan的逐字节、SSE4.2和AVX2实现(CPU不支持的跳过)
+    两种方式识别同样的字段(Host、Connection、Content-Length), 每次解析前都把请求拷贝进读缓冲区, 和从socket读入一样
+    直接包含http_scan.cpp, 可以分别调用各个实现, 不受启动时自动选择的影响
+
+    编译: g++ -std=c++17 -O2 bench/scan_bench.cpp -o scan_bench
+    例子: ./scan_bench -d 0.5 -o scan.json
+*/
+#include "../http_scan.cpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define BUFFER_SIZE 8192
+
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//解析结果, 累加起来防止编译器把解析优化掉
+struct parsed
+{
+    int url;
+    int host;
+    bool linger;
+    long content_length;
+};
+
+
+//原来的方式: 逐字节找\r\n并把它们改成'\0', 请求行用strpbrk切分, 头部依次strncasecmp
+bool parse_old(char* buf, int len, parsed* out)
+{
+    int checked = 0;
+    int start = 0;
+    bool request_line = true;
+    while(true)
+    {
+        //parse_line
+        char* line = buf + start;
+        bool ok = false;
+        for(; checked < len; ++checked)
+        {
+            char cur = buf[checked];
+            if(cur == '\r')
+            {
+                if(checked + 1 == len || buf[checked + 1] != '\n')
+                {
+                    return false;
+                }
+                buf[checked++] = '\0';
+                buf[checked++] = '\0';
+                ok = true;
+                break;
+            }
+            if(cur == '\n')
+            {
+                return false;
+            }
+        }
+        if(!ok)
+        {
+            return false;
+        }
+        start = checked;
+
+        if(request_line)
+        {
+            //parse_request_line
+            char* url = strpbrk(line, " ");
+            if(url == nullptr)
+            {
+                return false;
+            }
+            *url++ = '\0';
+            if(strcasecmp(line, "GET") != 0)
+            {
+                return false;
+            }
+            char* version = strpbrk(url, " ");
+            if(version == nullptr)
+            {
+                return false;
+            }
+            *version++ = '\0';
+            if(strcasecmp(version, "HTTP/1.1") != 0)
+            {
+                return false;
+            }
+            if(strncasecmp(url, "http://", 7) == 0)
+            {
+                url = strchr(url + 7, '/');
+            }
+            if(!url || url[0] != '/')
+            {
+                return false;
+            }
+            out->url = url - buf;
+            request_line = false;
+            continue;
+        }
+
+        //parse_headers
+        if(line[0] == '\0')
+        {
+            return true;
+        }
+        if(strncasecmp(line, "Connection:", 11) == 0)
+        {
+            if(strncasecmp(line + 12, "keep-alive", 10) == 0)
+            {
+                out->linger = true;
+            }
+        }
+        else if(strncasecmp(line, "Content-Length:", 15) == 0)
+        {
+            out->content_length = atol(line + 16);
+        }
+        else if(strncasecmp(line, "Host:", 5) == 0)
+        {
+            out->host = line + 6 - buf;
+        }
+    }
+}
+
+
+//现在的方式: 用scan查找分隔符, 行、字段名和字段值都是偏移和长度, 不修改缓冲区
+template<scan_func scan>
+bool parse_new(const char* buf, int len, parsed* out)
+{
+    int checked = 0;
+    bool request_line = true;
+    while(true)
+    {
+        //parse_line
+        int start = checked;
+        checked += scan(buf + checked, len - checked, "\r\n", 2);
+        if(checked + 1 >= len || buf[checked] != '\r' || buf[checked + 1] != '\n')
+        {
+            return false;
+        }
+        const char* text = buf + start;
+        int text_len = checked - start;
+        checked += 2;
+
+        if(request_line)
+        {
+            //parse_request_line
+            int method_len = scan(text, text_len, " ", 1);
+            if(method_len != 3 || strncasecmp(text, "GET", 3) != 0)
+            {
+                return false;
+            }
+            const char* url = text + method_len + 1;
+            int rest = text_len - method_len - 1;
+            int url_len = scan(url, rest, " ", 1);
+            if(url_len == rest || rest - url_len - 1 != 8 || strncasecmp(url + url_len + 1, "HTTP/1.1", 8) != 0)
+            {
+                return false;
+            }
+            if(url_len >= 7 && strncasecmp(url, "http://", 7) == 0)
+            {
+                int host_len = scan(url + 7, url_len - 7, "/", 1);
+                url += 7 + host_len;
+                url_len -= 7 + host_len;
+            }
+            if(url_len == 0 || url[0] != '/')
+            {
+                return false;
+            }
+            out->url = url - buf;
+            request_line = false;
+            continue;
+        }
+
+        //parse_headers
+        if(text_len == 0)
+        {
+            return true;
+        }
+        int name_len = scan(text, text_len, ":", 1);
+        if(name_len == text_len)
+        {
+            continue;
+        }
+        const char* value = text + name_len + 1;
+        int value_len = text_len - name_len - 1;
+        while(value_len > 0 && (value[0] == ' ' || value[0] == '\t'))
+        {
+            ++value;
+            --value_len;
+        }
+        while(value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+        {
+            --value_len;
+        }
+        switch(name_len)
+        {
+            case 4:
+            {
+                if(strncasecmp(text, "Host", 4) == 0)
+                {
+                    out->host = value - buf;
+                }
+                break;
+            }
+            case 10:
+            {
+                if(strncasecmp(text, "Connection", 10) == 0 && value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0)
+                {
+                    out->linger = true;
+                }
+                break;
+            }
+            case 14:
+            {
+                if(strncasecmp(text, "Content-Length", 14) == 0)
+                {
+                    long length = 0;
+                    for(int i = 0; i < value_len; ++i)
+                    {
+                        if(value[i] < '0' || value[i] > '9')
+                        {
+                            return false;
+                        }
+                        length = length * 10 + (value[i] - '0');
+                    }
+                    out->content_length = length;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+
+typedef bool (*parse_func)(char* buf, int len, parsed* out);
+
+bool parse_scalar(char* buf, int len, parsed* out) {return parse_new<scan_scalar>(buf, len, out);}
+#if defined(__x86_64__) || defined(__i386__)
+bool parse_sse42(char* buf, int len, parsed* out) {return parse_new<scan_sse42>(buf, len, out);}
+bool parse_avx2(char* buf, int len, parsed* out) {return parse_new<scan_avx2>(buf, len, out);}
+#endif
+
+struct parser
+{
+    const char* name;
+    parse_func func;
+    bool supported;
+};
+
+struct request
+{
+    const char* name;
+    std::string data;
+};
+
+
+double duration = 0.5;
+const char* output = nullptr;
+
+std::string browser_request(int cookie_len)
+{
+    return "GET /images/image1.jpg?v=20210322 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Referer: https://www.example.com/index.html\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+        "Cookie: session=" + std::string(cookie_len, 'x') + "\r\n"
+        "\r\n";
+}
+
+//对一个请求反复解析duration秒, 返回每次解析的纳秒数, 解析失败时返回-1
+double measure(const parser& p, const request& r, uint64_t* checksum)
+{
+    char buf[BUFFER_SIZE];
+    int len = r.data.size();
+    long rounds = 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(duration * 1e9);
+    uint64_t now;
+    do
+    {
+        for(int i = 0; i < 1000; ++i)
+        {
+            memcpy(buf, r.data.data(), len);
+            parsed out = {0, 0, false, 0};
+            if(!p.func(buf, len, &out))
+            {
+                return -1;
+            }
+            *checksum += out.url + out.host + out.linger + out.content_length;
+        }
+        rounds += 1000;
+        now = now_ns();
+    }
+    while(now < end);
+    return (double)(now - start) / rounds;
+}
+
+void usage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -d seconds       每种解析方式对每个请求的测试时间(默认0.5)\n"
+        "  -o file          把结果以JSON格式写入文件\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    int c;
+    while((c = getopt(argc, argv, "d:o:")) != -1)
+    {
+        switch(c)
+        {
+            case 'd': duration = atof(optarg); break;
+            case 'o': output = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(duration <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<parser> parsers;
+    parsers.push_back(parser{"state_machine", parse_old, true});
+    parsers.push_back(parser{"scan_scalar", parse_scalar, true});
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    parsers.push_back(parser{"scan_sse4.2", parse_sse42, (bool)__builtin_cpu_supports("sse4.2")});
+    parsers.push_back(parser{"scan_avx2", parse_avx2, (bool)__builtin_cpu_supports("avx2")});
+#endif
+
+    std::vector<request> requests;
+    requests.push_back(request{"small", "GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n"});
+    requests.push_back(request{"browser", browser_request(64)});
+    requests.push_back(request{"cookie_2k", browser_request(2048)});
+
+    std::string json;
+    uint64_t checksum = 0;
+    for(size_t i = 0; i < requests.size(); ++i)
+    {
+        const request& r = requests[i];
+        double baseline = 0;
+        for(size_t k = 0; k < parsers.size(); ++k)
+        {
+            const parser& p = parsers[k];
+            if(!p.supported)
+            {
+                continue;
+            }
+            double ns = measure(p, r, &checksum);
+            if(ns < 0)
+            {
+                fprintf(stderr, "%s failed to parse %s\n", p.name, r.name);
+                return 1;
+            }
+            if(k == 0)
+            {
+                baseline = ns;
+            }
+            printf("%-10s %5zu bytes  %-14s %8.1f ns/request %8.1f MB/s  %5.2fx\n",
+                r.name, r.data.size(), p.name, ns, r.data.size() / ns * 1e3, baseline / ns);
+            fflush(stdout);
+
+            char line[256];
+            snprintf(line, sizeof(line), "%s{\"request\": \"%s\", \"bytes\": %zu, \"parser\": \"%s\", \"ns_per_request\": %.1f, \"speedup\": %.2f}",
+                json.empty() ? "" : ", ", r.name, r.data.size(), p.name, ns, baseline / ns);
+            json += line;
+        }
+    }
+    //防止解析结果被当作无用的计算优化掉
+    if(checksum == 1)
+    {
+        printf("\n");
+    }
+
+    if(output)
+    {
+        FILE* fp = fopen(output, "w");
+        if(fp == nullptr)
+        {
+            perror("open output");
+            return 1;
+        }
+        fprintf(fp, "{\"scenario\": \"http_scan\", \"results\": [%s]}\n", json.c_str());
+        fclose(fp);
+    }
+    return 0;
+}
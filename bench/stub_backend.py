@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# 反向代理测试用的HTTP/1.1后端
+# 每条连接一个线程, 默认保持长连接, 每个响应带X-Conn(这条连接的编号)和X-Path, 用来判断代理是否复用了后端连接
+#   .../close...    回复后关闭连接(Connection: close)
+#   .../drop-next.. 正常回复, 但这条连接上的下一个请求不回复直接关闭, 模拟代理复用空闲连接时后端刚好关闭了它
+#   其他路径        回复"方法 路径"
+#
+# 用法: bench/stub_backend.py 端口
+
+import socket
+import sys
+import threading
+
+next_id = [0]
+id_lock = threading.Lock()
+
+
+def serve(conn, conn_id):
+    buf = b''
+    drop_next = False
+    while True:
+        while b'\r\n\r\n' not in buf:
+            data = conn.recv(65536)
+            if not data:
+                conn.close()
+                return
+            buf += data
+        head, buf = buf.split(b'\r\n\r\n', 1)
+        lines = head.decode('latin-1').split('\r\n')
+        method, path, _ = lines[0].split(' ', 2)
+        length = 0
+        for line in lines[1:]:
+            name, _, value = line.partition(':')
+            if name.strip().lower() == 'content-length':
+                length = int(value)
+        while len(buf) < length:
+            buf += conn.recv(65536)
+        buf = buf[length:]
+
+        if drop_next:
+            conn.close()
+            return
+        body = ('%s %s\n' % (method, path)).encode()
+        close = '/close' in path
+        drop_next = '/drop-next' in path
+        conn.sendall(('HTTP/1.1 200 OK\r\nX-Conn: %d\r\nX-Path: %s\r\nContent-Length: %d\r\n%s\r\n'
+                      % (conn_id, path, len(body), 'Connection: close\r\n' if close else '')).encode() + body)
+        if close:
+            conn.close()
+            return
+
+
+def main():
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('127.0.0.1', int(sys.argv[1])))
+    listener.listen(128)
+    while True:
+        conn, _ = listener.accept()
+        with id_lock:
+            next_id[0] += 1
+            conn_id = next_id[0]
+        threading.Thread(target=serve, args=(conn, conn_id), daemon=True).start()
+
+
+if __name__ == '__main__':
+    main()
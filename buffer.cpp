@@ -0,0 +1,362 @@
+#include "buffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+
+//每个线程独享的分级空闲链表, 空闲的内存块开头存放下一个空闲块的指针
+struct pool_slab
+{
+    void* free_list[BUFFER_CLASS_COUNT];
+    int count[BUFFER_CLASS_COUNT];
+
+    pool_slab()
+    {
+        for(int i = 0; i < BUFFER_CLASS_COUNT; ++i)
+        {
+            free_list[i] = nullptr;
+            count[i] = 0;
+        }
+    }
+    ~pool_slab()
+    {
+        for(int i = 0; i < BUFFER_CLASS_COUNT; ++i)
+        {
+            while(free_list[i])
+            {
+                void* p = free_list[i];
+                free_list[i] = *static_cast<void**>(p);
+                free(p);
+            }
+        }
+    }
+};
+
+thread_local pool_slab slab;
+
+//size所在的级别, 超过最大一级时返回-1
+int size_class(int size)
+{
+    int index = 0;
+    int class_size = BUFFER_CLASS_MIN;
+    while(class_size < size)
+    {
+        class_size <<= 1;
+        if(++index == BUFFER_CLASS_COUNT)
+        {
+            return -1;
+        }
+    }
+    return index;
+}
+
+//申请一个数据区至少为min_size的块, 块头和数据区一起占用一级的大小
+buffer_chunk* alloc_chunk(int min_size)
+{
+    int size = buffer_pool_size(sizeof(buffer_chunk) + min_size);
+    buffer_chunk* chunk = static_cast<buffer_chunk*>(buffer_pool_alloc(size));
+    if(chunk == nullptr)
+    {
+        return nullptr;
+    }
+    chunk->data = reinterpret_cast<char*>(chunk + 1);
+    chunk->capacity = size - sizeof(buffer_chunk);
+    chunk->next = nullptr;
+    chunk->start = 0;
+    chunk->end = 0;
+    return chunk;
+}
+
+void free_chunk(buffer_chunk* chunk)
+{
+    buffer_pool_free(chunk, sizeof(buffer_chunk) + chunk->capacity);
+}
+
+}
+
+
+int buffer_pool_size(int size)
+{
+    int index = size_class(size);
+    return index < 0 ? size : BUFFER_CLASS_MIN << index;
+}
+
+void* buffer_pool_alloc(int size)
+{
+    int index = size_class(size);
+    if(index < 0)
+    {
+        return malloc(size);
+    }
+    void* p = slab.free_list[index];
+    if(p)
+    {
+        slab.free_list[index] = *static_cast<void**>(p);
+        --slab.count[index];
+        return p;
+    }
+    return malloc(BUFFER_CLASS_MIN << index);
+}
+
+void buffer_pool_free(void* p, int size)
+{
+    int index = size_class(size);
+    if(index < 0 || slab.count[index] >= (BUFFER_SLAB_BYTES / BUFFER_CLASS_MIN >> index))
+    {
+        free(p);
+        return;
+    }
+    *static_cast<void**>(p) = slab.free_list[index];
+    slab.free_list[index] = p;
+    ++slab.count[index];
+}
+
+
+void chain_buffer::init(int first_size, int limit)
+{
+    m_head = nullptr;
+    m_tail = nullptr;
+    m_size = 0;
+    m_limit = limit;
+    m_first_size = first_size;
+}
+
+void chain_buffer::clear()
+{
+    //还没有初始化过的缓冲区(清零的内存)不持有任何块
+    buffer_chunk* chunk = m_head;
+    while(chunk)
+    {
+        buffer_chunk* next = chunk->next;
+        free_chunk(chunk);
+        chunk = next;
+    }
+    m_head = nullptr;
+    m_tail = nullptr;
+    m_size = 0;
+}
+
+buffer_chunk* chain_buffer::grow(int min_size)
+{
+    buffer_chunk* chunk = alloc_chunk(min_size);
+    if(chunk == nullptr)
+    {
+        return nullptr;
+    }
+    if(m_tail)
+    {
+        m_tail->next = chunk;
+    }
+    else
+    {
+        m_head = chunk;
+    }
+    m_tail = chunk;
+    return chunk;
+}
+
+void chain_buffer::compact()
+{
+    buffer_chunk* chunk = m_head;
+    if(chunk->start > 0)
+    {
+        memmove(chunk->data, chunk->data + chunk->start, chunk->end - chunk->start);
+        chunk->end -= chunk->start;
+        chunk->start = 0;
+    }
+}
+
+char* chain_buffer::prepare(int* len)
+{
+    int room = m_limit - m_size;
+    if(room <= 0)
+    {
+        return nullptr;
+    }
+
+    buffer_chunk* chunk = m_tail;
+    if(chunk == nullptr)
+    {
+        //空的缓冲区第一次写入
+        chunk = grow(m_first_size - sizeof(buffer_chunk));
+        if(chunk == nullptr)
+        {
+            return nullptr;
+        }
+    }
+    else if(chunk->end == chunk->capacity)
+    {
+        //只有一个块并且开头有已经读过的数据, 先压缩再继续使用
+        if(m_head == m_tail && chunk->start > 0)
+        {
+            compact();
+        }
+        else
+        {
+            chunk = grow(BUFFER_CHUNK_SIZE - sizeof(buffer_chunk));
+            if(chunk == nullptr)
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    int free_len = chunk->capacity - chunk->end;
+    *len = free_len < room ? free_len : room;
+    return chunk->data + chunk->end;
+}
+
+void chain_buffer::commit(int len)
+{
+    m_tail->end += len;
+    m_size += len;
+}
+
+bool chain_buffer::append(const char* data, int len)
+{
+    while(len > 0)
+    {
+        int room = 0;
+        char* p = prepare(&room);
+        if(p == nullptr)
+        {
+            return false;
+        }
+        int n = len < room ? len : room;
+        memcpy(p, data, n);
+        commit(n);
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool chain_buffer::vappend(const char* format, va_list arg_list)
+{
+    va_list copy;
+    va_copy(copy, arg_list);
+    int room = 0;
+    char* p = prepare(&room);
+    if(p == nullptr)
+    {
+        va_end(copy);
+        return false;
+    }
+    int len = vsnprintf(p, room, format, copy);
+    va_end(copy);
+    if(len < 0)
+    {
+        return false;
+    }
+    if(len < room)
+    {
+        commit(len);
+        return true;
+    }
+
+    //当前块剩余空间不够, 换一个足够大的新块重新格式化
+    if(m_size + len > m_limit)
+    {
+        return false;
+    }
+    buffer_chunk* chunk = grow(len + 1);
+    if(chunk == nullptr)
+    {
+        return false;
+    }
+    vsnprintf(chunk->data, chunk->capacity, format, arg_list);
+    commit(len);
+    return true;
+}
+
+char* chain_buffer::pullup()
+{
+    //空的缓冲区不申请内存, 返回一个空串让解析直接得到"数据不完整"
+    static char empty[1] = {0};
+    if(m_size == 0)
+    {
+        return m_head ? m_head->data + m_head->start : empty;
+    }
+
+    //跳过开头已经读完的块
+    while(m_head != m_tail && m_head->start == m_head->end)
+    {
+        buffer_chunk* chunk = m_head;
+        m_head = chunk->next;
+        free_chunk(chunk);
+    }
+    //所有数据都在第一个块中, 已经是连续的
+    if(m_head->end - m_head->start == m_size)
+    {
+        return m_head->data + m_head->start;
+    }
+
+    //数据分散在多个块中, 合并到一个足够大的新块
+    buffer_chunk* merged = alloc_chunk(m_size);
+    if(merged == nullptr)
+    {
+        return nullptr;
+    }
+    buffer_chunk* chunk = m_head;
+    while(chunk)
+    {
+        buffer_chunk* next = chunk->next;
+        memcpy(merged->data + merged->end, chunk->data + chunk->start, chunk->end - chunk->start);
+        merged->end += chunk->end - chunk->start;
+        free_chunk(chunk);
+        chunk = next;
+    }
+    m_head = merged;
+    m_tail = merged;
+    return merged->data;
+}
+
+void chain_buffer::drain(int len)
+{
+    if(len >= m_size)
+    {
+        //数据全部读走, 所有块都还给内存池, 空闲的连接不占用缓冲区
+        clear();
+        return;
+    }
+    m_size -= len;
+    while(len > 0 || m_head->start == m_head->end)
+    {
+        buffer_chunk* chunk = m_head;
+        int n = chunk->end - chunk->start;
+        if(n > len)
+        {
+            n = len;
+        }
+        chunk->start += n;
+        len -= n;
+        if(chunk->start == chunk->end)
+        {
+            m_head = chunk->next;
+            free_chunk(chunk);
+        }
+    }
+}
+
+int chain_buffer::peek(struct iovec* iov, int max_iov, int max_bytes) const
+{
+    int count = 0;
+    for(buffer_chunk* chunk = m_head; chunk && count < max_iov && max_bytes > 0; chunk = chunk->next)
+    {
+        int len = chunk->end - chunk->start;
+        if(len > max_bytes)
+        {
+            len = max_bytes;
+        }
+        if(len > 0)
+        {
+            iov[count].iov_base = chunk->data + chunk->start;
+            iov[count].iov_len = len;
+            max_bytes -= len;
+            ++count;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,74 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdarg.h>
+#include <sys/uio.h>
+
+#define BUFFER_CHUNK_SIZE 4096          //缓冲区增长时每个新块的大小(包括块头)
+#define BUFFER_CLASS_MIN 512            //内存池最小的一级, 每一级是上一级的两倍
+#define BUFFER_CLASS_COUNT 6            //内存池的级数, 最大一级为16KB, 更大的申请直接malloc
+#define BUFFER_SLAB_BYTES (1 << 20)     //每个线程的每一级最多缓存的空闲内存
+
+
+/*
+    按大小分级的内存池
+    申请的大小向上取整到所在的级别, 每个线程为每一级缓存一个空闲链表, 申请和归还都不需要加锁
+    内存在哪个线程归还就缓存到哪个线程, 超过上限的直接释放
+*/
+void* buffer_pool_alloc(int size);              //申请至少size字节, 失败返回nullptr
+void buffer_pool_free(void* p, int size);       //归还buffer_pool_alloc申请的内存, size必须和申请时相同
+int buffer_pool_size(int size);                 //size所在级别的实际大小, 超过最大一级时返回size
+
+
+//缓冲区中的一个块, 数据区紧跟在块头后面, 整个块从内存池申请
+struct buffer_chunk
+{
+    buffer_chunk* next;         //链表中的下一个块
+    char* data;                 //数据区起始位置
+    int capacity;               //数据区大小
+    int start;                  //第一个未读字节的位置
+    int end;                    //最后一个已写字节的下一个位置
+};
+
+
+/*
+    链式缓冲区
+    空的缓冲区不持有任何内存, 第一次写入时从内存池申请一个first_size大小的块, 常见的小请求只使用这一个块
+    写满后再申请BUFFER_CHUNK_SIZE的块挂到链表尾部, 总大小不超过m_limit; 数据全部读走后所有块都归还给内存池
+    没有构造和析构函数, 使用前必须调用init, 不再使用时调用clear归还申请的块,
+    这样连接表可以直接使用清零的内存, 不用逐个构造
+*/
+class chain_buffer
+{
+public:
+    void init(int first_size, int limit);                       //first_size为第一个块的大小(包括块头), limit为总大小上限
+    void clear();                                               //清空数据并把申请的块归还给内存池
+    void set_limit(int limit) {m_limit = limit;}
+
+    int size() const {return m_size;}                           //可读的字节数
+    int limit() const {return m_limit;}                         //总大小上限
+    bool empty() const {return m_size == 0;}
+
+    //返回一段可写空间, 写入后调用commit; 达到总大小上限时返回nullptr
+    char* prepare(int* len);
+    void commit(int len);
+
+    bool append(const char* data, int len);                     //追加数据
+    bool vappend(const char* format, va_list arg_list);         //格式化追加数据
+
+    char* pullup();                                             //把所有数据合并到一个连续的块中, 返回起始位置
+    void drain(int len);                                        //丢弃开头的len字节
+    int peek(struct iovec* iov, int max_iov, int max_bytes) const;  //把开头最多max_bytes字节的可读数据填入iov, 返回使用的iov数量
+
+private:
+    buffer_chunk* grow(int min_size);                           //在链表尾部追加一个数据区至少为min_size的新块
+    void compact();                                             //把单个块中的数据移到块的开头
+
+    buffer_chunk* m_head;                                       //第一个块, 空的缓冲区为nullptr
+    buffer_chunk* m_tail;                                       //最后一个块
+    int m_size;                                                 //可读的字节数
+    int m_limit;                                                //总大小上限
+    int m_first_size;                                           //第一个块的大小
+};
+
+#endif
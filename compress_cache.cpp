@@ -0,0 +1,406 @@
+#include "compress_cache.h"
+#include "log.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+#include <zlib.h>
+#ifdef USE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+compress_cache::compress_cache(file_cache* files, size_t max_size, int max_entries):
+        m_files(files), m_max_size(max_size), m_max_entries(max_entries), m_size(0),
+        m_head(nullptr), m_tail(nullptr), m_started(false), m_stop(false)
+{
+}
+
+compress_cache::~compress_cache()
+{
+    stop();
+    while(m_tail)
+    {
+        remove(m_tail);
+    }
+}
+
+bool compress_cache::start()
+{
+    if(pthread_create(&m_thread, nullptr, worker, this) != 0)
+    {
+        return false;
+    }
+    m_started = true;
+    return true;
+}
+
+void compress_cache::stop()
+{
+    if(!m_started)
+    {
+        return;
+    }
+    m_locker.lock();
+    m_stop = true;
+    m_locker.unlock();
+    m_job_sem.post();
+    pthread_join(m_thread, nullptr);
+    m_started = false;
+
+    //还没有处理的任务直接丢弃, 对应的结果一直停在准备中, 不会再被使用
+    while(!m_jobs.empty())
+    {
+        m_files->release(m_jobs.front().file);
+        m_jobs.pop_front();
+    }
+}
+
+file_entry* compress_cache::acquire(file_entry* file, int accept, int* encoding)
+{
+    static const int preference[] = {ENCODING_BR, ENCODING_GZIP};
+
+    variant_key key;
+    key.dev = file->st.st_dev;
+    key.ino = file->st.st_ino;
+    key.mtime = file->st.st_mtim.tv_sec * 1000000000L + file->st.st_mtim.tv_nsec;
+    key.size = file->st.st_size;
+
+    m_locker.lock();
+    for(size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); ++i)
+    {
+        if(!(accept & preference[i]))
+        {
+            continue;
+        }
+        key.encoding = preference[i];
+        std::unordered_map<variant_key, variant*, variant_hash>::iterator it = m_variants.find(key);
+        if(it == m_variants.end())
+        {
+            //第一次请求这种编码, 交给后台线程准备; 队列满时等以后的请求再试
+            if(m_started && !m_stop && m_jobs.size() < COMPRESS_QUEUE_SIZE)
+            {
+                variant* v = new variant;
+                v->key = key;
+                v->ready = false;
+                v->entry = nullptr;
+                m_variants[key] = v;
+                lru_push_front(v);
+                m_files->retain(file);
+                m_jobs.push_back(job{key, file});
+                m_job_sem.post();
+                evict();
+            }
+            continue;
+        }
+
+        variant* v = it->second;
+        if(!v->ready)
+        {
+            //后台线程还在准备
+            continue;
+        }
+        if(v->entry)
+        {
+            m_files->retain(v->entry);
+            lru_unlink(v);
+            lru_push_front(v);
+            m_locker.unlock();
+            *encoding = preference[i];
+            return v->entry;
+        }
+        //这种编码没有可用的结果, 试下一种
+    }
+    m_locker.unlock();
+    return nullptr;
+}
+
+size_t compress_cache::size()
+{
+    m_locker.lock();
+    size_t size = m_size;
+    m_locker.unlock();
+    return size;
+}
+
+void* compress_cache::worker(void* arg)
+{
+    compress_cache* cache = static_cast<compress_cache*>(arg);
+    cache->run();
+    return cache;
+}
+
+void compress_cache::run()
+{
+    while(true)
+    {
+        m_job_sem.wait();
+        m_locker.lock();
+        if(m_stop)
+        {
+            m_locker.unlock();
+            break;
+        }
+        if(m_jobs.empty())
+        {
+            m_locker.unlock();
+            continue;
+        }
+        job j = m_jobs.front();
+        m_jobs.pop_front();
+        m_locker.unlock();
+
+        //读文件和压缩都在锁外进行, 不影响请求线程查表
+        file_entry* entry = prepare(j.file, j.key.encoding);
+        m_files->release(j.file);
+        finish(j.key, entry);
+    }
+}
+
+file_entry* compress_cache::prepare(file_entry* file, int encoding)
+{
+    file_entry* entry = find_sidecar(file, encoding);
+    if(entry == nullptr)
+    {
+        entry = compress(file, encoding);
+    }
+    LOG_DEBUG("%s %s: %ld -> %ld", file->path.c_str(), encoding == ENCODING_BR ? "br" : "gzip",
+        (long)file->st.st_size, entry ? (long)entry->st.st_size : -1L);
+    return entry;
+}
+
+//预压缩文件和原始文件在同一目录, 文件名加上.br或者.gz
+//比原始文件旧的可能是过期的内容, 不比原始文件小的没有意义, 都不使用
+file_entry* compress_cache::find_sidecar(file_entry* file, int encoding)
+{
+    std::string path = file->path + (encoding == ENCODING_BR ? ".br" : ".gz");
+    file_entry* sidecar;
+    if(m_files->acquire(path.c_str(), &sidecar) != 0)
+    {
+        return nullptr;
+    }
+    if(sidecar->st.st_mtime < file->st.st_mtime || sidecar->st.st_size >= file->st.st_size)
+    {
+        m_files->release(sidecar);
+        return nullptr;
+    }
+    return sidecar;
+}
+
+file_entry* compress_cache::compress(file_entry* file, int encoding)
+{
+    size_t input_len = file->st.st_size;
+    if(input_len > COMPRESS_MAX_FILE || input_len < COMPRESS_MIN_FILE)
+    {
+        return nullptr;
+    }
+
+    std::string input(input_len, '\0');
+    size_t done = 0;
+    while(done < input_len)
+    {
+        ssize_t n = pread(file->fd, &input[done], input_len - done, done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            //文件在读取过程中被截断
+            return nullptr;
+        }
+        done += n;
+    }
+
+    std::string output;
+    if(!compress_data(input.data(), input_len, encoding, &output))
+    {
+        return nullptr;
+    }
+    size_t output_len = output.size();
+
+    //压缩结果放在内存文件中, 发送时和普通文件一样使用sendfile
+    int fd = memfd_create("compressed", MFD_CLOEXEC);
+    if(fd < 0)
+    {
+        LOG_WARN("memfd_create error: %s", strerror(errno));
+        return nullptr;
+    }
+    done = 0;
+    while(done < output_len)
+    {
+        ssize_t n = ::write(fd, output.data() + done, output_len - done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            close(fd);
+            return nullptr;
+        }
+        done += n;
+    }
+
+    //修改时间沿用原始文件, ETag加上编码后缀, 和原始文件以及其他编码区分开
+    file_entry* e = new file_entry;
+    e->path = file->path;
+    e->fd = fd;
+    e->base = 0;
+    e->bundle = nullptr;
+    e->st = file->st;
+    e->st.st_size = output_len;
+    int etag_len = strlen(file->etag);
+    snprintf(e->etag, sizeof(e->etag), "%.*s-%s\"", etag_len - 1, file->etag, encoding == ENCODING_BR ? "br" : "gz");
+    memcpy(e->last_modified, file->last_modified, sizeof(e->last_modified));
+    e->refcount = 1;
+    e->cached = false;
+    e->prev = nullptr;
+    e->next = nullptr;
+    return e;
+}
+
+bool compress_cache::compress_data(const char* input, size_t input_len, int encoding, std::string* result)
+{
+    std::string& output = *result;
+    size_t output_len = 0;
+    if(encoding == ENCODING_GZIP)
+    {
+        //windowBits加16输出gzip格式
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(deflateInit2(&zs, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return false;
+        }
+        output.resize(deflateBound(&zs, input_len));
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+        zs.avail_in = input_len;
+        zs.next_out = reinterpret_cast<Bytef*>(&output[0]);
+        zs.avail_out = output.size();
+        int ret = deflate(&zs, Z_FINISH);
+        output_len = zs.total_out;
+        deflateEnd(&zs);
+        if(ret != Z_STREAM_END)
+        {
+            return false;
+        }
+    }
+    else
+    {
+#ifdef USE_BROTLI
+        output_len = BrotliEncoderMaxCompressedSize(input_len);
+        output.resize(output_len);
+        if(!BrotliEncoderCompress(COMPRESS_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, input_len,
+            reinterpret_cast<const uint8_t*>(input), &output_len, reinterpret_cast<uint8_t*>(&output[0])))
+        {
+            return false;
+        }
+#else
+        //没有编译brotli时只能使用预压缩的.br文件
+        return false;
+#endif
+    }
+
+    //至少小10%才值得压缩发送
+    if(output_len > input_len / 10 * 9)
+    {
+        return false;
+    }
+    output.resize(output_len);
+    return true;
+}
+
+void compress_cache::finish(const variant_key& key, file_entry* entry)
+{
+    m_locker.lock();
+    std::unordered_map<variant_key, variant*, variant_hash>::iterator it = m_variants.find(key);
+    if(it != m_variants.end() && !it->second->ready)
+    {
+        variant* v = it->second;
+        v->ready = true;
+        v->entry = entry;
+        if(entry)
+        {
+            m_size += entry->st.st_size;
+            evict();
+        }
+        m_locker.unlock();
+        return;
+    }
+    m_locker.unlock();
+
+    //准备期间已经被淘汰
+    if(entry)
+    {
+        m_files->release(entry);
+    }
+}
+
+void compress_cache::set_limits(size_t max_size, int max_entries)
+{
+    m_locker.lock();
+    m_max_size = max_size;
+    m_max_entries = max_entries;
+    evict();
+    m_locker.unlock();
+}
+
+void compress_cache::evict()
+{
+    while(m_tail && (m_size > m_max_size || (int)m_variants.size() > m_max_entries))
+    {
+        remove(m_tail);
+    }
+}
+
+void compress_cache::remove(variant* v)
+{
+    m_variants.erase(v->key);
+    lru_unlink(v);
+    if(v->entry)
+    {
+        //正在发送的响应还持有引用, 发送完后才真正关闭
+        m_size -= v->entry->st.st_size;
+        m_files->release(v->entry);
+    }
+    delete v;
+}
+
+void compress_cache::lru_unlink(variant* v)
+{
+    if(v->prev)
+    {
+        v->prev->next = v->next;
+    }
+    else
+    {
+        m_head = v->next;
+    }
+    if(v->next)
+    {
+        v->next->prev = v->prev;
+    }
+    else
+    {
+        m_tail = v->prev;
+    }
+    v->prev = nullptr;
+    v->next = nullptr;
+}
+
+void compress_cache::lru_push_front(variant* v)
+{
+    v->prev = nullptr;
+    v->next = m_head;
+    if(m_head)
+    {
+        m_head->prev = v;
+    }
+    m_head = v;
+    if(!m_tail)
+    {
+        m_tail = v;
+    }
+}
@@ -0,0 +1,126 @@
+#ifndef COMPRESS_CACHE_H
+#define COMPRESS_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include "file_cache.h"
+#include "locker.h"
+
+#define COMPRESS_CACHE_SIZE (32 << 20)      //缓存中所有压缩结果的总大小上限(字节)
+#define COMPRESS_CACHE_ENTRIES 4096         //缓存的最大压缩结果数量
+#define COMPRESS_MAX_FILE (4 << 20)         //超过这个大小的文件不在内存中压缩
+#define COMPRESS_MIN_FILE 256               //小于这个大小的文件压缩后节省不了多少, 不压缩
+#define COMPRESS_QUEUE_SIZE 256             //等待后台线程处理的任务上限, 满时本次请求不压缩
+#define COMPRESS_GZIP_LEVEL 6               //gzip压缩级别
+#define COMPRESS_BROTLI_QUALITY 5           //brotli压缩质量, 用-DUSE_BROTLI编译并链接libbrotlienc时才在内存中压缩br
+
+//内容编码, 可以组合表示客户端接受的编码
+#define ENCODING_GZIP 1
+#define ENCODING_BR 2
+
+
+/*
+    压缩内容缓存
+    键是原始文件的身份(设备、inode、修改时间、大小)和编码, 文件变化后自然对应新的键, 旧的结果按LRU淘汰
+    请求线程只查表, 第一次请求某个文件时把任务交给后台线程, 本次仍然发送原始文件:
+    后台线程先找同目录下的.br/.gz预压缩文件(不比原始文件旧), 没有时在内存中压缩,
+    结果写入memfd, 和普通文件一样用sendfile发送
+    压缩后没有明显变小的文件也记录下来, 之后不再尝试; 预压缩文件只在原始文件变化后重新查找
+*/
+class compress_cache
+{
+public:
+    compress_cache(file_cache* files, size_t max_size = COMPRESS_CACHE_SIZE, int max_entries = COMPRESS_CACHE_ENTRIES);
+    ~compress_cache();
+
+    bool start();                           //启动后台压缩线程
+    void stop();                            //停止后台线程, 丢弃还没有处理的任务
+
+    //accept是客户端接受的编码, 优先br
+    //已经有压缩结果时返回它并增加引用计数(用file_cache的release释放), encoding为它的编码
+    //还没有时返回nullptr, 第一次请求时交给后台线程准备
+    file_entry* acquire(file_entry* file, int accept, int* encoding);
+
+    //按encoding压缩内存中的一段数据, 失败或者压缩后没有明显变小时返回false
+    static bool compress_data(const char* input, size_t input_len, int encoding, std::string* output);
+
+    size_t size();                          //当前压缩结果的总大小
+    //修改缓存上限, 超出新上限的结果立即淘汰
+    void set_limits(size_t max_size, int max_entries);
+
+private:
+    struct variant_key
+    {
+        dev_t dev;
+        ino_t ino;
+        long mtime;                         //修改时间(纳秒)
+        off_t size;
+        int encoding;
+
+        bool operator==(const variant_key& other) const
+        {
+            return dev == other.dev && ino == other.ino && mtime == other.mtime
+                && size == other.size && encoding == other.encoding;
+        }
+    };
+    struct variant_hash
+    {
+        size_t operator()(const variant_key& key) const
+        {
+            size_t h = key.ino;
+            h = h * 31 + key.dev;
+            h = h * 31 + key.mtime;
+            h = h * 31 + key.size;
+            return h * 31 + key.encoding;
+        }
+    };
+
+    //一个文件的一种编码
+    struct variant
+    {
+        variant_key key;
+        bool ready;                         //后台线程是否已经处理完
+        file_entry* entry;                  //压缩结果, 处理完后为nullptr表示没有可用的压缩结果
+        variant* prev;                      //LRU链表中的前一个(更近使用)
+        variant* next;                      //LRU链表中的后一个(更久未使用)
+    };
+
+    //交给后台线程的任务
+    struct job
+    {
+        variant_key key;
+        file_entry* file;                   //原始文件, 任务持有一个引用
+    };
+
+    static void* worker(void* arg);
+    void run();
+    file_entry* prepare(file_entry* file, int encoding);    //找预压缩文件或者压缩原始文件
+    file_entry* find_sidecar(file_entry* file, int encoding);
+    file_entry* compress(file_entry* file, int encoding);
+    void finish(const variant_key& key, file_entry* entry); //记录任务的结果
+
+    void evict();                                           //超出上限时淘汰最久未使用的结果
+    void remove(variant* v);
+    void lru_unlink(variant* v);
+    void lru_push_front(variant* v);
+
+private:
+    file_cache* m_files;                                    //原始文件和预压缩文件所在的文件缓存
+    size_t m_max_size;                                      //压缩结果总大小上限
+    int m_max_entries;                                      //结果数量上限
+    size_t m_size;                                          //当前压缩结果的总大小
+    std::unordered_map<variant_key, variant*, variant_hash> m_variants;
+    variant* m_head;                                        //LRU链表头, 最近使用
+    variant* m_tail;                                        //LRU链表尾, 最久未使用
+    std::deque<job> m_jobs;                                 //等待后台线程处理的任务
+    locker m_locker;                                        //保护以上所有成员
+    sem m_job_sem;                                          //任务数量
+    pthread_t m_thread;
+    bool m_started;
+    bool m_stop;
+};
+
+#endif
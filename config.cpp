@@ -0,0 +1,434 @@
+#include "config.h"
+#include "log.h"
+#include "threadpool.h"
+#include "http_conn.h"
+#include "event_loop.h"
+#include "reactor.h"
+#include "file_cache.h"
+#include "compress_cache.h"
+#include "overload.h"
+#include "upstream.h"
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+
+namespace
+{
+
+enum CONFIG_TYPE {CONFIG_INT = 0, CONFIG_SIZE, CONFIG_STRING};
+
+//一个配置项: 名字、类型、在server_config中的偏移、能否重新加载
+struct config_item
+{
+    const char* name;
+    CONFIG_TYPE type;
+    size_t offset;
+    bool reloadable;
+    const char* help;
+};
+
+#define CONFIG_ITEM(name, type, reloadable, help) {#name, type, offsetof(server_config, name), reloadable, help}
+
+const config_item config_items[] =
+{
+    CONFIG_ITEM(port, CONFIG_INT, false, "listen port"),
+    CONFIG_ITEM(reactor_number, CONFIG_INT, false, "0: one reactor + thread pool, >0: reactors with their own connections"),
+    CONFIG_ITEM(scheduler, CONFIG_STRING, false, "thread pool scheduling: shared, steal, affinity"),
+    CONFIG_ITEM(backend, CONFIG_STRING, false, "multi-reactor IO backend: epoll, uring"),
+    CONFIG_ITEM(root, CONFIG_STRING, false, "document root"),
+    CONFIG_ITEM(backlog, CONFIG_INT, false, "listen backlog"),
+    CONFIG_ITEM(defer_accept, CONFIG_INT, false, "TCP_DEFER_ACCEPT seconds, 0 to disable"),
+    CONFIG_ITEM(epoll_exclusive, CONFIG_INT, false, "1: reactors share one listen socket with EPOLLEXCLUSIVE"),
+    CONFIG_ITEM(max_fd, CONFIG_INT, false, "connection table size"),
+    CONFIG_ITEM(max_events, CONFIG_INT, false, "events returned by one epoll_wait"),
+    CONFIG_ITEM(max_requests, CONFIG_INT, false, "requests waiting in the thread pool queue"),
+    CONFIG_ITEM(upstream, CONFIG_STRING, false, "reverse proxy rules: path=backend,backend;path=backend"),
+    CONFIG_ITEM(thread_number, CONFIG_INT, true, "thread pool workers"),
+    CONFIG_ITEM(header_timeout, CONFIG_INT, true, "request header timeout (ms)"),
+    CONFIG_ITEM(keepalive_timeout, CONFIG_INT, true, "idle keep-alive timeout (ms)"),
+    CONFIG_ITEM(write_timeout, CONFIG_INT, true, "blocked write timeout (ms)"),
+    CONFIG_ITEM(drain_timeout, CONFIG_INT, true, "graceful shutdown deadline (ms)"),
+    CONFIG_ITEM(overload_target, CONFIG_INT, true, "shed load when queue time stays above this (ms), 0 to disable"),
+    CONFIG_ITEM(overload_interval, CONFIG_INT, true, "overload observation window (ms)"),
+    CONFIG_ITEM(upstream_timeout, CONFIG_INT, true, "reverse proxy backend timeout (ms)"),
+    CONFIG_ITEM(upstream_health_interval, CONFIG_INT, true, "reverse proxy health check period (ms)"),
+    CONFIG_ITEM(read_buffer_limit, CONFIG_SIZE, true, "read buffer limit per connection"),
+    CONFIG_ITEM(write_buffer_limit, CONFIG_SIZE, true, "write buffer limit per connection"),
+    CONFIG_ITEM(file_cache_size, CONFIG_SIZE, true, "file cache budget"),
+    CONFIG_ITEM(file_cache_entries, CONFIG_INT, true, "files kept in the file cache"),
+    CONFIG_ITEM(file_cache_max_file, CONFIG_SIZE, true, "largest file kept in the file cache"),
+    CONFIG_ITEM(compress_cache_size, CONFIG_SIZE, true, "compressed response budget"),
+    CONFIG_ITEM(compress_cache_entries, CONFIG_INT, true, "compressed responses kept"),
+    CONFIG_ITEM(bundle, CONFIG_STRING, true, "asset bundle built by 'pack', served before the document root"),
+    CONFIG_ITEM(log_level, CONFIG_INT, true, "0 debug, 1 info, 2 warn, 3 error"),
+};
+
+const int config_item_number = sizeof(config_items) / sizeof(config_items[0]);
+
+//当前发布的快照
+std::atomic<const server_config*> current(nullptr);
+//已经被替换的快照, 读取方可能还在使用, 不释放
+std::vector<const server_config*> retired;
+
+//配置文件路径和命令行中的设置, 重新加载时按同样的顺序再应用一次
+std::string config_path;
+std::vector<std::pair<std::string, std::string> > cli_settings;
+
+
+void set_defaults(server_config* c)
+{
+    memset(c, 0, sizeof(*c));
+    c->port = 0;
+    c->reactor_number = 0;
+    strcpy(c->scheduler, "shared");
+    strcpy(c->backend, "epoll");
+    strcpy(c->root, "resources");
+    c->backlog = 1024;
+    c->defer_accept = 0;
+    c->epoll_exclusive = 0;
+    c->max_fd = MAX_FD;
+    c->max_events = MAX_EVENT_NUMBER;
+    c->max_requests = MAX_REQUESTS;
+    c->thread_number = THREAD_NUMBER;
+    c->header_timeout = HEADER_TIMEOUT;
+    c->keepalive_timeout = KEEPALIVE_TIMEOUT;
+    c->write_timeout = WRITE_TIMEOUT;
+    c->drain_timeout = DRAIN_TIMEOUT;
+    c->overload_target = OVERLOAD_TARGET;
+    c->overload_interval = OVERLOAD_INTERVAL;
+    c->upstream_timeout = UPSTREAM_TIMEOUT;
+    c->upstream_health_interval = UPSTREAM_HEALTH_INTERVAL;
+    c->read_buffer_limit = http_conn::READ_BUFFER_LIMIT;
+    c->write_buffer_limit = http_conn::WRITE_BUFFER_LIMIT;
+    c->file_cache_size = FILE_CACHE_SIZE;
+    c->file_cache_entries = FILE_CACHE_ENTRIES;
+    c->file_cache_max_file = FILE_CACHE_MAX_FILE;
+    c->compress_cache_size = COMPRESS_CACHE_SIZE;
+    c->compress_cache_entries = COMPRESS_CACHE_ENTRIES;
+    c->log_level = LOG_LEVEL;
+}
+
+const config_item* find_item(const char* name)
+{
+    for(int i = 0; i < config_item_number; ++i)
+    {
+        if(strcmp(config_items[i].name, name) == 0)
+        {
+            return &config_items[i];
+        }
+    }
+    return nullptr;
+}
+
+//解析"123"、"64K"、"32M"、"1G"
+bool parse_number(const char* value, CONFIG_TYPE type, long long* result)
+{
+    char* end = nullptr;
+    long long n = strtoll(value, &end, 10);
+    if(end == value)
+    {
+        return false;
+    }
+    if(type == CONFIG_SIZE && *end != '\0')
+    {
+        switch(toupper(*end))
+        {
+            case 'K': n <<= 10; break;
+            case 'M': n <<= 20; break;
+            case 'G': n <<= 30; break;
+            default: return false;
+        }
+        ++end;
+    }
+    if(*end != '\0' || n < 0)
+    {
+        return false;
+    }
+    *result = n;
+    return true;
+}
+
+//设置一个配置项, 出错时把原因写入error
+bool set_item(server_config* c, const char* name, const char* value, std::string* error)
+{
+    const config_item* item = find_item(name);
+    if(item == nullptr)
+    {
+        *error = std::string("unknown setting ") + name;
+        return false;
+    }
+    char* field = reinterpret_cast<char*>(c) + item->offset;
+    if(item->type == CONFIG_STRING)
+    {
+        if(strlen(value) >= CONFIG_STRING_SIZE)
+        {
+            *error = std::string(name) + " is too long";
+            return false;
+        }
+        strcpy(field, value);
+        return true;
+    }
+
+    long long n = 0;
+    if(!parse_number(value, item->type, &n) || (item->type == CONFIG_INT && n > 0x7fffffff))
+    {
+        *error = std::string("bad value for ") + name + ": " + value;
+        return false;
+    }
+    if(item->type == CONFIG_INT)
+    {
+        *reinterpret_cast<int*>(field) = (int)n;
+    }
+    else
+    {
+        *reinterpret_cast<long long*>(field) = n;
+    }
+    return true;
+}
+
+//去掉首尾空白
+char* trim(char* s)
+{
+    while(isspace((unsigned char)*s))
+    {
+        ++s;
+    }
+    char* end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1]))
+    {
+        --end;
+    }
+    *end = '\0';
+    return s;
+}
+
+bool load_file(server_config* c, const char* path, std::string* error)
+{
+    FILE* fp = fopen(path, "r");
+    if(fp == nullptr)
+    {
+        *error = std::string("cannot open ") + path + ": " + strerror(errno);
+        return false;
+    }
+    char line[CONFIG_LINE_SIZE];
+    int line_number = 0;
+    bool ok = true;
+    while(ok && fgets(line, sizeof(line), fp))
+    {
+        ++line_number;
+        char* text = trim(line);
+        if(*text == '\0' || *text == '#')
+        {
+            continue;
+        }
+        char* eq = strchr(text, '=');
+        if(eq == nullptr)
+        {
+            *error = std::string(path) + ":" + std::to_string(line_number) + ": expected name = value";
+            ok = false;
+            break;
+        }
+        *eq = '\0';
+        ok = set_item(c, trim(text), trim(eq + 1), error);
+        if(!ok)
+        {
+            *error = std::string(path) + ":" + std::to_string(line_number) + ": " + *error;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+//环境变量WEBSERVER_<名字>覆盖配置文件
+bool load_env(server_config* c, std::string* error)
+{
+    for(int i = 0; i < config_item_number; ++i)
+    {
+        std::string env = "WEBSERVER_";
+        for(const char* p = config_items[i].name; *p; ++p)
+        {
+            env += toupper((unsigned char)*p);
+        }
+        const char* value = getenv(env.c_str());
+        if(value && *value && !set_item(c, config_items[i].name, value, error))
+        {
+            *error = env + ": " + *error;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool validate(const server_config* c, std::string* error)
+{
+    if(c->port <= 0 || c->port > 65535)
+    {
+        *error = "port is required";
+        return false;
+    }
+    if(c->thread_number <= 0 || c->max_fd <= 0 || c->max_events <= 0 || c->max_requests <= 0 || c->backlog <= 0)
+    {
+        *error = "thread_number, max_fd, max_events, max_requests and backlog must be positive";
+        return false;
+    }
+    if(c->header_timeout <= 0 || c->keepalive_timeout <= 0 || c->write_timeout <= 0 || c->drain_timeout <= 0
+        || c->upstream_timeout <= 0 || c->upstream_health_interval <= 0)
+    {
+        *error = "timeouts must be positive";
+        return false;
+    }
+    if(c->overload_target < 0 || c->overload_interval <= 0)
+    {
+        *error = "overload_target must not be negative and overload_interval must be positive";
+        return false;
+    }
+    if(c->read_buffer_limit < http_conn::READ_BUFFER_SIZE || c->read_buffer_limit > (1 << 30)
+        || c->write_buffer_limit < http_conn::WRITE_BUFFER_SIZE || c->write_buffer_limit > (1 << 30))
+    {
+        *error = "buffer limits must be between the first chunk size and 1G";
+        return false;
+    }
+    if(c->log_level < LOG_LEVEL_DEBUG || c->log_level > LOG_LEVEL_ERROR)
+    {
+        *error = "log_level must be 0-3";
+        return false;
+    }
+    return true;
+}
+
+//按默认值、配置文件、环境变量、命令行的顺序生成配置
+bool build(server_config* c, std::string* error)
+{
+    set_defaults(c);
+    if(!config_path.empty() && !load_file(c, config_path.c_str(), error))
+    {
+        return false;
+    }
+    if(!load_env(c, error))
+    {
+        return false;
+    }
+    for(size_t i = 0; i < cli_settings.size(); ++i)
+    {
+        if(!set_item(c, cli_settings[i].first.c_str(), cli_settings[i].second.c_str(), error))
+        {
+            return false;
+        }
+    }
+    return validate(c, error);
+}
+
+void publish(const server_config* c)
+{
+    const server_config* old = current.exchange(c, std::memory_order_acq_rel);
+    if(old)
+    {
+        retired.push_back(old);
+    }
+}
+
+}
+
+
+bool config::init(int argc, char* argv[])
+{
+    //选项在前, 之后是兼容原来用法的位置参数
+    static const char* positional[] = {"port", "reactor_number", "scheduler"};
+    int position = 0;
+    for(int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if(strcmp(arg, "-c") == 0 && i + 1 < argc)
+        {
+            config_path = argv[++i];
+        }
+        else if(strncmp(arg, "--", 2) == 0 && strchr(arg, '='))
+        {
+            const char* eq = strchr(arg, '=');
+            cli_settings.push_back(std::make_pair(std::string(arg + 2, eq - arg - 2), std::string(eq + 1)));
+        }
+        else if(arg[0] != '-' && position < (int)(sizeof(positional) / sizeof(positional[0])))
+        {
+            cli_settings.push_back(std::make_pair(std::string(positional[position++]), std::string(arg)));
+        }
+        else
+        {
+            fprintf(stderr, "unknown argument %s\n", arg);
+            return false;
+        }
+    }
+    if(config_path.empty() && getenv("WEBSERVER_CONFIG"))
+    {
+        config_path = getenv("WEBSERVER_CONFIG");
+    }
+
+    server_config* c = new server_config;
+    std::string error;
+    if(!build(c, &error))
+    {
+        fprintf(stderr, "config: %s\n", error.c_str());
+        delete c;
+        return false;
+    }
+    publish(c);
+    return true;
+}
+
+bool config::reload()
+{
+    server_config* c = new server_config;
+    std::string error;
+    if(!build(c, &error))
+    {
+        LOG_ERROR("config reload failed, keeping the current settings: %s", error.c_str());
+        delete c;
+        return false;
+    }
+
+    //只在启动时生效的配置项保持原来的值
+    const server_config* old = get();
+    for(int i = 0; i < config_item_number; ++i)
+    {
+        const config_item& item = config_items[i];
+        if(item.reloadable)
+        {
+            continue;
+        }
+        size_t size = item.type == CONFIG_STRING ? CONFIG_STRING_SIZE : (item.type == CONFIG_INT ? sizeof(int) : sizeof(long long));
+        char* field = reinterpret_cast<char*>(c) + item.offset;
+        const char* old_field = reinterpret_cast<const char*>(old) + item.offset;
+        if(memcmp(field, old_field, size) != 0)
+        {
+            LOG_WARN("config: %s only takes effect after a restart", item.name);
+            memcpy(field, old_field, size);
+        }
+    }
+    publish(c);
+    LOG_INFO("config reloaded");
+    return true;
+}
+
+const server_config* config::get()
+{
+    return current.load(std::memory_order_acquire);
+}
+
+void config::usage(const char* program)
+{
+    printf("usage: %s [-c config_file] [--name=value ...] port_number [reactor_number] [shared|steal|affinity]\n", program);
+    printf("       %s pack directory bundle\n", program);
+    printf("reactor_number为0(默认)时使用单reactor+线程池模式, 大于0时每个reactor独立处理自己的连接\n");
+    printf("线程池模式下shared(默认)为共享任务队列, steal为轮询分配的工作窃取, affinity为按连接分配的工作窃取\n");
+    printf("配置项可以写在配置文件中(名字 = 值), 或者用环境变量WEBSERVER_<名字>、命令行--名字=值覆盖; 标*的配置项收到SIGHUP后重新加载\n");
+    for(int i = 0; i < config_item_number; ++i)
+    {
+        printf("  %-24s %s %s\n", config_items[i].name, config_items[i].reloadable ? "*" : " ", config_items[i].help);
+    }
+}
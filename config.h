@@ -0,0 +1,70 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define CONFIG_STRING_SIZE 256          //字符串类型配置项的最大长度(包括结尾的'\0')
+#define CONFIG_LINE_SIZE 1024           //配置文件一行的最大长度
+
+
+//服务器的所有设置, 发布后不再修改, 使用者通过config::get()拿到当前的快照
+//只包含基本类型和定长数组, 可以直接按偏移读写
+struct server_config
+{
+    //以下设置只在启动时生效, 重新加载时的修改被忽略
+    int port;                                   //监听端口
+    int reactor_number;                         //0为单reactor+线程池, 大于0为多reactor
+    char scheduler[CONFIG_STRING_SIZE];         //线程池的调度方式: shared、steal、affinity
+    char backend[CONFIG_STRING_SIZE];           //多reactor的IO后端: epoll、uring
+    char root[CONFIG_STRING_SIZE];              //资源目录
+    int backlog;                                //监听队列长度
+    int defer_accept;                           //TCP_DEFER_ACCEPT的秒数, 0为不打开
+    int epoll_exclusive;                        //多reactor共享一个监听socket(EPOLLEXCLUSIVE)
+    int max_fd;                                 //连接表大小, 文件描述符不小于它的连接被拒绝
+    int max_events;                             //epoll_wait一次最多返回的事件数
+    int max_requests;                           //线程池队列中最多等待的请求数
+    char upstream[CONFIG_STRING_SIZE];          //反向代理的转发规则: "路径=后端,后端;路径=后端"
+
+    //以下设置收到SIGHUP后重新加载, 对之后的请求生效, 不断开已有的连接
+    int thread_number;                          //线程池的工作线程数量
+    int header_timeout;                         //等待客户端发完请求头的超时时间(毫秒)
+    int keepalive_timeout;                      //长连接空闲的超时时间(毫秒)
+    int write_timeout;                          //socket一直不可写的超时时间(毫秒)
+    int drain_timeout;                          //优雅退出时等待进行中的请求完成的最长时间(毫秒)
+    int overload_target;                        //过载保护的排队时间目标(毫秒), 0为不做过载保护
+    int overload_interval;                      //过载保护的观察周期(毫秒)
+    int upstream_timeout;                       //等待反向代理后端的超时时间(毫秒)
+    int upstream_health_interval;               //反向代理后端健康检查的周期(毫秒)
+    long long read_buffer_limit;                //读缓冲区总大小上限, 请求头超过这个大小时关闭连接
+    long long write_buffer_limit;               //写缓冲区总大小上限
+    long long file_cache_size;                  //文件缓存的总大小上限
+    int file_cache_entries;                     //文件缓存的最大文件数量
+    long long file_cache_max_file;              //超过这个大小的文件不进入文件缓存
+    long long compress_cache_size;              //压缩缓存的总大小上限
+    int compress_cache_entries;                 //压缩缓存的最大数量
+    char bundle[CONFIG_STRING_SIZE];            //静态资源包的路径, 为空时不使用; 文件变了重新加载时替换
+    int log_level;                              //日志级别: 0 debug, 1 info, 2 warn, 3 error
+};
+
+
+/*
+    运行时配置
+    依次使用默认值、配置文件、环境变量(WEBSERVER_加上大写的配置项名字)和命令行生成配置,
+    后面的来源覆盖前面的; 配置文件每行一个"名字 = 值", #开头的行是注释, 大小可以带K、M、G后缀
+    配置以不可修改的快照发布, 重新加载时生成新的快照并原子地替换指针, 读取方不加锁,
+    旧的快照不释放(重新加载很少发生), 读取方拿到的指针始终有效
+*/
+class config
+{
+public:
+    //解析命令行并发布第一份配置, 出错时输出原因并返回false
+    //命令行: [-c 配置文件] [--名字=值 ...] [port [reactor_number [scheduler]]]
+    static bool init(int argc, char* argv[]);
+    //重新读取配置文件并发布新的快照, 只在启动时生效的配置项被修改时输出警告并保留原来的值
+    //配置文件有错误时不修改当前配置, 返回false
+    static bool reload();
+    //当前的配置快照
+    static const server_config* get();
+    //输出命令行用法和所有配置项
+    static void usage(const char* program);
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "event_loop.h"
+#include "log.h"
+#include "config.h"
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+
+event_loop::event_loop(int listenfd, pool_base<http_conn>* pool):
+        m_listenfd(listenfd), m_pool(pool), m_timer_expire(0), m_signalfd(-1),
+        m_signal_handler(nullptr), m_inotifyfd(-1), m_stop(false), m_drain_requested(false),
+        m_draining(false), m_drain_deadline(0), m_started(false)
+{
+    //定时器到期和跨线程唤醒都作为普通的事件处理, 等待事件时不会再被信号打断
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    //连接表, 每个事件循环一份, 只有该事件循环自己访问
+    //使用清零的内存, 没有用到的连接不占用物理内存
+    m_max_fd = config::get()->max_fd;
+    m_fd_high = 0;
+    m_users = static_cast<http_conn*>(calloc(m_max_fd, sizeof(http_conn)));
+}
+
+event_loop::~event_loop()
+{
+    close(m_timerfd);
+    close(m_eventfd);
+    free(m_users);
+}
+
+void* event_loop::worker(void* arg)
+{
+    event_loop* loop = static_cast<event_loop*>(arg);
+    loop->loop();
+    return loop;
+}
+
+bool event_loop::start(int cpu)
+{
+    if(pthread_create(&m_thread, nullptr, worker, this) != 0)
+    {
+        return false;
+    }
+    m_started = true;
+
+    //每个事件循环固定在一个核上运行, 连接表和定时器链表都留在该核的缓存中
+    if(cpu >= 0)
+    {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        pthread_setaffinity_np(m_thread, sizeof(cpuset), &cpuset);
+    }
+    return true;
+}
+
+void event_loop::join()
+{
+    if(m_started)
+    {
+        pthread_join(m_thread, nullptr);
+        m_started = false;
+    }
+}
+
+void event_loop::stop()
+{
+    m_stop = true;
+    wakeup();
+}
+
+void event_loop::drain()
+{
+    m_drain_requested = true;
+    wakeup();
+}
+
+void event_loop::wakeup()
+{
+    uint64_t one = 1;
+    ::write(m_eventfd, &one, sizeof(one));
+}
+
+void event_loop::add_signalfd(int signalfd, void(*handler)(int))
+{
+    m_signalfd = signalfd;
+    m_signal_handler = handler;
+}
+
+void event_loop::watch_file_cache()
+{
+    m_inotifyfd = http_conn::m_file_cache.inotify_fd();
+}
+
+void event_loop::handle_timer()
+{
+    uint64_t expirations;
+    ::read(m_timerfd, &expirations, sizeof(expirations));
+    metrics::add(METRIC_SYSCALLS);
+    m_timer_expire = 0;
+
+    //关闭所有超时的连接
+    m_timer_wheel.tick(timer_now_ms(), [this](http_conn* user)
+    {
+        LOG_DEBUG("time out");
+        metrics::add(METRIC_TIMEOUTS);
+        if(user->in_pool)
+        {
+            //工作线程还在使用连接的缓冲区和文件, 只关闭socket, 交回后由EPOLLHUP在本线程关闭
+            shutdown(user->sockfd(), SHUT_RDWR);
+            metrics::add(METRIC_SYSCALLS);
+            return;
+        }
+        close_conn(user);
+    });
+}
+
+void event_loop::arm_timer()
+{
+    uint64_t now = timer_now_ms();
+    int timeout = m_timer_wheel.next_timeout(now);
+    //优雅退出的期限也通过timerfd唤醒
+    if(m_draining)
+    {
+        int left = m_drain_deadline > now ? (int)(m_drain_deadline - now) : 0;
+        if(timeout < 0 || left < timeout)
+        {
+            timeout = left;
+        }
+    }
+    if(timeout < 0)
+    {
+        //没有定时器, timerfd保持原样, 到期后空转一次即可
+        return;
+    }
+
+    //timerfd已经会在更早的时刻到期, 不需要重新设置
+    uint64_t expire = now + (timeout > 0 ? timeout : 1);
+    if(m_timer_expire != 0 && m_timer_expire <= expire)
+    {
+        return;
+    }
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = expire / 1000;
+    its.it_value.tv_nsec = (expire % 1000) * 1000000;
+    timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &its, nullptr);
+    metrics::add(METRIC_SYSCALLS);
+    m_timer_expire = expire;
+}
+
+void event_loop::handle_wakeup()
+{
+    uint64_t count;
+    ::read(m_eventfd, &count, sizeof(count));
+    metrics::add(METRIC_SYSCALLS);
+
+    if(m_drain_requested && !m_draining)
+    {
+        begin_drain();
+    }
+}
+
+void event_loop::accepted(int connfd)
+{
+    if(connfd >= m_fd_high)
+    {
+        m_fd_high = connfd + 1;
+    }
+}
+
+void event_loop::begin_drain()
+{
+    m_draining = true;
+    m_drain_deadline = timer_now_ms() + config::get()->drain_timeout;
+    stop_accept();
+
+    //空闲的长连接上没有进行中的请求, 直接关闭; 客户端发现连接关闭后会重新连接到新的进程
+    //长连接的空闲状态只由事件循环线程设置, 处于这个状态的连接不会同时在工作线程中处理
+    int idle = 0;
+    for(int fd = 0; fd < m_fd_high; ++fd)
+    {
+        http_conn* user = m_users + fd;
+        if(user->timeout_type == http_conn::TIMEOUT_KEEPALIVE && user->is_open())
+        {
+            close_conn(user);
+            ++idle;
+        }
+    }
+    LOG_INFO("draining: stopped accepting, closed %d idle connections", idle);
+}
+
+int event_loop::open_connections() const
+{
+    //线程池模式下连接可能在工作线程中关闭, 这时只有一个事件循环, 直接使用全局的连接数
+    if(m_pool)
+    {
+        return http_conn::m_user_count.load();
+    }
+    int count = 0;
+    for(int fd = 0; fd < m_fd_high; ++fd)
+    {
+        if(m_users[fd].is_open())
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void event_loop::check_drain()
+{
+    if(!m_draining)
+    {
+        return;
+    }
+    int open = open_connections();
+    if(open == 0)
+    {
+        LOG_INFO("drained");
+        m_stop = true;
+    }
+    else if(timer_now_ms() >= m_drain_deadline)
+    {
+        LOG_WARN("drain timeout, %d connections still open", open);
+        m_stop = true;
+    }
+}
+
+void event_loop::handle_signal()
+{
+    struct signalfd_siginfo info;
+    while(::read(m_signalfd, &info, sizeof(info)) == sizeof(info))
+    {
+        if(m_signal_handler)
+        {
+            m_signal_handler(info.ssi_signo);
+        }
+    }
+}
+
+void event_loop::set_timeout(http_conn* user, http_conn::TIMEOUT_TYPE type)
+{
+    //超时时间可以在运行时重新加载, 新的值对之后设置的定时器生效
+    const server_config* c = config::get();
+    int timeout = c->header_timeout;
+    if(type == http_conn::TIMEOUT_KEEPALIVE)
+    {
+        timeout = c->keepalive_timeout;
+    }
+    else if(type == http_conn::TIMEOUT_WRITE)
+    {
+        timeout = c->write_timeout;
+    }
+    else if(type == http_conn::TIMEOUT_UPSTREAM)
+    {
+        timeout = c->upstream_timeout;
+    }
+    user->timeout_type = type;
+    m_timer_wheel.add_timer(&user->timer, timer_now_ms() + timeout);
+}
@@ -0,0 +1,83 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+#include <atomic>
+#include "http_conn.h"
+#include "pool_base.h"
+
+//以下是默认值, 运行时使用config中的设置
+#define MAX_FD 65535                //最大文件描述符个数
+#define HEADER_TIMEOUT 30000        //等待客户端发完请求头的超时时间(毫秒)
+#define KEEPALIVE_TIMEOUT 150000    //长连接空闲的超时时间(毫秒)
+#define WRITE_TIMEOUT 60000         //socket一直不可写的超时时间(毫秒)
+#define DRAIN_TIMEOUT 30000         //优雅退出时等待进行中的请求完成的最长时间(毫秒)
+
+
+/*
+    事件循环的公共部分, 具体的IO后端(epoll、io_uring)继承它并实现loop和close_conn
+    一个事件循环独占一张连接表, 监听socket可以独占(SO_REUSEPORT)也可以和其他事件循环共享,
+    连接从accept开始直到关闭都只由接受它的事件循环处理
+    定时器、跨线程唤醒、信号和文件缓存的变化通知都通过文件描述符交给后端的事件循环, 处理方式各后端相同
+*/
+class event_loop
+{
+public:
+    event_loop(int listenfd, pool_base<http_conn>* pool);
+    virtual ~event_loop();
+
+    virtual void loop() = 0;                        //运行事件循环
+    bool start(int cpu = -1);                       //在新线程中运行事件循环, cpu >= 0 时绑定到该核
+    void join();                                    //等待事件循环线程退出
+    void stop();                                    //通知事件循环退出, 可以在任意线程中调用
+    //通知事件循环优雅退出, 可以在任意线程中调用: 不再接受新连接, 关闭空闲的长连接,
+    //其余连接的响应带Connection: close, 所有连接关闭或者超过drain_timeout后退出
+    void drain();
+    void wakeup();                                  //通过eventfd唤醒阻塞等待事件的事件循环
+
+    //由该事件循环监听signalfd, 收到信号后在事件循环线程中调用handler; 在loop之前调用
+    void add_signalfd(int signalfd, void(*handler)(int));
+    //由该事件循环监听文件缓存的inotify通知, 所有事件循环中只需要一个调用; 在loop之前调用
+    void watch_file_cache();
+
+protected:
+    virtual void close_conn(http_conn* user) = 0;   //删除定时器并关闭连接
+    virtual void stop_accept() = 0;                 //不再从监听socket接受新连接
+
+    void set_timeout(http_conn* user, http_conn::TIMEOUT_TYPE type);   //按超时类型重新设置连接的定时器
+    void handle_timer();                            //timerfd到期, 处理超时连接
+    void handle_wakeup();                           //读取eventfd, 清除唤醒通知
+    void handle_signal();                           //从signalfd中读取信号并处理
+    void arm_timer();                               //按时间轮上最近的超时时刻设置timerfd
+    void check_drain();                             //优雅退出时所有连接都已关闭或者超过期限则停止, 每轮循环结束时调用
+    void accepted(int connfd);                      //记录新连接用到的连接表范围
+
+private:
+    static void* worker(void* arg);                 //事件循环线程的入口函数
+    void begin_drain();                             //在事件循环线程中开始优雅退出
+    int open_connections() const;                   //还没有关闭的连接数量
+
+protected:
+    int m_listenfd;                                 //该事件循环的监听socket
+    pool_base<http_conn>* m_pool;                   //线程池, 为nullptr时不使用
+    http_conn* m_users;                             //该事件循环的连接表, 以socket为下标
+    int m_max_fd;                                   //连接表大小, 启动时从配置中读取
+    int m_fd_high;                                  //用到过的最大文件描述符加一, 遍历连接表时只到这里
+    timer_wheel<http_conn> m_timer_wheel;           //该事件循环的时间轮
+    int m_timerfd;                                  //时间轮的到期通知, 代替SIGALRM
+    uint64_t m_timer_expire;                        //timerfd当前设置的到期时刻(毫秒), 0表示未设置
+    int m_eventfd;                                  //其他线程唤醒本事件循环的通知
+    int m_signalfd;                                 //信号通知, 只有一个事件循环监听
+    void (*m_signal_handler)(int);                  //收到信号后调用的函数
+    int m_inotifyfd;                                //文件缓存的inotify通知, 只有一个事件循环监听
+    std::atomic<bool> m_stop;                       //事件循环停止运行标志
+    std::atomic<bool> m_drain_requested;            //其他线程要求优雅退出
+    bool m_draining;                                //已经开始优雅退出
+    uint64_t m_drain_deadline;                      //优雅退出的期限(毫秒), 超过后不再等待进行中的请求
+
+private:
+    pthread_t m_thread;                             //事件循环线程
+    bool m_started;                                 //是否在新线程中运行
+};
+
+#endif
@@ -0,0 +1,360 @@
+#include "file_cache.h"
+#include "asset_bundle.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <stdio.h>
+#include <time.h>
+
+file_cache::file_cache(size_t max_size, int max_entries, size_t max_file):
+        m_max_size(max_size), m_max_entries(max_entries), m_max_file(max_file), m_size(0), m_head(nullptr), m_tail(nullptr)
+{
+    m_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+file_cache::~file_cache()
+{
+    while(m_tail)
+    {
+        invalidate(m_tail);
+    }
+    if(m_inotifyfd >= 0)
+    {
+        close(m_inotifyfd);
+    }
+}
+
+int file_cache::acquire(const char* path, file_entry** entry)
+{
+    m_locker.lock();
+    std::unordered_map<std::string, file_entry*>::iterator it = m_entries.find(path);
+    if(it != m_entries.end())
+    {
+        //命中, 移到LRU链表头
+        file_entry* e = it->second;
+        ++e->refcount;
+        lru_unlink(e);
+        lru_push_front(e);
+        m_locker.unlock();
+        *entry = e;
+        return 0;
+    }
+    m_locker.unlock();
+
+    //未命中, 在锁外打开文件, 避免阻塞其他线程
+    int ret = open_entry(path, entry);
+    if(ret != 0)
+    {
+        return ret;
+    }
+
+    file_entry* e = *entry;
+    if(m_inotifyfd < 0)
+    {
+        return 0;
+    }
+
+    m_locker.lock();
+    if((size_t)e->st.st_size > m_max_file)
+    {
+        //太大的文件不缓存, 用完直接关闭
+        m_locker.unlock();
+        return 0;
+    }
+    it = m_entries.find(e->path);
+    if(it != m_entries.end())
+    {
+        //其他线程已经把同一个文件加入了缓存, 本次打开的用完直接关闭
+        m_locker.unlock();
+        return 0;
+    }
+    //没有监听到所在目录时无法得知文件的变化, 不缓存
+    if(!watch(e->path))
+    {
+        m_locker.unlock();
+        return 0;
+    }
+    insert(e);
+    m_locker.unlock();
+
+    //打开文件到开始监听目录之间文件可能已经变化, 这段时间的修改不会产生通知;
+    //加入缓存后再检查一次, 之后的变化都会收到通知
+    struct stat st;
+    if(stat(e->path.c_str(), &st) < 0 || !same_file(st, e->st))
+    {
+        m_locker.lock();
+        invalidate(e);
+        m_locker.unlock();
+    }
+    return 0;
+}
+
+bool file_cache::same_file(const struct stat& a, const struct stat& b)
+{
+    return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size
+        && a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+void file_cache::release(file_entry* entry)
+{
+    //资源包中的文件不在缓存中
+    if(entry->bundle)
+    {
+        asset_bundle::release(entry);
+        return;
+    }
+    m_locker.lock();
+    put(entry);
+    m_locker.unlock();
+}
+
+void file_cache::retain(file_entry* entry)
+{
+    if(entry->bundle)
+    {
+        asset_bundle::retain(entry);
+        return;
+    }
+    m_locker.lock();
+    ++entry->refcount;
+    m_locker.unlock();
+}
+
+int file_cache::open_entry(const char* path, file_entry** entry)
+{
+    struct stat st;
+    //获取所请求文件的相关信息
+    if(stat(path, &st) < 0)
+    {
+        return errno;
+    }
+    //判断访问权限
+    if(!(st.st_mode & S_IROTH))
+    {
+        return EACCES;
+    }
+    //判断是否是目录
+    if(S_ISDIR(st.st_mode))
+    {
+        return EISDIR;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return errno;
+    }
+
+    file_entry* e = new file_entry;
+    e->path = path;
+    e->fd = fd;
+    e->base = 0;
+    e->bundle = nullptr;
+    e->st = st;
+    //缓存条目创建时生成一次, 每次响应直接使用
+    snprintf(e->etag, sizeof(e->etag), "\"%lx-%lx-%lx\"", (unsigned long)st.st_ino,
+        (unsigned long)(st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec), (unsigned long)st.st_size);
+    struct tm tm;
+    gmtime_r(&st.st_mtime, &tm);
+    strftime(e->last_modified, sizeof(e->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    e->refcount = 1;
+    e->cached = false;
+    e->prev = nullptr;
+    e->next = nullptr;
+    *entry = e;
+    return 0;
+}
+
+void file_cache::insert(file_entry* entry)
+{
+    //缓存本身持有一个引用
+    ++entry->refcount;
+    entry->cached = true;
+    m_entries[entry->path] = entry;
+    lru_push_front(entry);
+    m_size += entry->st.st_size;
+
+    //超出上限时淘汰最久未使用的文件, 正在使用的文件等引用释放后才关闭
+    while(m_tail && m_tail != entry && (m_size > m_max_size || (int)m_entries.size() > m_max_entries))
+    {
+        invalidate(m_tail);
+    }
+}
+
+void file_cache::set_limits(size_t max_size, int max_entries, size_t max_file)
+{
+    m_locker.lock();
+    m_max_size = max_size;
+    m_max_entries = max_entries;
+    m_max_file = max_file;
+    while(m_tail && (m_size > m_max_size || (int)m_entries.size() > m_max_entries))
+    {
+        invalidate(m_tail);
+    }
+    //已经缓存的大文件也移除, 和新上限下的行为一致
+    file_entry* e = m_head;
+    while(e)
+    {
+        file_entry* next = e->next;
+        if((size_t)e->st.st_size > m_max_file)
+        {
+            invalidate(e);
+        }
+        e = next;
+    }
+    m_locker.unlock();
+}
+
+void file_cache::invalidate(file_entry* entry)
+{
+    if(!entry->cached)
+    {
+        return;
+    }
+    entry->cached = false;
+    m_entries.erase(entry->path);
+    lru_unlink(entry);
+    m_size -= entry->st.st_size;
+    put(entry);
+}
+
+void file_cache::invalidate_dir(const std::string& dir)
+{
+    std::string prefix = dir + "/";
+    file_entry* e = m_head;
+    while(e)
+    {
+        file_entry* next = e->next;
+        if(e->path.compare(0, prefix.size(), prefix) == 0)
+        {
+            invalidate(e);
+        }
+        e = next;
+    }
+}
+
+void file_cache::put(file_entry* entry)
+{
+    if(--entry->refcount > 0)
+    {
+        return;
+    }
+    close(entry->fd);
+    delete entry;
+}
+
+bool file_cache::watch(const std::string& path)
+{
+    std::string dir = path.substr(0, path.rfind('/'));
+    if(m_dir_watches.count(dir))
+    {
+        return true;
+    }
+    int wd = inotify_add_watch(m_inotifyfd, dir.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if(wd >= 0)
+    {
+        m_dir_watches[dir] = wd;
+        m_watch_dirs[wd] = dir;
+        return true;
+    }
+    return false;
+}
+
+void file_cache::handle_inotify()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(true)
+    {
+        ssize_t len = read(m_inotifyfd, buf, sizeof(buf));
+        if(len <= 0)
+        {
+            break;
+        }
+
+        m_locker.lock();
+        for(char* p = buf; p < buf + len; )
+        {
+            struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                //事件丢失, 无法判断哪些文件变化了, 全部失效
+                while(m_tail)
+                {
+                    invalidate(m_tail);
+                }
+                continue;
+            }
+
+            std::unordered_map<int, std::string>::iterator it = m_watch_dirs.find(event->wd);
+            if(it == m_watch_dirs.end())
+            {
+                continue;
+            }
+            std::string dir = it->second;
+
+            if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                //目录本身被删除或者移动, 目录下的文件全部失效
+                invalidate_dir(dir);
+                if(event->mask & IN_IGNORED)
+                {
+                    m_watch_dirs.erase(event->wd);
+                    m_dir_watches.erase(dir);
+                }
+                continue;
+            }
+
+            if(event->len > 0)
+            {
+                std::unordered_map<std::string, file_entry*>::iterator entry = m_entries.find(dir + "/" + event->name);
+                if(entry != m_entries.end())
+                {
+                    invalidate(entry->second);
+                }
+            }
+        }
+        m_locker.unlock();
+    }
+}
+
+void file_cache::lru_unlink(file_entry* entry)
+{
+    if(entry->prev)
+    {
+        entry->prev->next = entry->next;
+    }
+    else
+    {
+        m_head = entry->next;
+    }
+    if(entry->next)
+    {
+        entry->next->prev = entry->prev;
+    }
+    else
+    {
+        m_tail = entry->prev;
+    }
+    entry->prev = nullptr;
+    entry->next = nullptr;
+}
+
+void file_cache::lru_push_front(file_entry* entry)
+{
+    entry->prev = nullptr;
+    entry->next = m_head;
+    if(m_head)
+    {
+        m_head->prev = entry;
+    }
+    m_head = entry;
+    if(!m_tail)
+    {
+        m_tail = entry;
+    }
+}
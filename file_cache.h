@@ -0,0 +1,82 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+#define FILE_CACHE_SIZE (64 << 20)          //缓存中所有文件的总大小上限(字节)
+#define FILE_CACHE_ENTRIES 4096             //缓存的最大文件数量
+#define FILE_CACHE_MAX_FILE (8 << 20)       //超过这个大小的文件不进入缓存, 每次请求单独打开
+
+struct bundle_image;
+
+//缓存的文件, 保存打开的文件描述符和stat结果, 文件内容通过sendfile直接从描述符发送
+//通过引用计数共享, 被淘汰或者失效后等最后一个使用者释放时才真正关闭
+struct file_entry
+{
+    std::string path;               //解析后的文件完整路径, 也是缓存的键
+    int fd;                         //打开的文件描述符
+    off_t base;                     //文件内容在fd中的起始偏移, 只有资源包中的文件不为0
+    bundle_image* bundle;           //所属的资源包, 普通文件为nullptr; 资源包中的文件共享资源包的描述符和引用计数
+    struct stat st;                 //文件状态
+    char etag[64];                  //由inode、修改时间和大小生成的ETag, 包括引号
+    char last_modified[32];         //HTTP日期格式的修改时间
+    int refcount;                   //引用计数, 缓存本身持有一个引用
+    bool cached;                    //是否还在缓存中
+    file_entry* prev;               //LRU链表中的前一个(更近使用)
+    file_entry* next;               //LRU链表中的后一个(更久未使用)
+};
+
+
+//所有连接共享的文件缓存, 按总大小和文件数量淘汰最久未使用的文件
+//文件变化通过inotify通知, 命中时不会访问文件系统
+class file_cache
+{
+public:
+    file_cache(size_t max_size = FILE_CACHE_SIZE, int max_entries = FILE_CACHE_ENTRIES, size_t max_file = FILE_CACHE_MAX_FILE);
+    ~file_cache();
+
+    //修改缓存上限, 超出新上限的文件立即淘汰, 正在使用的文件等引用释放后才关闭
+    void set_limits(size_t max_size, int max_entries, size_t max_file);
+
+    //获取path对应的文件, 成功返回0并增加引用计数, 失败返回errno
+    //EACCES表示没有读权限, EISDIR表示请求的是目录
+    int acquire(const char* path, file_entry** entry);
+    //释放acquire得到的文件
+    void release(file_entry* entry);
+    //增加一个引用, 之后需要多调用一次release
+    void retain(file_entry* entry);
+
+    int inotify_fd() const {return m_inotifyfd;}
+    //读取inotify事件, 让变化了的文件失效
+    void handle_inotify();
+
+private:
+    int open_entry(const char* path, file_entry** entry);  //打开文件并获取文件状态
+    void insert(file_entry* entry);                         //加入缓存, 必要时淘汰旧文件
+    void invalidate(file_entry* entry);                     //从缓存中移除, 引用计数减一
+    void invalidate_dir(const std::string& dir);            //目录下的所有文件失效
+    void put(file_entry* entry);                            //引用计数减一, 为0时关闭文件
+    bool watch(const std::string& path);                    //监听文件所在的目录, 失败时返回false
+    static bool same_file(const struct stat& a, const struct stat& b);     //两次stat是否是同一个没有修改过的文件
+
+    void lru_unlink(file_entry* entry);
+    void lru_push_front(file_entry* entry);
+
+private:
+    size_t m_max_size;                                      //文件总大小上限
+    int m_max_entries;                                      //文件数量上限
+    size_t m_max_file;                                      //超过这个大小的文件不缓存
+    size_t m_size;                                          //当前文件总大小
+    std::unordered_map<std::string, file_entry*> m_entries; //路径到文件的索引
+    file_entry* m_head;                                     //LRU链表头, 最近使用
+    file_entry* m_tail;                                     //LRU链表尾, 最久未使用
+    int m_inotifyfd;                                        //inotify实例
+    std::unordered_map<int, std::string> m_watch_dirs;      //inotify监听描述符到目录的映射
+    std::unordered_map<std::string, int> m_dir_watches;     //目录到inotify监听描述符的映射
+    locker m_locker;                                        //保护以上所有成员
+};
+
+#endif
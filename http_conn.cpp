@@ -1,55 +1,104 @@
 #include "http_conn.h"
+#include "log.h"
+#include "config.h"
+#include "overload.h"
+#include "router.h"
+#include "asset_bundle.h"
 
 // 定义HTTP响应的一些状态信息
 const char* ok_200_title = "OK";
+const char* not_modified_304_title = "Not Modified";
+const char* partial_206_title = "Partial Content";
+const char* error_416_title = "Range Not Satisfiable";
+const char* error_416_form = "The requested range is not satisfiable.\n";
+const char* byteranges_boundary = "a1d5f2c8e9b3047e";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The requested method is not allowed for this URL.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
 
-// 资源目录
-const char* source_root = "/home/ubuntu/webservertest/webserver/resources";
+// 请求方法的名字, 下标是http_conn::METHOD
+const char* method_names[] =
+{
+    "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT",
+};
 
-//初始化类静态成员
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+// 按路径前缀设置Cache-Control, 使用最长匹配的前缀, 都不匹配时使用最后的默认值
+struct cache_control_rule
+{
+    const char* prefix;
+    const char* value;
+};
+const cache_control_rule cache_control_rules[] =
+{
+    {"/images/", "public, max-age=86400"},
+    {"/", "no-cache"},
+};
 
-//设置文件描述符非阻塞
-int setnonblocking(int fd)
+// 按扩展名设置Content-Type, 没有匹配的扩展名时使用application/octet-stream
+// compressible为true的文本类型才按Accept-Encoding压缩发送
+struct mime_type
 {
-    int old_option = fcntl(fd, F_GETFL);
-    int new_option = old_option | O_NONBLOCK;
-    fcntl(fd, F_SETFL, new_option);
-    return old_option;
-}
+    const char* extension;
+    const char* type;
+    bool compressible;
+};
+const mime_type mime_types[] =
+{
+    {".html", "text/html; charset=utf-8", true},
+    {".htm", "text/html; charset=utf-8", true},
+    {".css", "text/css; charset=utf-8", true},
+    {".js", "application/javascript; charset=utf-8", true},
+    {".json", "application/json", true},
+    {".txt", "text/plain; charset=utf-8", true},
+    {".xml", "application/xml", true},
+    {".svg", "image/svg+xml", true},
+    {".wasm", "application/wasm", true},
+    {".jpg", "image/jpeg", false},
+    {".jpeg", "image/jpeg", false},
+    {".png", "image/png", false},
+    {".gif", "image/gif", false},
+    {".webp", "image/webp", false},
+    {".ico", "image/x-icon", false},
+    {".woff2", "font/woff2", false},
+    {".pdf", "application/pdf", false},
+    {".mp4", "video/mp4", false},
+};
+
+//初始化类静态成员
+std::atomic<int> http_conn::m_user_count(0);
+file_cache http_conn::m_file_cache;
+compress_cache http_conn::m_compress_cache(&http_conn::m_file_cache);
+const char* http_conn::m_doc_root = "resources";
+std::atomic<bool> http_conn::m_draining(false);
 
 //向epoll中添加需要监听的文件描述符
+//fd必须已经是非阻塞的(accept4的SOCK_NONBLOCK, 或者timerfd等创建时的NONBLOCK标志),
+//配合ET模式在读完所有数据时返回EAGAIN, 而不是一直阻塞
 void addfd(int epollfd, int fd, bool one_shot)
 {
     epoll_event event;
     event.data.fd = fd;
     event.events = EPOLLIN | EPOLLRDHUP;
-    //设置端口复用
-    setnonblocking(fd); 
     if(one_shot)
     {
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    //设置非阻塞模式配合ET运行模式的EPOLL
-    //要不然在判断读完所有数据的时候就会一直阻塞, 而不是返回0
-    setnonblocking(fd);
+    metrics::add(METRIC_SYSCALLS);
 }
 
 //从epoll中移除舰艇的文件描述符
 void removefd(int epollfd, int fd)
 {
     epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
-    
+    metrics::add(METRIC_SYSCALLS);
 }
 
 //修改epoll中监听的文件描述符的监听内容, 并重置epolloneshot事件, 以确保下一次还可以坚挺到该文件描述符上的事件
@@ -59,6 +108,7 @@ void modfd(int epollfd, int fd, int ev)
     event.data.fd = fd;
     event.events = ev | EPOLLONESHOT | EPOLLET | EPOLLRDHUP;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    metrics::add(METRIC_SYSCALLS);
 }
 
 //关闭连接
@@ -67,11 +117,20 @@ void http_conn::close_conn()
     //这个if判断防止被多次关闭
     if(m_sockfd != -1)
     {
-        printf("close\n");
-        //从epoll中移除监听事件
-        removefd(m_epollfd, m_sockfd);
+        LOG_DEBUG("close %d", m_sockfd);
+        //释放还没有发送完的文件和从内存池申请的缓冲区、响应队列
+        unmap();
+        release_state();
+        m_read_buf.clear();
+        m_write_buf.clear();
+        //从epoll中移除监听事件, 不使用epoll的后端没有epoll对象
+        if(m_epollfd >= 0)
+        {
+            removefd(m_epollfd, m_sockfd);
+        }
         //关闭socket
         close(m_sockfd);
+        metrics::add(METRIC_SYSCALLS);
         //标记已经删除过
         m_sockfd = -1;
         --m_user_count;
@@ -80,16 +139,23 @@ void http_conn::close_conn()
 }
 
 //初始化该任务的连接
-void http_conn::init(int sockfd, const sockaddr_in& addr)
+void http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd)
 {
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    timer.task = this;
+    //缓冲区上限可以在运行时重新加载, 新连接使用新的值
+    const server_config* c = config::get();
+    m_read_buf.init(READ_BUFFER_SIZE, c->read_buffer_limit);
+    m_write_buf.init(WRITE_BUFFER_SIZE, c->write_buffer_limit);
 
 
-    //将socket加入epoll监听中, 打开epolloneshot
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    addfd(m_epollfd, m_sockfd, true);
+    //将socket加入epoll监听中, 打开epolloneshot; epollfd为-1时由后端自己提交读写操作
+    if(m_epollfd >= 0)
+    {
+        addfd(m_epollfd, m_sockfd, true);
+    }
     ++m_user_count;
 
     //初始化其他成员
@@ -99,40 +165,86 @@ void http_conn::init(int sockfd, const sockaddr_in& addr)
 }
 //初始化该任务的其他成员
 void http_conn::init()
+{
+    init_request();
+
+    m_read_buf.clear();                         // 清空读缓冲区, 归还申请的块
+    m_write_buf.clear();                        // 清空写缓冲区
+
+    release_state();                            // 没有排队等待发送的响应
+    m_response_head = 0;
+    m_response_count = 0;
+
+    m_request_start = 0;
+    m_queued_ns = 0;
+    upstream = nullptr;
+    in_pool = false;
+}
+
+//初始化解析一个请求用到的数据, 读缓冲区中可能还有流水线上的后续请求, 不能清空
+void http_conn::init_request()
 {
     m_check_state = CHECK_STATE_REQUESTLINE;    // 初始状态为检查请求行
-    m_linger = false;                           // 默认不保持链接  Connection : keep-alive保持连接
+    m_linger = false;                           // 解析请求行时按HTTP版本设置默认值, Connection字段可以改变
+    m_content_type = "text/html";               // 默认返回网页
     m_method = GET;                             // 默认请求方式为GET
-    m_url = nullptr;                            // URL为默认nullptr             
-    m_version = nullptr;                        // http版本默认为nullptr
+    m_url = http_view{0, 0};                    // URL默认为空
+    m_version = http_view{0, 0};                // http版本默认为空
     m_content_length = 0;                       // 请求数据长度默认为0
-    m_host = nullptr;                           // 请求主机默认为nullptr
-    bzero(m_real_file, FILENAME_LEN);           // 初始化客户端请求文件的路径
+    m_body = http_view{0, 0};                   // 默认没有请求数据
+    m_allowed = 0;
+    m_proxy_group = -1;                         // 默认不转发
+    m_host = http_view{0, 0};                   // 请求主机默认为空
+    m_if_none_match = http_view{0, 0};          // 默认不是条件请求
+    m_if_modified_since = http_view{0, 0};
+    m_range = http_view{0, 0};                  // 默认请求整个文件
+    m_if_range = http_view{0, 0};
+    m_range_count = 0;
+    m_accept_encoding = 0;                      // 默认只接受原始内容
+    m_content_encoding = nullptr;
+    m_vary = false;
 
     m_start_line = 0;                           // 正在解析的行的行起始位置
+    m_line_end = 0;
     m_checked_idx = 0;                          // 正在处理的字符在读缓冲区的位置
     m_read_bytes = 0;                           // 读缓冲区中已经读取的字节数
-    bzero(m_read_buf, READ_BUFFER_SIZE);        // 初始化读缓冲区
+    m_read_base = nullptr;
+    m_request_bytes = 0;
 
-    m_write_bytes = 0;                          // 写缓冲区中待读取的字节数
-    bzero(m_write_buf, WRITE_BUFFER_SIZE);       // 初始化写缓冲区
+    m_file = nullptr;                           // 没有引用缓存中的文件
+}
 
+//丢弃读缓冲区中已经处理完的请求, 后面的数据成为下一个请求的开头
+void http_conn::finish_request()
+{
+    m_read_buf.drain(m_request_bytes);
+    init_request();
 }
 
 //从socket一次性读取全部数据
 bool http_conn::read()
 {
-    if(m_read_bytes >= READ_BUFFER_SIZE)
+    //缓冲区为空说明读到的是一个新请求的开头
+    if(m_read_buf.empty())
     {
-        //读缓冲区暂时还存不下就退出
-        return false;
+        m_request_start = metrics::now_ns();
     }
 
     //读取到的字节数
     int bytes_read = 0;
     while(true)
     {
-        bytes_read = recv(m_sockfd, m_read_buf, READ_BUFFER_SIZE - m_read_bytes, 0);
+        //从读缓冲区末尾接着写, 空间不够时缓冲区自动增长
+        int room = 0;
+        char* p = m_read_buf.prepare(&room);
+        if(p == nullptr)
+        {
+            //超过了读缓冲区的上限, 请求头太大
+            return false;
+        }
+
+        bytes_read = recv(m_sockfd, p, room, 0);
+        metrics::add(METRIC_SYSCALLS);
         if(bytes_read == -1)
         {
             if(errno == EAGAIN)
@@ -154,79 +266,70 @@ bool http_conn::read()
                 return false;
             }
         }
-        m_read_bytes += bytes_read;
+        m_read_buf.commit(bytes_read);
     }
 
+    //没有读到数据时把为recv准备的块还给内存池
+    if(m_read_buf.empty())
+    {
+        m_read_buf.clear();
+    }
     //能到这里说明发来的数据已经全部读完
     return true;
 }
 
+//追加后端已经读到的数据, 超过读缓冲区上限时返回false
+bool http_conn::append_read(const char* data, int len)
+{
+    if(m_read_buf.empty())
+    {
+        m_request_start = metrics::now_ns();
+    }
+    return m_read_buf.append(data, len);
+}
+
 
 //从读缓冲区中获取完整的一行数据
+//用向量化的扫描一次跳过不含\r和\n的字节, 不往缓冲区中写'\0', 行的范围记在m_start_line和m_line_end中
 http_conn::LINE_STATUS http_conn::parse_line()
 {
-    //当前读取到的的字符
-    char cur;
-    for(; m_checked_idx < m_read_bytes; ++m_checked_idx)
+    m_checked_idx += http_scan(m_read_base + m_checked_idx, m_read_bytes - m_checked_idx, "\r\n", 2);
+    if(m_checked_idx == m_read_bytes)
     {
-        cur = m_read_buf[m_checked_idx];
-        if(cur == '\r')
-        {
-            if((m_checked_idx + 1) == m_read_bytes)
-            {
-                //如果当前已经是最后一个字符, 那说明当前行还是不完整, 还是需要继续读取
-                return LINE_OPEN;
-            }
-            else
-            {
-                if(m_read_buf[m_checked_idx + 1] == '\n')
-                {
-                    //已经读取到完整的行
-                    m_read_buf[m_checked_idx++] = '\0';
-                    m_read_buf[m_checked_idx++] = '\0';
-                    return LINE_OK;
-                }
-                else
-                {
-                    //如果下一个字符不是\n, 那说明格式错误
-                    return LINE_BAD;
-                }
-            }
+        //能运行到这说明当前行还是不完整
+        return LINE_OPEN;
+    }
 
+    if(m_read_base[m_checked_idx] == '\r')
+    {
+        if((m_checked_idx + 1) == m_read_bytes)
+        {
+            //如果当前已经是最后一个字符, 那说明当前行还是不完整, 下次从\r开始继续检查
+            return LINE_OPEN;
         }
-        else
+        if(m_read_base[m_checked_idx + 1] == '\n')
         {
-            if(cur == '\n')
-            {
-                if((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r'))
-                {
-                    //已经读取到完整的行
-                    m_read_buf[m_checked_idx - 1] = '\0';
-                    m_read_buf[m_checked_idx++] = '\0';
-                    return LINE_OK;
-                }
-                else
-                {
-                    //如果上一个字符不是\r, 那说明格式错误
-                    return LINE_BAD;
-                }
-            }
+            //已经读取到完整的行
+            m_line_end = m_checked_idx;
+            m_checked_idx += 2;
+            return LINE_OK;
         }
     }
 
-    //能运行到这说明当前行还是不完整
-    return LINE_OPEN;
+    //\r后面不是\n, 或者\n前面不是\r, 那说明格式错误
+    return LINE_BAD;
 }
 
 
 
 //解析HTTP请求行
-http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
+http_conn::HTTP_CODE http_conn::parse_request_line(const char* text, int len)
 {
     
     //GET /index.html HTTP/1.1
-    m_url = strpbrk(text, " ");
-    if(m_url == nullptr)
+    //按空格切分出请求方法、URL和版本三个字段
+    int method_len = http_scan(text, len, " ", 1);
+    if(method_len == len)
     {
         
         //如果找不到空格, 那说明是错误的格式
@@ -234,54 +337,64 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
     }
 
 
-    //提取http请求方法
-    //仅支持GET请求
-    *m_url++ = '\0'; //GET\0/index.html HTTP/1.1
-    char* method = text;
-    if(strcasecmp(method, "GET") == 0)
+    //提取http请求方法, 是否支持由路由表决定
+    int method = 0;
+    while(method < METHOD_NUMBER
+        && !((int)strlen(method_names[method]) == method_len && strncasecmp(text, method_names[method], method_len) == 0))
     {
-
-        m_method = GET;
+        ++method;
     }
-    else
+    if(method == METHOD_NUMBER)
     {
-        
-        //不是GET的请求, 都是错误格式
+        //不认识的请求方法, 都是错误格式
         return BAD_REQUEST;
     }
+    m_method = (METHOD)method;
 
-    //提取HTTP版本，仅支持HTTP/1.1
-    m_version = strpbrk(m_url, " ");
-    if(m_version == nullptr)
+    const char* url = text + method_len + 1;
+    int rest = len - method_len - 1;
+    int url_len = http_scan(url, rest, " ", 1);
+    if(url_len == rest)
     {
         
         return BAD_REQUEST;
     }
-    *m_version++ = '\0';//GET\0/index.html\0HTTP/1.1
-    if(strcasecmp(m_version, "HTTP/1.1") != 0)
+
+    //提取HTTP版本，支持HTTP/1.1和HTTP/1.0
+    const char* version = url + url_len + 1;
+    int version_len = rest - url_len - 1;
+    if(version_len != 8 || strncasecmp(version, "HTTP/1.", 7) != 0 || (version[7] != '1' && version[7] != '0'))
     {
         
-        //如果不是HTTP1.1, 都是格式错误
+        //其他版本都是格式错误
         return BAD_REQUEST;
     }
+    //HTTP/1.1默认保持连接, 除非Connection: close; HTTP/1.0默认关闭, 除非Connection: keep-alive
+    m_linger = version[7] == '1';
 
     //提取URL
-    printf("%s", m_url);
+    LOG_DEBUG("url %.*s", url_len, url);
     //有可能URI处是URL格式   //http://106.52.19.182:10000/index.html
-    if(strncasecmp(m_url, "http://", 7) == 0)
+    if(url_len >= 7 && strncasecmp(url, "http://", 7) == 0)
     {
-        m_url += 7;
+        url += 7;
+        url_len -= 7;
         //提取URI
-        //查找m_url中第一个/位置
-        m_url = strchr(m_url, '/');
+        //查找url中第一个/位置
+        int host_len = http_scan(url, url_len, "/", 1);
+        url += host_len;
+        url_len -= host_len;
     }
 
     //URI格式错误
-    if ( !m_url || m_url[0] != '/' ) 
+    if(url_len == 0 || url[0] != '/')
     {
         return BAD_REQUEST;
     }
 
+    m_url = make_view(url, url_len);
+    m_version = make_view(version, version_len);
+
 
     //检查请求行完毕，状态转变为检查请求头部状态
     m_check_state = CHECK_STATE_HEADER;
@@ -302,10 +415,10 @@ Content-Length:
 Host:
 
 */
-http_conn::HTTP_CODE http_conn::parse_headers(char* text)
+http_conn::HTTP_CODE http_conn::parse_headers(const char* text, int len)
 {
     //如果遇到空行, 表示头部字段已经解析完毕
-    if(text[0] == '\0')
+    if(len == 0)
     {
         //如果HTTP请求有消息体, 下一个状态就是解析消息体
         if(m_content_length != 0)
@@ -322,45 +435,136 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
         }
 
     }
-    else
+
+    //冒号前面是字段名, 后面去掉首尾空白是字段值
+    int name_len = http_scan(text, len, ":", 1);
+    if(name_len == len)
+    {
+        //没有冒号的行不是头部字段, 忽略
+        return NO_REQUEST;
+    }
+    const char* value = text + name_len + 1;
+    int value_len = len - name_len - 1;
+    while(value_len > 0 && (value[0] == ' ' || value[0] == '\t'))
+    {
+        ++value;
+        --value_len;
+    }
+    while(value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+    {
+        --value_len;
+    }
+
+    //先按字段名的长度分派, 每个头部最多只做一次字符串比较
+    switch(name_len)
     {
-        //提取Connection字段
-        if(strncasecmp(text, "Connection:", 11) == 0)
+        case 5:
         {
-            text += 11;
-            text += 1;//跳过值字段的空格
-            if(strncasecmp(text, "keep-alive", 10) == 0)
+            //请求文件的一部分, 只对GET有意义, HEAD和其他方法忽略
+            if(m_method == GET && strncasecmp(text, "Range", 5) == 0)
             {
-                printf("keep alive\n");
-                m_linger = true;
+                m_range = make_view(value, value_len);
             }
+            break;
         }
-        else
+        case 8:
         {
-            //提取Content-Length字段
-            if(strncasecmp(text, "Content-Length:", 15) == 0)
+            //文件没有变化时才按Range返回
+            if(strncasecmp(text, "If-Range", 8) == 0)
             {
-                text += 15;
-                text += 1;//跳过值字段的空格
-                m_content_length = atol(text);
-                
+                m_if_range = make_view(value, value_len);
             }
-            else
+            break;
+        }
+        case 4:
+        {
+            //处理Host头部字段
+            if(strncasecmp(text, "Host", 4) == 0)
+            {
+                m_host = make_view(value, value_len);
+            }
+            break;
+        }
+        case 10:
+        {
+            //提取Connection字段, 覆盖按HTTP版本设置的默认值
+            if(strncasecmp(text, "Connection", 10) == 0)
             {
-                //处理Host头部字段
-                if(strncasecmp(text, "Host:", 5) == 0)
+                if(value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0)
                 {
-                    text += 5;
-                    text += 1;//跳过字段空格
-                    m_host = text;
-
+                    LOG_DEBUG("keep alive");
+                    m_linger = true;
+                }
+                else if(value_len == 5 && strncasecmp(value, "close", 5) == 0)
+                {
+                    m_linger = false;
+                }
+            }
+            break;
+        }
+        case 14:
+        {
+            //提取Content-Length字段
+            if(strncasecmp(text, "Content-Length", 14) == 0)
+            {
+                if(value_len == 0)
+                {
+                    return BAD_REQUEST;
                 }
-                else
+                long length = 0;
+                for(int i = 0; i < value_len; ++i)
                 {
-                    //就解析那么多头部字段
-                    ;
+                    if(value[i] < '0' || value[i] > '9')
+                    {
+                        return BAD_REQUEST;
+                    }
+                    length = length * 10 + (value[i] - '0');
+                    //请求数据不能超过读缓冲区的上限
+                    if(length > m_read_buf.limit())
+                    {
+                        return BAD_REQUEST;
+                    }
                 }
+                m_content_length = length;
             }
+            break;
+        }
+        case 15:
+        {
+            //客户端接受的压缩编码
+            if(strncasecmp(text, "Accept-Encoding", 15) == 0)
+            {
+                m_accept_encoding = parse_accept_encoding(value, value_len);
+            }
+            break;
+        }
+        case 13:
+        {
+            //条件请求, 客户端缓存的ETag
+            if(strncasecmp(text, "If-None-Match", 13) == 0)
+            {
+                m_if_none_match = make_view(value, value_len);
+            }
+            break;
+        }
+        case 17:
+        {
+            //条件请求, 客户端缓存的修改时间
+            if(strncasecmp(text, "If-Modified-Since", 17) == 0)
+            {
+                m_if_modified_since = make_view(value, value_len);
+            }
+            //不支持分块传输的请求数据, 按Content-Length读取会把请求数据当成下一个请求
+            else if(strncasecmp(text, "Transfer-Encoding", 17) == 0)
+            {
+                return BAD_REQUEST;
+            }
+            break;
+        }
+        default:
+        {
+            //就解析那么多头部字段
+            break;
         }
     }
 
@@ -371,12 +575,11 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
 
 //解析请求报文中的请求数据
 //这里并没有处理数据的逻辑, 只是单存读取数据
-http_conn::HTTP_CODE http_conn::parse_content(char* text)
+http_conn::HTTP_CODE http_conn::parse_content()
 {
     if(m_read_bytes >= (m_content_length + m_checked_idx))
     {
         //数据已经读取完毕
-        text[m_content_length] = '\0';
         return GET_REQUEST;
     }
     else
@@ -393,239 +596,781 @@ http_conn::HTTP_CODE http_conn::process_read()
     //从状态机状态，解析行成功状态
     //主状态机初始状态, 解析请求行
 
-    m_check_state = CHECK_STATE_REQUESTLINE;
+    //不重置主状态机, 上一次没有解析完的请求接着解析
     LINE_STATUS line_status = LINE_OK;
 
-    HTTP_CODE ret = NO_REQUEST;
+    //读缓冲区可能由多个块组成, 解析前合并成连续的内存
+    char* base = m_read_buf.pullup();
+    if(base == nullptr)
+    {
+        m_linger = false;
+        return INTERNAL_ERROR;
+    }
+    //已经解析出来的字段都是相对缓冲区开头的偏移, 合并时数据被移动也不需要调整
+    m_read_base = base;
+    m_read_bytes = m_read_buf.size();
 
-    char* text = nullptr;
+    HTTP_CODE ret = NO_REQUEST;
 
 
-    //如果读取到新的完整行, 或者该任务处在解析请求数据且一直读取不到完整行
-    while(m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OPEN
-            || (line_status = parse_line()) == LINE_OK)
+    //如果该任务处在解析请求数据, 或者读取到新的完整行
+    while(m_check_state == CHECK_STATE_CONTENT || (line_status = parse_line()) == LINE_OK)
     {
-        
-        //获取一行数据
-        text = get_line();
-        printf("%s\n", text);
+        if(m_check_state == CHECK_STATE_CONTENT)
+        {
+            //请求数据不按行解析, 不能在其中查找行尾
+            ret = parse_content();
+            //已经获取到完整请求, 开始响应请求
+            if(ret == GET_REQUEST)
+            {
+                m_body = http_view{m_checked_idx, m_content_length};
+                m_request_bytes = m_checked_idx + m_content_length;
+                return do_request();
+            }
+            //数据还不够完整, 需要继续读取
+            return NO_REQUEST;
+        }
+
+        //获取一行数据, 不包括行尾的\r\n
+        const char* text = get_line();
+        int len = m_line_end - m_start_line;
+        LOG_DEBUG("%.*s", len, text);
         //前往下一行
         m_start_line = m_checked_idx;
 
 
-
-
-        switch(m_check_state)
+        if(m_check_state == CHECK_STATE_REQUESTLINE)
         {
-            case CHECK_STATE_REQUESTLINE:
+            ret = parse_request_line(text, len);
+            if(ret == BAD_REQUEST)
             {
-                ret = parse_request_line(text);
-                if(ret == BAD_REQUEST)
-                {
-                    printf("line\n");
-                    return BAD_REQUEST;
-                }
-                break;
+                LOG_DEBUG("bad request line");
+                //找不到下一个请求的开头, 响应之后关闭连接
+                m_linger = false;
+                return BAD_REQUEST;
             }
-            case CHECK_STATE_HEADER:
+        }
+        else
+        {
+            ret = parse_headers(text, len);
+            if(ret == BAD_REQUEST)
             {
-                ret = parse_headers(text);
-                if(ret == BAD_REQUEST)
-                {
-                    printf("head\n");
-                    return BAD_REQUEST;
-                }
-                else
-                {
-                    //已经获取到完整请求, 开始响应请求
-                    if(ret == GET_REQUEST)
-                    {
-                        return do_request();
-                    }
-                }
-                break;
+                LOG_DEBUG("bad header");
+                m_linger = false;
+                return BAD_REQUEST;
             }
-            case CHECK_STATE_CONTENT:
+            //已经获取到完整请求, 开始响应请求
+            if(ret == GET_REQUEST)
             {
-                ret = parse_content(text);
-                //已经获取到完整请求, 开始响应请求
-                if(ret == GET_REQUEST)
-                {
-                    return do_request();
-                }
-                //数据还不够完整, 需要继续读取
-                line_status = LINE_OPEN;
-                break;
+                m_body = http_view{m_checked_idx, 0};
+                m_request_bytes = m_checked_idx;
+                return do_request();
             }
-
         }
     }
 
+    //一行有格式错误
+    if(line_status == LINE_BAD)
+    {
+        m_linger = false;
+        return BAD_REQUEST;
+    }
+
     //能运行到这里, 说明请求还没解析完毕
     return NO_REQUEST;
     
 }
 
 
-//响应HTTP请求, 如果请求网页文件存在则返回, 否则报错
+//按请求的路径(不含查询字符串)和方法在路由表中找到处理函数, 由它生成响应
 http_conn::HTTP_CODE http_conn::do_request()
 {
-
-    //获取请求的文件路径
-    strcpy(m_real_file, source_root);
-    int len = strlen(source_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
-
-
-
-    //获取所请求文件的相关信息
-    if(stat(m_real_file, &m_file_stat) < 0)
+    //服务器正在退出, 这个响应发完后关闭连接, 客户端会换到新的连接上
+    //在处理函数写响应之前设置, 响应头部中的Connection才是close
+    if(m_draining.load(std::memory_order_relaxed))
     {
-        //文件不存在
-        return NO_RESOURCE;
+        m_linger = false;
     }
 
-    //判断访问权限
-    if(!m_file_stat.st_mode & S_IROTH)
+    const char* url = view_data(m_url);
+    int path_len = http_scan(url, m_url.len, "?", 1);
+    route_handler handler = router::match(m_method, url, path_len, &m_allowed);
+    if(handler == nullptr)
     {
-        //没有访问权限
-        return FORBIDDEN_REQUEST;
+        return m_allowed ? METHOD_NOT_ALLOWED : NO_RESOURCE;
     }
+    return handler(this);
+}
 
+//按名字查找请求头部, 请求头部在请求行和空行之间, 解析时已经检查过格式, 每行都以\r\n结尾
+const char* http_conn::header(const char* name, int* len) const
+{
+    int name_len = strlen(name);
+    const char* p = view_data(m_version) + m_version.len + 2;
+    const char* end = view_data(m_body) - 2;
+    while(p < end)
+    {
+        int line_len = http_scan(p, end - p, "\r", 1);
+        if(line_len > name_len && p[name_len] == ':' && strncasecmp(p, name, name_len) == 0)
+        {
+            //去掉值首尾的空白
+            const char* value = p + name_len + 1;
+            const char* value_end = p + line_len;
+            while(value < value_end && (*value == ' ' || *value == '\t'))
+            {
+                ++value;
+            }
+            while(value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            {
+                --value_end;
+            }
+            *len = value_end - value;
+            return value;
+        }
+        p += line_len + 2;
+    }
+    *len = 0;
+    return nullptr;
+}
 
-    //判断是否是目录
-    if(S_ISDIR(m_file_stat.st_mode))
+//处理函数的响应, 和错误页面一样整个写在写缓冲区中
+http_conn::HTTP_CODE http_conn::reply(int status, const char* title, const char* content_type, const char* body, int len, const char* headers)
+{
+    m_content_type = content_type;
+    if(add_status_line(status, title)
+        && (headers == nullptr || add_response("%s", headers))
+        && add_headers(len)
+        && (m_method == HEAD || m_write_buf.append(body, len)))
     {
-        //不能请求目录
-        return BAD_REQUEST;
+        return HANDLED_REQUEST;
     }
+    //响应已经写了一部分, 不能再在后面写错误页面
+    return CLOSED_CONNECTION;
+}
 
+//反向代理的后端连接和客户端连接在同一个epoll中转发, 自己提交读写操作的后端(io_uring)不支持
+http_conn::HTTP_CODE http_conn::proxy(int group)
+{
+    if(m_epollfd < 0)
+    {
+        static const char text[] = "The proxy is not available on this backend.\n";
+        return reply(502, "Bad Gateway", "text/plain", text, sizeof(text) - 1);
+    }
+    m_proxy_group = group;
+    return PROXY_REQUEST;
+}
 
+//响应GET请求的网页文件, 如果请求网页文件存在则返回, 否则报错
+http_conn::HTTP_CODE http_conn::do_file_request()
+{
+    //先查资源包: 一次哈希查找, Content-Type、ETag和压缩版本都是打包时准备好的, 不访问文件系统
+    //Range按原始文件计算, 带Range的请求不使用压缩版本
+    const char* path = view_data(m_url);
+    int path_len = http_scan(path, m_url.len, "?", 1);
+    int encoding = 0;
+    m_file = asset_bundle::acquire(path, path_len, m_range.len == 0 ? m_accept_encoding : 0, &encoding, &m_content_type, &m_vary);
+    if(m_file)
+    {
+        if(encoding != 0)
+        {
+            m_content_encoding = encoding == ENCODING_BR ? "br" : "gzip";
+        }
+    }
+    else
+    {
+        HTTP_CODE ret = open_file();
+        if(ret != FILE_REQUEST)
+        {
+            return ret;
+        }
+    }
 
-    //能运行到这说明文件存在, 并且可以访问
-    
+    //客户端缓存仍然有效时只返回头部, 文件的引用在响应发送完后释放
+    if(not_modified())
+    {
+        return NOT_MODIFIED;
+    }
 
-    int fd = open(m_real_file, O_RDONLY);
-    //创建内存映射
-    m_file_address = static_cast<char*>(mmap(nullptr, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
-    
-    //创建后就可以关闭打开的文件
-    close(fd);
+    //Range请求只发送请求的范围; 无法解析的Range按普通请求处理
+    if(m_range.len > 0 && if_range_matches())
+    {
+        int count = parse_ranges(m_file->st.st_size);
+        if(count == 0)
+        {
+            return RANGE_NOT_SATISFIABLE;
+        }
+        if(count > 0)
+        {
+            return PARTIAL_CONTENT;
+        }
+    }
 
     //获取文件成功
     return FILE_REQUEST;
-
 }
 
-
-
-// 对内存映射区执行munmap操作
-void http_conn::unmap()
+//在资源目录下打开URL对应的文件, 成功时返回FILE_REQUEST, m_file为要发送的文件(可能是压缩版本)
+http_conn::HTTP_CODE http_conn::open_file()
 {
-    if(m_file_address)
+    //查询字符串不属于文件路径, 和资源包一样去掉后再查找, 带不同查询字符串的请求共用同一个缓存项
+    const char* url = view_data(m_url);
+    int path_len = http_scan(url, m_url.len, "?", 1);
+
+    //不允许通过..访问资源目录以外的文件, 保证缓存的键就是解析后的路径
+    if(memmem(url, path_len, "/..", 3) != nullptr)
     {
-        munmap(m_file_address, m_file_stat.st_size);
-        m_file_address = nullptr;
+        return BAD_REQUEST;
     }
-}
 
+    //获取请求的文件路径, 其内容等于 doc_root + URL的路径部分, 只在查找缓存时使用, 不保存在连接中
+    char real_file[FILENAME_LEN];
+    int len = strlen(m_doc_root);
+    if(len >= FILENAME_LEN - 1)
+    {
+        return INTERNAL_ERROR;
+    }
+    memcpy(real_file, m_doc_root, len);
+    int url_len = path_len < FILENAME_LEN - len - 1 ? path_len : FILENAME_LEN - len - 1;
+    memcpy(real_file + len, url, url_len);
+    real_file[len + url_len] = '\0';
 
-//写HTTP响应
-bool http_conn::write()
-{
-    int ret = 0;
-    int bytes_have_send = 0;                    //已经发送的字节数
-    int bytes_to_send = m_write_bytes;          //将要发送的字节
 
 
-    if(bytes_to_send == 0)
+    //从文件缓存中获取文件, 命中时不需要stat、open和mmap
+    int err = m_file_cache.acquire(real_file, &m_file);
+    if(err == EACCES)
     {
-        //将要发送的字节为0, 这一次响应结束
-        //重新等待有数据到来
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
-        return true;
+        //没有访问权限
+        return FORBIDDEN_REQUEST;
+    }
+    else if(err == EISDIR)
+    {
+        //不能请求目录
+        return BAD_REQUEST;
+    }
+    else if(err != 0)
+    {
+        //文件不存在
+        return NO_RESOURCE;
     }
 
+    //能运行到这说明文件存在, 并且可以访问
 
-    while(true)
+    //文本文件按客户端接受的编码发送压缩版本, 压缩在后台线程进行, 还没准备好时发送原始文件
+    //Range按原始文件计算, 带Range的请求不压缩
+    if(set_content_type() && m_file->st.st_size >= COMPRESS_MIN_FILE)
     {
-        //分散写
-        ret = writev(m_sockfd, m_iv, m_iv_count);
-
-        if(ret <= -1)
+        m_vary = true;
+        if(m_accept_encoding != 0 && m_range.len == 0)
         {
-            //如果TCP写缓存没有空间, 则重新等待下一轮EPOLLOUT事件
-            if(errno == EAGAIN)
-            {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
-                return true;
-            }
-            else
+            int encoding = 0;
+            file_entry* compressed = m_compress_cache.acquire(m_file, m_accept_encoding, &encoding);
+            if(compressed)
             {
-                
-                //发生其他错误, 返回false并释放映射的内存
-                unmap();
-                return false;
+                m_file_cache.release(m_file);
+                m_file = compressed;
+                m_content_encoding = encoding == ENCODING_BR ? "br" : "gzip";
             }
         }
+    }
+    return FILE_REQUEST;
+}
 
-        bytes_have_send += ret;
 
-        //已经发完
-        if(bytes_to_send <= bytes_have_send)
-        {
-            unmap();
-            //判断是否需要保持连接
-            if(m_linger)
-            {
-                //回到初始连接状态
-                init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return true;
-            }
-            else
-            {
-                //不需要保持连接
-                //重新注册一下epolloneshot
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return false;
-            }
 
-        }
+//按URL的扩展名设置Content-Type, 返回是否是可以压缩的文本类型
+bool http_conn::set_content_type()
+{
+    const char* url = view_data(m_url);
+    int len = m_url.len;
+    //查询字符串不属于文件名
+    const char* query = static_cast<const char*>(memchr(url, '?', len));
+    if(query)
+    {
+        len = query - url;
     }
-
-
+    bool compressible = false;
+    m_content_type = mime_type(url, len, &compressible);
+    return compressible;
 }
 
-
-bool http_conn::add_response(const char* format, ...)
+//按扩展名查找Content-Type
+const char* http_conn::mime_type(const char* path, int len, bool* compressible)
 {
-    //写缓冲区暂时不足
-    if(m_write_bytes >= WRITE_BUFFER_SIZE)
+    for(size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); ++i)
     {
-        return false;
+        int ext_len = strlen(mime_types[i].extension);
+        if(ext_len < len && strncasecmp(path + len - ext_len, mime_types[i].extension, ext_len) == 0)
+        {
+            *compressible = mime_types[i].compressible;
+            return mime_types[i].type;
+        }
     }
+    *compressible = false;
+    return "application/octet-stream";
+}
 
-    //获得可变参数中第一个参数的地址
-    va_list arg_list;
-    va_start(arg_list, format);
+//解析Accept-Encoding: gzip, deflate, br;q=0.9
+//返回接受的编码, q=0表示明确不接受, *表示接受所有编码
+int http_conn::parse_accept_encoding(const char* value, int len)
+{
+    int accept = 0;
+    const char* p = value;
+    const char* end = value + len;
+    while(p < end)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            ++p;
+        }
+        const char* coding = p;
+        p += http_scan(p, end - p, ",", 1);
+        const char* item_end = p;
+
+        //编码名到分号或者空白为止
+        const char* coding_end = coding;
+        while(coding_end < item_end && *coding_end != ';' && *coding_end != ' ' && *coding_end != '\t')
+        {
+            ++coding_end;
+        }
+        int coding_len = coding_end - coding;
+
+        //q值的所有数字都是0时表示不接受
+        bool rejected = false;
+        const char* q = static_cast<const char*>(memmem(coding_end, item_end - coding_end, "q=", 2));
+        if(q)
+        {
+            rejected = true;
+            for(q += 2; q < item_end && *q != ' ' && *q != '\t' && *q != ';'; ++q)
+            {
+                if(*q >= '1' && *q <= '9')
+                {
+                    rejected = false;
+                }
+            }
+        }
+        if(rejected)
+        {
+            continue;
+        }
 
-    int len = vsnprintf(m_write_buf + m_write_bytes, 
-        WRITE_BUFFER_SIZE - 1 - m_write_bytes, format, arg_list);
+        if(coding_len == 2 && strncasecmp(coding, "br", 2) == 0)
+        {
+            accept |= ENCODING_BR;
+        }
+        else if((coding_len == 4 && strncasecmp(coding, "gzip", 4) == 0)
+            || (coding_len == 6 && strncasecmp(coding, "x-gzip", 6) == 0))
+        {
+            accept |= ENCODING_GZIP;
+        }
+        else if(coding_len == 1 && coding[0] == '*')
+        {
+            accept |= ENCODING_BR | ENCODING_GZIP;
+        }
+    }
+    return accept;
+}
 
-    if(len >= (WRITE_BUFFER_SIZE - 1 - m_write_bytes)) 
+//按RFC 7232的规则判断条件请求: 有If-None-Match时只看它, 否则看If-Modified-Since
+bool http_conn::not_modified() const
+{
+    if(m_if_none_match.len > 0)
     {
+        //逗号分隔的ETag列表, 使用弱比较(忽略W/前缀), *匹配任何存在的文件
+        const char* p = view_data(m_if_none_match);
+        const char* end = p + m_if_none_match.len;
+        int etag_len = strlen(m_file->etag);
+        while(p < end)
+        {
+            while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            {
+                ++p;
+            }
+            const char* tag = p;
+            p += http_scan(p, end - p, ",", 1);
+            const char* tag_end = p;
+            while(tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+            {
+                --tag_end;
+            }
+            if(tag_end - tag >= 2 && tag[0] == 'W' && tag[1] == '/')
+            {
+                tag += 2;
+            }
+            if((tag_end - tag == 1 && tag[0] == '*')
+                || (tag_end - tag == etag_len && memcmp(tag, m_file->etag, etag_len) == 0))
+            {
+                return true;
+            }
+        }
         return false;
     }
 
-    m_write_bytes += len;
-    va_end(arg_list);
+    if(m_if_modified_since.len > 0 && m_if_modified_since.len < 64)
+    {
+        //只接受RFC 7231推荐的IMF-fixdate格式, 例如Sun, 06 Nov 1994 08:49:37 GMT
+        char date[64];
+        memcpy(date, view_data(m_if_modified_since), m_if_modified_since.len);
+        date[m_if_modified_since.len] = '\0';
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* rest = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if(rest == nullptr || *rest != '\0')
+        {
+            //无法解析的日期按没有这个头部处理
+            return false;
+        }
+        return m_file->st.st_mtime <= timegm(&tm);
+    }
+    return false;
+}
+
+//If-Range可以是ETag或者日期, 都要求和当前文件完全一致(强比较)
+bool http_conn::if_range_matches() const
+{
+    if(m_if_range.len == 0)
+    {
+        return true;
+    }
+    const char* value = view_data(m_if_range);
+    if(value[0] == '"' || value[0] == 'W')
+    {
+        //弱ETag不能用于If-Range
+        return m_if_range.len == (int)strlen(m_file->etag) && memcmp(value, m_file->etag, m_if_range.len) == 0;
+    }
+    return m_if_range.len == (int)strlen(m_file->last_modified) && memcmp(value, m_file->last_modified, m_if_range.len) == 0;
+}
+
+//解析Range: bytes=0-99,200-,-50
+//超出文件的范围被忽略, 结果保存在m_state->ranges中
+int http_conn::parse_ranges(off_t size)
+{
+    const char* p = view_data(m_range);
+    const char* end = p + m_range.len;
+    if(m_range.len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+    {
+        return -1;
+    }
+    p += 6;
+
+    //没有内存保存范围时按普通请求处理
+    if(!acquire_state())
+    {
+        return -1;
+    }
+    m_range_count = 0;
+    while(p < end)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            ++p;
+        }
+        if(p == end)
+        {
+            break;
+        }
+
+        //读取"-"两边的数字, 没有数字时为-1
+        off_t first = -1;
+        off_t last = -1;
+        for(; p < end && *p >= '0' && *p <= '9'; ++p)
+        {
+            first = (first < 0 ? 0 : first * 10) + (*p - '0');
+            if(first > size)
+            {
+                first = size;
+            }
+        }
+        if(p == end || *p != '-')
+        {
+            return -1;
+        }
+        ++p;
+        for(; p < end && *p >= '0' && *p <= '9'; ++p)
+        {
+            last = (last < 0 ? 0 : last * 10) + (*p - '0');
+            if(last > size)
+            {
+                last = size;
+            }
+        }
+        while(p < end && (*p == ' ' || *p == '\t'))
+        {
+            ++p;
+        }
+        if(p < end && *p != ',')
+        {
+            return -1;
+        }
+
+        off_t start;
+        off_t length;
+        if(first < 0)
+        {
+            //-N表示最后N个字节
+            if(last < 0)
+            {
+                return -1;
+            }
+            if(last == 0 || size == 0)
+            {
+                continue;
+            }
+            start = last < size ? size - last : 0;
+            length = size - start;
+        }
+        else
+        {
+            if(last >= 0 && last < first)
+            {
+                return -1;
+            }
+            if(first >= size)
+            {
+                //不能满足的范围
+                continue;
+            }
+            start = first;
+            length = (last < 0 || last >= size ? size - 1 : last) - first + 1;
+        }
+
+        if(m_range_count == MAX_RANGES)
+        {
+            //范围太多, 返回整个文件
+            return -1;
+        }
+        m_state->ranges[m_range_count].start = start;
+        m_state->ranges[m_range_count].length = length;
+        ++m_range_count;
+    }
+    return m_range_count;
+}
+
+// 释放当前请求和所有排队响应对缓存文件的引用
+void http_conn::unmap()
+{
+    if(m_file)
+    {
+        m_file_cache.release(m_file);
+        m_file = nullptr;
+    }
+    while(m_response_count > 0)
+    {
+        finish_response();
+    }
+}
+
+// 队首的响应发送完毕, 出队并释放它引用的文件
+void http_conn::finish_response()
+{
+    response& r = m_state->responses[m_response_head];
+    if(r.file)
+    {
+        m_file_cache.release(r.file);
+        r.file = nullptr;
+    }
+    m_response_head = (m_response_head + 1) % MAX_PIPELINE;
+    --m_response_count;
+    if(m_response_count == 0)
+    {
+        //响应都发完了, 长连接空闲时不持有响应队列
+        release_state();
+    }
+}
+
+bool http_conn::acquire_state()
+{
+    if(m_state == nullptr)
+    {
+        m_state = static_cast<request_state*>(buffer_pool_alloc(sizeof(request_state)));
+        m_response_head = 0;
+    }
+    return m_state != nullptr;
+}
+
+void http_conn::release_state()
+{
+    if(m_state)
+    {
+        buffer_pool_free(m_state, sizeof(request_state));
+        m_state = nullptr;
+    }
+}
+
+
+//取出下一段要发送的数据
+//队首响应还有头部时, 从队首开始把连续的多个响应头部合并到iov中, 直到遇到带文件内容的响应或者不保持连接的响应,
+//返回iov数量; 最后一个响应带文件内容时more为true, file、offset、length是它的文件内容
+//队首响应只剩文件内容时返回0, file、offset、length是队首响应还没有发送的文件内容
+int http_conn::next_send(struct iovec* iov, bool* more, int* file, off_t* offset, off_t* length) const
+{
+    *more = false;
+    const response& r = m_state->responses[m_response_head];
+    if(r.header_bytes == 0)
+    {
+        *file = r.file->fd;
+        *offset = r.file_offset;
+        *length = r.file_remaining;
+        return 0;
+    }
+
+    int bytes = 0;
+    for(int i = 0; i < m_response_count; ++i)
+    {
+        const response& next = m_state->responses[(m_response_head + i) % MAX_PIPELINE];
+        bytes += next.header_bytes;
+        if(next.file_remaining > 0)
+        {
+            *more = true;
+            *file = next.file->fd;
+            *offset = next.file_offset;
+            *length = next.file_remaining;
+            break;
+        }
+        if(!next.linger)
+        {
+            break;
+        }
+    }
+    int iovcnt = m_write_buf.peek(iov, MAX_IOV, bytes);
+
+    //头部分散在太多的块中, 一次发不完时文件内容不能紧跟在后面
+    if(*more)
+    {
+        int total = 0;
+        for(int i = 0; i < iovcnt; ++i)
+        {
+            total += iov[i].iov_len;
+        }
+        *more = total == bytes;
+    }
+    return iovcnt;
+}
+
+//记录发送出去的bytes字节: 队首响应还有头部时是写缓冲区中的头部(可能跨多个响应), 否则是队首响应的文件内容
+//发完的响应出队并释放文件; 发完不保持连接的响应时返回false, 调用者应该关闭连接
+bool http_conn::sent(int bytes)
+{
+    metrics::add(METRIC_BYTES_SENT, bytes);
+    response& head = m_state->responses[m_response_head];
+    if(head.header_bytes == 0)
+    {
+        head.file_offset += bytes;
+        head.file_remaining -= bytes;
+        if(head.file_remaining == 0)
+        {
+            bool linger = head.linger;
+            finish_response();
+            return linger;
+        }
+        return true;
+    }
 
+    //丢弃已经发送的数据, 按顺序记到各个响应上
+    m_write_buf.drain(bytes);
+    uint64_t now = metrics::now_ns();
+    while(bytes > 0)
+    {
+        response& r = m_state->responses[m_response_head];
+        if(r.start_ns)
+        {
+            metrics::record(METRIC_TTFB, now - r.start_ns);
+            r.start_ns = 0;
+        }
+        int n = bytes < r.header_bytes ? bytes : r.header_bytes;
+        r.header_bytes -= n;
+        bytes -= n;
+        if(r.header_bytes == 0 && r.file_remaining == 0)
+        {
+            bool linger = r.linger;
+            finish_response();
+            if(!linger)
+            {
+                return false;
+            }
+        }
+    }
     return true;
+}
+
+//写HTTP响应
+//按请求顺序发送排队的响应, 连续的多个响应头部合并成一次sendmsg, 遇到文件内容时用sendfile
+bool http_conn::write()
+{
+    while(m_response_count > 0)
+    {
+        struct iovec iov[MAX_IOV];
+        bool more;
+        int file;
+        off_t offset;
+        off_t length;
+        int iovcnt = next_send(iov, &more, &file, &offset, &length);
+
+        int ret;
+        if(iovcnt > 0)
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            //后面还有文件内容时带上MSG_MORE, 让头部和文件开头合并到同一个TCP报文段中
+            ret = sendmsg(m_sockfd, &msg, more ? MSG_MORE : 0);
+        }
+        else
+        {
+            //文件内容用sendfile直接从文件描述符发送, 不经过用户态
+            ret = sendfile(m_sockfd, file, &offset, length);
+            if(ret == 0)
+            {
+                //文件在发送过程中被截断, 已经无法发送完声明的Content-Length
+                unmap();
+                return false;
+            }
+        }
+        metrics::add(METRIC_SYSCALLS);
 
+        if(ret < 0)
+        {
+            //如果TCP写缓存没有空间, 则等待下一轮EPOLLOUT事件, 未发送的数据还留在写缓冲区中
+            if(errno == EAGAIN)
+            {
+                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                return true;
+            }
+            //发生其他错误, 返回false并释放文件
+            unmap();
+            return false;
+        }
 
+        if(!sent(ret))
+        {
+            //不需要保持连接
+            unmap();
+            return false;
+        }
+    }
 
+    //所有响应都已经发完
+    //读缓冲区中还有没处理的流水线请求时由reactor继续处理, 不重新注册EPOLLIN
+    if(!has_pending_request())
+    {
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    }
+    return true;
+}
+
+
+bool http_conn::add_response(const char* format, ...)
+{
+    //获得可变参数中第一个参数的地址
+    va_list arg_list;
+    va_start(arg_list, format);
+
+    //写缓冲区空间不够时自动增长, 超过上限时失败
+    bool ret = m_write_buf.vappend(format, arg_list);
+    va_end(arg_list);
+
+    return ret;
 }
 
 //添加响应状态行
@@ -636,10 +1381,8 @@ bool http_conn::add_status_line(int status, const char* title)
 //添加响应头部
 bool http_conn::add_headers(int content_len) 
 {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
+    return add_content_length(content_len) && add_content_type()
+        && add_linger() && add_blank_line();
 }
 
 bool http_conn::add_content_length(int content_len) 
@@ -657,13 +1400,77 @@ bool http_conn::add_blank_line()
     return add_response( "%s", "\r\n" );
 }
 
+//multipart/byteranges响应: 先算出所有部分头部的总长度得到Content-Length,
+//再依次写入每个部分的头部, 记下每个部分头部结束的位置, 文件内容由sendfile在这些位置之间发送
+bool http_conn::add_byteranges()
+{
+    const char* part_format = "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n";
+    const char* close_format = "\r\n--%s--\r\n";
+    const char* part_type = m_content_type;
+    long total = snprintf(nullptr, 0, close_format, byteranges_boundary);
+    for(int i = 0; i < m_range_count; ++i)
+    {
+        const byte_range& r = m_state->ranges[i];
+        total += snprintf(nullptr, 0, part_format, byteranges_boundary, part_type,
+            (long)r.start, (long)(r.start + r.length - 1), (long)m_file->st.st_size);
+        total += r.length;
+    }
+
+    char content_type[64];
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", byteranges_boundary);
+    m_content_type = content_type;
+    bool ret = add_headers(total);
+    m_content_type = part_type;
+    if(!ret)
+    {
+        return false;
+    }
+
+    for(int i = 0; i < m_range_count; ++i)
+    {
+        const byte_range& r = m_state->ranges[i];
+        if(!add_response(part_format, byteranges_boundary, part_type,
+            (long)r.start, (long)(r.start + r.length - 1), (long)m_file->st.st_size))
+        {
+            return false;
+        }
+        m_state->part_end[i] = m_write_buf.size();
+    }
+    return add_response(close_format, byteranges_boundary);
+}
+
+bool http_conn::add_file_headers()
+{
+    //找最长匹配的路径前缀
+    const char* url = view_data(m_url);
+    const char* cache_control = nullptr;
+    int matched = -1;
+    for(size_t i = 0; i < sizeof(cache_control_rules) / sizeof(cache_control_rules[0]); ++i)
+    {
+        int len = strlen(cache_control_rules[i].prefix);
+        if(len > matched && len <= m_url.len && memcmp(url, cache_control_rules[i].prefix, len) == 0)
+        {
+            cache_control = cache_control_rules[i].value;
+            matched = len;
+        }
+    }
+
+    //压缩的响应不支持Range
+    return add_response("ETag: %s\r\nLast-Modified: %s\r\n", m_file->etag, m_file->last_modified)
+        && (m_content_encoding != nullptr || add_response("Accept-Ranges: bytes\r\n"))
+        && (cache_control == nullptr || add_response("Cache-Control: %s\r\n", cache_control))
+        && (m_content_encoding == nullptr || add_response("Content-Encoding: %s\r\n", m_content_encoding))
+        && (!m_vary || add_response("Vary: Accept-Encoding\r\n"));
+}
+
+//HEAD请求的响应只有头部, Content-Length仍然是GET时正文的长度
 bool http_conn::add_content( const char* content )
 {
-    return add_response( "%s", content );
+    return m_method == HEAD || add_response( "%s", content );
 }
 
 bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    return add_response("Content-Type:%s\r\n", m_content_type);
 }
 
 
@@ -714,23 +1521,64 @@ bool http_conn::process_write(HTTP_CODE ret)
             }
             break;
         case FILE_REQUEST:
-            add_status_line(200, ok_200_title);
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_bytes;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
+            //文件内容不拷贝到用户态, 发送时直接从文件描述符sendfile
+            return add_status_line(200, ok_200_title) && add_file_headers()
+                && add_headers(m_file->st.st_size);
+        case PARTIAL_CONTENT:
+            if(!add_status_line(206, partial_206_title) || !add_file_headers())
+            {
+                return false;
+            }
+            if(m_range_count == 1)
+            {
+                const byte_range& r = m_state->ranges[0];
+                return add_response("Content-Range: bytes %ld-%ld/%ld\r\n",
+                    (long)r.start, (long)(r.start + r.length - 1), (long)m_file->st.st_size)
+                    && add_headers(r.length);
+            }
+            return add_byteranges();
+        case RANGE_NOT_SATISFIABLE:
+            if(!add_status_line(416, error_416_title)
+                || !add_response("Content-Range: bytes */%ld\r\n", (long)m_file->st.st_size)
+                || !add_headers(strlen(error_416_form)) || !add_content(error_416_form))
+            {
+                return false;
+            }
+            break;
+        case NOT_MODIFIED:
+            //304响应没有正文, 也不发送Content-Length
+            return add_status_line(304, not_modified_304_title) && add_file_headers()
+                && add_linger() && add_blank_line();
+        case METHOD_NOT_ALLOWED:
+        {
+            //Allow列出这个路径上的路由支持的方法
+            add_status_line(405, error_405_title);
+            add_response("Allow: ");
+            const char* separator = "";
+            for(int i = 0; i < METHOD_NUMBER; ++i)
+            {
+                if(m_allowed & ROUTE_METHOD(i))
+                {
+                    add_response("%s%s", separator, method_names[i]);
+                    separator = ", ";
+                }
+            }
+            add_response("\r\n");
+            add_headers(strlen(error_405_form));
+            if(!add_content(error_405_form))
+            {
+                return false;
+            }
+            break;
+        }
+        case HANDLED_REQUEST:
+            //处理函数已经写好了整个响应
             return true;
         default:
             return false;
     }
     
-    //执行到这里说明是发生错误，要发送错误相关信息
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_bytes;
-    m_iv_count = 1;
-
+    //执行到这里说明是发生错误，要发送错误相关信息, 错误页面已经全部写在写缓冲区中
     return true;
     
 }
@@ -738,29 +1586,142 @@ bool http_conn::process_write(HTTP_CODE ret)
 
 
 
+void http_conn::push_response(int header_bytes, file_entry* file, off_t offset, off_t length, bool linger, bool first)
+{
+    response& r = m_state->responses[(m_response_head + m_response_count) % MAX_PIPELINE];
+    r.header_bytes = header_bytes;
+    r.file = file;
+    //资源包中的文件从资源包的描述符中间开始发送
+    r.file_offset = file ? file->base + offset : offset;
+    r.file_remaining = length;
+    r.linger = linger;
+    r.start_ns = first ? m_request_start : 0;
+    ++m_response_count;
+}
+
+//before是process_write之前写缓冲区的大小, 之后写入的都属于这个响应
+void http_conn::queue_response(HTTP_CODE ret, int before)
+{
+    if(ret == PARTIAL_CONTENT && m_range_count > 1)
+    {
+        //multipart响应拆成多段: 每段是一个部分的头部加上这个范围的文件内容, 最后一段是结束分隔符
+        //中间的段不能关闭连接, 每段各持有一个文件引用
+        int mark = before;
+        for(int i = 0; i < m_range_count; ++i)
+        {
+            m_file_cache.retain(m_file);
+            push_response(m_state->part_end[i] - mark, m_file, m_state->ranges[i].start, m_state->ranges[i].length, true, i == 0);
+            mark = m_state->part_end[i];
+        }
+        push_response(m_write_buf.size() - mark, nullptr, 0, 0, m_linger, false);
+        m_file_cache.release(m_file);
+    }
+    else
+    {
+        off_t offset = 0;
+        off_t length = 0;
+        if(m_method == HEAD && m_file)
+        {
+            //HEAD请求不发送文件内容, 头部中已经有文件的长度
+            m_file_cache.release(m_file);
+            m_file = nullptr;
+        }
+        else if(ret == FILE_REQUEST)
+        {
+            length = m_file->st.st_size;
+        }
+        else if(ret == PARTIAL_CONTENT)
+        {
+            offset = m_state->ranges[0].start;
+            length = m_state->ranges[0].length;
+        }
+        push_response(m_write_buf.size() - before, m_file, offset, length, m_linger, true);
+    }
+    m_file = nullptr;
+}
+
+//解析读缓冲区中所有完整的请求, 响应按请求顺序加入发送队列
+//返回false表示生成响应失败, 调用者应该关闭连接
+bool http_conn::process_requests()
+{
+    if(m_queued_ns)
+    {
+        //排队时间同时交给过载保护判断线程池是否处理不过来
+        uint64_t now = metrics::now_ns();
+        metrics::record(METRIC_QUEUE_WAIT, now - m_queued_ns);
+        overload::record(now - m_queued_ns, now);
+        m_queued_ns = 0;
+    }
+
+    //依次处理读缓冲区中所有完整的请求, 响应按请求顺序排队
+    //一个请求最多占用MAX_RANGES + 1个队列位置(multipart响应)
+    while(m_response_count + MAX_RANGES + 1 <= MAX_PIPELINE)
+    {
+        //路由的处理函数在解析时就把响应写进写缓冲区, 在这之后写入的都属于这个请求的响应
+        int before = m_write_buf.size();
+
+        //解析HTTP请求
+        uint64_t parse_start = metrics::now_ns();
+        HTTP_CODE read_ret = process_read();
+        if(read_ret == NO_REQUEST)
+        {
+            break;
+        }
+        metrics::record(METRIC_PARSE_TIME, metrics::now_ns() - parse_start);
+        metrics::add(METRIC_REQUESTS);
+
+        if(read_ret == PROXY_REQUEST)
+        {
+            //请求留在读缓冲区中, 前面的响应都发完后由reactor转发给后端, 转发完再处理后面的请求
+            break;
+        }
+
+        //响应要加入队列, 队列从内存池申请
+        if(!acquire_state())
+        {
+            return false;
+        }
+
+        //准备好响应数据, 追加到写缓冲区末尾
+        bool write_ret = process_write(read_ret);
+        if(!write_ret)
+        {
+            return false;
+        }
+
+        //加入响应队列, 文件的引用转移给响应
+        queue_response(read_ret, before);
+
+        if(!m_linger)
+        {
+            //这个响应之后就关闭连接, 后面的请求不再处理
+            m_read_buf.clear();
+            init_request();
+            break;
+        }
+
+        //丢弃已经处理完的请求, 继续解析缓冲区中的下一个请求
+        finish_request();
+    }
+    return true;
+}
+
 //任务处理函数
 void http_conn::process()
 {
-    //解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if(read_ret == NO_REQUEST)
+    if(!process_requests())
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        close_conn();
         return;
     }
 
-    //准备好响应数据
-    bool write_ret = process_write(read_ret);
-    if(!write_ret)
+    if(m_response_count == 0 && !proxy_pending())
     {
-        close_conn();
-        
+        //请求还不完整, 继续读取
+        modfd(m_epollfd, m_sockfd, EPOLLIN);
         return;
-
     }
-    
-    //如果process_write成功, 注册监听可写事件以及重新注册EPOLLONESHOT
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
-
 
-}
\ No newline at end of file
+    //如果有响应要发送或者有请求要转发, 注册监听可写事件以及重新注册EPOLLONESHOT
+    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+}
@@ -8,27 +8,50 @@
 #include <string.h>
 #include <errno.h>
 #include <cstdlib>
-#include <sys/mman.h>
-#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <stdarg.h>
 #include <cstdio>
+#include <atomic>
 #include "lst_timer.h"
+#include "file_cache.h"
+#include "compress_cache.h"
+#include "buffer.h"
+#include "http_scan.h"
+#include "metrics.h"
 #include <unistd.h>
 
+struct upstream_conn;
+
 //任务类
 class http_conn
 {
 public:
     static const int FILENAME_LEN = 200;            //请求文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;       //读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024;      //写缓冲区的大小
+    static const int READ_BUFFER_SIZE = 2048;       //读缓冲区第一个块的大小, 常见的请求只用这一块
+    static const int WRITE_BUFFER_SIZE = 1024;      //写缓冲区第一个块的大小
+    static const int READ_BUFFER_LIMIT = 64 * 1024; //读缓冲区总大小上限的默认值, 运行时使用config中的设置
+    static const int WRITE_BUFFER_LIMIT = 1024 * 1024;  //写缓冲区总大小上限的默认值
+    static const int MAX_IOV = 16;                  //一次writev最多发送的缓冲区块数
+    static const int MAX_PIPELINE = 24;             //一个连接上最多排队等待发送的响应数量
+    static const int MAX_RANGES = 8;                //一个Range请求最多支持的范围数量, 超过时返回整个文件
+
+    /*
+        连接当前等待的超时类型
+        TIMEOUT_HEADER      :   等待客户端发完请求头
+        TIMEOUT_KEEPALIVE   :   长连接空闲, 等待下一个请求
+        TIMEOUT_WRITE       :   等待socket可写, 发送被阻塞
+        TIMEOUT_UPSTREAM    :   等待反向代理的后端
+    */
+    enum TIMEOUT_TYPE {TIMEOUT_HEADER = 0, TIMEOUT_KEEPALIVE, TIMEOUT_WRITE, TIMEOUT_UPSTREAM};
 
-    static sort_timer_list<http_conn> timerList;   //共享的定时器链表
-    timer_node<http_conn>* timer;                   //自己拥有的定时器
+    timer_node<http_conn> timer;                    //自己拥有的定时器, 挂在接受该连接的reactor的时间轮上
+    TIMEOUT_TYPE timeout_type;                      //定时器当前的超时类型
+    upstream_conn* upstream;                        //正在为这个连接转发请求的后端连接, 没有时为nullptr
+    bool in_pool;                                   //已经交给线程池, 工作线程modfd交回之前不能关闭; 只在reactor线程中读写
 
 
     //HTTP请求方法
-    enum METHOD {GET= 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
+    enum METHOD {GET= 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, METHOD_NUMBER};
 
     /*
         解析客户端请求时，主状态机的状态
@@ -46,55 +69,93 @@ public:
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
-        CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        CLOSED_CONNECTION   :   表示连接只能关闭了, 例如处理函数的响应写了一半时写缓冲区满了
+        HANDLED_REQUEST     :   路由的处理函数已经把响应写进了写缓冲区
+        METHOD_NOT_ALLOWED  :   路径存在, 但是没有这个方法的路由
+        NOT_MODIFIED        :   条件请求中的缓存仍然有效, 只返回头部
+        PARTIAL_CONTENT     :   Range请求, 返回文件的一个或多个范围
+        RANGE_NOT_SATISFIABLE:  Range请求的范围都超出了文件
+        PROXY_REQUEST       :   请求要转发给反向代理的后端, 留在读缓冲区中由reactor转发
     */
-    enum HTTP_CODE {NO_REQUEST = 0, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION};
+    enum HTTP_CODE {NO_REQUEST = 0, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, HANDLED_REQUEST, NOT_MODIFIED,
+        PARTIAL_CONTENT, RANGE_NOT_SATISFIABLE, METHOD_NOT_ALLOWED, PROXY_REQUEST};
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
     enum LINE_STATUS {LINE_OK = 0, LINE_BAD, LINE_OPEN};
 public:
-    http_conn(){}
-    ~http_conn(){}
+    //没有自定义的构造和析构函数, 连接表可以直接使用清零的内存
+    //缓冲区和响应队列在处理请求时才从内存池申请, 连接空闲时归还, 在close_conn中释放
 public:
-    void init(int sockfd, const sockaddr_in& addr);                         //初始化新接受的连接
+    void init(int sockfd, const sockaddr_in& addr, int epollfd);            //初始化新接受的连接, epollfd为所属reactor的epoll对象
     void close_conn();                                                      //关闭连接
     void process();                                                         //处理客户端请求
     bool read();                                                            //非阻塞读
     bool write();                                                           // 非阻塞写
-    void shut()
-    {
-        if(m_sockfd != -1)
-        {
-            printf("time out\n");
-            //从epoll中移除监听事件
-            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_sockfd, 0);
-            //标记已经删除过
-            //关闭socket
-            --m_user_count;
-            shutdown(m_sockfd, SHUT_RDWR);
-            m_sockfd = -1;
-        }
-    }
+
+    //以下函数供自己提交读写操作的后端(io_uring)使用, epoll后端用上面的process、read和write
+    bool process_requests();                                                //解析并处理缓冲区中的请求, 不注册事件, 返回false时应关闭连接
+    bool append_read(const char* data, int len);                            //追加后端读到的数据
+    int next_send(struct iovec* iov, bool* more, int* file, off_t* offset, off_t* length) const;   //下一段要发送的头部或者文件内容
+    bool sent(int bytes);                                                   //记录发送了bytes字节, 返回false时应关闭连接
+    bool is_writing() const {return m_response_count > 0;}                  //是否还有响应数据没有发完
+    bool has_pending_request() const {return !m_read_buf.empty();}          //读缓冲区中是否还有没处理的请求数据
+    void set_queued(uint64_t ns) {m_queued_ns = ns;}                        //记录交给线程池的时间, 用来统计排队时间
+    bool is_open() const {return timer.task && m_sockfd != -1;}             //连接是否打开, 清零的表项还没有初始化过
+    int sockfd() const {return m_sockfd;}
+
+    //以下函数供路由的处理函数使用, 返回的指针指向读缓冲区, 只在处理函数执行期间有效
+    METHOD method() const {return m_method;}                                //请求方法
+    const char* url(int* len) const {*len = m_url.len; return view_data(m_url);}      //请求的URL, 包括查询字符串
+    const char* header(const char* name, int* len) const;                   //按名字(不区分大小写)查找请求头部的值, 没有时返回nullptr
+    const char* body(int* len) const {*len = m_body.len; return view_data(m_body);}   //请求数据
+    //把完整的响应写进写缓冲区, headers是额外的头部行(每行以\r\n结尾), 可以为nullptr; 处理函数直接返回它的结果
+    HTTP_CODE reply(int status, const char* title, const char* content_type, const char* body, int len, const char* headers = nullptr);
+    static HTTP_CODE serve_file(http_conn* conn) {return conn->do_file_request();}    //静态文件的处理函数, 先查资源包, 再在资源目录下查找URL对应的文件
+    static const char* mime_type(const char* path, int len, bool* compressible);     //按扩展名确定Content-Type, *compressible表示是否值得压缩
+    HTTP_CODE proxy(int group);                                             //把请求转发给第group条转发规则的后端, 处理函数直接返回它的结果
+
+    //以下函数供反向代理(upstream_pool)使用
+    int proxy_group() const {return m_proxy_group;}                         //当前请求的转发规则
+    bool proxy_pending() const {return m_proxy_group >= 0 && upstream == nullptr;}  //是否有请求等待开始转发
+    const char* request(int* len) const {*len = m_request_bytes; return m_read_base;}  //当前请求的原始数据, 包括请求数据
+    bool linger() const {return m_linger;}                                  //当前请求是否要求保持连接
+    void finish_proxy() {finish_request();}                                 //转发完毕, 丢弃读缓冲区中的请求
 private:
     void init();                                                            //初始化类自身的数据
+    void init_request();                                                    //初始化解析一个请求用到的数据, 不清空读缓冲区
+    void finish_request();                                                  //丢弃已经处理完的请求, 为解析下一个请求做准备
+    void finish_response();                                                 //队首的响应发送完毕, 释放它引用的文件
+    void queue_response(HTTP_CODE ret, int before);                         //把process_write生成的响应加入发送队列
+    void push_response(int header_bytes, file_entry* file, off_t offset, off_t length, bool linger, bool first);
+    bool acquire_state();                                                   //从内存池申请响应队列和Range解析结果, 失败返回false
+    void release_state();                                                   //响应都发完后归还
 
 
     HTTP_CODE process_read();                                               //解析HTTP请求
     bool process_write(HTTP_CODE ret);                                      //填充HTTP应答
 
     // 下面这一组函数被process_read调用以解析HTTP请求
-    HTTP_CODE parse_request_line(char* text);                               //解析请求行
-    HTTP_CODE parse_headers(char* text);                                    //解析请求头部
-    HTTP_CODE parse_content(char* text);                                    //解析请求数据
-    char* get_line() {return m_read_buf + m_start_line;}                    //返回新的一行的开头
+    HTTP_CODE parse_request_line(const char* text, int len);                //解析请求行
+    HTTP_CODE parse_headers(const char* text, int len);                     //解析请求头部
+    HTTP_CODE parse_content();                                              //解析请求数据
+    char* get_line() {return m_read_base + m_start_line;}                   //返回新的一行的开头
     LINE_STATUS parse_line();                                               //从读缓冲区中获取完整的一行数据
+    http_view make_view(const char* p, int len) const {return http_view{(int)(p - m_read_base), len};}
+    const char* view_data(const http_view& v) const {return m_read_base + v.offset;}
 
 
-    HTTP_CODE do_request();                                                 //响应GET请求的网页文件
+    HTTP_CODE do_request();                                                 //按路由表找到处理函数并调用
+    HTTP_CODE do_file_request();                                            //响应GET请求的网页文件
+    HTTP_CODE open_file();                                                  //在资源目录下打开请求的文件
+    bool set_content_type();                                                //按扩展名设置Content-Type, 返回是否可以压缩
+    static int parse_accept_encoding(const char* value, int len);           //解析Accept-Encoding, 返回接受的编码
+    bool not_modified() const;                                              //根据条件请求头部判断客户端缓存的文件是否仍然有效
+    bool if_range_matches() const;                                          //If-Range为空或者和文件匹配时才处理Range
+    int parse_ranges(off_t size);                                           //解析Range, 返回满足的范围数量, 语法错误或者范围太多时返回-1
 
     // 这一组函数被process_write调用以填充HTTP应答。
-    void unmap();                                                           //解除文件映射
+    void unmap();                                                           //释放所有响应对缓存文件的引用
     bool add_response(const char* format, ...);                             //往写缓冲中写入要发送的数据
 
     bool add_content(const char* content);                                  //写入响应正文
@@ -105,39 +166,89 @@ private:
         bool add_content_length(int content_length);                        //写入响应头部中的 content_length
         bool add_linger();                                                  //写入响应头部中的Connection
         bool add_blank_line();                                              //写入空行
+    bool add_file_headers();                                                //写入ETag、Last-Modified、Cache-Control和压缩相关的头部
+    bool add_byteranges();                                                  //写入multipart/byteranges响应的头部和各部分的分隔
 
 public:
-    static int m_epollfd;                   //所有用户共享的epoll对象
-    static int m_user_count;                //统计任务数量, 一个任务就是一个用户
+    static std::atomic<int> m_user_count;   //统计任务数量, 一个任务就是一个用户, 所有reactor共享
+    static file_cache m_file_cache;         //所有连接共享的文件缓存
+    static compress_cache m_compress_cache; //所有连接共享的压缩内容缓存, 必须定义在m_file_cache之后
+    static const char* m_doc_root;          //资源目录, 请求的URL拼接在它后面
+    static std::atomic<bool> m_draining;    //服务器正在优雅退出, 之后的响应都带Connection: close, 发完后关闭连接
 
 private:
+    int m_epollfd;                          //该任务所属reactor的epoll对象
     int m_sockfd;                           //该任务的socket文件描述符
     sockaddr_in m_address;                  //该任务的TCP通信socket地址
     
 
-    char m_read_buf[READ_BUFFER_SIZE];      //该用户的读缓冲区
+    chain_buffer m_read_buf;                //该用户的读缓冲区, 有数据时才持有内存, 按需增长
+    char* m_read_base;                      //读缓冲区合并成连续内存后的起始位置, 解析时使用
     int m_read_bytes;                       //读缓冲区等待读取的字节数
     int m_checked_idx;                      //正在分析的字符在读缓冲区中的下标 
     int m_start_line;                       //当前正在解析的行的起始位置
+    int m_line_end;                         //当前行的结束位置, 不包括行尾的\r\n
 
     CHECK_STATE m_check_state;              //主状态机当前所处状态
     METHOD m_method;                        //请求状态
 
-    char m_real_file[FILENAME_LEN];         // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
-    char* m_url;                            // 客户请求的目标文件的文件名
-    char* m_version;                        // HTTP协议版本号，我们仅支持HTTP1.1
-    char* m_host;                           // 主机名
+    http_view m_url;                        // 客户请求的目标文件的文件名
+    http_view m_version;                    // HTTP协议版本号，我们仅支持HTTP1.1
+    http_view m_host;                       // 主机名
+    http_view m_if_none_match;              // If-None-Match头部的值
+    http_view m_if_modified_since;          // If-Modified-Since头部的值
+    http_view m_range;                      // Range头部的值
+    http_view m_if_range;                   // If-Range头部的值
     int m_content_length;                   // HTTP请求数据段总长度(可能被压缩)
+    http_view m_body;                       // 请求数据
+    int m_allowed;                          // 405响应的Allow头部: 请求的路径上支持的方法
+    int m_proxy_group;                      // 请求匹配的转发规则, 不转发时为-1
     bool m_linger;                          // HTTP请求是否要求保持连接
+    const char* m_content_type;             // 响应的Content-Type
+    int m_accept_encoding;                  // 客户端接受的压缩编码(ENCODING_*的组合)
+    const char* m_content_encoding;         // 响应的Content-Encoding, 发送原始文件时为nullptr
+    bool m_vary;                            // 响应内容是否随Accept-Encoding变化
+
+    int m_request_bytes;                    // 当前请求(包括请求数据)在读缓冲区中占用的字节数
+    uint64_t m_request_start;               // 读到当前请求第一个字节的时间, 用来统计首字节时间
+    uint64_t m_queued_ns;                   // 交给线程池的时间, 不经过线程池时为0
 
-    char m_write_buf[WRITE_BUFFER_SIZE];    // 写缓冲区
-    int m_write_bytes;                      // 写缓冲区中待发送的字节数
-    char* m_file_address;                   // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat;                // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
+    chain_buffer m_write_buf;               // 写缓冲区, 按请求顺序存放所有排队响应的头部, 发送出去的数据从开头丢弃
+    file_entry* m_file;                     // 当前请求的目标文件在文件缓存中的引用, 文件的状态(大小、修改时间)从这里读取
+
+    // 请求的文件范围
+    struct byte_range
+    {
+        off_t start;                        // 第一个字节的偏移
+        off_t length;                       // 字节数
+    };
+    int m_range_count;
 
 
-    struct iovec m_iv[2];                   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
+    // 一个排队等待发送的响应
+    // 响应头部在写缓冲区中用sendmsg发送, 文件内容用sendfile直接从文件描述符发送, 不经过用户态
+    // 发送进度记录在这里, 发送被阻塞后在下一次EPOLLOUT时从断点继续
+    struct response
+    {
+        int header_bytes;                   // 写缓冲区中属于这个响应还没有发送的字节数
+        file_entry* file;                   // 响应的文件内容, 没有时为nullptr
+        off_t file_offset;                  // 文件中下一个要发送的字节的偏移
+        off_t file_remaining;               // 文件中还没有发送的字节数
+        bool linger;                        // 发送完后是否保持连接
+        uint64_t start_ns;                  // 请求开始的时间, 发出第一个字节后清零
+    };
+
+    // 只在处理请求和发送响应期间需要的数据, 从内存池申请, 空闲的长连接不持有
+    struct request_state
+    {
+        // 流水线请求的响应按请求顺序排队, 多个响应的头部合并成一次sendmsg发送
+        response responses[MAX_PIPELINE];   // 环形队列
+        byte_range ranges[MAX_RANGES];      // Range请求解析出的范围
+        int part_end[MAX_RANGES];           // multipart响应中每个部分的头部写完后写缓冲区的大小
+    };
+    request_state* m_state;                 // 没有排队的响应时为nullptr
+    int m_response_head;                    // 响应队列的队首下标
+    int m_response_count;                   // 队列中的响应数量
 
 };
 
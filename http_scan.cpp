@@ -0,0 +1,119 @@
+#include "http_scan.h"
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+
+typedef int (*scan_func)(const char* buf, int len, const char* set, int set_len);
+
+//逐字节比较, 也用来处理向量实现剩下的不足一个向量的尾部
+int scan_scalar(const char* buf, int len, const char* set, int set_len)
+{
+    for(int i = 0; i < len; ++i)
+    {
+        for(int k = 0; k < set_len; ++k)
+        {
+            if(buf[i] == set[k])
+            {
+                return i;
+            }
+        }
+    }
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//每个字符广播成一个向量分别比较, 结果按位或后用movemask取出命中的位置
+__attribute__((target("avx2")))
+int scan_avx2(const char* buf, int len, const char* set, int set_len)
+{
+    __m256i chars[HTTP_SCAN_MAX_SET];
+    for(int k = 0; k < set_len; ++k)
+    {
+        chars[k] = _mm256_set1_epi8(set[k]);
+    }
+
+    int i = 0;
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i));
+        __m256i hit = _mm256_cmpeq_epi8(data, chars[0]);
+        for(int k = 1; k < set_len; ++k)
+        {
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(data, chars[k]));
+        }
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if(mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_scalar(buf + i, len - i, set, set_len);
+}
+
+//pcmpestri一条指令就能在16字节中查找字符集合中的任意字符
+__attribute__((target("sse4.2")))
+int scan_sse42(const char* buf, int len, const char* set, int set_len)
+{
+    //set可能不足16字节, 复制出来再加载, 避免越界读
+    char padded[16] = {0};
+    memcpy(padded, set, set_len);
+    __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(padded));
+
+    int i = 0;
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+        int idx = _mm_cmpestri(chars, set_len, data, 16,
+            _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if(idx < 16)
+        {
+            return i + idx;
+        }
+    }
+    return i + scan_scalar(buf + i, len - i, set, set_len);
+}
+
+#endif
+
+struct scan_impl
+{
+    scan_func func;
+    const char* name;
+};
+
+scan_impl select_impl()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return scan_impl{scan_avx2, "avx2"};
+    }
+    if(__builtin_cpu_supports("sse4.2"))
+    {
+        return scan_impl{scan_sse42, "sse4.2"};
+    }
+#endif
+    return scan_impl{scan_scalar, "scalar"};
+}
+
+//程序启动时选择一次, 之后所有线程只读
+const scan_impl impl = select_impl();
+
+}
+
+
+int http_scan(const char* buf, int len, const char* set, int set_len)
+{
+    return impl.func(buf, len, set, set_len);
+}
+
+const char* http_scan_name()
+{
+    return impl.name;
+}
@@ -0,0 +1,28 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#define HTTP_SCAN_MAX_SET 4             //一次查找的字符集合最多包含的字符数
+
+
+//指向读缓冲区中一段数据的视图
+//用相对缓冲区开头的偏移表示, 缓冲区合并移动以后仍然有效, 也不需要往缓冲区里写'\0'
+struct http_view
+{
+    int offset;                 //相对缓冲区开头的偏移
+    int len;                    //长度
+};
+
+
+/*
+    HTTP报文扫描
+    在buf的前len个字节中查找第一个属于set的字符, 返回它的下标, 找不到时返回len
+    set最多HTTP_SCAN_MAX_SET个字符, 用来找行尾("\r\n")、冒号和空格等分隔符
+    启动时根据CPU支持的指令集选择实现: AVX2每次比较32字节, SSE4.2每次比较16字节,
+    都不支持时逐字节比较
+*/
+int http_scan(const char* buf, int len, const char* set, int set_len);
+
+//当前使用的实现的名字: "avx2", "sse4.2"或者"scalar"
+const char* http_scan_name();
+
+#endif
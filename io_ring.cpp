@@ -0,0 +1,247 @@
+#include "io_ring.h"
+#include "metrics.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace
+{
+
+int sys_io_uring_setup(unsigned entries, io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+template<typename T>
+T* ring_field(void* ring, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+}
+
+
+io_ring::io_ring():
+        m_fd(-1), m_sq_ring(MAP_FAILED), m_sq_ring_size(0), m_cq_ring(MAP_FAILED), m_cq_ring_size(0),
+        m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), m_sqe_tail(0), m_buf_ring(nullptr), m_buf_mask(0),
+        m_buffers(nullptr), m_buffer_size(0), m_buf_count(0)
+{
+    memset(m_ops, 0, sizeof(m_ops));
+}
+
+io_ring::~io_ring()
+{
+    if(m_buf_ring)
+    {
+        munmap(m_buf_ring, m_buf_count * sizeof(io_uring_buf));
+    }
+    free(m_buffers);
+    if(m_sqes != MAP_FAILED)
+    {
+        munmap(m_sqes, m_sq_entries * sizeof(io_uring_sqe));
+    }
+    if(m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+    {
+        munmap(m_cq_ring, m_cq_ring_size);
+    }
+    if(m_sq_ring != MAP_FAILED)
+    {
+        munmap(m_sq_ring, m_sq_ring_size);
+    }
+    if(m_fd >= 0)
+    {
+        close(m_fd);
+    }
+}
+
+int io_ring::init(unsigned entries)
+{
+    //多次接收和多次accept会产生很多完成事件, 完成队列比提交队列大
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    m_fd = sys_io_uring_setup(entries, &p);
+    if(m_fd < 0)
+    {
+        return -errno;
+    }
+    m_sq_entries = p.sq_entries;
+    m_cq_entries = p.cq_entries;
+
+    m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        //两个队列在同一块映射中
+        if(m_cq_ring_size > m_sq_ring_size)
+        {
+            m_sq_ring_size = m_cq_ring_size;
+        }
+        m_cq_ring_size = m_sq_ring_size;
+    }
+    m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sq_ring == MAP_FAILED)
+    {
+        return -errno;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_cq_ring = m_sq_ring;
+    }
+    else
+    {
+        m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if(m_cq_ring == MAP_FAILED)
+        {
+            return -errno;
+        }
+    }
+    m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if(m_sqes == MAP_FAILED)
+    {
+        return -errno;
+    }
+
+    m_sq_head = ring_field<std::atomic<unsigned> >(m_sq_ring, p.sq_off.head);
+    m_sq_tail = ring_field<std::atomic<unsigned> >(m_sq_ring, p.sq_off.tail);
+    m_sq_mask = *ring_field<unsigned>(m_sq_ring, p.sq_off.ring_mask);
+    m_sq_array = ring_field<unsigned>(m_sq_ring, p.sq_off.array);
+    m_sqe_tail = m_sq_tail->load(std::memory_order_relaxed);
+    m_cq_head = ring_field<std::atomic<unsigned> >(m_cq_ring, p.cq_off.head);
+    m_cq_tail = ring_field<std::atomic<unsigned> >(m_cq_ring, p.cq_off.tail);
+    m_cq_mask = *ring_field<unsigned>(m_cq_ring, p.cq_off.ring_mask);
+    m_cqes = ring_field<io_uring_cqe>(m_cq_ring, p.cq_off.cqes);
+
+    //SQE和提交队列中的下标一一对应, 只需要填一次
+    for(unsigned i = 0; i < m_sq_entries; ++i)
+    {
+        m_sq_array[i] = i;
+    }
+
+    //查询内核支持的操作码
+    size_t probe_size = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+    io_uring_probe* probe = static_cast<io_uring_probe*>(calloc(1, probe_size));
+    if(sys_io_uring_register(m_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0)
+    {
+        for(int i = 0; i < probe->ops_len && i < IORING_OP_LAST; ++i)
+        {
+            m_ops[i] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    }
+    free(probe);
+    return 0;
+}
+
+bool io_ring::supports(int op) const
+{
+    return op >= 0 && op < IORING_OP_LAST && m_ops[op];
+}
+
+io_uring_sqe* io_ring::get_sqe()
+{
+    if(m_sqe_tail - m_sq_head->load(std::memory_order_acquire) >= m_sq_entries)
+    {
+        //提交队列满了, 先交给内核
+        submit_and_wait(0);
+        if(m_sqe_tail - m_sq_head->load(std::memory_order_acquire) >= m_sq_entries)
+        {
+            return nullptr;
+        }
+    }
+    io_uring_sqe* sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++m_sqe_tail;
+    return sqe;
+}
+
+void io_ring::reserve(unsigned count)
+{
+    if(m_sqe_tail - m_sq_head->load(std::memory_order_acquire) + count > m_sq_entries)
+    {
+        submit_and_wait(0);
+    }
+}
+
+int io_ring::submit_and_wait(unsigned wait_nr)
+{
+    unsigned to_submit = m_sqe_tail - m_sq_tail->load(std::memory_order_relaxed);
+    m_sq_tail->store(m_sqe_tail, std::memory_order_release);
+    if(to_submit == 0 && wait_nr == 0)
+    {
+        return 0;
+    }
+    int ret = sys_io_uring_enter(m_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+    metrics::add(METRIC_SYSCALLS);
+    return ret < 0 ? -errno : ret;
+}
+
+int io_ring::register_files(const int* fds, unsigned count)
+{
+    if(sys_io_uring_register(m_fd, IORING_REGISTER_FILES, fds, count) < 0)
+    {
+        return -errno;
+    }
+    return 0;
+}
+
+int io_ring::register_buffers(int group, unsigned count, unsigned size)
+{
+    //缓冲区环必须按页对齐
+    void* ring = mmap(nullptr, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED)
+    {
+        return -errno;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if(sys_io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int err = errno;
+        munmap(ring, count * sizeof(io_uring_buf));
+        return -err;
+    }
+    m_buf_ring = static_cast<io_uring_buf_ring*>(ring);
+    m_buf_mask = count - 1;
+    m_buf_count = count;
+    m_buffer_size = size;
+    m_buffers = static_cast<char*>(malloc((size_t)count * size));
+    if(m_buffers == nullptr)
+    {
+        return -ENOMEM;
+    }
+    for(unsigned i = 0; i < count; ++i)
+    {
+        add_buffer(i);
+    }
+    return 0;
+}
+
+void io_ring::add_buffer(unsigned id)
+{
+    //tail只由用户态修改, 填好缓冲区后再发布新的tail
+    //C++中头文件里的柔性数组bufs前面多了一个空结构体, 偏移不对, 所以直接把环当作io_uring_buf数组
+    unsigned short tail = m_buf_ring->tail;
+    io_uring_buf* buf = reinterpret_cast<io_uring_buf*>(m_buf_ring) + (tail & m_buf_mask);
+    buf->addr = reinterpret_cast<uint64_t>(buffer(id));
+    buf->len = m_buffer_size;
+    buf->bid = id;
+    __atomic_store_n(&m_buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
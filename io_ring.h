@@ -0,0 +1,83 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <linux/io_uring.h>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+    io_uring的最小封装, 直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用, 不依赖liburing
+    只在一个线程中使用: 取SQE、提交并等待、遍历CQE都不加锁
+*/
+class io_ring
+{
+public:
+    io_ring();
+    ~io_ring();
+
+    int init(unsigned entries);                         //创建io_uring并映射队列, 成功返回0, 失败返回-errno
+    bool supports(int op) const;                        //内核是否支持这个操作码
+
+    //取一个清零的SQE, 提交队列满时先把已有的提交给内核
+    io_uring_sqe* get_sqe();
+    //保证提交队列至少还有count个空位, 链接在一起的SQE必须在同一次提交中
+    void reserve(unsigned count);
+    //提交所有新的SQE, 至少等待wait_nr个完成事件, 返回提交的数量或者-errno
+    int submit_and_wait(unsigned wait_nr);
+
+    //依次处理所有已经完成的CQE, 处理完后归还给内核
+    template<typename F>
+    unsigned for_each_cqe(F f);
+
+    int register_files(const int* fds, unsigned count);                //注册固定文件表, fds中的-1为空位
+    //注册一组由内核选择的接收缓冲区(provided buffer ring), count必须是2的幂
+    //成功返回0, 缓冲区用add_buffer交给内核
+    int register_buffers(int group, unsigned count, unsigned size);
+    char* buffer(unsigned id) const {return m_buffers + (size_t)id * m_buffer_size;}
+    void add_buffer(unsigned id);                       //把用完的接收缓冲区还给内核
+
+private:
+    int m_fd;
+    unsigned m_sq_entries;
+    unsigned m_cq_entries;
+    void* m_sq_ring;                                    //提交队列的映射
+    size_t m_sq_ring_size;
+    void* m_cq_ring;                                    //完成队列的映射, 内核支持时和提交队列是同一块
+    size_t m_cq_ring_size;
+    io_uring_sqe* m_sqes;                               //SQE数组的映射
+    std::atomic<unsigned>* m_sq_head;                   //内核消费到的位置
+    std::atomic<unsigned>* m_sq_tail;                   //提交给内核的位置
+    unsigned* m_sq_array;
+    unsigned m_sq_mask;
+    unsigned m_sqe_tail;                                //本地已经填好的SQE位置, 提交时写入m_sq_tail
+    std::atomic<unsigned>* m_cq_head;
+    std::atomic<unsigned>* m_cq_tail;
+    unsigned m_cq_mask;
+    io_uring_cqe* m_cqes;
+    unsigned char m_ops[IORING_OP_LAST];                //内核支持的操作码
+
+    io_uring_buf_ring* m_buf_ring;                      //接收缓冲区环
+    unsigned m_buf_mask;
+    char* m_buffers;                                    //所有接收缓冲区的内存
+    unsigned m_buffer_size;
+    unsigned m_buf_count;
+};
+
+
+template<typename F>
+unsigned io_ring::for_each_cqe(F f)
+{
+    unsigned head = m_cq_head->load(std::memory_order_relaxed);
+    unsigned tail = m_cq_tail->load(std::memory_order_acquire);
+    unsigned count = tail - head;
+    for(; head != tail; ++head)
+    {
+        f(m_cqes[head & m_cq_mask]);
+    }
+    m_cq_head->store(head, std::memory_order_release);
+    return count;
+}
+
+#endif
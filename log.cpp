@@ -0,0 +1,358 @@
+#include "log.h"
+#include "mpmc_queue.h"
+#include <atomic>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+namespace
+{
+
+struct log_record
+{
+    int len;
+    char data[LOG_RECORD_SIZE - sizeof(int)];
+};
+
+//一个线程的日志队列, 只有这个线程写入, 只有后台线程读出
+struct log_ring
+{
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> head;   //下一条写入的位置, 写日志的线程修改
+    alignas(CACHE_LINE_SIZE) std::atomic<unsigned> tail;   //下一条读出的位置, 后台线程修改
+    std::atomic<bool> exited;                               //写日志的线程已经退出, 写出剩余的日志后由后台线程释放
+    log_ring* next;                                         //所有队列串成一个链表, 写日志的线程只在表头插入, 只有后台线程删除
+    log_record records[LOG_RING_RECORDS];
+};
+
+//线程退出时标记自己的队列, 线程池调整线程数量时退出的线程不会留下不再使用的队列
+struct ring_owner
+{
+    log_ring* ring;
+    ~ring_owner();
+};
+
+//每秒只格式化一次日期和时间
+struct time_cache
+{
+    time_t second;
+    char text[24];
+};
+
+const char* level_names[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+std::atomic<log_ring*> rings(nullptr);
+std::atomic<unsigned long long> dropped_count(0);
+std::atomic<int> min_level(LOG_LEVEL);
+std::atomic<bool> running(false);
+std::atomic<bool> stopping(false);
+std::atomic<bool> sleeping(false);             //后台线程所有队列都空了, 正在或者准备在wakeup_fd上休眠
+int wakeup_fd = -1;                             //唤醒后台线程的eventfd
+int output_fd = STDOUT_FILENO;
+pthread_t flusher;
+
+thread_local ring_owner local_ring = {nullptr};
+thread_local time_cache local_time = {0, {0}};
+
+//后台线程休眠时唤醒它; 它只在所有队列都空时休眠, 所以只有队列从空变成非空时才会有系统调用
+void wake_flusher()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false))
+    {
+        uint64_t one = 1;
+        ssize_t n = ::write(wakeup_fd, &one, sizeof(one));
+        (void)n;
+    }
+}
+
+ring_owner::~ring_owner()
+{
+    if(ring)
+    {
+        ring->exited.store(true, std::memory_order_release);
+        if(running.load(std::memory_order_relaxed))
+        {
+            wake_flusher();
+        }
+        ring = nullptr;
+    }
+}
+
+log_ring* get_ring()
+{
+    if(local_ring.ring)
+    {
+        return local_ring.ring;
+    }
+    log_ring* ring = new log_ring;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->exited.store(false, std::memory_order_relaxed);
+
+    //挂到链表头, 后台线程下一轮就能看到
+    log_ring* first = rings.load(std::memory_order_relaxed);
+    do
+    {
+        ring->next = first;
+    } while(!rings.compare_exchange_weak(first, ring, std::memory_order_release, std::memory_order_relaxed));
+    local_ring.ring = ring;
+    return ring;
+}
+
+//格式化"日期 时间.毫秒 级别 ", 返回长度
+int format_prefix(char* buf, int size, int level)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(now.tv_sec != local_time.second)
+    {
+        struct tm tm;
+        localtime_r(&now.tv_sec, &tm);
+        strftime(local_time.text, sizeof(local_time.text), "%Y-%m-%d %H:%M:%S", &tm);
+        local_time.second = now.tv_sec;
+    }
+    return snprintf(buf, size, "%s.%03ld %s ", local_time.text, now.tv_nsec / 1000000, level_names[level]);
+}
+
+void write_all(const char* data, int len)
+{
+    while(len > 0)
+    {
+        ssize_t n = ::write(output_fd, data, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+//从链表中删除并释放线程已经退出的队列, prev为它的前一个队列
+//在表头时要和插入新队列的线程竞争, 失败时留到下一轮; 不在表头时只有后台线程修改前一个队列的next
+bool unlink_ring(log_ring* prev, log_ring* ring)
+{
+    if(prev)
+    {
+        prev->next = ring->next;
+    }
+    else
+    {
+        log_ring* first = ring;
+        if(!rings.compare_exchange_strong(first, ring->next, std::memory_order_acq_rel))
+        {
+            return false;
+        }
+    }
+    delete ring;
+    return true;
+}
+
+//取出所有队列中的日志写出, 返回写出的条数
+int drain(char* batch, unsigned long long& reported)
+{
+    int count = 0;
+    int len = 0;
+    log_ring* prev = nullptr;
+    log_ring* next;
+    for(log_ring* ring = rings.load(std::memory_order_acquire); ring; ring = next)
+    {
+        next = ring->next;
+        //先读退出标记: 看到线程已经退出时, 之后读到的head就是最后一条日志的位置
+        bool exited = ring->exited.load(std::memory_order_acquire);
+        unsigned tail = ring->tail.load(std::memory_order_relaxed);
+        unsigned head = ring->head.load(std::memory_order_acquire);
+        for(; tail != head; ++tail)
+        {
+            const log_record& r = ring->records[tail & (LOG_RING_RECORDS - 1)];
+            if(len + r.len > LOG_BATCH_SIZE)
+            {
+                write_all(batch, len);
+                len = 0;
+            }
+            memcpy(batch + len, r.data, r.len);
+            len += r.len;
+            ++count;
+        }
+        //记录已经复制出来, 槽位可以重新使用
+        ring->tail.store(tail, std::memory_order_release);
+
+        if(!exited || !unlink_ring(prev, ring))
+        {
+            prev = ring;
+        }
+    }
+
+    unsigned long long dropped = dropped_count.load(std::memory_order_relaxed);
+    if(dropped != reported)
+    {
+        char line[LOG_RECORD_SIZE];
+        int n = format_prefix(line, sizeof(line), LOG_LEVEL_WARN);
+        n += snprintf(line + n, sizeof(line) - n, "log queue full, %llu records dropped\n", dropped - reported);
+        if(n >= (int)sizeof(line))
+        {
+            n = sizeof(line) - 1;
+        }
+        if(len + n > LOG_BATCH_SIZE)
+        {
+            write_all(batch, len);
+            len = 0;
+        }
+        memcpy(batch + len, line, n);
+        len += n;
+        reported = dropped;
+    }
+
+    if(len > 0)
+    {
+        write_all(batch, len);
+    }
+    return count;
+}
+
+//是否有队列中还有日志, 或者有已经退出、等待释放的队列
+bool pending()
+{
+    for(log_ring* ring = rings.load(std::memory_order_acquire); ring; ring = ring->next)
+    {
+        if(ring->exited.load(std::memory_order_relaxed)
+            || ring->head.load(std::memory_order_relaxed) != ring->tail.load(std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void* flush_thread(void*)
+{
+    //信号都由主线程的signalfd处理
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+    char* batch = new char[LOG_BATCH_SIZE];
+    unsigned long long reported = 0;
+    while(true)
+    {
+        bool stop = stopping.load(std::memory_order_acquire);
+        int count = drain(batch, reported);
+        if(stop)
+        {
+            break;
+        }
+        if(count == 0)
+        {
+            //登记休眠后再检查一次所有队列, 和写日志的线程"写入后检查休眠标记"配对, 不会错过登记前写入的日志
+            sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(pending() || stopping.load(std::memory_order_acquire))
+            {
+                sleeping.store(false);
+                continue;
+            }
+            uint64_t value;
+            ssize_t n = ::read(wakeup_fd, &value, sizeof(value));
+            (void)n;
+        }
+    }
+    delete [] batch;
+    return nullptr;
+}
+
+}
+
+
+bool logger::init(int fd)
+{
+    output_fd = fd;
+    stopping = false;
+    sleeping = false;
+    if(wakeup_fd < 0)
+    {
+        wakeup_fd = eventfd(0, EFD_CLOEXEC);
+        if(wakeup_fd < 0)
+        {
+            return false;
+        }
+    }
+    if(pthread_create(&flusher, nullptr, flush_thread, nullptr) != 0)
+    {
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+void logger::stop()
+{
+    if(!running.exchange(false))
+    {
+        return;
+    }
+    stopping.store(true, std::memory_order_release);
+    uint64_t one = 1;
+    ssize_t n = ::write(wakeup_fd, &one, sizeof(one));
+    (void)n;
+    pthread_join(flusher, nullptr);
+}
+
+void logger::set_level(int level)
+{
+    min_level.store(level, std::memory_order_relaxed);
+}
+
+void logger::append(int level, const char* format, ...)
+{
+    if(level < min_level.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    log_ring* ring = get_ring();
+    unsigned head = ring->head.load(std::memory_order_relaxed);
+    unsigned tail = ring->tail.load(std::memory_order_acquire);
+    if(head - tail == LOG_RING_RECORDS)
+    {
+        //后台线程来不及写出, 丢弃这条日志
+        dropped_count.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    log_record& r = ring->records[head & (LOG_RING_RECORDS - 1)];
+    int size = sizeof(r.data) - 1;      //留一个字节给换行
+    int len = format_prefix(r.data, size, level);
+    va_list arg_list;
+    va_start(arg_list, format);
+    int n = vsnprintf(r.data + len, size - len, format, arg_list);
+    va_end(arg_list);
+    if(n > 0)
+    {
+        len += n < size - len ? n : size - len - 1;
+    }
+    r.data[len++] = '\n';
+    r.len = len;
+
+    if(running.load(std::memory_order_relaxed))
+    {
+        ring->head.store(head + 1, std::memory_order_release);
+        wake_flusher();
+    }
+    else
+    {
+        //后台线程没有启动(启动前或者停止后), 直接同步写出
+        write_all(r.data, r.len);
+    }
+}
+
+unsigned long long logger::dropped()
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,62 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+#include <unistd.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+//编译时的日志级别, 低于这个级别的日志调用在编译时就被去掉, 不产生任何开销
+//默认只保留INFO及以上, 每个请求都会打印的DEBUG日志需要用-DLOG_LEVEL=0编译才输出
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RECORD_SIZE 256             //一条日志的最大长度(包括时间和级别), 超出部分被截断
+#define LOG_RING_RECORDS 1024           //每个线程的日志环形队列能容纳的日志条数, 必须是2的幂
+#define LOG_BATCH_SIZE (64 << 10)       //后台线程一次write的最大字节数
+
+
+/*
+    异步日志
+    每个线程第一次写日志时创建自己的单生产者单消费者环形队列, 写日志只是在自己的队列中格式化一条记录,
+    不加锁也不做系统调用; 后台线程轮流取出所有队列中的记录, 拼成一批后一次write写出
+    所有队列都空时后台线程在eventfd上休眠, 只有它休眠时写入的日志才需要一次write唤醒它, 空闲时不会定时醒来
+    线程退出时标记自己的队列, 后台线程写出剩余的日志后释放它
+    队列满时丢弃新的日志并计数, 后台线程会把丢弃的条数写到日志中
+    低于编译时级别的日志调用在编译时被去掉, 低于运行时级别(set_level)的日志在append中直接返回
+*/
+class logger
+{
+public:
+    static bool init(int fd = STDOUT_FILENO);                   //启动后台线程, 日志写到fd
+    static void stop();                                         //写出剩余的日志并停止后台线程
+    static void append(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+    static unsigned long long dropped();                        //因为队列满而丢弃的日志条数
+    static void set_level(int level);                           //运行时的日志级别, 只能在编译时级别的基础上再提高
+};
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) logger::append(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) do {} while(0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) logger::append(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) do {} while(0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) logger::append(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) do {} while(0)
+#endif
+
+#define LOG_ERROR(format, ...) logger::append(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+#endif
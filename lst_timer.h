@@ -2,281 +2,289 @@
 #define LST_TIMER_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <time.h>
 #include <arpa/inet.h>
-#include "http_conn.h"
 
 
-#define BUFFER_SIZE 64
+//获取单调时钟的当前时间(毫秒), 不受系统时间调整的影响
+inline uint64_t timer_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 
-//定时器节点
+//定时器节点, 直接嵌入在任务对象中, 添加定时器时不需要再分配内存
+//没有构造函数, 全部清零时表示不在时间轮上
 template<typename T>
 class timer_node
 {
 public:
-    time_t expire;              //任务超时时间
+    uint64_t expire;            //任务超时时间(毫秒)
     T* task;                    //任务指针
-    timer_node():prev(nullptr), next(nullptr){}
-    ~timer_node(){}
+
+    //是否已经挂在时间轮上
+    bool pending() const {return next != nullptr;}
 
     timer_node<T>* prev;        //指向前一个定时器
     timer_node<T>* next;        //指向后一个定时器
-
-
 };
 
 
-//升序定时器链表
+/*
+    分层时间轮, 精度为1毫秒
+    第0层有256个槽, 每个槽1毫秒
+    第1~4层各有64个槽, 每一层的一个槽等于下一层转一圈的时间
+    添加、更新、删除定时器都是O(1), 与定时器数量无关
+    高层的定时器在低层转完一圈时被重新分配(cascade)到低层
+*/
 template<typename T>
-class sort_timer_list
+class timer_wheel
 {
-
 public:
+    timer_wheel();
+    ~timer_wheel(){}
 
-    sort_timer_list():head(nullptr), tail(nullptr){}
-    ~sort_timer_list();
+    void add_timer(timer_node<T>* timer, uint64_t expire);      //添加定时器, expire为超时时刻(毫秒)
+    void update_timer(timer_node<T>* timer, uint64_t expire);   //修改定时器的超时时刻
+    void del_timer(timer_node<T>* timer);                       //删除定时器, 未添加过的定时器直接忽略
 
-    void add_timer(timer_node<T>* timer);        //向链表中添加节点timer
-    void update_timer(timer_node<T>* timer);     //在链表中更新timer的超时时间
-    void del_timer(timer_node<T>* &timer);        //在链表中删除节点timer
-    void tick();                            //SIGALRM每次触发时都要调用的函数
+    //推进时间轮到now, 对每一个超时的定时器调用cb(task)
+    template<typename F>
+    void tick(uint64_t now, F cb);
 
+    //距离下一次需要调用tick的毫秒数, 没有定时器时返回-1
+    int next_timeout(uint64_t now) const;
 
-private:
-
-    void add_timer(timer_node<T>* timer, timer_node<T>* list_head);     //重载函数, 在list_head及其之后的链表中删除timer
-
-    timer_node<T>* head;       //头结点
-    timer_node<T>* tail;       //尾结点
+    int size() const {return m_count;}
 
+private:
+    static const int TVR_BITS = 8;
+    static const int TVN_BITS = 6;
+    static const int TVR_SIZE = 1 << TVR_BITS;
+    static const int TVN_SIZE = 1 << TVN_BITS;
+    static const int TVR_MASK = TVR_SIZE - 1;
+    static const int TVN_MASK = TVN_SIZE - 1;
+    static const int TVN_LEVELS = 4;
+
+    void internal_add(timer_node<T>* timer);                    //按超时时刻把定时器挂到对应的槽
+    int cascade(int level, int index);                          //把第level层index槽中的定时器重新分配到低层
+
+    static void list_init(timer_node<T>* head) {head->prev = head->next = head;}
+    static bool list_empty(const timer_node<T>* head) {return head->next == head;}
+    static void list_add_tail(timer_node<T>* head, timer_node<T>* timer);
+    static void list_del(timer_node<T>* timer);
+
+    uint64_t m_current;                                         //时间轮当前走到的时刻
+    int m_count;                                                //时间轮上的定时器数量
+    timer_node<T> m_tv1[TVR_SIZE];                              //第0层的槽, 每个槽是一个带头结点的双向循环链表
+    timer_node<T> m_tvn[TVN_LEVELS][TVN_SIZE];                  //第1~4层的槽
 };
 
 
-
-
-//析构函数
 template<typename T>
-sort_timer_list<T>::~sort_timer_list()
+timer_wheel<T>::timer_wheel():m_current(timer_now_ms()), m_count(0)
 {
-    timer_node<T>* cur = head;
-    while(cur != nullptr)
+    for(int i = 0; i < TVR_SIZE; ++i)
     {
-        timer_node<T>* temp = cur;
-        cur = cur->next;
-        delete temp;
-
+        list_init(m_tv1 + i);
+    }
+    for(int level = 0; level < TVN_LEVELS; ++level)
+    {
+        for(int i = 0; i < TVN_SIZE; ++i)
+        {
+            list_init(&m_tvn[level][i]);
+        }
     }
+}
 
+template<typename T>
+void timer_wheel<T>::list_add_tail(timer_node<T>* head, timer_node<T>* timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
 }
 
+template<typename T>
+void timer_wheel<T>::list_del(timer_node<T>* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = nullptr;
+    timer->next = nullptr;
+}
 
-//将新的节点插入链表
 template<typename T>
-void sort_timer_list<T>::add_timer(timer_node<T>* timer)
+void timer_wheel<T>::internal_add(timer_node<T>* timer)
 {
+    uint64_t expire = timer->expire;
+    uint64_t idx = expire - m_current;
+    timer_node<T>* head;
 
-    //如果链表本来为空
-    if(head == nullptr)
+    if(expire < m_current)
     {
-        head = timer;
-        tail = head;
-        printf("本来为空\n");
-        return;
+        //已经超时的定时器放到下一次tick就会处理的槽
+        head = m_tv1 + (m_current & TVR_MASK);
     }
-    
-    //链表本来不为空
-    //直接插入链表尾
-    tail->next = timer;
-    timer->next = nullptr;
-    timer->prev = tail;
-    tail = timer;
-
-    /*
-    //如果头节点超时时间已经大于或者等于timer, 那么将timer插入成为头节点
-    //否则寻找第一个超时时间大于timer的节点, 将timer插在这个节点前边
-    if(head->expire >= timer->expire)
+    else if(idx < TVR_SIZE)
     {
-        timer->next = head;
-        head->prev = timer;
-        head = timer;
-        return;
+        head = m_tv1 + (expire & TVR_MASK);
     }
     else
     {
-        timer_node<T>* cur = head->next;
-        while(cur)
+        //找到能容纳这个时间跨度的最低一层
+        int level = 0;
+        while(level < TVN_LEVELS - 1 && idx >= (1ULL << (TVR_BITS + (level + 1) * TVN_BITS)))
         {
-            if(cur->expire > timer->expire)
-            {
-                cur->prev->next = timer;
-                timer->prev = cur->prev;
-                cur->prev = timer;
-                timer->next = cur;
-                return;
-            }
-            else
-            {
-                cur = cur->next;
-            }
+            ++level;
         }
-
-        //要是能到这里, 说明应该把节点插入链表尾部
-        tail->next = timer;
-        timer->next = nullptr;
-        timer->prev = tail;
-        tail = timer;
-        
-        
+        if(idx >= (1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)))
+        {
+            //超出时间轮范围的定时器放在最高层的最远处, 转到时会再次分配
+            expire = m_current + (1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1;
+        }
+        int index = (expire >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+        head = &m_tvn[level][index];
     }
-    */
+    list_add_tail(head, timer);
 }
 
 template<typename T>
-void sort_timer_list<T>::update_timer(timer_node<T>* timer)
+void timer_wheel<T>::add_timer(timer_node<T>* timer, uint64_t expire)
 {
-
-
-    timer_node<T>* temp = timer->next;
-    //如果当前节点已经是尾节点, 那么就不用更新位置
-    if(temp == nullptr)
+    if(timer->pending())
     {
-        return;
+        list_del(timer);
+        --m_count;
     }
+    timer->expire = expire;
+    internal_add(timer);
+    ++m_count;
+}
 
-    //新的超时时间一定比链表中所有存在的节点的超时时间大, 直接将原来的节点位置移动到末尾即可
-    
-    //将该节点移出来
-    //如果该节点是头节点
-    if(timer->prev == nullptr)
-    {
-        //移除头结点
-        head = temp;
-        temp->prev = nullptr;
-
-        //放到尾结点
-        timer->next = nullptr;
-        timer->prev = tail;
-        tail->next = timer;
-        tail = timer;
-    }
-    else
-    {
-        //移除头结点
-        timer->prev->next = timer->next;
-        timer->next->prev = timer->prev;
-        
-        //放到尾结点
-        timer->next = nullptr;
-        timer->prev = tail;
-        tail->next = timer;
-        tail = timer;
-    }
-    
+template<typename T>
+void timer_wheel<T>::update_timer(timer_node<T>* timer, uint64_t expire)
+{
+    add_timer(timer, expire);
 }
 
 template<typename T>
-void sort_timer_list<T>::del_timer(timer_node<T>* &timer)
+void timer_wheel<T>::del_timer(timer_node<T>* timer)
 {
     //已经删除, 防止重复删除
-    if(timer == nullptr)
+    if(!timer->pending())
     {
         return;
     }
-    //如果只有一个节点
-    if(timer == head && timer == tail)
-    {
-        delete timer;
-        head = nullptr;
-        tail = nullptr;
-        timer = nullptr;
-        return;
-
-    }
-
+    list_del(timer);
+    --m_count;
+}
 
-    //如果是头节点
-    if(timer->prev == nullptr)
+template<typename T>
+int timer_wheel<T>::cascade(int level, int index)
+{
+    //先把整个槽摘下来, 再逐个重新插入
+    timer_node<T> work;
+    timer_node<T>* head = &m_tvn[level][index];
+    if(!list_empty(head))
     {
-        head = timer->next;
-        timer->next->prev = nullptr;
-        delete timer;
-        timer = nullptr;
-        return;
+        work.next = head->next;
+        work.prev = head->prev;
+        work.next->prev = &work;
+        work.prev->next = &work;
+        list_init(head);
 
+        while(work.next != &work)
+        {
+            timer_node<T>* timer = work.next;
+            list_del(timer);
+            internal_add(timer);
+        }
     }
-
-    //如果是尾结点
-    if(timer->next == nullptr)
-    {
-        tail = timer->prev;
-        tail->next = nullptr;
-        delete timer;
-        timer = nullptr;
-        return;
-    }
-
-    //如果位于链表中间
-    timer->prev->next = timer->next;
-    timer->next->prev = timer->prev;
-    delete timer;
-    timer = nullptr;
-    
+    return index;
 }
 
-
 template<typename T>
-void sort_timer_list<T>::tick()
+template<typename F>
+void timer_wheel<T>::tick(uint64_t now, F cb)
 {
-    //链表空则不作操作
-    if(head == nullptr)
+    //时间轮上没有定时器时直接跳到当前时刻
+    if(m_count == 0)
     {
-        printf("empty list\n");
+        if(now > m_current)
+        {
+            m_current = now;
+        }
         return;
     }
 
-    printf("timer tick\n");
-    //获取当前时间
-    time_t cur = time(nullptr);
-
-    timer_node<T>* temp = head;
-    while(temp)
+    while(m_current <= now)
     {
+        int index = m_current & TVR_MASK;
 
-        if(cur < temp->expire)
+        //第0层转完一圈, 从高层取出下一个槽重新分配
+        if(index == 0)
         {
-            //链表中没有超时
-            break;
-        }
-        else
-        {
-            //链表中至少有一个超时
-
-            //关闭连接
-            temp->task->shut();
-
-            /*
-            //更新头节点位置
-            head = temp->next;
-            if(head)
+            for(int level = 0; level < TVN_LEVELS; ++level)
             {
-                head->prev = nullptr;
+                int n = (m_current >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+                if(cascade(level, n) != 0)
+                {
+                    break;
+                }
             }
-            */
-            //删除节点 
-            del_timer(temp);
+        }
+        ++m_current;
+
+        //逐个处理超时的定时器, 回调中可能会删除或者重新添加其他定时器
+        timer_node<T>* head = m_tv1 + index;
+        while(!list_empty(head))
+        {
+            timer_node<T>* timer = head->next;
+            list_del(timer);
+            --m_count;
+            cb(timer->task);
+        }
 
-            //往前继续判断有无超时
-            temp = head;
+        if(m_count == 0)
+        {
+            m_current = now + 1;
+            break;
         }
     }
 }
 
+template<typename T>
+int timer_wheel<T>::next_timeout(uint64_t now) const
+{
+    if(m_count == 0)
+    {
+        return -1;
+    }
+    if(now >= m_current)
+    {
+        return 0;
+    }
 
+    //在第0层向前找第一个非空的槽, 找不到就等到第0层转完一圈再重新分配
+    int index = m_current & TVR_MASK;
+    int distance = 0;
+    for(; distance < TVR_SIZE - index; ++distance)
+    {
+        if(!list_empty(m_tv1 + index + distance))
+        {
+            break;
+        }
+    }
+    uint64_t target = m_current + distance;
+    return target > now ? (int)(target - now) : 0;
+}
 
 
 
 
-
-
-#endif
\ No newline at end of file
+#endif
@@ -1,19 +1,27 @@
 #include "http_conn.h"
 #include "threadpool.h"
+#include "steal_threadpool.h"
+#include "reactor.h"
+#include "uring_reactor.h"
+#include "log.h"
+#include "config.h"
+#include "overload.h"
+#include "router.h"
+#include "upstream.h"
+#include "asset_bundle.h"
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
 
-
-
-#define MAX_FD 65535                //最大文件描述符个数
-#define MAX_EVENT_NUMBER 10000      //监听的最大事件数量
-#define TIMESLOT 50                  //超时时间系数
-//初始化任务类中共享的定时器链表
-sort_timer_list<http_conn> http_conn::timerList;
-
-//向epoll中添加要监视的文件描述符
-extern void addfd(int epollfd, int fd, bool one_shot);
-//从epoll中删除要监听的文件描述符
-extern void removefd(int epollfd, int fd);
+#define UPGRADE_FD_ENV "WEBSERVER_UPGRADE_FD"   //新进程从这个环境变量得到和旧进程之间的通道
+#define UPGRADE_TIMEOUT 10000                   //等待新进程准备好的最长时间(毫秒)
+#define UPGRADE_MAX_FDS 64                      //一次交接的监听socket数量上限
+#define HEALTH_URL "/healthz"                   //健康检查, 优雅退出期间返回503让负载均衡摘掉这个进程
 
 
 
@@ -28,54 +36,223 @@ void addsig(int sig, void(*handler)(int))
     sigaction(sig, &sa, nullptr);
 }
 
-void timer_handler(int)
-{
-    // 定时处理任务，实际上就是调用tick()函数
-    http_conn::timerList.tick();
-    // 因为一次 alarm 调用只会引起一次SIGALARM 信号，所以我们要重新定时，以不断触发 SIGALARM信号。
-    alarm(TIMESLOT);
-}
 
+//所有正在运行的事件循环, 收到退出信号时逐个通知
+static std::vector<event_loop*> reactors;
+//单reactor模式的线程池, 重新加载配置时调整线程数量
+static pool_base<http_conn>* thread_pool = nullptr;
+//所有监听socket, 平滑升级时交给新进程
+static std::vector<int> listen_sockets;
+//启动时的命令行参数, 平滑升级时用同样的参数启动新进程
+static char** saved_argv = nullptr;
 
-int main(int argc, char* argv[])
+//把配置中可以重新加载的部分应用到各个模块; 超时时间和缓冲区上限由使用方每次读取config, 不需要在这里设置
+void apply_config()
 {
-    if(argc <= 1)
+    const server_config* c = config::get();
+    logger::set_level(c->log_level);
+    http_conn::m_file_cache.set_limits(c->file_cache_size, c->file_cache_entries, c->file_cache_max_file);
+    http_conn::m_compress_cache.set_limits(c->compress_cache_size, c->compress_cache_entries);
+    //资源包加载失败时继续使用原来的(或者只从资源目录提供文件)
+    asset_bundle::load(c->bundle);
+    if(thread_pool && !thread_pool->resize(c->thread_number))
     {
-        printf("usage: %s port_number\n", argv[0]);
-        return 1;
+        LOG_WARN("config: thread_number of this scheduler only takes effect after a restart");
     }
+}
 
-    int port = atoi(argv[1]);
-
-    //忽略SIGPIPE信号, 以防止向已断开TCP连接的socket发送数据时产生的信号
-    addsig(SIGPIPE, SIG_IGN);
-    //捕捉SIGALARM信号
-    addsig(SIGALRM, timer_handler);
+//通过SCM_RIGHTS发送一组文件描述符, 正文是描述符的数量
+bool send_fds(int channel, const std::vector<int>& fds)
+{
+    int count = fds.size();
+    struct iovec iov = {&count, sizeof(count)};
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * count);
+    return sendmsg(channel, &msg, MSG_NOSIGNAL) == sizeof(count);
+}
 
+//接收send_fds发送的文件描述符, 失败时返回空
+std::vector<int> recv_fds(int channel)
+{
+    std::vector<int> fds;
+    int count = 0;
+    struct iovec iov = {&count, sizeof(count)};
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) != sizeof(count))
+    {
+        return fds;
+    }
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            fds.assign(data, data + n);
+        }
+    }
+    return fds;
+}
 
+//所有事件循环开始优雅退出
+void drain_all()
+{
+    http_conn::m_draining = true;
+    for(size_t i = 0; i < reactors.size(); ++i)
+    {
+        reactors[i]->drain();
+    }
+}
 
-    threadpool<http_conn> pool;
-    threadpool<http_conn>* pool_point = &pool;
-    
-    /*
-    //创建线程池
-    threadpool<http_conn>* pool_point = new threadpool<http_conn>;
-    */
+//平滑升级: 用同样的参数启动新的程序, 通过SCM_RIGHTS把监听socket交给它
+//新进程开始监听后回复一个字节, 本进程再开始优雅退出; 交接期间监听socket一直打开, 新连接在队列中等待而不会被拒绝
+//在reactor线程中同步等待新进程启动, 这段时间内本reactor不处理事件
+void upgrade()
+{
+    if(http_conn::m_draining)
+    {
+        LOG_WARN("upgrade: already draining");
+        return;
+    }
+    if(listen_sockets.size() > UPGRADE_MAX_FDS)
+    {
+        LOG_ERROR("upgrade: too many listen sockets");
+        return;
+    }
+    int channel[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) < 0)
+    {
+        LOG_ERROR("upgrade: socketpair: %s", strerror(errno));
+        return;
+    }
 
+    //fork之后的子进程中只能调用异步信号安全的函数, 新进程的环境变量在fork之前准备好
+    std::string channel_env = std::string(UPGRADE_FD_ENV "=") + std::to_string(channel[1]);
+    std::vector<char*> envp;
+    for(char** e = environ; *e; ++e)
+    {
+        if(strncmp(*e, UPGRADE_FD_ENV "=", strlen(UPGRADE_FD_ENV) + 1) != 0)
+        {
+            envp.push_back(*e);
+        }
+    }
+    envp.push_back(&channel_env[0]);
+    envp.push_back(nullptr);
 
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        LOG_ERROR("upgrade: fork: %s", strerror(errno));
+        close(channel[0]);
+        close(channel[1]);
+        return;
+    }
+    if(pid == 0)
+    {
+        //通道要留给新程序, 信号掩码恢复默认, 新程序自己创建signalfd
+        fcntl(channel[1], F_SETFD, 0);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, nullptr);
+        execvpe(saved_argv[0], saved_argv, envp.data());
+        _exit(127);
+    }
+    close(channel[1]);
 
+    //发送监听socket后等待新进程回复
+    char ready = 0;
+    struct pollfd pfd = {channel[0], POLLIN, 0};
+    if(!send_fds(channel[0], listen_sockets) || poll(&pfd, 1, UPGRADE_TIMEOUT) != 1 || ::read(channel[0], &ready, 1) != 1)
+    {
+        //新进程启动失败或者没有按时准备好, 本进程继续服务
+        LOG_ERROR("upgrade: new process %d did not take over, keep serving", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        close(channel[0]);
+        return;
+    }
+    close(channel[0]);
+    LOG_INFO("upgrade: new process %d is serving, draining", pid);
+    drain_all();
+}
 
+//在监听signalfd的reactor线程中被调用, 不是异步信号处理函数
+//SIGTERM优雅退出, 正在优雅退出时再收到SIGTERM或者收到SIGINT则立即退出
+void signal_handler(int sig)
+{
+    if(sig == SIGINT || (sig == SIGTERM && http_conn::m_draining))
+    {
+        LOG_INFO("stop");
+        for(size_t i = 0; i < reactors.size(); ++i)
+        {
+            reactors[i]->stop();
+        }
+    }
+    else if(sig == SIGTERM)
+    {
+        LOG_INFO("graceful stop");
+        drain_all();
+    }
+    else if(sig == SIGUSR2)
+    {
+        upgrade();
+    }
+    else if(sig == SIGHUP)
+    {
+        //重新加载配置, 已有的连接不受影响
+        if(config::reload())
+        {
+            apply_config();
+        }
+    }
+}
 
-    //任务数组
-    http_conn* users = new http_conn[MAX_FD];
-    
+//阻塞退出、升级和重新加载配置的信号并创建signalfd, 信号通过epoll在事件循环中处理
+//必须在创建其他线程之前调用, 新线程会继承信号掩码
+int create_signalfd()
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
 
 
-    //创建监听socket， tcp
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
+//创建监听socket, reuse_port为true时多个reactor各自绑定同一端口, 由内核分发连接
+//backlog为全连接队列长度; defer_accept大于0时打开TCP_DEFER_ACCEPT, 客户端发来数据(或者超过这么多秒)后才放入队列
+int create_listenfd(int port, bool reuse_port, int backlog, int defer_accept)
+{
+    //创建监听socket， tcp, 非阻塞以便批量accept直到EAGAIN
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenfd < 0)
+    {
+        return -1;
+    }
 
     //地址结构
     struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_family = AF_INET;
     address.sin_port = htons(port);
@@ -84,163 +261,403 @@ int main(int argc, char* argv[])
     //端口复用
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(reuse_port)
+    {
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+    if(defer_accept > 0)
+    {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept));
+    }
+
+    //绑定端口并监听
+    if(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listenfd, backlog) < 0)
+    {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+//平滑升级启动的新进程从旧进程得到的监听socket
+static std::vector<int> inherited_sockets;
+
+//优先使用从旧进程得到的监听socket, 端口不同或者已经用完时再创建新的
+int open_listenfd(int port, bool reuse_port, int backlog, int defer_accept)
+{
+    while(!inherited_sockets.empty())
+    {
+        int listenfd = inherited_sockets.front();
+        inherited_sockets.erase(inherited_sockets.begin());
+        struct sockaddr_in address;
+        socklen_t len = sizeof(address);
+        if(getsockname(listenfd, (struct sockaddr*)&address, &len) == 0 && ntohs(address.sin_port) == port)
+        {
+            //已经在监听, 队列中的连接都保留, 只按新的配置调整队列长度和TCP_DEFER_ACCEPT
+            setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept));
+            listen(listenfd, backlog);
+            return listenfd;
+        }
+        LOG_WARN("upgrade: inherited socket is not listening on port %d, closed", port);
+        close(listenfd);
+    }
+    return create_listenfd(port, reuse_port, backlog, defer_accept);
+}
+
+//从旧进程的通道中取得监听socket
+int start_upgrade()
+{
+    const char* value = getenv(UPGRADE_FD_ENV);
+    if(value == nullptr)
+    {
+        return -1;
+    }
+    int channel = atoi(value);
+    unsetenv(UPGRADE_FD_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+    inherited_sockets = recv_fds(channel);
+    LOG_INFO("upgrade: got %d listen sockets from the old process", (int)inherited_sockets.size());
+    return channel;
+}
+
+//所有监听socket都已经开始使用, 通知旧进程开始优雅退出
+//没有用到的监听socket会在旧进程退出后关闭, 队列中的连接被重置, 所以升级时不要减少reactor数量
+void finish_upgrade(int channel)
+{
+    if(channel < 0)
+    {
+        return;
+    }
+    if(!inherited_sockets.empty())
+    {
+        LOG_WARN("upgrade: %d inherited listen sockets unused, closed", (int)inherited_sockets.size());
+        for(size_t i = 0; i < inherited_sockets.size(); ++i)
+        {
+            close(inherited_sockets[i]);
+        }
+        inherited_sockets.clear();
+    }
+    char ready = 1;
+    ::write(channel, &ready, 1);
+    close(channel);
+}
 
-    //绑定端口
-    bind(listenfd, (struct sockaddr*)&address, sizeof(address));
+//读取/proc/net/netstat中TcpExt的一个计数器(整个系统的), 读取失败返回0
+//ListenOverflows是全连接队列满时丢弃的连接数, ListenDrops还包括其他原因丢弃的SYN
+uint64_t read_tcp_ext(const char* name)
+{
+    FILE* fp = fopen("/proc/net/netstat", "r");
+    if(fp == nullptr)
+    {
+        return 0;
+    }
+    //TcpExt占两行: 第一行是计数器名字, 第二行是对应的值
+    char names[4096];
+    char values[4096];
+    uint64_t result = 0;
+    while(fgets(names, sizeof(names), fp) && fgets(values, sizeof(values), fp))
+    {
+        if(strncmp(names, "TcpExt:", 7) != 0)
+        {
+            continue;
+        }
+        char* name_save = nullptr;
+        char* value_save = nullptr;
+        char* n = strtok_r(names, " \n", &name_save);
+        char* v = strtok_r(values, " \n", &value_save);
+        while(n && v)
+        {
+            if(strcmp(n, name) == 0)
+            {
+                result = strtoull(v, nullptr, 10);
+                break;
+            }
+            n = strtok_r(nullptr, " \n", &name_save);
+            v = strtok_r(nullptr, " \n", &value_save);
+        }
+        break;
+    }
+    fclose(fp);
+    return result;
+}
 
-    //监听
-    listen(listenfd, 5);
+//所有监听socket的全连接队列中等待accept的连接数
+//监听状态的socket在TCP_INFO的tcpi_unacked中返回当前的队列长度
+double accept_queue_length(const std::vector<int>& listenfds)
+{
+    double total = 0;
+    for(size_t i = 0; i < listenfds.size(); ++i)
+    {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if(getsockopt(listenfds[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        {
+            total += info.tcpi_unacked;
+        }
+    }
+    return total;
+}
+
+//注册监听队列相关的监控数据, 内核的累计丢弃数是counter, 队列长度是gauge
+void add_listen_metrics(const std::vector<int>& listenfds)
+{
+    metrics::add_counter("webserver_listen_overflows_total", "Connections dropped because an accept queue was full (whole host, TcpExt ListenOverflows).",
+        []{return read_tcp_ext("ListenOverflows");});
+    metrics::add_counter("webserver_listen_drops_total", "SYNs dropped by listen sockets (whole host, TcpExt ListenDrops).",
+        []{return read_tcp_ext("ListenDrops");});
+    metrics::add_gauge("webserver_accept_queue_length", "Connections waiting in the accept queues.",
+        [listenfds]{return accept_queue_length(listenfds);});
+}
+
+
+//合并所有线程的监控数据作为响应正文
+http_conn::HTTP_CODE metrics_handler(http_conn* conn)
+{
+    std::string body;
+    metrics::render(body);
+    return conn->reply(200, "OK", "text/plain; version=0.0.4", body.data(), body.size());
+}
+
+http_conn::HTTP_CODE health_handler(http_conn* conn)
+{
+    if(http_conn::m_draining.load(std::memory_order_relaxed))
+    {
+        return conn->reply(503, "Service Unavailable", "text/plain", "draining\n", 9);
+    }
+    return conn->reply(200, "OK", "text/plain", "ok\n", 3);
+}
+
+//注册所有路由, 必须在创建reactor和线程池之前完成, 反向代理的规则有错误时返回false
+//静态文件是匹配所有路径的前缀路由, 其他路由精确匹配或者前缀更长, 优先于它
+bool register_routes(const char* upstream_rules)
+{
+    router::add(ROUTE_GET, METRICS_URL, metrics_handler);
+    router::add(ROUTE_GET, HEALTH_URL, health_handler);
+    if(!upstream::init(upstream_rules))
+    {
+        return false;
+    }
+    if(!router::add(ROUTE_GET | ROUTE_HEAD, "/*", http_conn::serve_file))
+    {
+        //所有路径都转发给了后端
+        LOG_INFO("static files are not served, \"/*\" is proxied");
+    }
+    return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+    //打包静态资源: sever pack 目录 资源包
+    if(argc > 1 && strcmp(argv[1], "pack") == 0)
+    {
+        if(argc != 4)
+        {
+            config::usage(argv[0]);
+            return 1;
+        }
+        return asset_bundle::pack(argv[2], argv[3]) ? 0 : 1;
+    }
 
+    //默认值 < 配置文件 < 环境变量 < 命令行
+    if(!config::init(argc, argv))
+    {
+        config::usage(argv[0]);
+        return 1;
+    }
+    const server_config* c = config::get();
+
+    //以下设置只在启动时读取一次
+    int port = c->port;
+    int reactor_number = c->reactor_number < 0 ? 0 : c->reactor_number;
+    http_conn::m_doc_root = c->root;
+    bool use_uring = strcmp(c->backend, "uring") == 0;
+    int backlog = c->backlog;
+    int defer_accept = c->defer_accept;
+    bool exclusive = c->epoll_exclusive != 0;
+
+    //启动后台日志线程, 之后的日志都异步写出
+    logger::init();
+    apply_config();
+    LOG_INFO("http scan: %s", http_scan_name());
+
+    if(!register_routes(c->upstream))
+    {
+        logger::stop();
+        return 1;
+    }
 
+    //平滑升级时由旧进程启动, 监听socket从旧进程接收
+    saved_argv = argv;
+    int upgrade_channel = start_upgrade();
 
-    //监听事件数组
-    epoll_event events[MAX_EVENT_NUMBER];
+    metrics::add_gauge("webserver_active_connections", "Open client connections.", []{return (double)http_conn::m_user_count.load();});
+    metrics::add_gauge("webserver_overloaded", "1 while new requests are shed with 503.", []{return overload::overloaded() ? 1.0 : 0.0;});
+    metrics::add_counter("webserver_log_dropped_total", "Log records dropped because a log queue was full.", []{return (uint64_t)logger::dropped();});
 
-    //创建epoll
-    int epollfd = epoll_create(5);
+    //忽略SIGPIPE信号, 以防止向已断开TCP连接的socket发送数据时产生的信号
+    addsig(SIGPIPE, SIG_IGN);
+    //SIGINT、SIGTERM、SIGHUP和SIGUSR2改由signalfd接收
+    int sigfd = create_signalfd();
 
-    //监听listenfd, 不开epolloneshot
-    addfd(epollfd, listenfd, false);
+    //后台压缩线程, 同样在signalfd之后创建以继承信号掩码
+    if(!http_conn::m_compress_cache.start())
+    {
+        LOG_WARN("compress thread not started, responses are not compressed");
+    }
+    metrics::add_gauge("webserver_compress_cache_bytes", "Bytes of compressed responses held in memory.", []{return (double)http_conn::m_compress_cache.size();});
 
-    //初始化任务类中共享的epollfd
-    http_conn::m_epollfd = epollfd;
+    //反向代理后端的健康检查线程
+    if(!upstream::start())
+    {
+        LOG_WARN("upstream health check thread not started");
+    }
 
-    //激活定时器
-    alarm(TIMESLOT);
-    
 
-    while(true)
+    if(reactor_number == 0)
     {
-        //阻塞等待
-        printf("wait\n");
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-    
-        //如果失败并且不是被信号打断
-        if(number < 0 && errno != EINTR)
+        //单reactor + 线程池: 主线程负责IO, 工作线程负责解析请求
+        //工作线程自己收发数据, 只能使用epoll后端
+        if(use_uring)
+        {
+            LOG_WARN("io_uring backend needs reactor_number > 0, using epoll");
+        }
+        int listenfd = open_listenfd(port, false, backlog, defer_accept);
+        if(listenfd < 0)
         {
-            printf("epoll failure\n");
-            break;
+            LOG_ERROR("listen error: %s", strerror(errno));
+            http_conn::m_compress_cache.stop();
+            upstream::stop();
+            logger::stop();
+            return 1;
         }
+        listen_sockets.push_back(listenfd);
+        add_listen_metrics(listen_sockets);
 
+        //按参数选择调度方式, reactor只通过append接口提交任务
+        const char* scheduler = c->scheduler;
+        pool_base<http_conn>* pool;
+        if(strcmp(scheduler, "steal") == 0)
+        {
+            pool = new steal_threadpool<http_conn>(c->thread_number, c->max_requests, steal_threadpool<http_conn>::STEAL_ROUND_ROBIN);
+        }
+        else if(strcmp(scheduler, "affinity") == 0)
+        {
+            pool = new steal_threadpool<http_conn>(c->thread_number, c->max_requests, steal_threadpool<http_conn>::STEAL_AFFINITY);
+        }
+        else
+        {
+            pool = new threadpool<http_conn>(c->thread_number, c->max_requests);
+        }
+        if(pool->thread_number() == 0)
+        {
+            LOG_ERROR("no worker thread started");
+            delete pool;
+            close(listenfd);
+            http_conn::m_compress_cache.stop();
+            upstream::stop();
+            logger::stop();
+            return 1;
+        }
+        thread_pool = pool;
+        metrics::add_gauge("webserver_queue_depth", "Requests waiting in the threadpool.", [pool]{return (double)pool->size();});
+        reactor main_reactor(listenfd, pool);
+        reactors.push_back(&main_reactor);
+        main_reactor.add_signalfd(sigfd, signal_handler);
+        main_reactor.watch_file_cache();
+        finish_upgrade(upgrade_channel);
+        main_reactor.loop();
+
+        thread_pool = nullptr;
+        delete pool;
+        close(listenfd);
+        close(sigfd);
+        http_conn::m_compress_cache.stop();
+        upstream::stop();
+        logger::stop();
+        return 0;
+    }
 
 
-        //成功, events中存放着响应事件
-        for(int i = 0; i < number; ++i)
+    //多reactor: 每个reactor拥有自己的监听socket(SO_REUSEPORT)、epoll对象和连接表
+    //共享监听socket时所有reactor用EPOLLEXCLUSIVE监听同一个socket, 新连接只唤醒其中一个
+    //连接在整个生命周期内只由一个线程处理, 不需要线程池
+    long cpu_number = sysconf(_SC_NPROCESSORS_ONLN);
+    std::vector<int> listenfds;
+    for(int i = 0; i < (exclusive ? 1 : reactor_number); ++i)
+    {
+        int listenfd = open_listenfd(port, !exclusive, backlog, defer_accept);
+        if(listenfd < 0)
         {
-            int sockfd = events[i].data.fd;
-            if(sockfd == listenfd)
+            LOG_ERROR("listen error: %s", strerror(errno));
+            http_conn::m_compress_cache.stop();
+            upstream::stop();
+            logger::stop();
+            return 1;
+        }
+        listenfds.push_back(listenfd);
+    }
+    listen_sockets = listenfds;
+    add_listen_metrics(listenfds);
+
+    for(int i = 0; i < reactor_number; ++i)
+    {
+        int listenfd = listenfds[exclusive ? 0 : i];
+
+        event_loop* loop = nullptr;
+        if(use_uring)
+        {
+            uring_reactor* r = new uring_reactor(listenfd);
+            if(r->init())
             {
-                struct sockaddr_in client_address;
-                socklen_t client_addr_length = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_addr_length);
-                //失败
-                if(connfd < 0)
-                {
-                    perror("accept error");
-                    continue;
-                }
-
-                //超过预定最大文件描述符
-                if(http_conn::m_user_count >= MAX_FD)
-                {
-                    
-                    close(connfd);
-                    continue; 
-                }
-                printf("accept\n");
-                
-                //初始化任务数组并且将连接任务放置到epoll监听中
-                users[connfd].init(connfd, client_address);
-
-
-                
-                //初始化定时器, 记录超时时间,并加入链表中
-                timer_node<http_conn>* timer = new timer_node<http_conn>;
-                timer->task = &users[connfd];
-                timer->expire = time(nullptr) + 3 * TIMESLOT;
-                users[connfd].timer = timer;
-                http_conn::timerList.add_timer(timer);
-                printf("insert\n");
-                
-                
+                loop = r;
             }
             else
             {
-                if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
-                {
-                    //读关闭或者读写关闭或者错误
-                    //EPOLLRDHUB 检测到对端已经关闭socket的写端，本端读不到任何数据
-                    //EPOLLHUP 检测到socket正常关闭
-                    //EPOLLERR 检测到对方socket异常关闭
-
-                    //从定时器链表中删除该定时器
-                    printf("对方断开连接\n");
-                    http_conn::timerList.del_timer(users[sockfd].timer);
-                    users[sockfd].close_conn();
-
-                }
-                else
-                {
-                    //socket读缓冲区有数据
-                    if(events[i].events & EPOLLIN)
-                    {
-                        //先读取出全部数据再将任务加入到线程池中
-                        //读取数据失败就断开连接
-                        if(users[sockfd].read())
-                        {
-                            // 如果有数据发来，则我们要调整该连接对应的超时时间并且更新定时器在链表中的位置。
-                            
-                            if(users[sockfd].timer)
-                            {
-                                time_t cur = time(NULL);
-
-                                users[sockfd].timer->expire = cur + 3 * TIMESLOT;
-                                
-                                http_conn::timerList.update_timer(users[sockfd].timer);
-                            }
-                            
-                            pool_point->append(users + sockfd);
-
-                        }
-                        else
-                        {
-                            //删除定时器
-                            http_conn::timerList.del_timer(users[sockfd].timer);
-                            users[sockfd].close_conn();
-                        }
-                        
-                    }
-                    else
-                    {
-                        //检测到socket写缓存有空闲
-                        if(events[i].events & EPOLLOUT)
-                        {
-
-                            //将数据全部写出
-                            //如果失败则关闭连接
-                            if(!users[sockfd].write())
-                            {
-                                printf("write error\n");
-                                //删除定时器
-                                http_conn::timerList.del_timer(users[sockfd].timer);
-                                users[sockfd].close_conn();
-
-                            }
-
-                        }
-                    }
-                }
+                //内核不支持需要的io_uring功能, 所有reactor都退回epoll
+                LOG_WARN("io_uring not available, using epoll");
+                delete r;
+                use_uring = false;
             }
         }
+        if(loop == nullptr)
+        {
+            loop = new reactor(listenfd, nullptr, exclusive);
+        }
+        reactors.push_back(loop);
     }
+    LOG_INFO("backend: %s, backlog %d, defer accept %d, %s listen socket", use_uring ? "io_uring" : "epoll",
+        backlog, defer_accept, exclusive ? "shared" : "reuseport");
 
+    //第0个reactor在主线程中运行并负责接收信号, 其余的各自启动一个线程
+    reactors[0]->add_signalfd(sigfd, signal_handler);
+    reactors[0]->watch_file_cache();
+    for(int i = 1; i < reactor_number; ++i)
+    {
+        if(!reactors[i]->start(cpu_number > 0 ? i % cpu_number : -1))
+        {
+            LOG_ERROR("pthread_create error");
+            http_conn::m_compress_cache.stop();
+            upstream::stop();
+            logger::stop();
+            return 1;
+        }
+    }
+    finish_upgrade(upgrade_channel);
+    reactors[0]->loop();
 
-    close(epollfd);
-    close(listenfd);
-    delete [] users;
-    delete pool_point;
+    for(int i = 0; i < reactor_number; ++i)
+    {
+        reactors[i]->join();
+        delete reactors[i];
+    }
+    for(size_t i = 0; i < listenfds.size(); ++i)
+    {
+        close(listenfds[i]);
+    }
+    close(sigfd);
+    http_conn::m_compress_cache.stop();
+    upstream::stop();
+    logger::stop();
     return 0;
-
-
-
 }
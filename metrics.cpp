@@ -0,0 +1,242 @@
+#include "metrics.h"
+#include "locker.h"
+#include <atomic>
+#include <vector>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+namespace
+{
+
+//一个线程的监控数据, 只有这个线程写, 输出时其他线程读
+struct metrics_block
+{
+    std::atomic<uint64_t> counters[METRIC_COUNTER_NUMBER];
+    std::atomic<uint64_t> buckets[METRIC_HISTOGRAM_NUMBER][METRICS_BUCKETS];
+    std::atomic<uint64_t> sums[METRIC_HISTOGRAM_NUMBER];
+    metrics_block* next;                //所有线程的数据串成一个链表, 只增加不删除
+};
+
+struct gauge
+{
+    const char* name;
+    const char* help;
+    std::function<double()> fn;         //瞬时值
+    std::function<uint64_t()> counter;  //外部计数器, 设置时不使用fn
+};
+
+struct counter_info
+{
+    const char* name;
+    const char* help;
+};
+
+const counter_info counter_infos[METRIC_COUNTER_NUMBER] =
+{
+    {"webserver_accepts_total", "Accepted connections."},
+    {"webserver_requests_total", "Parsed requests."},
+    {"webserver_sent_bytes_total", "Bytes written to sockets."},
+    {"webserver_timeouts_total", "Connections closed by timeout."},
+    {"webserver_syscalls_total", "System calls made by event loops and connection IO."},
+    {"webserver_accept_wakeups_total", "Times an event loop woke up for a readable listen socket."},
+    {"webserver_shed_total", "Requests answered with 503 because the server was overloaded or the queue was full."},
+    {"webserver_upstream_requests_total", "Requests forwarded to reverse proxy backends."},
+    {"webserver_upstream_errors_total", "Forwarded requests that did not get a complete backend response."},
+};
+
+const counter_info histogram_infos[METRIC_HISTOGRAM_NUMBER] =
+{
+    {"webserver_queue_wait_seconds", "Time a request waits in the threadpool queue."},
+    {"webserver_parse_seconds", "Time to parse a request and look up its file."},
+    {"webserver_ttfb_seconds", "Time from the first request byte read to the first response byte sent."},
+};
+
+const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+std::atomic<metrics_block*> blocks(nullptr);
+thread_local metrics_block* local_block = nullptr;
+
+locker gauge_locker;
+std::vector<gauge> gauges;
+
+metrics_block* get_block()
+{
+    if(local_block)
+    {
+        return local_block;
+    }
+    //值初始化, 所有计数清零
+    metrics_block* block = new metrics_block();
+    metrics_block* first = blocks.load(std::memory_order_relaxed);
+    do
+    {
+        block->next = first;
+    } while(!blocks.compare_exchange_weak(first, block, std::memory_order_release, std::memory_order_relaxed));
+    local_block = block;
+    return block;
+}
+
+//只有本线程修改, 用普通的读和写代替原子加法
+inline void bump(std::atomic<uint64_t>& value, uint64_t n)
+{
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+int bucket_index(uint64_t value)
+{
+    if(value < (1ULL << METRICS_SUB_BITS))
+    {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if(msb > METRICS_MAX_BITS)
+    {
+        return METRICS_BUCKETS - 1;
+    }
+    int shift = msb - METRICS_SUB_BITS;
+    return ((shift + 1) << METRICS_SUB_BITS) + ((value >> shift) & ((1 << METRICS_SUB_BITS) - 1));
+}
+
+//桶中最大的值, 用来报告分位数
+uint64_t bucket_upper(int index)
+{
+    if(index < (1 << METRICS_SUB_BITS))
+    {
+        return index;
+    }
+    int shift = (index >> METRICS_SUB_BITS) - 1;
+    uint64_t sub = index & ((1 << METRICS_SUB_BITS) - 1);
+    return (((1ULL << METRICS_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void append_format(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void append_format(std::string& out, const char* format, ...)
+{
+    char line[256];
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(line, sizeof(line), format, arg_list);
+    va_end(arg_list);
+    if(len > 0)
+    {
+        out.append(line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+    }
+}
+
+}
+
+
+void metrics::add(METRIC_COUNTER counter, uint64_t n)
+{
+    bump(get_block()->counters[counter], n);
+}
+
+void metrics::record(METRIC_HISTOGRAM histogram, uint64_t ns)
+{
+    metrics_block* block = get_block();
+    bump(block->buckets[histogram][bucket_index(ns)], 1);
+    bump(block->sums[histogram], ns);
+}
+
+void metrics::add_gauge(const char* name, const char* help, std::function<double()> fn)
+{
+    gauge_locker.lock();
+    gauges.push_back(gauge{name, help, fn, nullptr});
+    gauge_locker.unlock();
+}
+
+void metrics::add_counter(const char* name, const char* help, std::function<uint64_t()> fn)
+{
+    gauge_locker.lock();
+    gauges.push_back(gauge{name, help, nullptr, fn});
+    gauge_locker.unlock();
+}
+
+uint64_t metrics::now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void metrics::render(std::string& out)
+{
+    metrics_block* first = blocks.load(std::memory_order_acquire);
+
+    //计数器
+    for(int c = 0; c < METRIC_COUNTER_NUMBER; ++c)
+    {
+        uint64_t total = 0;
+        for(metrics_block* b = first; b; b = b->next)
+        {
+            total += b->counters[c].load(std::memory_order_relaxed);
+        }
+        append_format(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            counter_infos[c].name, counter_infos[c].help, counter_infos[c].name,
+            counter_infos[c].name, (unsigned long long)total);
+    }
+
+    //直方图合并后以summary的形式输出分位数
+    std::vector<uint64_t> merged(METRICS_BUCKETS);
+    for(int h = 0; h < METRIC_HISTOGRAM_NUMBER; ++h)
+    {
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        for(int i = 0; i < METRICS_BUCKETS; ++i)
+        {
+            merged[i] = 0;
+        }
+        for(metrics_block* b = first; b; b = b->next)
+        {
+            for(int i = 0; i < METRICS_BUCKETS; ++i)
+            {
+                uint64_t n = b->buckets[h][i].load(std::memory_order_relaxed);
+                merged[i] += n;
+                count += n;
+            }
+            sum += b->sums[h].load(std::memory_order_relaxed);
+        }
+
+        const char* name = histogram_infos[h].name;
+        append_format(out, "# HELP %s %s\n# TYPE %s summary\n", name, histogram_infos[h].help, name);
+        int index = 0;
+        uint64_t seen = 0;
+        for(size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q)
+        {
+            //第一个累计数量达到count*q的桶
+            uint64_t rank = (uint64_t)(quantiles[q] * count + 0.5);
+            if(rank == 0)
+            {
+                rank = 1;
+            }
+            while(index < METRICS_BUCKETS && seen + merged[index] < rank)
+            {
+                seen += merged[index];
+                ++index;
+            }
+            double value = (count == 0 || index == METRICS_BUCKETS) ? 0 : bucket_upper(index) / 1e9;
+            append_format(out, "%s{quantile=\"%g\"} %.9f\n", name, quantiles[q], value);
+        }
+        append_format(out, "%s_sum %.9f\n%s_count %llu\n", name, sum / 1e9, name, (unsigned long long)count);
+    }
+
+    //注册的瞬时值和外部计数器
+    gauge_locker.lock();
+    for(size_t i = 0; i < gauges.size(); ++i)
+    {
+        const gauge& g = gauges[i];
+        //计数器按整数输出, 瞬时值保留double的全部精度, %g只有6位有效数字
+        if(g.counter)
+        {
+            append_format(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                g.name, g.help, g.name, g.name, (unsigned long long)g.counter());
+        }
+        else
+        {
+            append_format(out, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", g.name, g.help, g.name, g.name, g.fn());
+        }
+    }
+    gauge_locker.unlock();
+}
@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string>
+#include <functional>
+
+#define METRICS_URL "/metrics"          //保留的URL, 返回Prometheus文本格式的监控数据
+#define METRICS_SUB_BITS 4              //每个2的幂区间再分成2^4个子区间, 相对误差不超过1/16
+#define METRICS_MAX_BITS 40             //直方图能区分的最大值为2^40纳秒(约18分钟), 更大的值记在最后一个区间
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 2) << METRICS_SUB_BITS)
+
+
+//计数器
+enum METRIC_COUNTER
+{
+    METRIC_ACCEPTS = 0,             //接受的连接数
+    METRIC_REQUESTS,                //解析完成的请求数
+    METRIC_BYTES_SENT,              //发送的字节数
+    METRIC_TIMEOUTS,                //超时关闭的连接数
+    METRIC_SYSCALLS,                //事件循环和连接收发数据时的系统调用次数, 用来比较不同的IO后端
+    METRIC_ACCEPT_WAKEUPS,          //监听socket可读的次数, 和接受的连接数相比可以看出每次唤醒接受了多少连接
+    METRIC_SHED,                    //过载或者队列满时直接回复503的请求数
+    METRIC_UPSTREAM_REQUESTS,       //转发给反向代理后端的请求数
+    METRIC_UPSTREAM_ERRORS,         //没有得到后端完整响应的转发数
+    METRIC_COUNTER_NUMBER
+};
+
+//延迟直方图, 单位都是纳秒
+enum METRIC_HISTOGRAM
+{
+    METRIC_QUEUE_WAIT = 0,          //请求在线程池队列中等待的时间
+    METRIC_PARSE_TIME,              //解析一个请求(包括查找文件)的时间
+    METRIC_TTFB,                    //从读到请求的第一个字节到发出响应的第一个字节的时间
+    METRIC_HISTOGRAM_NUMBER
+};
+
+
+/*
+    监控数据
+    每个线程第一次记录时创建自己的计数器和直方图, 记录时只修改自己线程的数据, 不加锁也不需要原子读改写
+    直方图使用HDR直方图的对数-线性分桶: 每个2的幂区间等分成16个桶, 任意大小的值都只有约6%的误差
+    请求METRICS_URL时把所有线程的数据合并, 输出计数器、分位数、总和以及注册的瞬时值和计数器
+*/
+class metrics
+{
+public:
+    static void add(METRIC_COUNTER counter, uint64_t n = 1);
+    static void record(METRIC_HISTOGRAM histogram, uint64_t ns);
+
+    //注册一个瞬时值(活跃连接数、队列长度等), 输出时调用fn取值; 只在启动时调用
+    static void add_gauge(const char* name, const char* help, std::function<double()> fn);
+
+    //注册一个在别处累计、只增不减的值(内核统计等), 和add_gauge一样输出时取值, 类型为counter, 按整数输出
+    static void add_counter(const char* name, const char* help, std::function<uint64_t()> fn);
+
+    //合并所有线程的数据, 以Prometheus文本格式追加到out
+    static void render(std::string& out);
+
+    //单调时钟的当前时间(纳秒)
+    static uint64_t now_ns();
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#define CACHE_LINE_SIZE 64
+
+
+/*
+    有界的无锁多生产者多消费者队列(Vyukov的环形队列)
+    每个槽位带一个序号, 生产者和消费者各自用CAS抢占入队和出队位置, 再根据槽位序号判断槽位是否可用
+    容量向上取整为2的幂, 所有槽位在构造时一次性分配, 入队出队都不再申请内存
+*/
+template<typename T>
+class mpmc_queue
+{
+public:
+    mpmc_queue(size_t capacity);
+    ~mpmc_queue();
+
+    //入队, 队列满时返回false
+    bool push(const T& value);
+    //出队, 队列空时返回false
+    bool pop(T& value);
+
+    size_t capacity() const {return m_mask + 1;}
+    //队列中的元素数量, 并发修改时只是近似值
+    size_t size() const
+    {
+        size_t dequeue = m_dequeue_pos.load(std::memory_order_relaxed);
+        size_t enqueue = m_enqueue_pos.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;   //等于入队位置时可以写入, 等于入队位置+1时可以读出
+        T data;
+    };
+
+    cell* m_cells;                                          //环形数组
+    size_t m_mask;                                          //容量-1, 用来对位置取模
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_enqueue_pos;    //下一个入队位置, 和出队位置放在不同的缓存行
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_dequeue_pos;    //下一个出队位置
+};
+
+template<typename T>
+mpmc_queue<T>::mpmc_queue(size_t capacity):m_enqueue_pos(0), m_dequeue_pos(0)
+{
+    size_t size = 2;
+    while(size < capacity)
+    {
+        size <<= 1;
+    }
+    m_mask = size - 1;
+    m_cells = new cell[size];
+    for(size_t i = 0; i < size; ++i)
+    {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+template<typename T>
+mpmc_queue<T>::~mpmc_queue()
+{
+    delete [] m_cells;
+}
+
+template<typename T>
+bool mpmc_queue<T>::push(const T& value)
+{
+    cell* c;
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    while(true)
+    {
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0)
+        {
+            //槽位空闲, 抢占这个入队位置
+            if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            //槽位中上一轮的数据还没有被取走, 队列已满
+            return false;
+        }
+        else
+        {
+            //其他生产者已经占用了这个位置, 重新读取入队位置
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    c->data = value;
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+bool mpmc_queue<T>::pop(T& value)
+{
+    cell* c;
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    while(true)
+    {
+        c = &m_cells[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0)
+        {
+            //槽位中有数据, 抢占这个出队位置
+            if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            //槽位还没有写入数据, 队列为空
+            return false;
+        }
+        else
+        {
+            pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    value = c->data;
+    //槽位留给下一轮的生产者
+    c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include "overload.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+#include <atomic>
+#include <sys/socket.h>
+
+namespace
+{
+
+//过载时的响应, 不解析请求也不经过写缓冲区, 一次send发完
+const char shed_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: " OVERLOAD_RETRY_AFTER "\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 46\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "The server is overloaded, please retry later.\n";
+
+std::atomic<uint64_t> window_end(0);            //当前观察周期的结束时刻(纳秒)
+std::atomic<uint64_t> window_min(UINT64_MAX);   //当前观察周期内排队时间的最小值
+std::atomic<bool> state(false);                 //上一个观察周期是否过载
+
+}
+
+
+void overload::record(uint64_t sojourn_ns, uint64_t now_ns)
+{
+    const server_config* c = config::get();
+    if(c->overload_target <= 0)
+    {
+        state.store(false, std::memory_order_relaxed);
+        return;
+    }
+
+    uint64_t min = window_min.load(std::memory_order_relaxed);
+    while(sojourn_ns < min && !window_min.compare_exchange_weak(min, sojourn_ns, std::memory_order_relaxed))
+    {
+    }
+
+    //观察周期结束, 只由一个线程判断这个周期是否过载并开始下一个周期
+    uint64_t end = window_end.load(std::memory_order_relaxed);
+    if(now_ns < end || !window_end.compare_exchange_strong(end, now_ns + (uint64_t)c->overload_interval * 1000000, std::memory_order_relaxed))
+    {
+        return;
+    }
+    min = window_min.exchange(UINT64_MAX, std::memory_order_relaxed);
+    bool over = end != 0 && min > (uint64_t)c->overload_target * 1000000;
+    if(over != state.load(std::memory_order_relaxed))
+    {
+        state.store(over, std::memory_order_relaxed);
+        if(over)
+        {
+            LOG_WARN("overloaded: minimum queue time %.1fms, shedding new requests", min / 1e6);
+        }
+        else
+        {
+            LOG_INFO("overload cleared");
+        }
+    }
+}
+
+bool overload::overloaded()
+{
+    if(!state.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+    //状态只在record中更新, 没有请求时不会更新; 超过一个观察周期没有任何记录说明已经没有请求在排队,
+    //过载状态已经过期, 不能让空闲之后的第一批请求收到503
+    const server_config* c = config::get();
+    uint64_t end = window_end.load(std::memory_order_relaxed);
+    if(c->overload_target > 0 && metrics::now_ns() <= end + (uint64_t)c->overload_interval * 1000000)
+    {
+        return true;
+    }
+    bool expected = true;
+    if(state.compare_exchange_strong(expected, false, std::memory_order_relaxed))
+    {
+        LOG_INFO("overload cleared: no queued requests");
+    }
+    return false;
+}
+
+void overload::shed(int sockfd)
+{
+    //发不完也不等待, 连接马上就要关闭
+    send(sockfd, shed_response, sizeof(shed_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    //接收队列中还有没读的请求时close会发送RST, 客户端可能来不及读到503就收到连接重置;
+    //先发FIN表示响应结束, 再读走已经到达的请求数据, 之后的close就是正常的关闭
+    shutdown(sockfd, SHUT_WR);
+    char discard[4096];
+    int calls = 2;
+    for(int i = 0; i < OVERLOAD_DRAIN_READS; ++i)
+    {
+        ++calls;
+        if(recv(sockfd, discard, sizeof(discard), MSG_DONTWAIT) <= 0)
+        {
+            break;
+        }
+    }
+    metrics::add(METRIC_SYSCALLS, calls);
+    metrics::add(METRIC_SHED);
+}
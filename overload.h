@@ -0,0 +1,29 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+
+//以下是默认值, 运行时使用config中的设置
+#define OVERLOAD_TARGET 20              //排队时间的目标(毫秒), 0为不做过载保护; 一轮处理上千个连接的事件就要十几毫秒, 太小会把正常的高并发当成过载
+#define OVERLOAD_INTERVAL 100           //观察周期(毫秒)
+#define OVERLOAD_RETRY_AFTER "1"        //503响应中的Retry-After(秒)
+#define OVERLOAD_DRAIN_READS 16         //回复503后最多读几次丢弃已经到达的请求数据
+
+
+/*
+    过载保护(CoDel)
+    不看队列长度而看排队时间: 突发流量会让一部分请求排队很久, 但一个周期内总有请求很快被处理;
+    如果一个观察周期内排队时间的最小值都超过了目标值, 说明队列一直排不空, 服务器已经过载
+    过载期间新请求不再进入队列, 直接回复预先生成的503(带Retry-After)并关闭连接, 下一个周期排队时间降下来后恢复
+    线程池模式下排队时间是请求在任务队列中等待的时间; 多reactor模式下请求不排队,
+    使用事件循环每轮处理事件的时间: 一轮处理得越久, 下一轮的事件就等得越久
+*/
+class overload
+{
+public:
+    static void record(uint64_t sojourn_ns, uint64_t now_ns);  //记录一次排队时间, 可以在任意线程中调用
+    static bool overloaded();                                   //当前是否过载, 超过一个观察周期没有记录时不再过载
+    static void shed(int sockfd);                               //回复503并关闭写方向, 丢弃已到达的请求数据, 调用方随后关闭连接
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef POOL_BASE_H
+#define POOL_BASE_H
+
+
+//线程池的公共接口, reactor通过它把请求交给共享队列的threadpool或者工作窃取的steal_threadpool
+template<typename T>
+class pool_base
+{
+public:
+    virtual ~pool_base() {}
+
+    //将新的任务加入任务队列, 队列已满时返回false
+    virtual bool append(T* request) = 0;
+    //等待处理的任务数量, 不加锁读取, 只是近似值
+    virtual int size() const = 0;
+    //正在运行的工作线程数量, 创建线程失败时少于要求的数量, 为0时线程池不能使用
+    virtual int thread_number() const = 0;
+    //运行时修改工作线程数量, 不支持时返回false
+    virtual bool resize(int /* thread_number */) {return false;}
+};
+
+
+//自旋等待时让出流水线资源, 减少对另一个超线程和总线的干扰
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#endif
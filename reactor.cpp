@@ -0,0 +1,358 @@
+#include "reactor.h"
+#include "log.h"
+#include "config.h"
+#include "overload.h"
+
+//向epoll中添加要监视的文件描述符
+extern void addfd(int epollfd, int fd, bool one_shot);
+//从epoll中删除要监听的文件描述符
+extern void removefd(int epollfd, int fd);
+//修改epoll中监听的文件描述符的监听内容, 并重置epolloneshot事件
+extern void modfd(int epollfd, int fd, int ev);
+
+
+reactor::reactor(int listenfd, pool_base<http_conn>* pool, bool exclusive):
+        event_loop(listenfd, pool)
+{
+    //创建epoll
+    m_epollfd = epoll_create(5);
+
+    //监听listenfd, 水平触发, 不开epolloneshot
+    epoll_event event;
+    event.data.fd = m_listenfd;
+    event.events = EPOLLIN;
+    if(exclusive)
+    {
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event);
+
+    //监听时间轮的timerfd和跨线程唤醒的eventfd
+    addfd(m_epollfd, m_timerfd, false);
+    addfd(m_epollfd, m_eventfd, false);
+
+    m_max_events = config::get()->max_events;
+    m_events = new epoll_event[m_max_events];
+
+    //后端连接注册在同一个epoll中
+    m_upstreams.init(m_epollfd);
+}
+
+reactor::~reactor()
+{
+    close(m_epollfd);
+    delete [] m_events;
+}
+
+void reactor::loop()
+{
+    //信号和文件缓存的变化通知只由一个reactor监听
+    if(m_signalfd >= 0)
+    {
+        addfd(m_epollfd, m_signalfd, false);
+    }
+    if(m_inotifyfd >= 0)
+    {
+        addfd(m_epollfd, m_inotifyfd, false);
+    }
+
+    while(!m_stop)
+    {
+        //阻塞等待, 超时、信号和唤醒都通过文件描述符通知
+        int number = epoll_wait(m_epollfd, m_events, m_max_events, -1);
+        metrics::add(METRIC_SYSCALLS);
+
+        //如果失败并且不是被信号打断
+        if(number < 0 && errno != EINTR)
+        {
+            LOG_ERROR("epoll failure: %s", strerror(errno));
+            break;
+        }
+
+        //成功, events中存放着响应事件
+        uint64_t batch_start = metrics::now_ns();
+        bool timeout = false;
+        for(int i = 0; i < number; ++i)
+        {
+            int sockfd = m_events[i].data.fd;
+            if(sockfd == m_listenfd)
+            {
+                handle_accept();
+            }
+            else if(sockfd == m_timerfd)
+            {
+                //超时处理放到本轮事件处理完之后, 避免关闭本轮还有事件的连接
+                timeout = true;
+            }
+            else if(sockfd == m_eventfd)
+            {
+                handle_wakeup();
+            }
+            else if(sockfd == m_signalfd)
+            {
+                handle_signal();
+            }
+            else if(sockfd == m_inotifyfd)
+            {
+                //资源目录下的文件发生变化, 让缓存中对应的文件失效
+                http_conn::m_file_cache.handle_inotify();
+            }
+            else
+            {
+                handle_event(sockfd, m_events[i].events);
+            }
+        }
+
+        //定时处理任务, 每轮循环的固定位置执行
+        if(timeout)
+        {
+            handle_timer();
+        }
+        //本轮可能添加了更早到期的定时器, 重新设置timerfd
+        arm_timer();
+        check_drain();
+
+        //多reactor模式下请求不排队, 本轮处理的时间就是下一轮的事件等待的时间
+        if(m_pool == nullptr && number > 0)
+        {
+            uint64_t now = metrics::now_ns();
+            overload::record(now - batch_start, now);
+        }
+    }
+}
+
+void reactor::handle_accept()
+{
+    metrics::add(METRIC_ACCEPT_WAKEUPS);
+
+    //一次唤醒取走队列中的多个连接, 新连接直接是非阻塞的, 不需要再fcntl
+    //超过ACCEPT_BATCH时留给下一轮, 避免连接风暴时已有连接的事件得不到处理
+    for(int i = 0; i < ACCEPT_BATCH; ++i)
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addr_length = sizeof(client_address);
+        int connfd = accept4(m_listenfd, (struct sockaddr*)&client_address, &client_addr_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        metrics::add(METRIC_SYSCALLS);
+        //失败
+        if(connfd < 0)
+        {
+            //连接在三次握手完成后被对方重置, 继续取下一个
+            if(errno == ECONNABORTED || errno == EINTR)
+            {
+                continue;
+            }
+            //队列已经取空; 多个reactor共享端口时, 连接可能已经被别的reactor取走
+            if(errno != EAGAIN)
+            {
+                LOG_ERROR("accept error: %s", strerror(errno));
+            }
+            return;
+        }
+
+        //超过预定最大文件描述符
+        if(connfd >= m_max_fd || http_conn::m_user_count >= m_max_fd)
+        {
+            close(connfd);
+            metrics::add(METRIC_SYSCALLS);
+            continue;
+        }
+        LOG_DEBUG("accept %d", connfd);
+        metrics::add(METRIC_ACCEPTS);
+
+        //初始化任务数组并且将连接任务放置到本reactor的epoll监听中
+        accepted(connfd);
+        m_users[connfd].init(connfd, client_address, m_epollfd);
+
+        //初始化定时器, 等待客户端发来请求
+        set_timeout(m_users + connfd, http_conn::TIMEOUT_HEADER);
+    }
+}
+
+void reactor::stop_accept()
+{
+    //监听socket可能已经交给了新的进程, 只从本reactor的epoll中移除, 不关闭
+    epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, nullptr);
+    metrics::add(METRIC_SYSCALLS);
+}
+
+void reactor::handle_event(int sockfd, uint32_t events)
+{
+    if(m_upstreams.owns(sockfd))
+    {
+        //反向代理的后端连接
+        upstream_pool::STATUS status;
+        http_conn* client = m_upstreams.handle(sockfd, &status);
+        if(client)
+        {
+            handle_upstream(client, status);
+        }
+        return;
+    }
+
+    http_conn* user = m_users + sockfd;
+    //同一批事件中前面的处理关闭了后端连接, 它的事件落在没有打开的表项上
+    if(!user->is_open())
+    {
+        return;
+    }
+    //EPOLLONESHOT: 交给线程池的连接只有在工作线程modfd之后才会再有事件, 收到事件说明已经交回
+    user->in_pool = false;
+
+    if(user->upstream)
+    {
+        //正在转发: 客户端断开时放弃转发, 可写时继续发送响应
+        if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        {
+            close_conn(user);
+        }
+        else
+        {
+            handle_upstream(user, m_upstreams.resume(user));
+        }
+    }
+    else if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        //读关闭或者读写关闭或者错误
+        //EPOLLRDHUB 检测到对端已经关闭socket的写端，本端读不到任何数据
+        //EPOLLHUP 检测到socket正常关闭
+        //EPOLLERR 检测到对方socket异常关闭
+        LOG_DEBUG("对方断开连接");
+        close_conn(user);
+    }
+    else if(events & EPOLLIN)
+    {
+        //先读取出全部数据再处理请求
+        //读取数据失败就断开连接
+        if(!user->read())
+        {
+            close_conn(user);
+            return;
+        }
+
+        //空闲的长连接上来了新的请求, 开始计算读取请求头的超时
+        //已经在读请求头的连接不延长超时时间, 防止客户端一点一点地发送
+        if(user->timeout_type == http_conn::TIMEOUT_KEEPALIVE)
+        {
+            set_timeout(user, http_conn::TIMEOUT_HEADER);
+        }
+
+        dispatch(user);
+    }
+    else if(events & EPOLLOUT)
+    {
+        //将数据全部写出
+        //如果失败则关闭连接
+        if(!user->write())
+        {
+            LOG_DEBUG("write error");
+            close_conn(user);
+        }
+        else if(user->is_writing())
+        {
+            //发送了一部分, 重新计算发送阻塞的超时
+            set_timeout(user, http_conn::TIMEOUT_WRITE);
+        }
+        else if(user->proxy_pending())
+        {
+            //前面的响应都发完了, 开始转发读缓冲区中的请求
+            handle_upstream(user, m_upstreams.start(user));
+        }
+        else if(user->has_pending_request())
+        {
+            //读缓冲区中还有流水线上的后续请求, 不等新的数据到达直接继续处理
+            set_timeout(user, http_conn::TIMEOUT_HEADER);
+            dispatch(user);
+        }
+        else
+        {
+            //响应发送完毕, 长连接进入空闲状态
+            set_timeout(user, http_conn::TIMEOUT_KEEPALIVE);
+        }
+    }
+}
+
+void reactor::dispatch(http_conn* user)
+{
+    if(m_pool)
+    {
+        //过载时新请求不再进入队列; 队列已经排空时照常处理, 让过载保护重新得到排队时间
+        if(overload::overloaded() && m_pool->size() > 0)
+        {
+            shed(user);
+            return;
+        }
+        user->set_queued(metrics::now_ns());
+        //任务队列已满时线程池已经处理不过来, 同样回复503
+        if(!m_pool->append(user))
+        {
+            shed(user);
+            return;
+        }
+        user->in_pool = true;
+    }
+    else if(overload::overloaded())
+    {
+        shed(user);
+    }
+    else
+    {
+        //多reactor模式下直接在本线程解析, 连接不会被其他线程访问
+        user->process();
+    }
+}
+
+void reactor::shed(http_conn* user)
+{
+    //dispatch时连接上没有正在发送的响应, 503可以直接写到socket
+    overload::shed(user->sockfd());
+    close_conn(user);
+}
+
+void reactor::handle_upstream(http_conn* user, upstream_pool::STATUS status)
+{
+    switch(status)
+    {
+        case upstream_pool::UPSTREAM_WAIT_BACKEND:
+        {
+            set_timeout(user, http_conn::TIMEOUT_UPSTREAM);
+            break;
+        }
+        case upstream_pool::UPSTREAM_WAIT_CLIENT:
+        {
+            set_timeout(user, http_conn::TIMEOUT_WRITE);
+            break;
+        }
+        case upstream_pool::UPSTREAM_DONE:
+        {
+            if(user->has_pending_request())
+            {
+                //流水线上的后续请求从EPOLLOUT分支处理, 和发完响应后一样交给dispatch
+                set_timeout(user, http_conn::TIMEOUT_HEADER);
+                modfd(m_epollfd, user->sockfd(), EPOLLOUT);
+            }
+            else
+            {
+                set_timeout(user, http_conn::TIMEOUT_KEEPALIVE);
+                modfd(m_epollfd, user->sockfd(), EPOLLIN);
+            }
+            break;
+        }
+        default:
+        {
+            close_conn(user);
+            break;
+        }
+    }
+}
+
+void reactor::close_conn(http_conn* user)
+{
+    //正在转发的请求不再需要后端的响应, 后端连接的状态不确定, 直接关闭
+    if(user->upstream)
+    {
+        m_upstreams.abort(user);
+    }
+    //从时间轮中删除该定时器
+    m_timer_wheel.del_timer(&user->timer);
+    user->close_conn();
+}
@@ -0,0 +1,41 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include "event_loop.h"
+#include "upstream.h"
+
+#define MAX_EVENT_NUMBER 10000      //监听的最大事件数量
+#define ACCEPT_BATCH 64             //监听socket每次可读时最多接受的连接数, 剩下的留到下一轮(水平触发)
+
+
+//epoll后端的事件循环, 独占一个epoll对象
+//socket可读时由连接自己recv, 可写时由连接自己sendmsg/sendfile, 每次处理完用EPOLLONESHOT重新注册
+class reactor : public event_loop
+{
+public:
+    //pool为nullptr时在事件循环线程中直接解析请求(多reactor模式)
+    //否则把解析任务交给线程池(单reactor + 线程池模式)
+    //exclusive为true时监听socket由多个reactor共享, 用EPOLLEXCLUSIVE注册, 新连接只唤醒其中一个
+    reactor(int listenfd, pool_base<http_conn>* pool = nullptr, bool exclusive = false);
+    ~reactor();
+
+    void loop();                                    //运行事件循环
+
+private:
+    void handle_accept();                           //批量接受新连接
+    void handle_event(int sockfd, uint32_t events); //处理已连接socket上的事件
+    void close_conn(http_conn* user);               //删除定时器并关闭连接
+    void stop_accept();                             //从epoll中移除监听socket
+    void dispatch(http_conn* user);                 //解析处理请求, 有线程池时交给线程池
+    void shed(http_conn* user);                     //过载时回复503并关闭连接
+    void handle_upstream(http_conn* user, upstream_pool::STATUS status);  //按转发的进展设置定时器和后续处理
+
+private:
+    int m_epollfd;                                  //该reactor独占的epoll对象
+    epoll_event* m_events;                          //监听事件数组
+    int m_max_events;                               //epoll_wait一次最多返回的事件数
+    upstream_pool m_upstreams;                      //本reactor到反向代理后端的连接
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "router.h"
+#include <string>
+#include <vector>
+
+namespace
+{
+
+//基数树的节点, 节点对应的路径是从根到它的所有标签连起来
+struct route_node
+{
+    std::string label;                                  //从父节点到这个节点的路径片段
+    std::string first;                                  //每个子节点标签的首字节, 和children一一对应
+    std::vector<route_node*> children;                  //子节点的标签首字节互不相同
+    route_handler exact[http_conn::METHOD_NUMBER];      //路径正好到这个节点为止的路由
+    route_handler prefix[http_conn::METHOD_NUMBER];     //以这个节点的路径为前缀的路由
+    int exact_methods;                                  //exact中注册了处理函数的方法
+    int prefix_methods;                                 //prefix中注册了处理函数的方法
+
+    route_node(): exact_methods(0), prefix_methods(0)
+    {
+        for(int i = 0; i < http_conn::METHOD_NUMBER; ++i)
+        {
+            exact[i] = nullptr;
+            prefix[i] = nullptr;
+        }
+    }
+};
+
+//根节点的标签为空, 节点注册后一直存在, 不释放
+route_node root;
+
+//找到路径为path的节点, 不存在时创建; 新路径和已有的标签只有一部分相同时把标签拆成两个节点
+route_node* insert(const char* path, int len)
+{
+    route_node* node = &root;
+    int pos = 0;
+    while(pos < len)
+    {
+        size_t index = node->first.find(path[pos]);
+        if(index == std::string::npos)
+        {
+            //没有首字节相同的子节点, 剩下的路径整个作为新节点的标签
+            route_node* child = new route_node;
+            child->label.assign(path + pos, len - pos);
+            node->first.push_back(path[pos]);
+            node->children.push_back(child);
+            return child;
+        }
+
+        route_node* child = node->children[index];
+        int common = 0;
+        int max = len - pos < (int)child->label.size() ? len - pos : child->label.size();
+        while(common < max && child->label[common] == path[pos + common])
+        {
+            ++common;
+        }
+        if(common < (int)child->label.size())
+        {
+            //新的中间节点拿走相同的部分, 原来的子节点留下后面的部分, 首字节不变
+            route_node* middle = new route_node;
+            middle->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            middle->first.push_back(child->label[0]);
+            middle->children.push_back(child);
+            node->children[index] = middle;
+            child = middle;
+        }
+        pos += common;
+        node = child;
+    }
+    return node;
+}
+
+}
+
+
+bool router::add(int methods, const char* path, route_handler handler)
+{
+    int len = strlen(path);
+    bool is_prefix = len > 0 && path[len - 1] == '*';
+    if(is_prefix)
+    {
+        --len;
+    }
+
+    route_node* node = insert(path, len);
+    route_handler* handlers = is_prefix ? node->prefix : node->exact;
+    int& registered = is_prefix ? node->prefix_methods : node->exact_methods;
+    if(registered & methods)
+    {
+        return false;
+    }
+    for(int m = 0; m < http_conn::METHOD_NUMBER; ++m)
+    {
+        if(methods & ROUTE_METHOD(m))
+        {
+            handlers[m] = handler;
+        }
+    }
+    registered |= methods;
+    return true;
+}
+
+route_handler router::match(int method, const char* path, int len, int* allowed)
+{
+    const route_node* node = &root;
+    const route_node* longest = nullptr;        //经过的节点中最深的前缀路由
+    int pos = 0;
+    while(true)
+    {
+        if(node->prefix_methods)
+        {
+            longest = node;
+        }
+        if(pos == len)
+        {
+            break;
+        }
+
+        //按首字节找子节点, 再比较整个标签
+        const char* first = node->first.data();
+        const char* p = static_cast<const char*>(memchr(first, path[pos], node->first.size()));
+        if(p == nullptr)
+        {
+            node = nullptr;
+            break;
+        }
+        const route_node* child = node->children[p - first];
+        int label_len = child->label.size();
+        if(label_len > len - pos || memcmp(child->label.data(), path + pos, label_len) != 0)
+        {
+            node = nullptr;
+            break;
+        }
+        pos += label_len;
+        node = child;
+    }
+
+    *allowed = (node ? node->exact_methods : 0) | (longest ? longest->prefix_methods : 0);
+    if(node && node->exact[method])
+    {
+        return node->exact[method];
+    }
+    if(longest && longest->prefix[method])
+    {
+        return longest->prefix[method];
+    }
+    return nullptr;
+}
@@ -0,0 +1,40 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "http_conn.h"
+
+#define ROUTE_METHOD(m) (1 << (m))                  //路由支持的方法是这些位的组合
+#define ROUTE_GET ROUTE_METHOD(http_conn::GET)
+#define ROUTE_POST ROUTE_METHOD(http_conn::POST)
+#define ROUTE_HEAD ROUTE_METHOD(http_conn::HEAD)
+#define ROUTE_PUT ROUTE_METHOD(http_conn::PUT)
+#define ROUTE_DELETE ROUTE_METHOD(http_conn::DELETE)
+#define ROUTE_ANY ((1 << http_conn::METHOD_NUMBER) - 1)    //所有方法
+
+
+//路由的处理函数, 在解析出完整请求的线程中调用
+//通过conn读取请求的方法、URL、头部和请求数据, 用conn->reply把响应直接写进连接的写缓冲区并返回它的结果;
+//也可以不写响应, 返回NO_RESOURCE、BAD_REQUEST、FORBIDDEN_REQUEST或INTERNAL_ERROR, 由服务器生成错误页面
+typedef http_conn::HTTP_CODE (*route_handler)(http_conn* conn);
+
+
+/*
+    路由表
+    启动时注册, 按路径建成基数树(压缩前缀树), 相同前缀的路由共享节点; 每个节点按方法保存处理函数
+    注册只能在开始处理请求之前进行, 之后只读, 多个线程查找时不加锁
+    查找沿着请求的路径走一遍树, 每个节点只比较一次首字节和一次标签, 和注册了多少路由无关
+*/
+class router
+{
+public:
+    //注册路由, methods是ROUTE_GET等的组合
+    //path以*结尾时是前缀路由, 匹配所有以*前面部分开头的路径, 例如"/*"匹配所有路径
+    //同一个路径和方法已经注册过时返回false
+    static bool add(int methods, const char* path, route_handler handler);
+
+    //查找path(不含查询字符串)上method的处理函数: 精确路由优先, 其次是最长的前缀路由
+    //*allowed为这个路径上所有路由支持的方法; 路径存在但不支持method时返回nullptr并且*allowed不为0
+    static route_handler match(int method, const char* path, int len, int* allowed);
+};
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef STEAL_THREADPOOL_H
+#define STEAL_THREADPOOL_H
+
+#include <pthread.h>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+#include "locker.h"
+#include "log.h"
+#include "pool_base.h"
+#include "mpmc_queue.h"
+#include "ws_deque.h"
+#include "threadpool.h"
+#define STEAL_DEQUE_SIZE 256            //每个工作线程的工作窃取队列容量
+#define STEAL_BATCH 32                  //每次从收件队列转移到工作窃取队列的最大任务数
+
+
+/*
+    工作窃取线程池
+    每个工作线程有自己的收件队列(mpmc_queue)和Chase-Lev工作窃取队列(ws_deque)
+    append按轮询或者按任务地址(同一个连接总是同一个地址)把任务放进某个线程的收件队列,
+    线程从收件队列成批取出任务放进自己的工作窃取队列, 空闲的线程从其他线程的队列中偷取任务,
+    这样大部分时间每个线程只访问自己的队列, 一批耗时的请求也不会让其他线程的任务一直等待
+*/
+template<typename T>
+class steal_threadpool : public pool_base<T>
+{
+public:
+    //任务分配方式
+    //STEAL_ROUND_ROBIN : 轮流分配给各个线程
+    //STEAL_AFFINITY    : 同一个任务对象总是先分配给同一个线程, 连接的数据留在同一个核的缓存中
+    enum POLICY {STEAL_ROUND_ROBIN = 0, STEAL_AFFINITY};
+
+    steal_threadpool(int thread_number = THREAD_NUMBER, int max_requests = MAX_REQUESTS, POLICY policy = STEAL_ROUND_ROBIN);
+    ~steal_threadpool();
+
+    bool append(T* request);
+    int size() const;
+    int thread_number() const {return m_thread_number;}
+
+private:
+    //每个工作线程独占的数据, 按缓存行对齐, 避免不同线程的数据共享缓存行
+    struct alignas(CACHE_LINE_SIZE) worker_data
+    {
+        worker_data(int capacity):inbox(capacity), deque(STEAL_DEQUE_SIZE), parked(false){}
+
+        steal_threadpool* pool;
+        int index;
+        pthread_t thread;
+        mpmc_queue<T*> inbox;           //其他线程放入的任务
+        ws_deque<T*> deque;             //拥有者取任务, 其他线程偷任务
+        sem wakeup;                     //休眠时在这个信号量上等待
+        std::atomic<bool> parked;       //是否已经准备休眠
+    };
+
+    static void* worker(void* arg);
+    void run(worker_data* self);
+    //依次从自己的工作窃取队列、自己的收件队列和其他线程的队列中找一个任务
+    bool find_task(worker_data* self, T*& request);
+    //唤醒指定的线程, 它没有休眠时返回false
+    bool wake(worker_data* w);
+
+private:
+    int m_thread_number;                        //线程池中线程数量
+    POLICY m_policy;                            //任务分配方式
+    std::vector<worker_data*> m_workers;        //所有工作线程
+    std::atomic<unsigned> m_next;               //轮询分配的下一个线程
+    std::atomic<bool> m_stop;                   //线程停止运行标志
+};
+
+template<typename T>
+steal_threadpool<T>::steal_threadpool(int thread_number, int max_requests, POLICY policy):
+        m_thread_number(thread_number), m_policy(policy), m_next(0), m_stop(false)
+{
+    //总的等待任务数量平均分给各个线程的收件队列
+    int capacity = max_requests / thread_number + 1;
+    for(int i = 0; i < thread_number; ++i)
+    {
+        worker_data* w = new worker_data(capacity);
+        w->pool = this;
+        w->index = i;
+        m_workers.push_back(w);
+    }
+    for(int i = 0; i < thread_number; ++i)
+    {
+        LOG_INFO("create %d pthread", i + 1);
+        if(pthread_create(&m_workers[i]->thread, nullptr, worker, m_workers[i]) != 0)
+        {
+            //没有线程的队列不会被取走, 只保留已经创建的线程, 任务只分配给它们, 析构时也只等待它们
+            LOG_ERROR("pthread_create error, %d threads running", i);
+            for(int j = i; j < thread_number; ++j)
+            {
+                delete m_workers[j];
+            }
+            m_workers.resize(i);
+            m_thread_number = i;
+            break;
+        }
+    }
+}
+
+template<typename T>
+steal_threadpool<T>::~steal_threadpool()
+{
+    //线程停止运行, 唤醒所有休眠的线程并等待它们退出
+    m_stop = true;
+    for(int i = 0; i < m_thread_number; ++i)
+    {
+        m_workers[i]->wakeup.post();
+    }
+    for(int i = 0; i < m_thread_number; ++i)
+    {
+        pthread_join(m_workers[i]->thread, nullptr);
+        delete m_workers[i];
+    }
+}
+
+template<typename T>
+bool steal_threadpool<T>::append(T* request)
+{
+    unsigned index;
+    if(m_policy == STEAL_AFFINITY)
+    {
+        //对象在连接表中的下标
+        index = (uintptr_t)request / sizeof(T) % m_thread_number;
+    }
+    else
+    {
+        index = m_next.fetch_add(1, std::memory_order_relaxed) % m_thread_number;
+    }
+
+    //目标线程的收件队列满了就依次尝试其他线程
+    int tried = 0;
+    while(!m_workers[index]->inbox.push(request))
+    {
+        if(++tried == m_thread_number)
+        {
+            return false;
+        }
+        index = (index + 1) % m_thread_number;
+    }
+
+    //和工作线程的"登记休眠后再检查队列"配对, 见threadpool::append
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    //优先唤醒目标线程; 它正在忙时唤醒一个空闲线程来偷取任务
+    if(wake(m_workers[index]))
+    {
+        return true;
+    }
+    for(int i = 1; i < m_thread_number; ++i)
+    {
+        if(wake(m_workers[(index + i) % m_thread_number]))
+        {
+            break;
+        }
+    }
+    return true;
+}
+
+template<typename T>
+int steal_threadpool<T>::size() const
+{
+    int total = 0;
+    for(int i = 0; i < m_thread_number; ++i)
+    {
+        total += m_workers[i]->inbox.size() + m_workers[i]->deque.size();
+    }
+    return total;
+}
+
+template<typename T>
+bool steal_threadpool<T>::wake(worker_data* w)
+{
+    if(!w->parked.load(std::memory_order_relaxed))
+    {
+        return false;
+    }
+    bool expected = true;
+    if(!w->parked.compare_exchange_strong(expected, false))
+    {
+        return false;
+    }
+    w->wakeup.post();
+    return true;
+}
+
+template<typename T>
+void* steal_threadpool<T>::worker(void* arg)
+{
+    worker_data* self = static_cast<worker_data*>(arg);
+    self->pool->run(self);
+    return self;
+}
+
+template<typename T>
+bool steal_threadpool<T>::find_task(worker_data* self, T*& request)
+{
+    if(self->deque.pop(request))
+    {
+        return true;
+    }
+
+    //自己的队列空了, 从收件队列取一批: 第一个马上执行, 其余的放进工作窃取队列供自己和其他线程取用
+    if(self->inbox.pop(request))
+    {
+        T* next;
+        for(int i = 1; i < STEAL_BATCH && self->inbox.pop(next); ++i)
+        {
+            self->deque.push(next);
+        }
+        return true;
+    }
+
+    //从其他线程偷取, 先偷已经转移到工作窃取队列的任务, 再偷收件队列中还没有被取走的任务
+    for(int i = 1; i < m_thread_number; ++i)
+    {
+        worker_data* victim = m_workers[(self->index + i) % m_thread_number];
+        if(victim->deque.steal(request) || victim->inbox.pop(request))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+void steal_threadpool<T>::run(worker_data* self)
+{
+    T* request = nullptr;
+    while(!m_stop)
+    {
+        //先自旋一段时间, 任务密集时不用进入内核休眠和唤醒
+        bool got = false;
+        for(int i = 0; i < THREADPOOL_SPIN && !got; ++i)
+        {
+            got = find_task(self, request);
+            if(!got)
+            {
+                cpu_relax();
+            }
+        }
+
+        if(!got)
+        {
+            //登记休眠后再找一次任务, 避免错过登记前刚放入的任务
+            self->parked.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            got = find_task(self, request);
+            if(got)
+            {
+                //取消登记; 如果已经被生产者清除, 多出来的一次post只会造成一次空唤醒
+                self->parked.store(false);
+            }
+            else
+            {
+                self->wakeup.wait();
+                continue;
+            }
+        }
+
+        //执行任务
+        request->process();
+    }
+}
+
+#endif
@@ -1,17 +1,24 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
-#include <list>
 #include <pthread.h>
-#include <cstdio>
+#include <atomic>
 #include "locker.h"
+#include "log.h"
+#include "mpmc_queue.h"
+#include "pool_base.h"
 #define THREAD_NUMBER 4
 #define MAX_REQUESTS 10000
+#define THREADPOOL_SPIN 2000            //工作线程没有任务时在休眠前自旋检查队列的次数
+#define THREADPOOL_MAX_THREADS 256      //运行时调整线程数量的上限
 
 
 
+//所有工作线程共享一个任务队列的线程池
+//线程数量可以在运行时调整: 减少时多出的线程处理完手上的任务或者下一次被唤醒时自己退出, 调整的线程不等待,
+//增加时先复用还没有退出的线程
 template<typename T>
-class threadpool
+class threadpool : public pool_base<T>
 {
 public:
     threadpool(int thread_number = THREAD_NUMBER, int max_requests = MAX_REQUESTS);
@@ -19,97 +26,284 @@ public:
 
     //将新的任务加入任务队列
     bool append(T* request);
+    int size() const {return m_workqueue.size();}
+    int thread_number() const {return m_thread_number;}
+    //修改工作线程数量, 在任意一个线程中调用, 不等待多出的线程退出
+    bool resize(int thread_number);
 private:
+    enum WORKER_STATE {WORKER_RUNNING = 0, WORKER_RETIRING, WORKER_EXITED};
+    //一个工作线程的位置, 线程退出后位置可以给新线程使用
+    struct worker_slot
+    {
+        threadpool* pool;
+        pthread_t thread;
+        bool joinable;                  //线程已经创建、还没有被join
+        std::atomic<int> state;         //WORKER_STATE
+    };
+
     //工作线程运行时的函数
     static void* worker(void* arg);
     //线程执行任务所用函数
-    void run();
+    void run(worker_slot* slot);
+    //在slot上创建工作线程
+    bool start_worker(worker_slot* slot);
+    //被要求退出的线程确认退出, 线程数量又被调大时返回false继续运行
+    bool retire(worker_slot* slot);
+    //唤醒一个正在休眠的工作线程, 没有线程休眠时不做系统调用
+    void wake_one();
+    //唤醒所有正在休眠的工作线程
+    void wake_all();
+    //登记休眠后又拿到了任务, 取消登记
+    void cancel_idle();
 private:
-    int m_thread_number;                //线程池中线程数量
-    pthread_t* m_threads;               //存放线程池中线程ID的数组
+    int m_thread_number;                //正在运行的线程数量
+    worker_slot* m_slots;               //工作线程的位置, 前m_thread_number个正在运行
     int m_max_requests;                 //请求队列中最多允许等待的任务数量
-    std::list<T*> m_workqueue;          //任务队列
-    locker m_queuelocker;               //保护任务队列的互斥锁
-    sem m_requests_number;              //信号量，值等于任务队列中的任务数量
-    bool m_stop;                        //线程停止运行标志
+    mpmc_queue<T*> m_workqueue;         //任务队列, 无锁, 入队出队不申请内存
+    sem m_wakeup;                       //休眠的工作线程在这个信号量上等待
+    std::atomic<int> m_idle;            //已经准备休眠、还没有被唤醒的工作线程数量
+    std::atomic<bool> m_stop;           //线程停止运行标志
+    locker m_resize_locker;             //保护m_thread_number和m_slots的创建、回收
 };
 
 template<typename T>
 threadpool<T>::threadpool(int thread_number, int max_requests):
-        m_thread_number(thread_number), m_max_requests(max_requests), m_threads(nullptr), m_stop(false)
+        m_thread_number(0), m_slots(nullptr), m_max_requests(max_requests),
+        m_workqueue(max_requests), m_idle(0), m_stop(false)
 {
-    //创建线程ID数组以及线程
+    //创建线程位置数组以及线程
+    m_slots = new worker_slot[THREADPOOL_MAX_THREADS];
+    for(int i = 0; i < THREADPOOL_MAX_THREADS; ++i)
+    {
+        m_slots[i].pool = this;
+        m_slots[i].joinable = false;
+        m_slots[i].state.store(WORKER_EXITED, std::memory_order_relaxed);
+    }
+    resize(thread_number);
+}
 
-    m_threads = new pthread_t[m_thread_number];
-    
-    for(int i = 0; i < thread_number; ++i)
+template<typename T>
+threadpool<T>::~threadpool()
+{
+    //线程停止运行, 唤醒所有休眠的线程并等待它们退出
+    //已经被要求退出、还在休眠的线程也要唤醒
+    m_stop = true;
+    for(int i = 0; i < THREADPOOL_MAX_THREADS; ++i)
+    {
+        if(m_slots[i].joinable)
+        {
+            m_wakeup.post();
+        }
+    }
+    for(int i = 0; i < THREADPOOL_MAX_THREADS; ++i)
     {
-        printf("create %d pthread\n", i + 1);
-        pthread_create(m_threads + i, nullptr, worker, this);
-        pthread_detach(m_threads[i]);
+        if(m_slots[i].joinable)
+        {
+            pthread_join(m_slots[i].thread, nullptr);
+        }
+    }
+    delete [] m_slots;
+}
 
+template<typename T>
+bool threadpool<T>::start_worker(worker_slot* slot)
+{
+    //上一个在这个位置上的线程已经确认退出, 回收后再创建新线程
+    if(slot->joinable)
+    {
+        pthread_join(slot->thread, nullptr);
+        slot->joinable = false;
     }
+    slot->state.store(WORKER_RUNNING, std::memory_order_relaxed);
+    if(pthread_create(&slot->thread, nullptr, worker, slot) != 0)
+    {
+        slot->state.store(WORKER_EXITED, std::memory_order_relaxed);
+        return false;
+    }
+    slot->joinable = true;
+    return true;
 }
 
 template<typename T>
-threadpool<T>::~threadpool()
+bool threadpool<T>::resize(int thread_number)
 {
+    if(thread_number < 1)
+    {
+        thread_number = 1;
+    }
+    if(thread_number > THREADPOOL_MAX_THREADS)
+    {
+        thread_number = THREADPOOL_MAX_THREADS;
+    }
 
-    delete [] m_threads;
-    //线程停止运行
-    m_stop = true;
+    m_resize_locker.lock();
+    if(thread_number < m_thread_number)
+    {
+        //标记多出的线程, 它们在处理完当前任务或者被唤醒后自己退出
+        //resize在reactor线程中被SIGHUP调用, 不能等待它们退出, 否则这个reactor上所有连接的IO都会停顿
+        for(int i = thread_number; i < m_thread_number; ++i)
+        {
+            m_slots[i].state.store(WORKER_RETIRING);
+        }
+        //和工作线程"登记休眠后检查状态"配对, 已经登记休眠的线程都会被唤醒
+        //共享的信号量不能指定唤醒哪个线程, 按要退出的线程数多发几次, 被多唤醒的线程重新登记休眠;
+        //仍然没有轮到的线程在之后的某次唤醒时退出, 它用掉的唤醒由retire转交
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake_all();
+        for(int i = thread_number; i < m_thread_number; ++i)
+        {
+            m_wakeup.post();
+        }
+    }
+    for(int i = m_thread_number; i < thread_number; ++i)
+    {
+        //还没有退出的线程直接继续运行, 已经退出的位置创建新线程
+        int expected = WORKER_RETIRING;
+        if(m_slots[i].state.compare_exchange_strong(expected, WORKER_RUNNING))
+        {
+            continue;
+        }
+        if(!start_worker(m_slots + i))
+        {
+            LOG_ERROR("pthread_create error, %d threads running", i);
+            thread_number = i;
+            break;
+        }
+    }
+    LOG_INFO("threadpool: %d threads", thread_number);
+    m_thread_number = thread_number;
+    m_resize_locker.unlock();
+    return true;
 }
 
 template<typename T>
 bool threadpool<T>::append(T* request)
 {
-    //临界区，加锁
-    m_queuelocker.lock();
     //如果任务队列已满, 则返回错误
-    if(m_workqueue.size() > m_max_requests)
+    if(!m_workqueue.push(request))
     {
-        m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_requests_number.post();
-    
 
+    //入队和检查休眠线程数量之间需要全屏障, 和工作线程的"登记休眠后再检查队列"配对,
+    //保证不会出现任务已经入队而所有线程都在休眠的情况
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_idle.load(std::memory_order_relaxed) > 0)
+    {
+        wake_one();
+    }
+    return true;
+}
+
+template<typename T>
+void threadpool<T>::wake_one()
+{
+    //先把休眠线程数量减一再post, 多个生产者不会为同一个休眠线程重复post
+    int idle = m_idle.load(std::memory_order_relaxed);
+    while(idle > 0)
+    {
+        if(m_idle.compare_exchange_weak(idle, idle - 1))
+        {
+            m_wakeup.post();
+            return;
+        }
+    }
+}
+
+template<typename T>
+void threadpool<T>::wake_all()
+{
+    int idle = m_idle.exchange(0);
+    for(int i = 0; i < idle; ++i)
+    {
+        m_wakeup.post();
+    }
+}
+
+template<typename T>
+void threadpool<T>::cancel_idle()
+{
+    //如果已经被生产者减掉, 多出来的一次post只会造成一次空唤醒
+    int idle = m_idle.load(std::memory_order_relaxed);
+    while(idle > 0 && !m_idle.compare_exchange_weak(idle, idle - 1))
+    {
+    }
+}
+
+template<typename T>
+bool threadpool<T>::retire(worker_slot* slot)
+{
+    int expected = WORKER_RETIRING;
+    if(!slot->state.compare_exchange_strong(expected, WORKER_EXITED))
+    {
+        return false;
+    }
+    //退出的线程可能用掉了本来给其他线程的唤醒(那个线程已经不在休眠计数中), 队列中还有任务时直接补发一次;
+    //多出来的唤醒只会让一个线程空转一次
+    if(m_workqueue.size() > 0)
+    {
+        m_wakeup.post();
+    }
     return true;
 }
 
 template<typename T>
 void* threadpool<T>::worker(void* arg)
 {
-    threadpool* pool = static_cast<threadpool*>(arg);
-    pool->run();
-    
-    //没有意义的返回值, 不可能执行到这里
-    return pool;
+    worker_slot* slot = static_cast<worker_slot*>(arg);
+    slot->pool->run(slot);
+
+    return slot->pool;
 
 }
 
 template<typename T>
-void threadpool<T>::run()
+void threadpool<T>::run(worker_slot* slot)
 {
+    T* request = nullptr;
     while(!m_stop)
     {
-        //取出任务, 信号量减少
-        m_requests_number.wait();
-        //临界区, 上锁
-        m_queuelocker.lock();
-
-        //取任务
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
+        //线程数量被调小, 处理完上一个任务后退出
+        if(slot->state.load(std::memory_order_relaxed) == WORKER_RETIRING && retire(slot))
+        {
+            break;
+        }
 
-        //解锁
-        m_queuelocker.unlock();
+        //先自旋一段时间, 任务密集时不用进入内核休眠和唤醒
+        bool got = false;
+        for(int i = 0; i < THREADPOOL_SPIN && !got; ++i)
+        {
+            got = m_workqueue.pop(request);
+            if(!got)
+            {
+                cpu_relax();
+            }
+        }
 
+        if(!got)
+        {
+            //登记休眠后再检查一次队列和退出标记, 避免错过登记前刚入队的任务或者刚发出的退出要求
+            m_idle.fetch_add(1);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            got = m_workqueue.pop(request);
+            if(got)
+            {
+                cancel_idle();
+            }
+            else if(slot->state.load(std::memory_order_relaxed) == WORKER_RETIRING)
+            {
+                cancel_idle();
+                continue;
+            }
+            else
+            {
+                m_wakeup.wait();
+                continue;
+            }
+        }
 
         //执行任务
         request->process();
     }
 }
-#endif
\ No newline at end of file
+#endif
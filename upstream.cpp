@@ -0,0 +1,1241 @@
+#include "upstream.h"
+#include "router.h"
+#include "config.h"
+#include "log.h"
+#include <atomic>
+#include <string>
+#include <netdb.h>
+#include <poll.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+
+//修改epoll中监听的文件描述符的监听内容, 并重置epolloneshot事件
+extern void modfd(int epollfd, int fd, int ev);
+
+
+namespace
+{
+
+//还没有向客户端转发任何数据时出错的响应, 不经过写缓冲区, 一次send发完
+const char bad_gateway_response[] =
+    "HTTP/1.1 502 Bad Gateway\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 42\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "The upstream server could not be reached.\n";
+
+//一个后端, 所有reactor共享
+struct upstream_backend
+{
+    std::string name;                       //配置中的地址, 输出日志时使用
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    int index;                              //在所有后端中的下标, 空闲连接按它分组
+    std::atomic<int> outstanding;           //所有reactor中正在转发给它的请求数
+    std::atomic<bool> healthy;              //健康检查的结果
+};
+
+//一条转发规则
+struct upstream_group
+{
+    std::string path;                       //路由的路径, 不含结尾的*
+    bool prefix;                            //是否是前缀路由
+    std::vector<upstream_backend*> backends;
+    std::atomic<unsigned> next;             //未完成请求数相同时轮流选择, 每次从不同的后端开始比较
+};
+
+//启动时创建, 之后不再修改
+std::vector<upstream_backend*> backends;
+std::vector<upstream_group*> groups;
+
+pthread_t health_thread;
+bool health_started = false;
+int health_stopfd = -1;                     //通知健康检查线程退出
+
+
+//回复502, 调用方随后关闭连接
+void bad_gateway(int sockfd)
+{
+    send(sockfd, bad_gateway_response, sizeof(bad_gateway_response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    metrics::add(METRIC_SYSCALLS);
+}
+
+//标记后端的健康状态, 状态变化时输出日志
+void set_healthy(upstream_backend* b, bool healthy, const char* reason)
+{
+    if(b->healthy.exchange(healthy) != healthy)
+    {
+        if(healthy)
+        {
+            LOG_INFO("upstream %s is up", b->name.c_str());
+        }
+        else
+        {
+            LOG_WARN("upstream %s is down: %s", b->name.c_str(), reason);
+        }
+    }
+}
+
+//解析"IP:端口"、"主机名:端口"、"[IPv6]:端口"或者"unix:路径"
+bool parse_address(const std::string& text, upstream_backend* b)
+{
+    memset(&b->addr, 0, sizeof(b->addr));
+    if(text.compare(0, 5, "unix:") == 0)
+    {
+        sockaddr_un* addr = reinterpret_cast<sockaddr_un*>(&b->addr);
+        std::string path = text.substr(5);
+        if(path.empty() || path.size() >= sizeof(addr->sun_path))
+        {
+            return false;
+        }
+        addr->sun_family = AF_UNIX;
+        memcpy(addr->sun_path, path.c_str(), path.size() + 1);
+        b->addr_len = offsetof(sockaddr_un, sun_path) + path.size() + 1;
+        return true;
+    }
+
+    size_t colon = text.rfind(':');
+    if(colon == std::string::npos || colon == 0 || colon + 1 == text.size())
+    {
+        return false;
+    }
+    std::string host = text.substr(0, colon);
+    std::string port = text.substr(colon + 1);
+    if(host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')
+    {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    //启动时解析一次, 之后不再查询DNS
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if(getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 || result == nullptr)
+    {
+        return false;
+    }
+    memcpy(&b->addr, result->ai_addr, result->ai_addrlen);
+    b->addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+//去掉首尾的空白
+std::string trim(const std::string& s)
+{
+    size_t begin = s.find_first_not_of(" \t");
+    if(begin == std::string::npos)
+    {
+        return std::string();
+    }
+    size_t end = s.find_last_not_of(" \t");
+    return s.substr(begin, end - begin + 1);
+}
+
+//连接一次后端, 在timeout毫秒内连上则认为健康
+bool probe(upstream_backend* b, int timeout, std::string* reason)
+{
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        *reason = strerror(errno);
+        return false;
+    }
+    int err = 0;
+    if(connect(fd, reinterpret_cast<sockaddr*>(&b->addr), b->addr_len) < 0)
+    {
+        err = errno;
+        if(err == EINPROGRESS)
+        {
+            pollfd pfd = {fd, POLLOUT, 0};
+            if(poll(&pfd, 1, timeout) <= 0)
+            {
+                err = ETIMEDOUT;
+            }
+            else
+            {
+                socklen_t len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            }
+        }
+    }
+    close(fd);
+    if(err != 0)
+    {
+        *reason = strerror(err);
+        return false;
+    }
+    return true;
+}
+
+void* health_worker(void*)
+{
+    while(true)
+    {
+        for(size_t i = 0; i < backends.size(); ++i)
+        {
+            std::string reason;
+            bool healthy = probe(backends[i], UPSTREAM_HEALTH_TIMEOUT, &reason);
+            set_healthy(backends[i], healthy, reason.c_str());
+        }
+
+        //等待下一个周期, 周期可以重新加载
+        pollfd pfd = {health_stopfd, POLLIN, 0};
+        if(poll(&pfd, 1, config::get()->upstream_health_interval) > 0)
+        {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+//在健康的后端中选择未完成请求最少的一个, 都不健康时在所有后端中选择
+upstream_backend* pick(upstream_group* g)
+{
+    int n = g->backends.size();
+    unsigned start = g->next.fetch_add(1, std::memory_order_relaxed);
+    upstream_backend* best = nullptr;
+    bool best_healthy = false;
+    int best_load = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        upstream_backend* b = g->backends[(start + i) % n];
+        bool healthy = b->healthy.load(std::memory_order_relaxed);
+        int load = b->outstanding.load(std::memory_order_relaxed);
+        if(best == nullptr || (healthy && !best_healthy) || (healthy == best_healthy && load < best_load))
+        {
+            best = b;
+            best_healthy = healthy;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+}
+
+
+//到后端的一个连接, 只由创建它的reactor访问, 空闲时留在它的连接池中
+struct upstream_conn
+{
+    enum STATE {STATE_CONNECTING = 0, STATE_SENDING, STATE_HEADER, STATE_BODY, STATE_IDLE};
+    //响应内容的结束方式: 没有内容、按Content-Length、分块编码、后端关闭连接
+    enum BODY_MODE {BODY_NONE = 0, BODY_LENGTH, BODY_CHUNKED, BODY_CLOSE};
+    //分块编码的解析状态
+    enum CHUNK_STATE {CHUNK_SIZE = 0, CHUNK_EXT, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER, CHUNK_TRAILER_LINE};
+
+    int fd;
+    int pipe[2];                            //splice响应内容用的管道, 第一次用到时创建, 和连接一起复用
+    int pipe_bytes;                         //管道中还没有发给客户端的字节数
+    upstream_backend* backend;
+    int group;                              //请求匹配的转发规则
+    http_conn* client;                      //正在转发的客户端连接, 空闲时为nullptr
+    STATE state;
+    bool reused;                            //从连接池中取出的连接, 后端可能已经关闭了它
+    bool client_armed;                      //客户端socket是否已经在epoll中注册
+    int attempts;                           //这个请求已经尝试过的连接数
+    int sent;                               //请求已经发给后端的字节数
+    char* header;                           //后端的响应头部, 从内存池申请, 转发后归还
+    int header_len;
+    BODY_MODE mode;
+    long long remaining;                    //BODY_LENGTH: 还没有从后端读取的字节数
+    CHUNK_STATE chunk_state;
+    long long chunk_size;                   //当前块还没有读取的字节数
+    int chunk_digits;                       //块大小已经读到的数字个数
+    bool eof;                               //响应内容已经全部从后端读完
+    bool keepalive;                         //响应转发完后后端连接能否复用
+    bool linger;                            //响应转发完后客户端连接是否保持
+    chain_buffer out;                       //要发给客户端的响应头部和拷贝的响应内容, 先于管道中的数据发送
+};
+
+namespace
+{
+
+//从分块编码的数据中找出属于这个响应的部分, 返回消耗的字节数, 格式错误返回-1; 找到结尾时设置eof
+int scan_chunked(upstream_conn* u, const char* data, int len)
+{
+    int i = 0;
+    while(i < len && !u->eof)
+    {
+        char c = data[i];
+        switch(u->chunk_state)
+        {
+            case upstream_conn::CHUNK_SIZE:
+            {
+                int digit = c >= '0' && c <= '9' ? c - '0' : (c >= 'a' && c <= 'f' ? c - 'a' + 10 : (c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1));
+                if(digit >= 0)
+                {
+                    if(++u->chunk_digits > 15)
+                    {
+                        return -1;
+                    }
+                    u->chunk_size = u->chunk_size * 16 + digit;
+                    ++i;
+                }
+                else if(u->chunk_digits > 0 && (c == ';' || c == ' ' || c == '\t' || c == '\r'))
+                {
+                    u->chunk_state = upstream_conn::CHUNK_EXT;
+                }
+                else
+                {
+                    return -1;
+                }
+                break;
+            }
+            case upstream_conn::CHUNK_EXT:
+            {
+                //块扩展一直到行尾
+                if(c == '\n')
+                {
+                    u->chunk_state = u->chunk_size > 0 ? upstream_conn::CHUNK_DATA : upstream_conn::CHUNK_TRAILER;
+                }
+                ++i;
+                break;
+            }
+            case upstream_conn::CHUNK_DATA:
+            {
+                int n = len - i < u->chunk_size ? len - i : u->chunk_size;
+                i += n;
+                u->chunk_size -= n;
+                if(u->chunk_size == 0)
+                {
+                    u->chunk_state = upstream_conn::CHUNK_DATA_END;
+                }
+                break;
+            }
+            case upstream_conn::CHUNK_DATA_END:
+            {
+                //块数据后面是\r\n
+                if(c == '\n')
+                {
+                    u->chunk_state = upstream_conn::CHUNK_SIZE;
+                    u->chunk_digits = 0;
+                }
+                else if(c != '\r')
+                {
+                    return -1;
+                }
+                ++i;
+                break;
+            }
+            case upstream_conn::CHUNK_TRAILER:
+            {
+                //最后一个块之后是若干行trailer和一个空行
+                if(c == '\n')
+                {
+                    u->eof = true;
+                }
+                else if(c != '\r')
+                {
+                    u->chunk_state = upstream_conn::CHUNK_TRAILER_LINE;
+                }
+                ++i;
+                break;
+            }
+            case upstream_conn::CHUNK_TRAILER_LINE:
+            {
+                if(c == '\n')
+                {
+                    u->chunk_state = upstream_conn::CHUNK_TRAILER;
+                }
+                ++i;
+                break;
+            }
+        }
+    }
+    return i;
+}
+
+//从后端读到的数据中属于响应内容的字节数, 格式错误返回-1
+int body_bytes(upstream_conn* u, const char* data, int len)
+{
+    if(u->eof)
+    {
+        return 0;
+    }
+    switch(u->mode)
+    {
+        case upstream_conn::BODY_LENGTH:
+        {
+            int n = len < u->remaining ? len : u->remaining;
+            u->remaining -= n;
+            u->eof = u->remaining == 0;
+            return n;
+        }
+        case upstream_conn::BODY_CHUNKED:
+            return scan_chunked(u, data, len);
+        case upstream_conn::BODY_CLOSE:
+            return len;
+        default:
+            return 0;
+    }
+}
+
+//头部字段的值中是否有token(逗号分隔, 不区分大小写)
+bool has_token(const char* value, int len, const char* token)
+{
+    int token_len = strlen(token);
+    const char* p = value;
+    const char* end = value + len;
+    while(p < end)
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            ++p;
+        }
+        const char* item = p;
+        p += http_scan(p, end - p, ",", 1);
+        const char* item_end = p;
+        while(item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t'))
+        {
+            --item_end;
+        }
+        if(item_end - item == token_len && strncasecmp(item, token, token_len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+
+bool upstream::init(const char* rules)
+{
+    //规则之间用分号分隔, 每条规则是"路径=后端,后端"
+    std::string text(rules);
+    size_t pos = 0;
+    while(pos < text.size())
+    {
+        size_t end = text.find(';', pos);
+        if(end == std::string::npos)
+        {
+            end = text.size();
+        }
+        std::string rule = trim(text.substr(pos, end - pos));
+        pos = end + 1;
+        if(rule.empty())
+        {
+            continue;
+        }
+
+        size_t eq = rule.find('=');
+        std::string path = trim(rule.substr(0, eq));
+        if(eq == std::string::npos || path.empty() || path[0] != '/')
+        {
+            LOG_ERROR("upstream rule %s: expected path=backend,backend", rule.c_str());
+            return false;
+        }
+        upstream_group* g = new upstream_group;
+        g->prefix = path[path.size() - 1] == '*';
+        g->path = g->prefix ? path.substr(0, path.size() - 1) : path;
+        g->next = 0;
+
+        std::string list = rule.substr(eq + 1);
+        size_t start = 0;
+        while(start <= list.size())
+        {
+            size_t comma = list.find(',', start);
+            if(comma == std::string::npos)
+            {
+                comma = list.size();
+            }
+            std::string address = trim(list.substr(start, comma - start));
+            start = comma + 1;
+            if(address.empty())
+            {
+                continue;
+            }
+            upstream_backend* b = new upstream_backend;
+            b->name = address;
+            if(!parse_address(address, b))
+            {
+                LOG_ERROR("upstream rule %s: bad backend address %s", rule.c_str(), address.c_str());
+                delete b;
+                return false;
+            }
+            b->index = backends.size();
+            b->outstanding = 0;
+            //第一次健康检查之前认为是健康的
+            b->healthy = true;
+            backends.push_back(b);
+            g->backends.push_back(b);
+        }
+        if(g->backends.empty())
+        {
+            LOG_ERROR("upstream rule %s: no backend", rule.c_str());
+            delete g;
+            return false;
+        }
+
+        //转发规则支持所有方法, 由后端决定是否接受
+        if(!router::add(ROUTE_ANY, path.c_str(), upstream::handler))
+        {
+            LOG_ERROR("upstream rule %s: route already registered", rule.c_str());
+            delete g;
+            return false;
+        }
+        groups.push_back(g);
+        LOG_INFO("upstream %s -> %s", path.c_str(), list.c_str());
+    }
+    return true;
+}
+
+bool upstream::enabled()
+{
+    return !backends.empty();
+}
+
+bool upstream::start()
+{
+    if(backends.empty())
+    {
+        return true;
+    }
+    health_stopfd = eventfd(0, EFD_CLOEXEC);
+    if(health_stopfd < 0 || pthread_create(&health_thread, nullptr, health_worker, nullptr) != 0)
+    {
+        return false;
+    }
+    health_started = true;
+    return true;
+}
+
+void upstream::stop()
+{
+    if(!health_started)
+    {
+        return;
+    }
+    uint64_t one = 1;
+    ::write(health_stopfd, &one, sizeof(one));
+    pthread_join(health_thread, nullptr);
+    close(health_stopfd);
+    health_started = false;
+}
+
+http_conn::HTTP_CODE upstream::handler(http_conn* conn)
+{
+    //路由表已经选中了某一条转发规则, 按同样的规则(精确匹配优先, 其次最长前缀)找到它
+    int len = 0;
+    const char* url = conn->url(&len);
+    len = http_scan(url, len, "?", 1);
+    int group = -1;
+    int matched = -1;
+    for(size_t i = 0; i < groups.size(); ++i)
+    {
+        const upstream_group* g = groups[i];
+        int path_len = g->path.size();
+        if(path_len > len || memcmp(url, g->path.data(), path_len) != 0)
+        {
+            continue;
+        }
+        if(!g->prefix)
+        {
+            if(path_len == len)
+            {
+                group = i;
+                break;
+            }
+        }
+        else if(path_len > matched)
+        {
+            group = i;
+            matched = path_len;
+        }
+    }
+    if(group < 0)
+    {
+        return http_conn::NO_RESOURCE;
+    }
+    return conn->proxy(group);
+}
+
+
+upstream_pool::upstream_pool(): m_epollfd(-1), m_max_fd(0), m_conns(nullptr)
+{
+}
+
+upstream_pool::~upstream_pool()
+{
+    if(m_conns == nullptr)
+    {
+        return;
+    }
+    for(int fd = 0; fd < m_max_fd; ++fd)
+    {
+        if(m_conns[fd])
+        {
+            destroy(m_conns[fd]);
+        }
+    }
+    free(m_conns);
+}
+
+void upstream_pool::init(int epollfd)
+{
+    m_epollfd = epollfd;
+    if(!upstream::enabled())
+    {
+        return;
+    }
+    //后端连接也是文件描述符, 和客户端连接一样不能超过连接表的大小
+    //表使用清零的内存, 没有用到的部分不占用物理内存
+    m_max_fd = config::get()->max_fd;
+    m_conns = static_cast<upstream_conn**>(calloc(m_max_fd, sizeof(upstream_conn*)));
+    m_idle.resize(backends.size());
+}
+
+upstream_pool::STATUS upstream_pool::start(http_conn* client)
+{
+    metrics::add(METRIC_UPSTREAM_REQUESTS);
+    upstream_conn* u = acquire(client->proxy_group(), false);
+    if(u == nullptr)
+    {
+        LOG_WARN("upstream: no backend available");
+        metrics::add(METRIC_UPSTREAM_ERRORS);
+        bad_gateway(client->sockfd());
+        return UPSTREAM_CLOSE;
+    }
+    attach(u, client);
+    return pump(u);
+}
+
+upstream_pool::STATUS upstream_pool::resume(http_conn* client)
+{
+    upstream_conn* u = client->upstream;
+    //EPOLLONESHOT的事件已经取出, 客户端socket不再注册
+    u->client_armed = false;
+    return pump(u);
+}
+
+http_conn* upstream_pool::handle(int fd, STATUS* status)
+{
+    upstream_conn* u = m_conns[fd];
+    http_conn* client = u->client;
+    if(client == nullptr)
+    {
+        //空闲连接上有事件: 后端关闭了连接或者发来了多余的数据, 不能再复用
+        std::vector<upstream_conn*>& idle = m_idle[u->backend->index];
+        for(size_t i = 0; i < idle.size(); ++i)
+        {
+            if(idle[i] == u)
+            {
+                idle[i] = idle.back();
+                idle.pop_back();
+                break;
+            }
+        }
+        destroy(u);
+        return nullptr;
+    }
+
+    if(u->state == upstream_conn::STATE_CONNECTING)
+    {
+        //非阻塞connect的结果
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        metrics::add(METRIC_SYSCALLS);
+        if(err != 0)
+        {
+            set_healthy(u->backend, false, strerror(err));
+            *status = retry(u, true, true);
+            return client;
+        }
+        u->state = upstream_conn::STATE_SENDING;
+    }
+    *status = pump(u);
+    return client;
+}
+
+void upstream_pool::abort(http_conn* client)
+{
+    upstream_conn* u = client->upstream;
+    detach(u);
+    destroy(u);
+}
+
+upstream_conn* upstream_pool::acquire(int group, bool fresh)
+{
+    upstream_group* g = groups[group];
+    //立即失败的connect把后端标记为不健康, 下一次会选到别的后端; 每个后端最多尝试一次
+    for(size_t i = 0; i < g->backends.size(); ++i)
+    {
+        upstream_backend* b = pick(g);
+
+        //最近放回的空闲连接最可能还没有被后端关闭
+        std::vector<upstream_conn*>& idle = m_idle[b->index];
+        if(!fresh && !idle.empty())
+        {
+            upstream_conn* u = idle.back();
+            idle.pop_back();
+            u->group = group;
+            u->reused = true;
+            u->state = upstream_conn::STATE_SENDING;
+            return u;
+        }
+
+        upstream_conn* u = new upstream_conn;
+        u->fd = -1;
+        u->pipe[0] = -1;
+        u->pipe[1] = -1;
+        u->pipe_bytes = 0;
+        u->backend = b;
+        u->group = group;
+        u->client = nullptr;
+        u->reused = false;
+        u->header = nullptr;
+        u->header_len = 0;
+        u->out.init(http_conn::WRITE_BUFFER_SIZE, config::get()->write_buffer_limit);
+        if(open(u))
+        {
+            return u;
+        }
+        destroy(u);
+    }
+    return nullptr;
+}
+
+bool upstream_pool::open(upstream_conn* u)
+{
+    upstream_backend* b = u->backend;
+    int fd = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    metrics::add(METRIC_SYSCALLS);
+    if(fd < 0)
+    {
+        LOG_ERROR("upstream socket: %s", strerror(errno));
+        return false;
+    }
+    if(fd >= m_max_fd)
+    {
+        close(fd);
+        return false;
+    }
+    if(b->addr.ss_family != AF_UNIX)
+    {
+        //请求和响应头部都是一次写完的小数据, 不等待合并
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    int ret = connect(fd, reinterpret_cast<sockaddr*>(&b->addr), b->addr_len);
+    metrics::add(METRIC_SYSCALLS);
+    if(ret < 0 && errno != EINPROGRESS)
+    {
+        set_healthy(b, false, strerror(errno));
+        close(fd);
+        return false;
+    }
+    u->fd = fd;
+    m_conns[fd] = u;
+
+    //连接完成(或者失败)时可写
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLOUT | EPOLLONESHOT | EPOLLET | EPOLLRDHUP;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, fd, &event);
+    metrics::add(METRIC_SYSCALLS);
+    u->state = ret == 0 ? upstream_conn::STATE_SENDING : upstream_conn::STATE_CONNECTING;
+    return true;
+}
+
+void upstream_pool::attach(upstream_conn* u, http_conn* client)
+{
+    u->client = client;
+    client->upstream = u;
+    u->backend->outstanding.fetch_add(1, std::memory_order_relaxed);
+    u->client_armed = false;
+    u->attempts = 0;
+    u->sent = 0;
+    u->header_len = 0;
+    u->mode = upstream_conn::BODY_NONE;
+    u->remaining = 0;
+    u->chunk_state = upstream_conn::CHUNK_SIZE;
+    u->chunk_size = 0;
+    u->chunk_digits = 0;
+    u->eof = false;
+    u->keepalive = false;
+    u->linger = false;
+    //写缓冲区的上限可以在运行时重新加载
+    u->out.set_limit(config::get()->write_buffer_limit);
+}
+
+void upstream_pool::detach(upstream_conn* u)
+{
+    u->backend->outstanding.fetch_sub(1, std::memory_order_relaxed);
+    u->client->upstream = nullptr;
+    u->client = nullptr;
+}
+
+void upstream_pool::release(upstream_conn* u)
+{
+    std::vector<upstream_conn*>& idle = m_idle[u->backend->index];
+    if(!u->keepalive || (int)idle.size() >= UPSTREAM_KEEPALIVE)
+    {
+        destroy(u);
+        return;
+    }
+    //空闲时只监听可读: 后端关闭连接或者发来数据都说明这个连接不能再用
+    u->state = upstream_conn::STATE_IDLE;
+    modfd(m_epollfd, u->fd, EPOLLIN);
+    idle.push_back(u);
+}
+
+void upstream_pool::destroy(upstream_conn* u)
+{
+    if(u->fd >= 0)
+    {
+        m_conns[u->fd] = nullptr;
+        close(u->fd);
+        metrics::add(METRIC_SYSCALLS);
+    }
+    if(u->pipe[0] >= 0)
+    {
+        close(u->pipe[0]);
+        close(u->pipe[1]);
+    }
+    if(u->header)
+    {
+        buffer_pool_free(u->header, UPSTREAM_HEADER_SIZE);
+    }
+    u->out.clear();
+    delete u;
+}
+
+upstream_pool::STATUS upstream_pool::wait_backend(upstream_conn* u, int ev)
+{
+    modfd(m_epollfd, u->fd, ev);
+    //等待后端期间客户端socket只注册EPOLLRDHUP, 客户端断开时尽早放弃转发; 不注册EPOLLIN, 后续请求留在socket中
+    if(!u->client_armed)
+    {
+        modfd(m_epollfd, u->client->sockfd(), 0);
+        u->client_armed = true;
+    }
+    return UPSTREAM_WAIT_BACKEND;
+}
+
+upstream_pool::STATUS upstream_pool::wait_client(upstream_conn* u)
+{
+    modfd(m_epollfd, u->client->sockfd(), EPOLLOUT);
+    u->client_armed = true;
+    return UPSTREAM_WAIT_CLIENT;
+}
+
+upstream_pool::STATUS upstream_pool::pump(upstream_conn* u)
+{
+    http_conn* client = u->client;
+    while(true)
+    {
+        switch(u->state)
+        {
+            case upstream_conn::STATE_CONNECTING:
+                return wait_backend(u, EPOLLOUT);
+
+            case upstream_conn::STATE_SENDING:
+            {
+                //读缓冲区开头就是完整的原始请求(包括请求数据), 直接发送, 不重新组装
+                int len = 0;
+                const char* request = client->request(&len);
+                while(u->sent < len)
+                {
+                    int n = send(u->fd, request + u->sent, len - u->sent, MSG_NOSIGNAL);
+                    metrics::add(METRIC_SYSCALLS);
+                    if(n < 0)
+                    {
+                        if(errno == EAGAIN)
+                        {
+                            return wait_backend(u, EPOLLOUT);
+                        }
+                        return error(u);
+                    }
+                    u->sent += n;
+                }
+                u->state = upstream_conn::STATE_HEADER;
+                break;
+            }
+
+            case upstream_conn::STATE_HEADER:
+            {
+                if(u->header == nullptr)
+                {
+                    u->header = static_cast<char*>(buffer_pool_alloc(UPSTREAM_HEADER_SIZE));
+                    if(u->header == nullptr)
+                    {
+                        return error(u);
+                    }
+                }
+                const char* end = static_cast<const char*>(memmem(u->header, u->header_len, "\r\n\r\n", 4));
+                if(end)
+                {
+                    if(!parse_header(u, end + 4 - u->header))
+                    {
+                        return error(u);
+                    }
+                    break;
+                }
+                if(u->header_len == UPSTREAM_HEADER_SIZE)
+                {
+                    LOG_WARN("upstream %s: response header too large", u->backend->name.c_str());
+                    return error(u);
+                }
+
+                int n = recv(u->fd, u->header + u->header_len, UPSTREAM_HEADER_SIZE - u->header_len, 0);
+                metrics::add(METRIC_SYSCALLS);
+                if(n < 0 && errno == EAGAIN)
+                {
+                    return wait_backend(u, EPOLLIN);
+                }
+                if(n <= 0)
+                {
+                    return error(u);
+                }
+                u->header_len += n;
+                break;
+            }
+
+            case upstream_conn::STATE_BODY:
+            {
+                int sockfd = client->sockfd();
+                //先发已经拷贝的头部和内容, 再发管道中的内容, 保证顺序
+                while(!u->out.empty())
+                {
+                    struct iovec iov[http_conn::MAX_IOV];
+                    struct msghdr msg;
+                    memset(&msg, 0, sizeof(msg));
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = u->out.peek(iov, http_conn::MAX_IOV, u->out.size());
+                    //管道中已经有内容时让头部和内容合并到同一个TCP报文段
+                    int n = sendmsg(sockfd, &msg, MSG_NOSIGNAL | (u->pipe_bytes > 0 ? MSG_MORE : 0));
+                    metrics::add(METRIC_SYSCALLS);
+                    if(n < 0)
+                    {
+                        if(errno == EAGAIN)
+                        {
+                            return wait_client(u);
+                        }
+                        return error(u);
+                    }
+                    metrics::add(METRIC_BYTES_SENT, n);
+                    u->out.drain(n);
+                }
+                while(u->pipe_bytes > 0)
+                {
+                    int n = splice(u->pipe[0], nullptr, sockfd, nullptr, u->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    metrics::add(METRIC_SYSCALLS);
+                    if(n < 0 && errno == EAGAIN)
+                    {
+                        return wait_client(u);
+                    }
+                    if(n <= 0)
+                    {
+                        return error(u);
+                    }
+                    metrics::add(METRIC_BYTES_SENT, n);
+                    u->pipe_bytes -= n;
+                }
+                if(u->eof)
+                {
+                    return finish(u);
+                }
+
+                if(u->mode == upstream_conn::BODY_CHUNKED)
+                {
+                    //分块编码要找到结束位置, 读到用户态边检查边转发
+                    int room = 0;
+                    char* p = u->out.prepare(&room);
+                    if(p == nullptr)
+                    {
+                        return error(u);
+                    }
+                    int n = recv(u->fd, p, room, 0);
+                    metrics::add(METRIC_SYSCALLS);
+                    if(n < 0 && errno == EAGAIN)
+                    {
+                        return wait_backend(u, EPOLLIN);
+                    }
+                    if(n <= 0)
+                    {
+                        return error(u);
+                    }
+                    int used = scan_chunked(u, p, n);
+                    if(used < 0)
+                    {
+                        return error(u);
+                    }
+                    u->out.commit(used);
+                    if(used < n)
+                    {
+                        //响应之后还有数据, 后端的状态不确定, 不再复用
+                        u->keepalive = false;
+                    }
+                }
+                else
+                {
+                    //长度已知或者以关闭连接结束的内容从后端socket经过管道直接搬到客户端socket
+                    if(u->pipe[0] < 0 && pipe2(u->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+                    {
+                        u->pipe[0] = -1;
+                        return error(u);
+                    }
+                    long long want = UPSTREAM_PIPE_SIZE;
+                    if(u->mode == upstream_conn::BODY_LENGTH && u->remaining < want)
+                    {
+                        want = u->remaining;
+                    }
+                    int n = splice(u->fd, nullptr, u->pipe[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    metrics::add(METRIC_SYSCALLS);
+                    if(n < 0 && errno == EAGAIN)
+                    {
+                        return wait_backend(u, EPOLLIN);
+                    }
+                    if(n == 0 && u->mode == upstream_conn::BODY_CLOSE)
+                    {
+                        //后端关闭连接表示内容结束
+                        u->eof = true;
+                        break;
+                    }
+                    if(n <= 0)
+                    {
+                        return error(u);
+                    }
+                    u->pipe_bytes += n;
+                    if(u->mode == upstream_conn::BODY_LENGTH)
+                    {
+                        u->remaining -= n;
+                        u->eof = u->remaining == 0;
+                    }
+                }
+                break;
+            }
+
+            default:
+                return error(u);
+        }
+    }
+}
+
+//header_bytes是头部(包括结尾的空行)的长度, 后面是已经读到的响应内容
+bool upstream_pool::parse_header(upstream_conn* u, int header_bytes)
+{
+    const char* p = u->header;
+    const char* end = p + header_bytes - 2;
+
+    //状态行: HTTP/1.1 200 OK
+    int line_len = http_scan(p, end - p, "\r", 1);
+    if(line_len < 12 || memcmp(p, "HTTP/1.", 7) != 0 || p[8] != ' '
+        || p[9] < '1' || p[9] > '5' || p[10] < '0' || p[10] > '9' || p[11] < '0' || p[11] > '9')
+    {
+        LOG_WARN("upstream %s: bad status line", u->backend->name.c_str());
+        return false;
+    }
+    bool http11 = p[7] != '0';
+    int status = (p[9] - '0') * 100 + (p[10] - '0') * 10 + (p[11] - '0');
+    if(status < 200)
+    {
+        //不支持协议升级; 100 Continue等中间响应不转发, 丢掉后继续读取最终的响应
+        if(status == 101)
+        {
+            return false;
+        }
+        memmove(u->header, u->header + header_bytes, u->header_len - header_bytes);
+        u->header_len -= header_bytes;
+        return true;
+    }
+    if(!u->out.append(p, line_len + 2))
+    {
+        return false;
+    }
+    p += line_len + 2;
+
+    //转发除了逐跳头部以外的所有头部, Connection按客户端连接重新生成
+    bool close = false;
+    bool keep_alive = false;
+    bool has_encoding = false;
+    bool chunked = false;
+    long long length = -1;
+    while(p < end)
+    {
+        line_len = http_scan(p, end - p, "\r", 1);
+        const char* line = p;
+        p += line_len + 2;
+        int name_len = http_scan(line, line_len, ":", 1);
+        if(name_len == line_len)
+        {
+            return false;
+        }
+        const char* value = line + name_len + 1;
+        int value_len = line_len - name_len - 1;
+        while(value_len > 0 && (value[0] == ' ' || value[0] == '\t'))
+        {
+            ++value;
+            --value_len;
+        }
+        while(value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+        {
+            --value_len;
+        }
+
+        if(name_len == 10 && strncasecmp(line, "Connection", 10) == 0)
+        {
+            close = close || has_token(value, value_len, "close");
+            keep_alive = keep_alive || has_token(value, value_len, "keep-alive");
+            continue;
+        }
+        if((name_len == 10 && strncasecmp(line, "Keep-Alive", 10) == 0)
+            || (name_len == 16 && strncasecmp(line, "Proxy-Connection", 16) == 0))
+        {
+            continue;
+        }
+        if(name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+        {
+            //最后一个编码是chunked时按分块编码结束, 否则以关闭连接结束
+            has_encoding = true;
+            chunked = value_len >= 7 && strncasecmp(value + value_len - 7, "chunked", 7) == 0;
+        }
+        else if(name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+        {
+            long long n = 0;
+            for(int i = 0; i < value_len; ++i)
+            {
+                if(value[i] < '0' || value[i] > '9' || n > (1LL << 50))
+                {
+                    return false;
+                }
+                n = n * 10 + (value[i] - '0');
+            }
+            if(value_len == 0 || (length >= 0 && length != n))
+            {
+                return false;
+            }
+            length = n;
+        }
+        if(!u->out.append(line, line_len + 2))
+        {
+            return false;
+        }
+    }
+
+    //HEAD请求和204、304响应没有内容; Transfer-Encoding优先于Content-Length
+    if(u->client->method() == http_conn::HEAD || status == 204 || status == 304)
+    {
+        u->mode = upstream_conn::BODY_NONE;
+    }
+    else if(has_encoding)
+    {
+        u->mode = chunked ? upstream_conn::BODY_CHUNKED : upstream_conn::BODY_CLOSE;
+    }
+    else if(length >= 0)
+    {
+        u->mode = upstream_conn::BODY_LENGTH;
+        u->remaining = length;
+    }
+    else
+    {
+        u->mode = upstream_conn::BODY_CLOSE;
+    }
+    u->eof = u->mode == upstream_conn::BODY_NONE || (u->mode == upstream_conn::BODY_LENGTH && length == 0);
+    u->keepalive = (http11 ? !close : keep_alive) && u->mode != upstream_conn::BODY_CLOSE;
+    //以关闭连接结束的内容转发给客户端时也只能以关闭连接结束
+    u->linger = u->client->linger() && u->mode != upstream_conn::BODY_CLOSE;
+    if(!u->out.append(u->linger ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n", u->linger ? 26 : 21))
+    {
+        return false;
+    }
+
+    //和头部一起读到的内容
+    int extra = u->header_len - header_bytes;
+    int used = body_bytes(u, u->header + header_bytes, extra);
+    if(used < 0 || !u->out.append(u->header + header_bytes, used))
+    {
+        return false;
+    }
+    if(used < extra)
+    {
+        u->keepalive = false;
+    }
+
+    buffer_pool_free(u->header, UPSTREAM_HEADER_SIZE);
+    u->header = nullptr;
+    u->header_len = 0;
+    u->state = upstream_conn::STATE_BODY;
+    return true;
+}
+
+upstream_pool::STATUS upstream_pool::finish(upstream_conn* u)
+{
+    http_conn* client = u->client;
+    bool linger = u->linger;
+    detach(u);
+    release(u);
+    if(!linger)
+    {
+        return UPSTREAM_CLOSE;
+    }
+    //丢弃读缓冲区中已经转发的请求
+    client->finish_proxy();
+    return UPSTREAM_DONE;
+}
+
+upstream_pool::STATUS upstream_pool::error(upstream_conn* u)
+{
+    if(u->state == upstream_conn::STATE_BODY)
+    {
+        //已经向客户端转发了一部分响应, 只能关闭连接
+        LOG_WARN("upstream %s: response interrupted", u->backend->name.c_str());
+        metrics::add(METRIC_UPSTREAM_ERRORS);
+        detach(u);
+        destroy(u);
+        return UPSTREAM_CLOSE;
+    }
+    //空闲连接可能在放回连接池后被后端关闭, 后端还没有回复任何数据时换一个新连接重试;
+    //请求已经发出一部分时后端可能已经执行了它, 只有幂等的方法才能再发一次, 其他方法回复502
+    http_conn::METHOD method = u->client->method();
+    bool idempotent = method == http_conn::GET || method == http_conn::HEAD || method == http_conn::OPTIONS;
+    if(u->reused && u->header_len == 0 && (u->sent == 0 || idempotent))
+    {
+        return retry(u, false, true);
+    }
+    LOG_WARN("upstream %s: no valid response", u->backend->name.c_str());
+    http_conn* client = u->client;
+    metrics::add(METRIC_UPSTREAM_ERRORS);
+    detach(u);
+    destroy(u);
+    bad_gateway(client->sockfd());
+    return UPSTREAM_CLOSE;
+}
+
+//backend_down为true时是连接失败, 可以换另一个后端; 否则是复用的连接失效, 换一个新连接
+upstream_pool::STATUS upstream_pool::retry(upstream_conn* u, bool backend_down, bool fresh)
+{
+    http_conn* client = u->client;
+    int group = u->group;
+    int attempts = u->attempts + 1;
+    detach(u);
+    destroy(u);
+
+    //每个后端最多尝试一次, 再加上复用连接失效时的一次
+    upstream_conn* next = nullptr;
+    if(attempts <= (int)groups[group]->backends.size())
+    {
+        next = acquire(group, fresh);
+    }
+    if(next == nullptr)
+    {
+        LOG_WARN("upstream: no backend available%s", backend_down ? "" : " after a stale connection");
+        metrics::add(METRIC_UPSTREAM_ERRORS);
+        bad_gateway(client->sockfd());
+        return UPSTREAM_CLOSE;
+    }
+    attach(next, client);
+    next->attempts = attempts;
+    return pump(next);
+}
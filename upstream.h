@@ -0,0 +1,89 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stdint.h>
+#include <vector>
+#include "http_conn.h"
+
+//以下是默认值, 运行时使用config中的设置
+#define UPSTREAM_TIMEOUT 60000              //等待后端的超时时间(毫秒), 每次后端有进展时重新计算
+#define UPSTREAM_HEALTH_INTERVAL 2000       //健康检查的周期(毫秒)
+
+#define UPSTREAM_HEADER_SIZE 8192           //后端响应头部的最大长度
+#define UPSTREAM_KEEPALIVE 16               //每个reactor为每个后端保留的空闲连接数
+#define UPSTREAM_PIPE_SIZE 65536            //splice一次最多搬运的字节数, 和管道的默认容量相同
+#define UPSTREAM_HEALTH_TIMEOUT 1000        //健康检查连接后端的超时时间(毫秒)
+
+
+/*
+    反向代理的转发规则和后端
+    规则在启动时从配置中读取并注册成路由, 格式为"路径=后端,后端;路径=后端", 路径和路由表的写法相同(可以以*结尾),
+    后端是"IP:端口"、"主机名:端口"或者"unix:路径"
+    后台线程定期连接每个后端做健康检查, 转发时连接失败的后端也立即标记为不健康, 直到健康检查重新连上
+    转发时在健康的后端中选择未完成请求最少的一个
+*/
+class upstream
+{
+public:
+    static bool init(const char* rules);                        //解析转发规则并注册路由, 规则有错误时返回false
+    static bool enabled();                                      //是否配置了转发规则
+    static bool start();                                        //启动健康检查线程
+    static void stop();                                         //停止健康检查线程
+    static http_conn::HTTP_CODE handler(http_conn* conn);       //转发规则的路由处理函数
+};
+
+
+/*
+    一个reactor的后端连接池
+    请求在解析它的线程中只记下转发规则, 由reactor在前面的响应都发完后开始转发, 之后都在reactor线程中进行:
+    从空闲连接中取出或者新建到后端的非阻塞连接, 发送读缓冲区中的原始请求, 读取并改写响应头部,
+    Content-Length和以关闭连接结束的响应内容从后端socket经过管道splice到客户端socket, 不经过用户态;
+    分块编码的响应需要找到结束位置, 经过用户态转发; 后端连接的事件和客户端连接在同一个epoll中
+    响应转发完后可以复用的后端连接放回连接池, 空闲连接上有任何事件(通常是后端关闭了连接)时关闭
+*/
+class upstream_pool
+{
+public:
+    /*
+        转发的进展, reactor据此设置客户端连接的定时器和后续处理
+        UPSTREAM_WAIT_BACKEND   :   等待后端连接可读或可写
+        UPSTREAM_WAIT_CLIENT    :   等待客户端socket可写
+        UPSTREAM_DONE           :   响应转发完毕, 客户端连接保持, 可以处理下一个请求
+        UPSTREAM_CLOSE          :   应该关闭客户端连接(出错, 或者响应要求关闭连接)
+    */
+    enum STATUS {UPSTREAM_WAIT_BACKEND = 0, UPSTREAM_WAIT_CLIENT, UPSTREAM_DONE, UPSTREAM_CLOSE};
+
+    upstream_pool();
+    ~upstream_pool();
+    void init(int epollfd);                                     //使用reactor的epoll对象, 在reactor的构造函数中调用
+
+    bool owns(int fd) const {return m_conns && fd < m_max_fd && m_conns[fd];}  //fd是否是本连接池的后端连接
+    STATUS start(http_conn* client);                            //开始转发client读缓冲区中的请求
+    STATUS resume(http_conn* client);                           //转发中的客户端socket可写
+    http_conn* handle(int fd, STATUS* status);                  //后端连接上有事件, 返回正在转发的客户端连接, 空闲连接返回nullptr
+    void abort(http_conn* client);                              //客户端连接要关闭, 放弃正在进行的转发
+
+private:
+    upstream_conn* acquire(int group, bool fresh);              //按负载选择后端, 取出空闲连接或者新建连接, fresh为true时不用空闲连接
+    bool open(upstream_conn* u);                                //新建到u->backend的非阻塞连接
+    void attach(upstream_conn* u, http_conn* client);
+    void detach(upstream_conn* u);
+    void release(upstream_conn* u);                             //转发完毕, 可以复用的连接放回连接池, 否则关闭
+    void destroy(upstream_conn* u);
+
+    STATUS pump(upstream_conn* u);                              //尽可能推进转发, 直到需要等待某一端
+    bool parse_header(upstream_conn* u, int header_bytes);      //解析后端响应头部, 生成发给客户端的头部
+    STATUS wait_backend(upstream_conn* u, int ev);
+    STATUS wait_client(upstream_conn* u);
+    STATUS finish(upstream_conn* u);                            //响应转发完毕
+    STATUS error(upstream_conn* u);                             //出错: 能重试时换一个连接重试, 还没有转发任何数据时回复502
+    STATUS retry(upstream_conn* u, bool backend_down, bool fresh);
+
+private:
+    int m_epollfd;                                              //所属reactor的epoll对象
+    int m_max_fd;                                               //m_conns的大小
+    upstream_conn** m_conns;                                    //以后端socket为下标, 没有配置转发规则时为nullptr
+    std::vector<std::vector<upstream_conn*> > m_idle;           //每个后端的空闲连接
+};
+
+#endif
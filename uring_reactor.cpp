@@ -0,0 +1,616 @@
+#include "uring_reactor.h"
+#include "log.h"
+#include "overload.h"
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+namespace
+{
+
+uint64_t make_data(int op, int fd)
+{
+    return ((uint64_t)(unsigned)fd << 8) | (unsigned)op;
+}
+
+//多次recv需要5.19以上的内核(接收缓冲区环)和6.0以上的内核(IORING_RECV_MULTISHOT), 操作码探测不到这些标志
+bool kernel_at_least(int major, int minor)
+{
+    struct utsname name;
+    int kernel_major = 0;
+    int kernel_minor = 0;
+    if(uname(&name) != 0 || sscanf(name.release, "%d.%d", &kernel_major, &kernel_minor) != 2)
+    {
+        return false;
+    }
+    return kernel_major > major || (kernel_major == major && kernel_minor >= minor);
+}
+
+}
+
+
+uring_reactor::uring_reactor(int listenfd):
+        event_loop(listenfd, nullptr), m_conns(nullptr), m_fixed_files(nullptr), m_fixed_count(0), m_timer_fired(false)
+{
+}
+
+uring_reactor::~uring_reactor()
+{
+    free(m_conns);
+    delete [] m_fixed_files;
+}
+
+bool uring_reactor::init()
+{
+    if(!kernel_at_least(6, 0))
+    {
+        return false;
+    }
+    int ret = m_ring.init(URING_ENTRIES);
+    if(ret < 0)
+    {
+        LOG_WARN("io_uring_setup: %s", strerror(-ret));
+        return false;
+    }
+    const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SPLICE, IORING_OP_POLL_ADD, IORING_OP_FILES_UPDATE};
+    for(size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i)
+    {
+        if(!m_ring.supports(ops[i]))
+        {
+            LOG_WARN("io_uring op %d not supported", ops[i]);
+            return false;
+        }
+    }
+    ret = m_ring.register_buffers(URING_BUFFER_GROUP, URING_BUFFERS, URING_BUFFER_SIZE);
+    if(ret < 0)
+    {
+        LOG_WARN("io_uring provided buffers: %s", strerror(-ret));
+        return false;
+    }
+
+    //固定文件表不能超过文件描述符数量的上限; 注册失败时不使用固定文件
+    struct rlimit limit;
+    m_fixed_count = m_max_fd;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)m_fixed_count)
+    {
+        m_fixed_count = limit.rlim_cur;
+    }
+    m_fixed_files = new int[m_fixed_count];
+    for(int i = 0; i < m_fixed_count; ++i)
+    {
+        m_fixed_files[i] = -1;
+    }
+    ret = m_ring.register_files(m_fixed_files, m_fixed_count);
+    if(ret < 0)
+    {
+        LOG_WARN("io_uring fixed files: %s", strerror(-ret));
+        m_fixed_count = 0;
+    }
+
+    //和连接表一样使用清零的内存
+    m_conns = static_cast<conn_state*>(calloc(m_max_fd, sizeof(conn_state)));
+    return m_conns != nullptr;
+}
+
+void uring_reactor::loop()
+{
+    arm_accept();
+    arm_poll(m_timerfd);
+    arm_poll(m_eventfd);
+    if(m_signalfd >= 0)
+    {
+        arm_poll(m_signalfd);
+    }
+    if(m_inotifyfd >= 0)
+    {
+        arm_poll(m_inotifyfd);
+    }
+
+    while(!m_stop)
+    {
+        //提交上一轮产生的所有操作并等待至少一个完成事件, 每轮只有这一次系统调用
+        int ret = m_ring.submit_and_wait(1);
+        if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+        {
+            LOG_ERROR("io_uring_enter failure: %s", strerror(-ret));
+            break;
+        }
+
+        m_timer_fired = false;
+        uint64_t batch_start = metrics::now_ns();
+        unsigned handled = 0;
+        unsigned n;
+        while((n = m_ring.for_each_cqe([this](const io_uring_cqe& cqe) {handle_cqe(cqe);})) > 0)
+        {
+            handled += n;
+        }
+
+        //超时处理放到本轮事件处理完之后, 避免关闭本轮还有事件的连接
+        if(m_timer_fired)
+        {
+            handle_timer();
+        }
+        arm_timer();
+        check_drain();
+
+        //请求不排队, 本轮处理的时间就是下一轮的完成事件等待的时间
+        if(handled > 0)
+        {
+            uint64_t now = metrics::now_ns();
+            overload::record(now - batch_start, now);
+        }
+    }
+}
+
+io_uring_sqe* uring_reactor::prepare(int op, int fd)
+{
+    io_uring_sqe* sqe = m_ring.get_sqe();
+    if(sqe == nullptr)
+    {
+        //提交队列满并且内核没有取走, 只有内核出错时才会发生
+        LOG_ERROR("io_uring submission queue full");
+        abort();
+    }
+    sqe->user_data = make_data(op, fd);
+    return sqe;
+}
+
+void uring_reactor::set_socket(io_uring_sqe* sqe, int fd)
+{
+    sqe->fd = fd;
+    if(m_conns[fd].fixed)
+    {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+void uring_reactor::arm_accept()
+{
+    //多次accept: 一个操作持续产生新连接, 不需要对端地址
+    io_uring_sqe* sqe = prepare(OP_ACCEPT, m_listenfd);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+void uring_reactor::arm_recv(int fd)
+{
+    //多次recv: 数据到达时内核从接收缓冲区环中取一个缓冲区, 连接空闲时不占用缓冲区
+    io_uring_sqe* sqe = prepare(OP_RECV, fd);
+    sqe->opcode = IORING_OP_RECV;
+    set_socket(sqe, fd);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    m_conns[fd].recv_armed = true;
+}
+
+void uring_reactor::arm_poll(int fd)
+{
+    io_uring_sqe* sqe = prepare(OP_POLL, fd);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void uring_reactor::handle_cqe(const io_uring_cqe& cqe)
+{
+    int op = cqe.user_data & 0xff;
+    int fd = cqe.user_data >> 8;
+    switch(op)
+    {
+        case OP_ACCEPT:
+            handle_accept(cqe.res, cqe.flags);
+            break;
+        case OP_RECV:
+            handle_recv(fd, cqe.res, cqe.flags);
+            break;
+        case OP_SEND:
+        case OP_SPLICE_IN:
+        case OP_SPLICE_OUT:
+            handle_send(fd, op, cqe.res);
+            break;
+        case OP_POLL:
+            handle_poll(fd, cqe.flags);
+            break;
+        case OP_FILES_UPDATE:
+            if(cqe.res < 0)
+            {
+                LOG_WARN("io_uring files update %d: %s", fd, strerror(-cqe.res));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void uring_reactor::handle_accept(int res, unsigned flags)
+{
+    //多次accept出错或者被取消后要重新提交, 优雅退出时是主动取消的, 不再提交
+    if(!(flags & IORING_CQE_F_MORE) && !m_stop && !m_draining)
+    {
+        arm_accept();
+    }
+    if(res < 0)
+    {
+        if(res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+        {
+            LOG_ERROR("accept error: %s", strerror(-res));
+        }
+        return;
+    }
+
+    int connfd = res;
+    //超过预定最大文件描述符
+    if(connfd >= m_max_fd || http_conn::m_user_count >= m_max_fd)
+    {
+        close(connfd);
+        metrics::add(METRIC_SYSCALLS);
+        return;
+    }
+    LOG_DEBUG("accept %d", connfd);
+    metrics::add(METRIC_ACCEPTS);
+
+    conn_state& st = m_conns[connfd];
+    memset(&st, 0, sizeof(st));
+
+    //不使用epoll, 多次accept也不返回对端地址
+    struct sockaddr_in client_address;
+    memset(&client_address, 0, sizeof(client_address));
+    accepted(connfd);
+    m_users[connfd].init(connfd, client_address, -1);
+
+    //注册到固定文件表, 之后的recv在注册完成后才执行
+    if(connfd < m_fixed_count)
+    {
+        m_fixed_files[connfd] = connfd;
+        io_uring_sqe* sqe = prepare(OP_FILES_UPDATE, connfd);
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&m_fixed_files[connfd]);
+        sqe->len = 1;
+        sqe->off = connfd;
+        sqe->flags |= IOSQE_IO_LINK;
+        st.fixed = true;
+    }
+    arm_recv(connfd);
+
+    //初始化定时器, 等待客户端发来请求
+    set_timeout(m_users + connfd, http_conn::TIMEOUT_HEADER);
+}
+
+void uring_reactor::handle_recv(int fd, int res, unsigned flags)
+{
+    conn_state& st = m_conns[fd];
+    http_conn* user = m_users + fd;
+    st.recv_armed = (flags & IORING_CQE_F_MORE) != 0;
+
+    //数据拷贝到连接的读缓冲区后马上把缓冲区还给内核
+    bool ok = true;
+    if(flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(res > 0 && !st.closing)
+        {
+            ok = user->append_read(m_ring.buffer(id), res);
+        }
+        m_ring.add_buffer(id);
+    }
+
+    if(st.closing)
+    {
+        if(!st.recv_armed && st.inflight == 0)
+        {
+            finish_close(fd);
+        }
+        return;
+    }
+    if(res == -ENOBUFS)
+    {
+        //接收缓冲区暂时用完, 本轮处理过的缓冲区已经还回去了
+        if(!st.recv_armed)
+        {
+            arm_recv(fd);
+        }
+        return;
+    }
+    if(res <= 0 || !ok)
+    {
+        //对方关闭连接、出错或者请求头太大
+        begin_close(fd);
+        return;
+    }
+    if(!st.recv_armed)
+    {
+        arm_recv(fd);
+    }
+
+    //空闲的长连接上来了新的请求, 开始计算读取请求头的超时
+    if(user->timeout_type == http_conn::TIMEOUT_KEEPALIVE)
+    {
+        set_timeout(user, http_conn::TIMEOUT_HEADER);
+    }
+
+    //正在发送时只保存数据, 和epoll后端一样等响应发完再处理后续的请求
+    if(st.inflight == 0 && !user->is_writing())
+    {
+        process(fd);
+    }
+}
+
+void uring_reactor::handle_poll(int fd, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE) && !m_stop)
+    {
+        arm_poll(fd);
+    }
+    if(fd == m_timerfd)
+    {
+        m_timer_fired = true;
+    }
+    else if(fd == m_eventfd)
+    {
+        handle_wakeup();
+    }
+    else if(fd == m_signalfd)
+    {
+        handle_signal();
+    }
+    else if(fd == m_inotifyfd)
+    {
+        //资源目录下的文件发生变化, 让缓存中对应的文件失效
+        http_conn::m_file_cache.handle_inotify();
+    }
+}
+
+void uring_reactor::process(int fd)
+{
+    http_conn* user = m_users + fd;
+    //过载时新请求直接回复503; 还有响应在发送的连接不能插入数据, 照常处理
+    if(overload::overloaded() && !user->is_writing() && m_conns[fd].inflight == 0)
+    {
+        overload::shed(fd);
+        begin_close(fd);
+        return;
+    }
+    if(!user->process_requests())
+    {
+        begin_close(fd);
+        return;
+    }
+    if(user->is_writing())
+    {
+        start_send(fd);
+    }
+}
+
+void uring_reactor::start_send(int fd)
+{
+    conn_state& st = m_conns[fd];
+    http_conn* user = m_users + fd;
+
+    bool more;
+    int file;
+    off_t offset;
+    off_t length;
+    int iovcnt = user->next_send(st.iov, &more, &file, &offset, &length);
+
+    //发送文件内容需要管道, 在提交任何操作之前创建, 避免链接断在中间
+    if((iovcnt == 0 || more) && !st.has_pipe)
+    {
+        metrics::add(METRIC_SYSCALLS);
+        if(pipe2(st.pipe, O_CLOEXEC) < 0)
+        {
+            LOG_ERROR("pipe error: %s", strerror(errno));
+            begin_close(fd);
+            return;
+        }
+        st.has_pipe = true;
+    }
+
+    //头部、管道输入、管道输出三个操作必须在同一次提交中
+    m_ring.reserve(3);
+    if(iovcnt > 0)
+    {
+        //MSG_WAITALL保证头部全部发出后才执行链接在后面的文件内容
+        memset(&st.msg, 0, sizeof(st.msg));
+        st.msg.msg_iov = st.iov;
+        st.msg.msg_iovlen = iovcnt;
+        io_uring_sqe* sqe = prepare(OP_SEND, fd);
+        sqe->opcode = IORING_OP_SENDMSG;
+        set_socket(sqe, fd);
+        sqe->addr = reinterpret_cast<uint64_t>(&st.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+        ++st.inflight;
+        if(!more)
+        {
+            return;
+        }
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    send_file(fd, file, offset, length);
+}
+
+void uring_reactor::send_file(int fd, int file, off_t offset, off_t length)
+{
+    conn_state& st = m_conns[fd];
+    unsigned len = length < URING_PIPE_SIZE ? length : URING_PIPE_SIZE;
+
+    //文件 -> 管道, 不满len字节时链接中断, 后面的操作被取消
+    io_uring_sqe* sqe = prepare(OP_SPLICE_IN, fd);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = st.pipe[1];
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = file;
+    sqe->splice_off_in = offset;
+    sqe->len = len;
+    sqe->flags |= IOSQE_IO_LINK;
+
+    //管道 -> socket
+    sqe = prepare(OP_SPLICE_OUT, fd);
+    sqe->opcode = IORING_OP_SPLICE;
+    set_socket(sqe, fd);
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = st.pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = len;
+    st.inflight += 2;
+}
+
+void uring_reactor::handle_send(int fd, int op, int res)
+{
+    conn_state& st = m_conns[fd];
+    http_conn* user = m_users + fd;
+    --st.inflight;
+
+    if(st.closing)
+    {
+        if(st.inflight == 0 && !st.recv_armed)
+        {
+            finish_close(fd);
+        }
+        return;
+    }
+
+    if(res == -ECANCELED)
+    {
+        //链接中前面的操作没有完整完成, 本操作没有执行, 剩下的部分在send_done中继续
+    }
+    else if(op == OP_SPLICE_IN)
+    {
+        if(res > 0)
+        {
+            st.pipe_bytes += res;
+        }
+        else
+        {
+            //读不到数据说明文件在发送过程中被截断, 已经无法发送完声明的Content-Length
+            st.close_after = true;
+        }
+    }
+    else if(res < 0)
+    {
+        st.close_after = true;
+    }
+    else
+    {
+        if(op == OP_SPLICE_OUT)
+        {
+            st.pipe_bytes -= res;
+        }
+        //发完了不保持连接的响应
+        if(!user->sent(res))
+        {
+            st.close_after = true;
+        }
+    }
+
+    if(st.inflight == 0)
+    {
+        send_done(fd);
+    }
+}
+
+void uring_reactor::send_done(int fd)
+{
+    conn_state& st = m_conns[fd];
+    http_conn* user = m_users + fd;
+
+    if(st.close_after)
+    {
+        begin_close(fd);
+        return;
+    }
+
+    if(st.pipe_bytes > 0)
+    {
+        //管道中还有上次没有发完的数据, 先发送它们
+        io_uring_sqe* sqe = prepare(OP_SPLICE_OUT, fd);
+        sqe->opcode = IORING_OP_SPLICE;
+        set_socket(sqe, fd);
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = st.pipe[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->len = st.pipe_bytes;
+        ++st.inflight;
+        set_timeout(user, http_conn::TIMEOUT_WRITE);
+    }
+    else if(user->is_writing())
+    {
+        //发送了一部分, 重新计算发送阻塞的超时
+        start_send(fd);
+        set_timeout(user, http_conn::TIMEOUT_WRITE);
+    }
+    else if(user->has_pending_request())
+    {
+        //读缓冲区中还有流水线上的后续请求, 不等新的数据到达直接继续处理
+        set_timeout(user, http_conn::TIMEOUT_HEADER);
+        process(fd);
+    }
+    else
+    {
+        //响应发送完毕, 长连接进入空闲状态
+        set_timeout(user, http_conn::TIMEOUT_KEEPALIVE);
+    }
+}
+
+void uring_reactor::stop_accept()
+{
+    //取消后accept以-ECANCELED结束; 取消之前已经完成的accept照常处理, 它们的响应带Connection: close
+    io_uring_sqe* sqe = prepare(OP_CANCEL, m_listenfd);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = make_data(OP_ACCEPT, m_listenfd);
+}
+
+void uring_reactor::close_conn(http_conn* user)
+{
+    begin_close(user - m_users);
+}
+
+void uring_reactor::begin_close(int fd)
+{
+    conn_state& st = m_conns[fd];
+    if(st.closing)
+    {
+        return;
+    }
+    st.closing = true;
+    m_timer_wheel.del_timer(&m_users[fd].timer);
+
+    //进行中的recv、sendmsg和splice持有socket的引用, 关闭读写让它们马上结束
+    shutdown(fd, SHUT_RDWR);
+    metrics::add(METRIC_SYSCALLS);
+    if(st.inflight == 0 && !st.recv_armed)
+    {
+        finish_close(fd);
+    }
+}
+
+void uring_reactor::finish_close(int fd)
+{
+    conn_state& st = m_conns[fd];
+    if(st.fixed)
+    {
+        //从固定文件表中删除, 否则表中的引用会让socket一直不被真正关闭
+        m_fixed_files[fd] = -1;
+        io_uring_sqe* sqe = prepare(OP_FILES_UPDATE, fd);
+        sqe->opcode = IORING_OP_FILES_UPDATE;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(&m_fixed_files[fd]);
+        sqe->len = 1;
+        sqe->off = fd;
+        st.fixed = false;
+    }
+    if(st.has_pipe)
+    {
+        close(st.pipe[0]);
+        close(st.pipe[1]);
+        metrics::add(METRIC_SYSCALLS, 2);
+        st.has_pipe = false;
+    }
+    m_users[fd].close_conn();
+}
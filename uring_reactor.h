@@ -0,0 +1,79 @@
+#ifndef URING_REACTOR_H
+#define URING_REACTOR_H
+
+#include "event_loop.h"
+#include "io_ring.h"
+
+#define URING_ENTRIES 1024          //提交队列大小
+#define URING_BUFFERS 512           //接收缓冲区数量, 必须是2的幂
+#define URING_BUFFER_SIZE 4096      //每个接收缓冲区的大小
+#define URING_BUFFER_GROUP 0        //接收缓冲区组的编号
+#define URING_PIPE_SIZE 65536       //一次splice经过管道的最大字节数(管道的默认容量)
+
+
+/*
+    io_uring后端的事件循环, 只用于多reactor模式(连接不会交给线程池)
+    读写都以操作的形式提交, 每轮循环只有一次io_uring_enter:
+    监听socket上是一个多次accept操作, 每个连接上是一个使用内核选择缓冲区的多次recv操作,
+    响应头部用sendmsg发送, 文件内容用splice经过每个连接自己的管道发送到socket, 头部和文件内容链接成一组按顺序执行
+    连接的socket注册在固定文件表中, 下标就是文件描述符
+    timerfd、eventfd、signalfd和inotify用多次poll操作监听, 处理方式和epoll后端相同
+*/
+class uring_reactor : public event_loop
+{
+public:
+    uring_reactor(int listenfd);
+    ~uring_reactor();
+
+    bool init();                                    //创建io_uring, 内核不支持需要的功能时返回false
+    void loop();                                    //运行事件循环
+
+private:
+    //操作类型, 和文件描述符一起编码在user_data中
+    enum OP {OP_ACCEPT = 0, OP_RECV, OP_SEND, OP_SPLICE_IN, OP_SPLICE_OUT, OP_POLL, OP_FILES_UPDATE, OP_CANCEL};
+
+    //连接在io_uring后端中的状态, 和连接表一样以socket为下标
+    struct conn_state
+    {
+        int inflight;                               //正在进行的发送操作数量
+        int pipe_bytes;                             //管道中还没有发送到socket的字节数
+        int pipe[2];                                //splice发送文件内容用的管道, 第一次发送文件时创建
+        bool has_pipe;
+        bool recv_armed;                            //多次recv操作是否还在进行
+        bool fixed;                                 //socket是否注册在固定文件表中
+        bool closing;                               //正在关闭, 等所有操作结束后释放连接
+        bool close_after;                           //发送结束后关闭连接(不保持连接的响应已经发完或者发送出错)
+        struct msghdr msg;                          //正在进行的sendmsg的参数, 操作完成前不能修改
+        struct iovec iov[http_conn::MAX_IOV];
+    };
+
+    io_uring_sqe* prepare(int op, int fd);          //取一个SQE并设置user_data
+    void set_socket(io_uring_sqe* sqe, int fd);     //操作的目标是连接的socket, 注册过时使用固定文件
+    void arm_accept();
+    void arm_recv(int fd);
+    void arm_poll(int fd);
+
+    void handle_cqe(const io_uring_cqe& cqe);
+    void handle_accept(int res, unsigned flags);
+    void handle_recv(int fd, int res, unsigned flags);
+    void handle_send(int fd, int op, int res);
+    void handle_poll(int fd, unsigned flags);
+
+    void process(int fd);                           //解析缓冲区中的请求并开始发送响应
+    void start_send(int fd);                        //提交发送队列中的下一段: 头部, 或者头部链接文件内容, 或者文件内容
+    void send_file(int fd, int file, off_t offset, off_t length);  //把文件的一段经过管道splice到socket
+    void send_done(int fd);                         //本轮的发送操作都结束了, 决定下一步
+    void close_conn(http_conn* user);
+    void stop_accept();                             //取消多次accept操作
+    void begin_close(int fd);                       //关闭socket的读写, 让进行中的操作尽快结束
+    void finish_close(int fd);                      //所有操作都结束后释放连接
+
+private:
+    io_ring m_ring;
+    conn_state* m_conns;                            //连接的状态表
+    int* m_fixed_files;                             //固定文件表的内容, 更新时内核从这里读取
+    int m_fixed_count;                              //固定文件表的大小, 更大的文件描述符不注册
+    bool m_timer_fired;                             //本轮是否收到了timerfd到期
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include "mpmc_queue.h"
+
+
+/*
+    有界的Chase-Lev工作窃取双端队列
+    只有拥有者线程可以push和pop队尾(bottom), 其他线程用steal从队头(top)偷取最早放入的任务
+    只有队列剩下最后一个元素时拥有者和窃取者才需要CAS竞争, 平时拥有者的操作不需要原子读改写
+    T必须是可以放进std::atomic的类型(通常是指针), 容量向上取整为2的幂
+*/
+template<typename T>
+class ws_deque
+{
+public:
+    ws_deque(int capacity);
+    ~ws_deque();
+
+    //拥有者线程调用, 队列满时返回false
+    bool push(T value);
+    //拥有者线程调用, 取出最后放入的任务, 队列空时返回false
+    bool pop(T& value);
+    //任意线程调用, 取出最早放入的任务, 队列空或者和其他线程竞争失败时返回false
+    bool steal(T& value);
+    //队列中的元素数量, 并发修改时只是近似值
+    int size() const
+    {
+        int64_t top = m_top.load(std::memory_order_relaxed);
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        return bottom > top ? bottom - top : 0;
+    }
+
+private:
+    std::atomic<T>* m_buffer;                               //环形数组
+    int64_t m_mask;                                         //容量-1
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> m_top;    //窃取端, 所有线程竞争
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> m_bottom; //拥有者端
+};
+
+template<typename T>
+ws_deque<T>::ws_deque(int capacity):m_top(0), m_bottom(0)
+{
+    int64_t size = 2;
+    while(size < capacity)
+    {
+        size <<= 1;
+    }
+    m_mask = size - 1;
+    m_buffer = new std::atomic<T>[size];
+}
+
+template<typename T>
+ws_deque<T>::~ws_deque()
+{
+    delete [] m_buffer;
+}
+
+template<typename T>
+bool ws_deque<T>::push(T value)
+{
+    int64_t b = m_bottom.load(std::memory_order_relaxed);
+    int64_t t = m_top.load(std::memory_order_acquire);
+    if(b - t > m_mask)
+    {
+        return false;
+    }
+    m_buffer[b & m_mask].store(value, std::memory_order_relaxed);
+    //先写入元素再移动bottom, 窃取者看到新的bottom时一定能看到元素
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(b + 1, std::memory_order_relaxed);
+    return true;
+}
+
+template<typename T>
+bool ws_deque<T>::pop(T& value)
+{
+    //先占住最后一个元素, 再看窃取者有没有拿走它
+    int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+    m_bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = m_top.load(std::memory_order_relaxed);
+
+    if(t > b)
+    {
+        //队列为空
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    value = m_buffer[b & m_mask].load(std::memory_order_relaxed);
+    if(t == b)
+    {
+        //只剩最后一个元素, 和窃取者竞争top
+        bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+template<typename T>
+bool ws_deque<T>::steal(T& value)
+{
+    int64_t t = m_top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = m_bottom.load(std::memory_order_acquire);
+    if(t >= b)
+    {
+        return false;
+    }
+
+    value = m_buffer[t & m_mask].load(std::memory_order_relaxed);
+    //和拥有者或者其他窃取者竞争, 失败说明元素已经被别人拿走
+    return m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+#endif